@@ -0,0 +1,629 @@
+// Benchmark path enumeration, single path lookup and full extraction of an ext2 image.
+//
+// Each phase runs main once under ptrace to count its system calls (this run also warms
+// the page cache), then REPEATS more times to time it. The results are printed as JSON:
+// wall time (best and mean), CPU time, peak RSS, system calls and throughput. The lookup
+// resolves one path without extracting it (--batch with --resolve-only); unless given,
+// the path is the deepest file found by the enumeration. Extraction runs in a fresh
+// directory under WORKDIR, which is removed afterwards.
+//
+// Images to benchmark can be made with create_ext2_image.c, e.g.:
+//   gcc -O2 create_ext2_image.c -o create_ext2_image -lm
+//   gcc -O2 benchmark.c -o benchmark
+//   ./create_ext2_image -b 1024 -n 20000 -f 8 -d 3 -l bench.img
+//   ./benchmark -a -j -a 4 ./main bench.img
+//
+// Usage: benchmark [OPTION]... MAIN IMAGE
+//   -r, --repeats N    Timed runs per phase (default 3).
+//   -p, --path PATH    Path to look up (default: the deepest file).
+//   -a, --arg ARG      Pass ARG to main (repeat for several arguments).
+//   -w, --workdir DIR  Where to extract (default /tmp).
+
+#define _GNU_SOURCE // for mkdtemp and nftw.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_MAIN_ARGS 32
+#define READ_BUF_SIZE (64 * 1024)
+
+#define PHASE_ENUMERATE 0
+#define PHASE_LOOKUP 1
+#define PHASE_EXTRACT 2
+#define PHASES 3
+
+// Measurements of one run of main.
+struct Run
+{
+    double wallTime;
+    double userTime;
+    double sysTime;
+    long peakRss;      // KiB.
+    long long syscalls; // Only counted under ptrace (-1 when unavailable).
+    int status;
+};
+
+// Output of the enumeration, kept to choose the path to look up.
+struct Enumeration
+{
+    uint64_t numPaths;
+    char *deepestFile;
+    int deepestDepth;
+    char *line; // Partial line carried over between reads.
+    size_t lineLen;
+};
+
+
+// Command line options.
+struct Options
+{
+    int repeats;
+    const char *lookupPath;
+    const char *mainArgs[MAX_MAIN_ARGS];
+    int numMainArgs;
+    const char *workDir;
+    const char *mainPath;
+    const char *imagePath;
+} opts = {3, NULL, {NULL}, 0, "/tmp", NULL, NULL};
+
+// Results of the extraction, summed by nftw.
+uint64_t extractedBytes = 0;
+uint64_t extractedFiles = 0;
+
+// Function prototypes.
+void parseOptions(int argc, char *argv[]);
+void usage(const char *prog);
+void buildArgv(int phase, const char *batchPath, const char **argv);
+void runMain(const char **argv, const char *dir, int isTraced, struct Enumeration *enumeration,
+             struct Run *run);
+long long traceChild(pid_t pid, int *status, struct rusage *usage);
+void readEnumeration(int fd, struct Enumeration *enumeration);
+void addEnumeratedPath(struct Enumeration *enumeration, const char *path, size_t len);
+int sumFile(const char *path, const struct stat *st, int type, struct FTW *ftw);
+int removeFile(const char *path, const struct stat *st, int type, struct FTW *ftw);
+char *makeRunDir(void);
+void removeRunDir(char *dir);
+void printPhase(const char *name, struct Run *runs, int numRuns, struct Run *traced, uint64_t items,
+                uint64_t bytes, int isLast);
+void printString(const char *str);
+double now(void);
+void *do_calloc(size_t nmemb, size_t size);
+void *do_realloc(void *ptr, size_t size);
+
+int main(int argc, char *argv[])
+{
+    parseOptions(argc, argv);
+
+    struct Run traced[PHASES];
+    struct Run *runs[PHASES];
+    for (int phase = 0; phase < PHASES; phase++)
+    {
+        runs[phase] = (struct Run *)do_calloc(opts.repeats, sizeof(struct Run));
+    }
+
+    // ENUMERATION ------------------------------------------------------------
+    // Only the untraced runs read the paths (stdout of the traced one is dropped).
+    const char *mainArgv[MAX_MAIN_ARGS + 8];
+    struct Enumeration enumeration;
+    memset(&enumeration, 0, sizeof(enumeration));
+    buildArgv(PHASE_ENUMERATE, NULL, mainArgv);
+    runMain(mainArgv, NULL, 1, NULL, &traced[PHASE_ENUMERATE]);
+    for (int i = 0; i < opts.repeats; i++)
+    {
+        enumeration.numPaths = 0;
+        runMain(mainArgv, NULL, 0, &enumeration, &runs[PHASE_ENUMERATE][i]);
+    }
+    if (opts.lookupPath == NULL)
+    {
+        if (enumeration.deepestFile == NULL)
+        {
+            fprintf(stderr, "The image holds no file to look up.\n");
+            exit(1);
+        }
+        opts.lookupPath = enumeration.deepestFile;
+    }
+    // ------------------------------------------------------------------------
+
+    // LOOKUP -----------------------------------------------------------------
+    // A batch of one path.
+    char *runDir = makeRunDir();
+    char batchPath[4096];
+    snprintf(batchPath, sizeof(batchPath), "%s/lookup.txt", runDir);
+    FILE *batch = fopen(batchPath, "w");
+    if (batch == NULL)
+    {
+        perror(batchPath);
+        exit(1);
+    }
+    fprintf(batch, "%s\n", opts.lookupPath);
+    fclose(batch);
+
+    buildArgv(PHASE_LOOKUP, batchPath, mainArgv);
+    runMain(mainArgv, NULL, 1, NULL, &traced[PHASE_LOOKUP]);
+    for (int i = 0; i < opts.repeats; i++)
+    {
+        runMain(mainArgv, NULL, 0, NULL, &runs[PHASE_LOOKUP][i]);
+    }
+    removeRunDir(runDir);
+    // ------------------------------------------------------------------------
+
+    // EXTRACTION -------------------------------------------------------------
+    // Each run extracts into an empty directory.
+    buildArgv(PHASE_EXTRACT, NULL, mainArgv);
+    for (int i = -1; i < opts.repeats; i++)
+    {
+        runDir = makeRunDir();
+        runMain(mainArgv, runDir, i == -1, NULL, i == -1 ? &traced[PHASE_EXTRACT] : &runs[PHASE_EXTRACT][i]);
+        if (i == -1)
+        {
+            nftw(runDir, sumFile, 64, FTW_PHYS);
+        }
+        removeRunDir(runDir);
+    }
+    // ------------------------------------------------------------------------
+
+    printf("{\n  \"main\": ");
+    printString(opts.mainPath);
+    printf(",\n  \"image\": ");
+    printString(opts.imagePath);
+    printf(",\n  \"args\": [");
+    for (int i = 0; i < opts.numMainArgs; i++)
+    {
+        printf(i == 0 ? "" : ", ");
+        printString(opts.mainArgs[i]);
+    }
+    printf("],\n  \"repeats\": %d,\n  \"lookup_path\": ", opts.repeats);
+    printString(opts.lookupPath);
+    printf(",\n  \"phases\": {\n");
+    printPhase("enumerate", runs[PHASE_ENUMERATE], opts.repeats, &traced[PHASE_ENUMERATE],
+               enumeration.numPaths, 0, 0);
+    printPhase("lookup", runs[PHASE_LOOKUP], opts.repeats, &traced[PHASE_LOOKUP], 1, 0, 0);
+    printPhase("extract", runs[PHASE_EXTRACT], opts.repeats, &traced[PHASE_EXTRACT], extractedFiles,
+               extractedBytes, 1);
+    printf("  }\n}\n");
+
+    // Free the allocated memory.
+    for (int phase = 0; phase < PHASES; phase++)
+    {
+        free(runs[phase]);
+    }
+    free(enumeration.deepestFile);
+    free(enumeration.line);
+    free((char *)opts.mainPath);
+    free((char *)opts.imagePath);
+
+    return 0;
+}
+
+// OPTIONS --------------------------------------------------------------------
+void parseOptions(int argc, char *argv[])
+{
+    static struct option longOpts[] = {
+        {"repeats", required_argument, NULL, 'r'},
+        {"path", required_argument, NULL, 'p'},
+        {"arg", required_argument, NULL, 'a'},
+        {"workdir", required_argument, NULL, 'w'},
+        {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:p:a:w:", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+        {
+            char *end;
+            long repeats = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || repeats < 1 || repeats > INT32_MAX)
+            {
+                fprintf(stderr, "Invalid number of repeats: %s\n", optarg);
+                exit(1);
+            }
+            opts.repeats = (int)repeats;
+            break;
+        }
+        case 'p':
+            opts.lookupPath = optarg;
+            break;
+        case 'a':
+            if (opts.numMainArgs == MAX_MAIN_ARGS)
+            {
+                fprintf(stderr, "Too many arguments for main.\n");
+                exit(1);
+            }
+            opts.mainArgs[opts.numMainArgs++] = optarg;
+            break;
+        case 'w':
+            opts.workDir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 2)
+    {
+        usage(argv[0]);
+    }
+
+    // Extraction runs main in another directory.
+    opts.mainPath = realpath(argv[optind], NULL);
+    opts.imagePath = realpath(argv[optind + 1], NULL);
+    if (opts.mainPath == NULL || opts.imagePath == NULL)
+    {
+        perror(opts.mainPath == NULL ? argv[optind] : argv[optind + 1]);
+        exit(1);
+    }
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-r REPEATS] [-p PATH] [-a ARG]... [-w WORKDIR] MAIN IMAGE\n", prog);
+    exit(1);
+}
+
+// Command line of main for a phase: the user's options, then the phase's own.
+void buildArgv(int phase, const char *batchPath, const char **argv)
+{
+    int argc = 0;
+    argv[argc++] = opts.mainPath;
+    for (int i = 0; i < opts.numMainArgs; i++)
+    {
+        argv[argc++] = opts.mainArgs[i];
+    }
+    if (phase == PHASE_LOOKUP)
+    {
+        argv[argc++] = "--batch";
+        argv[argc++] = batchPath;
+        argv[argc++] = "--resolve-only";
+    }
+    argv[argc++] = opts.imagePath;
+    if (phase == PHASE_EXTRACT)
+    {
+        argv[argc++] = "/";
+    }
+    argv[argc] = NULL;
+}
+
+// RUNS -----------------------------------------------------------------------
+// Run main in dir (or the current directory) and measure it. Its stdout goes to the
+// enumeration when given, else to /dev/null.
+void runMain(const char **argv, const char *dir, int isTraced, struct Enumeration *enumeration,
+             struct Run *run)
+{
+    int pipeFds[2] = {-1, -1};
+    if (enumeration != NULL && pipe(pipeFds) == -1)
+    {
+        perror("pipe failed");
+        exit(1);
+    }
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork failed");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        int fd = enumeration != NULL ? pipeFds[1] : open("/dev/null", O_WRONLY);
+        if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1 || (dir != NULL && chdir(dir) == -1))
+        {
+            perror("child");
+            _exit(127);
+        }
+        if (enumeration != NULL)
+        {
+            close(pipeFds[0]);
+        }
+        if (isTraced)
+        {
+            // Stop until the parent has set the tracing options.
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+        }
+
+        execv(argv[0], (char *const *)argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    run->syscalls = -1;
+    if (enumeration != NULL)
+    {
+        close(pipeFds[1]);
+        readEnumeration(pipeFds[0], enumeration);
+        close(pipeFds[0]);
+    }
+
+    struct rusage usage;
+    if (isTraced)
+    {
+        run->syscalls = traceChild(pid, &run->status, &usage);
+    }
+    else if (wait4(pid, &run->status, 0, &usage) == -1)
+    {
+        perror("wait4 failed");
+        exit(1);
+    }
+    run->wallTime = now() - start;
+    run->userTime = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    run->sysTime = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    run->peakRss = usage.ru_maxrss;
+
+    if (!WIFEXITED(run->status) || WEXITSTATUS(run->status) != 0)
+    {
+        fprintf(stderr, "Warning: %s exited with status %d.\n", argv[0],
+                WIFEXITED(run->status) ? WEXITSTATUS(run->status) : 128 + WTERMSIG(run->status));
+    }
+}
+
+// Follow the child and its threads from one system call to the next, counting the
+// entries. Returns -1 (and just waits) when the child cannot be traced.
+long long traceChild(pid_t pid, int *status, struct rusage *usage)
+{
+    if (waitpid(pid, status, 0) == -1 || !WIFSTOPPED(*status) ||
+        ptrace(PTRACE_SETOPTIONS, pid, NULL,
+               (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC |
+                        PTRACE_O_EXITKILL)) == -1)
+    {
+        // Not traceable (e.g., ptrace is not allowed here): let it run untraced.
+        kill(pid, SIGCONT);
+        if (wait4(pid, status, 0, usage) == -1)
+        {
+            perror("wait4 failed");
+            exit(1);
+        }
+
+        return -1;
+    }
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    long long syscalls = 0;
+    long long stops = 0;
+    int hasInfo = 1;
+    for (;;)
+    {
+        pid_t tid = wait4(-1, status, __WALL, usage);
+        if (tid == -1)
+        {
+            perror("wait4 failed");
+            exit(1);
+        }
+        if (WIFEXITED(*status) || WIFSIGNALED(*status))
+        {
+            if (tid == pid)
+            {
+                break;
+            }
+            continue;
+        }
+
+        int sig = 0;
+        if (WSTOPSIG(*status) == (SIGTRAP | 0x80))
+        {
+            // System call stop: entries only, where the kernel can tell them apart.
+            stops++;
+            struct __ptrace_syscall_info info;
+            if (hasInfo && ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void *)sizeof(info), &info) > 0)
+            {
+                syscalls += info.op == PTRACE_SYSCALL_INFO_ENTRY;
+            }
+            else
+            {
+                hasInfo = 0;
+            }
+        }
+        else if (*status >> 16 == 0 && WSTOPSIG(*status) != SIGSTOP)
+        {
+            sig = WSTOPSIG(*status); // Deliver genuine signals.
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+
+    return hasInfo ? syscalls : (stops + 1) / 2;
+}
+
+// Count the paths and remember the deepest file (directories end in '/').
+void readEnumeration(int fd, struct Enumeration *enumeration)
+{
+    char buf[READ_BUF_SIZE];
+    ssize_t bytesRead;
+    while ((bytesRead = read(fd, buf, sizeof(buf))) > 0 || (bytesRead == -1 && errno == EINTR))
+    {
+        char *start = buf;
+        char *end;
+        while (bytesRead > 0 && (end = memchr(start, '\n', buf + bytesRead - start)) != NULL)
+        {
+            enumeration->line = (char *)do_realloc(enumeration->line, enumeration->lineLen + (end - start) + 1);
+            memcpy(enumeration->line + enumeration->lineLen, start, end - start);
+            addEnumeratedPath(enumeration, enumeration->line, enumeration->lineLen + (end - start));
+            enumeration->lineLen = 0;
+            start = end + 1;
+        }
+
+        // Carry the partial line over to the next read.
+        if (bytesRead > 0 && start < buf + bytesRead)
+        {
+            enumeration->line = (char *)do_realloc(enumeration->line, enumeration->lineLen + (buf + bytesRead - start));
+            memcpy(enumeration->line + enumeration->lineLen, start, buf + bytesRead - start);
+            enumeration->lineLen += buf + bytesRead - start;
+        }
+    }
+    enumeration->lineLen = 0;
+}
+
+void addEnumeratedPath(struct Enumeration *enumeration, const char *path, size_t len)
+{
+    enumeration->numPaths++;
+    if (len == 0 || path[len - 1] == '/')
+    {
+        return;
+    }
+
+    int depth = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        depth += path[i] == '/';
+    }
+    if (depth > enumeration->deepestDepth)
+    {
+        free(enumeration->deepestFile);
+        enumeration->deepestFile = strndup(path, len);
+        enumeration->deepestDepth = depth;
+    }
+}
+
+int sumFile(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)path;
+    (void)ftw;
+    if (type == FTW_F && S_ISREG(st->st_mode))
+    {
+        extractedBytes += st->st_size;
+        extractedFiles++;
+    }
+
+    return 0;
+}
+
+int removeFile(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)type;
+    (void)ftw;
+    if (remove(path) == -1)
+    {
+        perror(path);
+    }
+
+    return 0;
+}
+
+char *makeRunDir(void)
+{
+    char *dir = (char *)do_realloc(NULL, strlen(opts.workDir) + sizeof("/ext2bench.XXXXXX"));
+    sprintf(dir, "%s/ext2bench.XXXXXX", opts.workDir);
+    if (mkdtemp(dir) == NULL)
+    {
+        perror(dir);
+        exit(1);
+    }
+
+    return dir;
+}
+
+void removeRunDir(char *dir)
+{
+    nftw(dir, removeFile, 64, FTW_DEPTH | FTW_PHYS);
+
+    // Free the allocated memory.
+    free(dir);
+}
+
+// REPORT ---------------------------------------------------------------------
+void printPhase(const char *name, struct Run *runs, int numRuns, struct Run *traced, uint64_t items,
+                uint64_t bytes, int isLast)
+{
+    double best = runs[0].wallTime;
+    double total = 0;
+    double user = 0;
+    double sys = 0;
+    long peakRss = traced->peakRss;
+    for (int i = 0; i < numRuns; i++)
+    {
+        best = runs[i].wallTime < best ? runs[i].wallTime : best;
+        total += runs[i].wallTime;
+        user += runs[i].userTime;
+        sys += runs[i].sysTime;
+        peakRss = runs[i].peakRss > peakRss ? runs[i].peakRss : peakRss;
+    }
+
+    printf("    \"%s\": {\n", name);
+    printf("      \"wall_s_best\": %.6f,\n", best);
+    printf("      \"wall_s_mean\": %.6f,\n", total / numRuns);
+    printf("      \"user_s_mean\": %.6f,\n", user / numRuns);
+    printf("      \"sys_s_mean\": %.6f,\n", sys / numRuns);
+    printf("      \"peak_rss_kib\": %ld,\n", peakRss);
+    if (traced->syscalls < 0)
+    {
+        printf("      \"syscalls\": null,\n");
+    }
+    else
+    {
+        printf("      \"syscalls\": %lld,\n", traced->syscalls);
+    }
+    printf("      \"items\": %llu,\n", (unsigned long long)items);
+    printf("      \"items_per_s\": %.1f,\n", items / best);
+    printf("      \"bytes\": %llu,\n", (unsigned long long)bytes);
+    printf("      \"bytes_per_s\": %.1f\n", bytes / best);
+    printf("    }%s\n", isLast ? "" : ",");
+}
+
+// JSON string (paths are printed as is, bar the characters that must be escaped).
+void printString(const char *str)
+{
+    putchar('"');
+    for (; *str != '\0'; str++)
+    {
+        if (*str == '"' || *str == '\\')
+        {
+            printf("\\%c", *str);
+        }
+        else if ((unsigned char)*str < 0x20)
+        {
+            printf("\\u%04x", *str);
+        }
+        else
+        {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The allocation helpers of ext2read.c, which the benchmark does not link with.
+void *do_calloc(size_t nmemb, size_t size)
+{
+    void *ptr = calloc(nmemb, size);
+    if (ptr == NULL)
+    {
+        perror("calloc failed");
+        exit(1);
+    }
+
+    return ptr;
+}
+
+void *do_realloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (ptr == NULL)
+    {
+        perror("realloc failed");
+        exit(1);
+    }
+
+    return ptr;
+}
@@ -0,0 +1,1012 @@
+// Create a synthetic ext2 image for benchmarking (see benchmark.c).
+//
+// The image is written directly (no mke2fs needed) and passes e2fsck. It holds a tree of
+// directories with a given fan-out and depth, and files with log-uniformly distributed
+// sizes spread over all its directories. With --levels, the root also gets one file
+// ending in each block pointer level (direct, SI, DI and TI, see test_cases_README.txt).
+// Files too big to be written whole (e.g., the TI file of 4K blocks) are sparse: only
+// their first and last blocks are allocated.
+//
+// Usage: create_ext2_image [OPTION]... IMAGE
+//   -b, --block-size SIZE  1024, 2048 or 4096 (default 4096).
+//   -n, --files N          Number of files (default 1000).
+//   -f, --fanout N         Subdirectories per directory (default 4).
+//   -d, --depth N          Levels of subdirectories under the root (default 2).
+//   -s, --sizes MIN:MAX    Range of the file sizes in bytes, K/M/G suffixes allowed
+//                          (default 0:64K).
+//   -l, --levels           Add the block pointer level files.
+//   -S, --seed N           Seed of the file sizes and contents (default 1).
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SB_ADDR 1024
+#define SB_SIZE 1024
+#define BGD_SIZE 32
+#define INODE_SIZE 128
+#define DBLOCK_PTR_COUNT 12
+#define ROOT_INODE_NUM 2
+#define LOST_FOUND_INODE_NUM 11
+#define FIRST_INODE_NUM 12
+#define NAME_SIZE 32
+#define SPARSE_MIN_SIZE (256ULL * 1024 * 1024) // Bigger level files are written sparse.
+#define SPARSE_EDGE_BLOCKS 4                    // Blocks allocated at each end of them.
+#define WRITE_BUF_SIZE (1024 * 1024)
+#define TIMESTAMP 1700000000
+
+#define MODE_DIR 0x41ED  // drwxr-xr-x
+#define MODE_FILE 0x81A4 // -rw-r--r--
+#define FT_REG_FILE 1
+#define FT_DIR 2
+#define FEATURE_INCOMPAT_FILETYPE 0x0002
+#define FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+
+// Directory or file to be put in the image.
+struct Node
+{
+    uint32_t inodeNum;
+    uint32_t parent;     // Index of the parent directory in dirs.
+    uint32_t nextChild;  // Index of the next sibling (in dirs or files), or UINT32_MAX.
+    uint32_t firstDir;   // Directories only: first subdirectory.
+    uint32_t firstFile;  // Directories only: first file.
+    uint32_t numSubdirs; // Directories only.
+    uint64_t size;       // Files only (directories are sized by their entries).
+    int isSparse;
+    char name[NAME_SIZE];
+};
+
+// Layout of the file system, and the state of writing it.
+struct Image
+{
+    int fd;
+    uint32_t blockSize;
+    uint32_t ptrsPerBlock;
+    uint32_t firstDataBlock;
+    uint32_t blocksPerGroup;
+    uint32_t inodesPerGroup;
+    uint32_t numGroups;
+    uint32_t gdtBlocks;
+    uint32_t inodeTableBlocks;
+    uint64_t totalBlocks;
+    uint32_t totalInodes;
+    uint32_t usedInodes;
+    uint8_t *blockBitmap; // Whole file system (bit b is block b).
+    uint64_t nextBlock;   // Allocation cursor.
+    uint64_t iBlocks;     // 512-byte sectors of the inode being written.
+    int isDryRun;         // Count the blocks of an inode without writing them.
+    uint64_t dryRunBlocks;
+    uint8_t *inodeTable; // All inode tables, back to back.
+    uint8_t *block;      // Scratch block.
+    uint8_t *writeBuf;   // Contiguous data blocks waiting to be written.
+    uint64_t writeBufStart;
+    uint32_t writeBufBlocks;
+};
+
+// Contents of the inode being written: a file (generated) or a directory (buffer).
+struct Source
+{
+    uint64_t numBlocks;
+    uint64_t size;
+    int isSparse;
+    uint32_t inodeNum;
+    const uint8_t *data; // Directory entries, or NULL for file contents.
+};
+
+// Command line options.
+struct Options
+{
+    uint32_t blockSize;
+    uint32_t numFiles;
+    uint32_t fanout;
+    uint32_t depth;
+    uint64_t minSize;
+    uint64_t maxSize;
+    int hasLevels;
+    uint64_t seed;
+    const char *imagePath;
+} opts = {4096, 1000, 4, 2, 0, 64 * 1024, 0, 1, NULL};
+
+struct Node *dirs = NULL;
+uint32_t numDirs = 0;
+struct Node *files = NULL;
+uint32_t numFiles = 0;
+uint64_t rngState;
+
+// Function prototypes.
+void parseOptions(int argc, char *argv[]);
+uint64_t parseSize(char *str);
+uint64_t parseNumber(char *str, uint64_t max);
+void usage(const char *prog);
+uint64_t nextRandom(void);
+uint64_t randomSize(void);
+void buildTree(void);
+uint32_t addDir(uint32_t parent, const char *name);
+void addFile(uint32_t parent, const char *name, uint64_t size, int isSparse);
+uint8_t *buildDirBlocks(struct Image *img, uint32_t dirIndex, uint64_t *size);
+void addDirEntry(struct Image *img, uint8_t **buf, uint64_t *size, uint64_t *lastEntry,
+                 uint32_t inodeNum, const char *name, uint8_t fileType);
+void planLayout(struct Image *img, uint64_t dataBlocks);
+int hasSuperblockCopy(uint32_t group);
+uint64_t groupStart(struct Image *img, uint32_t group);
+uint64_t groupDataStart(struct Image *img, uint32_t group);
+uint64_t countInodeBlocks(struct Image *img, struct Source *src);
+void writeInode(struct Image *img, uint32_t inodeNum, uint16_t mode, uint16_t linksCount,
+                struct Source *src);
+uint32_t writeBlockTree(struct Image *img, struct Source *src, int level, uint64_t firstLogical);
+int isBlockAllocated(struct Source *src, uint64_t logical);
+int isRangeAllocated(struct Source *src, uint64_t first, uint64_t span);
+uint32_t allocBlock(struct Image *img);
+void fillFileBlock(struct Source *src, uint64_t logical, uint8_t *block, uint32_t blockSize);
+void writeBlock(struct Image *img, uint64_t blockNum, const uint8_t *data);
+void flushWrites(struct Image *img);
+void writeMetadata(struct Image *img);
+void writeSuperblock(struct Image *img, uint32_t group, uint64_t freeBlocks, uint32_t freeInodes,
+                     int hasLargeFile);
+void put16(uint8_t *buf, uint32_t offset, uint16_t value);
+void put32(uint8_t *buf, uint32_t offset, uint32_t value);
+void do_pwrite(int fd, const void *buf, size_t size, off_t offset);
+void *do_calloc(size_t count, size_t size);
+void *do_realloc(void *ptr, size_t size);
+
+
+int main(int argc, char *argv[])
+{
+    parseOptions(argc, argv);
+    rngState = opts.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    struct Image img;
+    memset(&img, 0, sizeof(img));
+    img.blockSize = opts.blockSize;
+    img.ptrsPerBlock = opts.blockSize / 4;
+    img.firstDataBlock = opts.blockSize == 1024 ? 1 : 0;
+    img.blocksPerGroup = opts.blockSize * 8;
+    img.block = do_calloc(1, img.blockSize);
+
+    buildTree();
+
+    // PLAN THE LAYOUT --------------------------------------------------------
+    // Lay the directories out first, since their size decides how many blocks they need.
+    uint8_t **dirBlocks = do_calloc(numDirs, sizeof(uint8_t *));
+    uint64_t *dirSizes = do_calloc(numDirs, sizeof(uint64_t));
+    uint64_t dataBlocks = 0;
+    uint64_t totalBytes = 0;
+    img.isDryRun = 1;
+    for (uint32_t i = 0; i < numDirs; i++)
+    {
+        dirBlocks[i] = buildDirBlocks(&img, i, &dirSizes[i]);
+        struct Source src = {dirSizes[i] / img.blockSize, dirSizes[i], 0, dirs[i].inodeNum, dirBlocks[i]};
+        dataBlocks += countInodeBlocks(&img, &src);
+    }
+    for (uint32_t i = 0; i < numFiles; i++)
+    {
+        struct Source src = {(files[i].size + img.blockSize - 1) / img.blockSize, files[i].size,
+                             files[i].isSparse, files[i].inodeNum, NULL};
+        dataBlocks += countInodeBlocks(&img, &src);
+        totalBytes += files[i].size;
+    }
+    img.isDryRun = 0;
+
+    planLayout(&img, dataBlocks);
+    // ------------------------------------------------------------------------
+
+    // WRITE THE IMAGE --------------------------------------------------------
+    img.fd = open(opts.imagePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (img.fd == -1)
+    {
+        perror(opts.imagePath);
+        exit(1);
+    }
+    if (ftruncate(img.fd, (off_t)(img.totalBlocks * img.blockSize)) == -1)
+    {
+        perror("ftruncate failed");
+        exit(1);
+    }
+    img.blockBitmap = do_calloc((img.totalBlocks + 7) / 8, 1);
+    img.inodeTable = do_calloc((size_t)img.numGroups * img.inodeTableBlocks, img.blockSize);
+    img.writeBuf = do_calloc(WRITE_BUF_SIZE, 1);
+    img.nextBlock = groupDataStart(&img, 0);
+
+    for (uint32_t i = 0; i < numDirs; i++)
+    {
+        struct Source src = {dirSizes[i] / img.blockSize, dirSizes[i], 0, dirs[i].inodeNum, dirBlocks[i]};
+        writeInode(&img, dirs[i].inodeNum, MODE_DIR, 2 + dirs[i].numSubdirs, &src);
+        free(dirBlocks[i]);
+    }
+    for (uint32_t i = 0; i < numFiles; i++)
+    {
+        struct Source src = {(files[i].size + img.blockSize - 1) / img.blockSize, files[i].size,
+                             files[i].isSparse, files[i].inodeNum, NULL};
+        writeInode(&img, files[i].inodeNum, MODE_FILE, 1, &src);
+    }
+    flushWrites(&img);
+    writeMetadata(&img);
+    close(img.fd);
+    // ------------------------------------------------------------------------
+
+    printf("%s: %u-byte blocks, %llu blocks in %u groups, %u directories, %u files, %llu bytes of file data\n",
+           opts.imagePath, img.blockSize, (unsigned long long)img.totalBlocks, img.numGroups,
+           numDirs, numFiles, (unsigned long long)totalBytes);
+
+    // Free the allocated memory.
+    free(dirBlocks);
+    free(dirSizes);
+    free(img.blockBitmap);
+    free(img.inodeTable);
+    free(img.writeBuf);
+    free(img.block);
+    free(dirs);
+    free(files);
+
+    return 0;
+}
+
+// OPTIONS --------------------------------------------------------------------
+void parseOptions(int argc, char *argv[])
+{
+    static struct option longOpts[] = {
+        {"block-size", required_argument, NULL, 'b'},
+        {"files", required_argument, NULL, 'n'},
+        {"fanout", required_argument, NULL, 'f'},
+        {"depth", required_argument, NULL, 'd'},
+        {"sizes", required_argument, NULL, 's'},
+        {"levels", no_argument, NULL, 'l'},
+        {"seed", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:n:f:d:s:lS:", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            opts.blockSize = (uint32_t)parseSize(optarg);
+            if (opts.blockSize != 1024 && opts.blockSize != 2048 && opts.blockSize != 4096)
+            {
+                fprintf(stderr, "Invalid block size: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'n':
+            opts.numFiles = (uint32_t)parseNumber(optarg, UINT32_MAX);
+            break;
+        case 'f':
+            opts.fanout = (uint32_t)parseNumber(optarg, UINT32_MAX);
+            break;
+        case 'd':
+            opts.depth = (uint32_t)parseNumber(optarg, UINT32_MAX);
+            break;
+        case 's':
+        {
+            char *sep = strchr(optarg, ':');
+            if (sep == NULL)
+            {
+                fprintf(stderr, "Invalid sizes: %s\n", optarg);
+                exit(1);
+            }
+
+            *sep = '\0';
+            opts.minSize = parseSize(optarg);
+            opts.maxSize = parseSize(sep + 1);
+            if (opts.minSize > opts.maxSize)
+            {
+                fprintf(stderr, "Invalid sizes: %s:%s\n", optarg, sep + 1);
+                exit(1);
+            }
+            break;
+        }
+        case 'l':
+            opts.hasLevels = 1;
+            break;
+        case 'S':
+            opts.seed = parseNumber(optarg, UINT64_MAX);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+    }
+    opts.imagePath = argv[optind];
+}
+
+// Parse a size such as 4096, 512K, 16M or 1G (in bytes), as main does. Unlike there, 0
+// is a valid size (of a file).
+uint64_t parseSize(char *str)
+{
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        size <<= 10;
+        // Fall through.
+    case 'M':
+    case 'm':
+        size <<= 10;
+        // Fall through.
+    case 'K':
+    case 'k':
+        size <<= 10;
+        end++;
+        break;
+    }
+
+    if (end == str || *end != '\0' || str[0] == '-')
+    {
+        fprintf(stderr, "Invalid size: %s\n", str);
+        exit(1);
+    }
+
+    return size;
+}
+
+// Parse a plain decimal number of at most max.
+uint64_t parseNumber(char *str, uint64_t max)
+{
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(str, &end, 10);
+
+    if (end == str || *end != '\0' || str[0] == '-' || errno == ERANGE || number > max)
+    {
+        fprintf(stderr, "Invalid number: %s\n", str);
+        exit(1);
+    }
+
+    return number;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-b BLOCK_SIZE] [-n FILES] [-f FANOUT] [-d DEPTH] [-s MIN:MAX] [-l] [-S SEED] IMAGE\n",
+            prog);
+    exit(1);
+}
+
+// xorshift64*.
+uint64_t nextRandom(void)
+{
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+
+    return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+// Log-uniform in [minSize, maxSize], so that small files dominate as on real file systems.
+uint64_t randomSize(void)
+{
+    double lo = log((double)opts.minSize + 1);
+    double hi = log((double)opts.maxSize + 1);
+    double r = (double)(nextRandom() >> 11) / (double)(1ULL << 53);
+    uint64_t size = (uint64_t)exp(lo + (hi - lo) * r) - 1;
+
+    return size < opts.minSize ? opts.minSize : (size > opts.maxSize ? opts.maxSize : size);
+}
+
+// TREE -----------------------------------------------------------------------
+// Create the directories breadth first, then deal the files out over all of them.
+void buildTree(void)
+{
+    addDir(0, "");
+    addDir(0, "lost+found");
+
+    char name[NAME_SIZE];
+    uint32_t levelStart = 0;
+    for (uint32_t depth = 0; depth < opts.depth; depth++)
+    {
+        uint32_t levelEnd = numDirs;
+        for (uint32_t d = levelStart; d < levelEnd; d++)
+        {
+            if (d == 1)
+            {
+                continue; // lost+found.
+            }
+
+            for (uint32_t i = 0; i < opts.fanout; i++)
+            {
+                snprintf(name, sizeof(name), "d%u_%u", depth, i);
+                addDir(d, name);
+            }
+        }
+        levelStart = levelEnd;
+    }
+
+    for (uint32_t i = 0; i < opts.numFiles; i++)
+    {
+        snprintf(name, sizeof(name), "f%u.bin", i);
+        uint32_t d = i % (numDirs - 1);
+        addFile(d == 0 ? 0 : d + 1, name, randomSize(), 0);
+    }
+
+    if (opts.hasLevels)
+    {
+        // Each file ends one byte into its level (the direct one fills its 12 blocks).
+        uint64_t p = opts.blockSize / 4;
+        uint64_t levelBlocks[4] = {DBLOCK_PTR_COUNT, DBLOCK_PTR_COUNT + p, DBLOCK_PTR_COUNT + p + p * p,
+                                   DBLOCK_PTR_COUNT + p + p * p + p * p * p};
+        const char *levelNames[4] = {"level_direct.bin", "level_si.bin", "level_di.bin", "level_ti.bin"};
+        for (int i = 0; i < 4; i++)
+        {
+            uint64_t size = i == 0 ? levelBlocks[0] * opts.blockSize : levelBlocks[i - 1] * opts.blockSize + 1;
+            addFile(0, levelNames[i], size, size > SPARSE_MIN_SIZE);
+        }
+    }
+}
+
+uint32_t addDir(uint32_t parent, const char *name)
+{
+    dirs = do_realloc(dirs, (numDirs + 1) * sizeof(struct Node));
+    struct Node *dir = &dirs[numDirs];
+    memset(dir, 0, sizeof(struct Node));
+
+    // Root is inode 2 and lost+found inode 11, the first two directories added.
+    dir->inodeNum = numDirs == 0 ? ROOT_INODE_NUM : (numDirs == 1 ? LOST_FOUND_INODE_NUM : FIRST_INODE_NUM + numDirs - 2);
+    dir->parent = parent;
+    dir->firstDir = UINT32_MAX;
+    dir->firstFile = UINT32_MAX;
+    dir->nextChild = UINT32_MAX;
+    snprintf(dir->name, sizeof(dir->name), "%s", name);
+    if (numDirs != 0)
+    {
+        dir->nextChild = dirs[parent].firstDir;
+        dirs[parent].firstDir = numDirs;
+        dirs[parent].numSubdirs++;
+    }
+
+    return numDirs++;
+}
+
+void addFile(uint32_t parent, const char *name, uint64_t size, int isSparse)
+{
+    files = do_realloc(files, (numFiles + 1) * sizeof(struct Node));
+    struct Node *file = &files[numFiles];
+    memset(file, 0, sizeof(struct Node));
+
+    file->parent = parent;
+    file->size = size;
+    file->isSparse = isSparse;
+    snprintf(file->name, sizeof(file->name), "%s", name);
+    file->nextChild = dirs[parent].firstFile;
+    dirs[parent].firstFile = numFiles;
+    numFiles++;
+}
+
+// Directory entries of a directory, in whole blocks.
+uint8_t *buildDirBlocks(struct Image *img, uint32_t dirIndex, uint64_t *size)
+{
+    struct Node *dir = &dirs[dirIndex];
+    uint8_t *buf = NULL;
+    uint64_t lastEntry = 0;
+
+    *size = 0;
+    addDirEntry(img, &buf, size, &lastEntry, dir->inodeNum, ".", FT_DIR);
+    addDirEntry(img, &buf, size, &lastEntry, dirs[dir->parent].inodeNum, "..", FT_DIR);
+    for (uint32_t child = dir->firstDir; child != UINT32_MAX; child = dirs[child].nextChild)
+    {
+        addDirEntry(img, &buf, size, &lastEntry, dirs[child].inodeNum, dirs[child].name, FT_DIR);
+    }
+    for (uint32_t child = dir->firstFile; child != UINT32_MAX; child = files[child].nextChild)
+    {
+        // Files get their inodes after all the directories, in the order they were added.
+        files[child].inodeNum = FIRST_INODE_NUM + (numDirs - 2) + child;
+        addDirEntry(img, &buf, size, &lastEntry, files[child].inodeNum, files[child].name, FT_REG_FILE);
+    }
+
+    return buf;
+}
+
+// Append an entry, starting a new block when it does not fit in the current one. The
+// last entry of a block spans the rest of it.
+void addDirEntry(struct Image *img, uint8_t **buf, uint64_t *size, uint64_t *lastEntry,
+                 uint32_t inodeNum, const char *name, uint8_t fileType)
+{
+    uint32_t nameLen = (uint32_t)strlen(name);
+    uint32_t recLen = (8 + nameLen + 3) & ~3U;
+    uint64_t used = *size == 0 ? 0 : *lastEntry + ((8 + (*buf)[*lastEntry + 6] + 3) & ~3U);
+    uint64_t blockEnd = *size;
+
+    uint64_t offset;
+    if (*size == 0 || used + recLen > blockEnd)
+    {
+        *buf = do_realloc(*buf, *size + img->blockSize);
+        memset(*buf + *size, 0, img->blockSize);
+        offset = *size;
+        *size += img->blockSize;
+    }
+    else
+    {
+        offset = used;
+        put16(*buf, (uint32_t)*lastEntry + 4, (uint16_t)(offset - *lastEntry));
+    }
+
+    put32(*buf, (uint32_t)offset, inodeNum);
+    put16(*buf, (uint32_t)offset + 4, (uint16_t)(*size - offset));
+    (*buf)[offset + 6] = (uint8_t)nameLen;
+    (*buf)[offset + 7] = fileType;
+    memcpy(*buf + offset + 8, name, nameLen);
+    *lastEntry = offset;
+}
+
+// LAYOUT ---------------------------------------------------------------------
+// Pick the smallest number of groups holding the data blocks and all the inodes.
+void planLayout(struct Image *img, uint64_t dataBlocks)
+{
+    uint32_t inodesPerBlock = img->blockSize / INODE_SIZE;
+
+    img->usedInodes = FIRST_INODE_NUM - 1 + (numDirs - 2) + numFiles;
+    for (img->numGroups = 1;; img->numGroups++)
+    {
+        img->gdtBlocks = (img->numGroups * BGD_SIZE + img->blockSize - 1) / img->blockSize;
+        img->inodesPerGroup = (img->usedInodes + img->numGroups - 1) / img->numGroups;
+        img->inodesPerGroup = (img->inodesPerGroup + inodesPerBlock - 1) / inodesPerBlock * inodesPerBlock;
+        if (img->inodesPerGroup > img->blockSize * 8)
+        {
+            continue;
+        }
+
+        img->inodeTableBlocks = img->inodesPerGroup / inodesPerBlock;
+        img->totalBlocks = img->firstDataBlock + (uint64_t)img->numGroups * img->blocksPerGroup;
+        uint64_t capacity = 0;
+        for (uint32_t group = 0; group < img->numGroups; group++)
+        {
+            capacity += groupStart(img, group) + img->blocksPerGroup - groupDataStart(img, group);
+        }
+
+        // Leave a little slack for the allocator skipping group headers.
+        if (capacity >= dataBlocks + dataBlocks / 100 + 16 && img->totalBlocks <= UINT32_MAX)
+        {
+            break;
+        }
+    }
+    img->totalInodes = img->inodesPerGroup * img->numGroups;
+}
+
+// Groups 0, 1 and powers of 3, 5 and 7 keep a copy of the superblock (sparse_super).
+int hasSuperblockCopy(uint32_t group)
+{
+    if (group <= 1)
+    {
+        return 1;
+    }
+
+    for (uint32_t base = 3; base <= 7; base += 2)
+    {
+        uint32_t n = base;
+        while (n < group)
+        {
+            n *= base;
+        }
+        if (n == group)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+uint64_t groupStart(struct Image *img, uint32_t group)
+{
+    return img->firstDataBlock + (uint64_t)group * img->blocksPerGroup;
+}
+
+// First block after the superblock copy, descriptors, bitmaps and inode table.
+uint64_t groupDataStart(struct Image *img, uint32_t group)
+{
+    return groupStart(img, group) + (hasSuperblockCopy(group) ? 1 + img->gdtBlocks : 0) + 2 +
+           img->inodeTableBlocks;
+}
+
+// INODES AND BLOCKS ----------------------------------------------------------
+uint64_t countInodeBlocks(struct Image *img, struct Source *src)
+{
+    img->dryRunBlocks = 0;
+    writeInode(img, 0, 0, 0, src);
+
+    return img->dryRunBlocks;
+}
+
+// Allocate and write the blocks of an inode, then fill in its record.
+void writeInode(struct Image *img, uint32_t inodeNum, uint16_t mode, uint16_t linksCount,
+                struct Source *src)
+{
+    uint64_t p = img->ptrsPerBlock;
+    uint64_t levelFirst[4] = {0, DBLOCK_PTR_COUNT, DBLOCK_PTR_COUNT + p, DBLOCK_PTR_COUNT + p + p * p};
+    uint32_t ptrs[DBLOCK_PTR_COUNT + 3];
+
+    img->iBlocks = 0;
+    for (int i = 0; i < DBLOCK_PTR_COUNT; i++)
+    {
+        ptrs[i] = writeBlockTree(img, src, 0, (uint64_t)i);
+    }
+    for (int i = 1; i <= 3; i++)
+    {
+        ptrs[DBLOCK_PTR_COUNT + i - 1] = writeBlockTree(img, src, i, levelFirst[i]);
+    }
+    if (img->isDryRun)
+    {
+        return;
+    }
+
+    uint8_t *inode = img->inodeTable + (size_t)(inodeNum - 1) * INODE_SIZE;
+    put16(inode, 0, mode);
+    put32(inode, 4, (uint32_t)src->size);
+    put32(inode, 8, TIMESTAMP);
+    put32(inode, 12, TIMESTAMP);
+    put32(inode, 16, TIMESTAMP);
+    put16(inode, 26, linksCount);
+    put32(inode, 28, (uint32_t)img->iBlocks);
+    for (int i = 0; i < DBLOCK_PTR_COUNT + 3; i++)
+    {
+        put32(inode, 40 + 4 * i, ptrs[i]);
+    }
+    put32(inode, 108, (uint32_t)(src->size >> 32));
+}
+
+// Allocate the subtree of pointers at a level (0 is a data block) covering the logical
+// blocks from firstLogical, parents ahead of their children as mke2fs does. Returns 0
+// when nothing under it is allocated.
+uint32_t writeBlockTree(struct Image *img, struct Source *src, int level, uint64_t firstLogical)
+{
+    uint64_t span = 1;
+    for (int l = 0; l < level; l++)
+    {
+        span *= img->ptrsPerBlock;
+    }
+    if (!isRangeAllocated(src, firstLogical, span))
+    {
+        return 0;
+    }
+
+    img->iBlocks += img->blockSize / 512;
+    uint32_t blockNum;
+    if (img->isDryRun)
+    {
+        img->dryRunBlocks++;
+        blockNum = 0;
+        if (level == 0)
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        blockNum = allocBlock(img);
+    }
+
+    if (level == 0)
+    {
+        if (src->data != NULL)
+        {
+            writeBlock(img, blockNum, src->data + firstLogical * img->blockSize);
+        }
+        else
+        {
+            fillFileBlock(src, firstLogical, img->block, img->blockSize);
+            writeBlock(img, blockNum, img->block);
+        }
+
+        return blockNum;
+    }
+
+    uint32_t *ptrs = do_calloc(img->ptrsPerBlock, sizeof(uint32_t));
+    uint64_t childSpan = span / img->ptrsPerBlock;
+    for (uint64_t i = 0; i < img->ptrsPerBlock; i++)
+    {
+        ptrs[i] = writeBlockTree(img, src, level - 1, firstLogical + i * childSpan);
+    }
+    if (!img->isDryRun)
+    {
+        for (uint64_t i = 0; i < img->ptrsPerBlock; i++)
+        {
+            put32((uint8_t *)ptrs, (uint32_t)(i * 4), ptrs[i]);
+        }
+        writeBlock(img, blockNum, (uint8_t *)ptrs);
+    }
+
+    // Free the allocated memory.
+    free(ptrs);
+
+    return blockNum == 0 ? 1 : blockNum;
+}
+
+int isBlockAllocated(struct Source *src, uint64_t logical)
+{
+    if (logical >= src->numBlocks)
+    {
+        return 0;
+    }
+
+    return !src->isSparse || logical < SPARSE_EDGE_BLOCKS || logical >= src->numBlocks - SPARSE_EDGE_BLOCKS;
+}
+
+int isRangeAllocated(struct Source *src, uint64_t first, uint64_t span)
+{
+    if (first >= src->numBlocks)
+    {
+        return 0;
+    }
+
+    uint64_t last = first + span - 1;
+    if (last >= src->numBlocks)
+    {
+        last = src->numBlocks - 1;
+    }
+
+    return isBlockAllocated(src, first) || isBlockAllocated(src, last) ||
+           (src->isSparse && first < SPARSE_EDGE_BLOCKS);
+}
+
+// Next free block, skipping the group headers.
+uint32_t allocBlock(struct Image *img)
+{
+    uint32_t group = (uint32_t)((img->nextBlock - img->firstDataBlock) / img->blocksPerGroup);
+    if (img->nextBlock < groupDataStart(img, group))
+    {
+        img->nextBlock = groupDataStart(img, group);
+    }
+    if (img->nextBlock >= img->totalBlocks)
+    {
+        fprintf(stderr, "Image is full.\n");
+        exit(1);
+    }
+
+    uint64_t blockNum = img->nextBlock++;
+    img->blockBitmap[blockNum / 8] |= (uint8_t)(1 << (blockNum % 8));
+
+    return (uint32_t)blockNum;
+}
+
+// Pseudorandom contents, a function of the inode and the block, zeroed past the end.
+void fillFileBlock(struct Source *src, uint64_t logical, uint8_t *block, uint32_t blockSize)
+{
+    uint64_t state = ((uint64_t)src->inodeNum << 32 ^ logical) * 0x9E3779B97F4A7C15ULL + 1;
+    for (uint32_t i = 0; i < blockSize; i += 8)
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        *(uint64_t *)(block + i) = state * 0x2545F4914F6CDD1DULL;
+    }
+
+    uint64_t valid = src->size - logical * blockSize;
+    if (valid < blockSize)
+    {
+        memset(block + valid, 0, blockSize - valid);
+    }
+}
+
+// Queue a block, writing the queue out when the block does not follow it.
+void writeBlock(struct Image *img, uint64_t blockNum, const uint8_t *data)
+{
+    if (img->writeBufBlocks != 0 &&
+        (blockNum != img->writeBufStart + img->writeBufBlocks ||
+         (uint64_t)(img->writeBufBlocks + 1) * img->blockSize > WRITE_BUF_SIZE))
+    {
+        flushWrites(img);
+    }
+    if (img->writeBufBlocks == 0)
+    {
+        img->writeBufStart = blockNum;
+    }
+
+    memcpy(img->writeBuf + (size_t)img->writeBufBlocks * img->blockSize, data, img->blockSize);
+    img->writeBufBlocks++;
+}
+
+void flushWrites(struct Image *img)
+{
+    if (img->writeBufBlocks == 0)
+    {
+        return;
+    }
+
+    do_pwrite(img->fd, img->writeBuf, (size_t)img->writeBufBlocks * img->blockSize,
+              (off_t)(img->writeBufStart * img->blockSize));
+    img->writeBufBlocks = 0;
+}
+
+// METADATA -------------------------------------------------------------------
+// Bitmaps, inode tables, descriptors and superblock copies of every group.
+void writeMetadata(struct Image *img)
+{
+    int hasLargeFile = 0;
+    for (uint32_t i = 0; i < numFiles; i++)
+    {
+        hasLargeFile |= files[i].size >= (1ULL << 31);
+    }
+
+    for (uint32_t group = 0; group < img->numGroups; group++)
+    {
+        for (uint64_t b = groupStart(img, group); b < groupDataStart(img, group); b++)
+        {
+            img->blockBitmap[b / 8] |= (uint8_t)(1 << (b % 8));
+        }
+    }
+
+    uint8_t *gdt = do_calloc(img->gdtBlocks, img->blockSize);
+    uint8_t *bitmap = do_calloc(1, img->blockSize);
+    uint64_t totalFree = 0;
+    uint32_t totalFreeInodes = 0;
+    for (uint32_t group = 0; group < img->numGroups; group++)
+    {
+        uint64_t start = groupStart(img, group);
+
+        // Block bitmap (every group is whole, so there is no padding past the end).
+        memset(bitmap, 0, img->blockSize);
+        uint32_t freeBlocks = 0;
+        for (uint64_t b = 0; b < img->blocksPerGroup; b++)
+        {
+            uint64_t blockNum = start + b;
+            if (img->blockBitmap[blockNum / 8] & (1 << (blockNum % 8)))
+            {
+                bitmap[b / 8] |= (uint8_t)(1 << (b % 8));
+            }
+            else
+            {
+                freeBlocks++;
+            }
+        }
+        uint64_t blockNum = groupDataStart(img, group) - img->inodeTableBlocks - 2;
+        do_pwrite(img->fd, bitmap, img->blockSize, (off_t)(blockNum * img->blockSize));
+
+        // Inode bitmap; bits past the last inode of the group are set.
+        memset(bitmap, 0, img->blockSize);
+        uint32_t freeInodes = 0;
+        uint32_t usedDirs = 0;
+        for (uint32_t i = 0; i < img->blockSize * 8; i++)
+        {
+            uint32_t inodeNum = group * img->inodesPerGroup + i + 1;
+            if (i >= img->inodesPerGroup || inodeNum <= img->usedInodes)
+            {
+                bitmap[i / 8] |= (uint8_t)(1 << (i % 8));
+            }
+            else
+            {
+                freeInodes++;
+            }
+            if (i < img->inodesPerGroup && inodeNum <= img->usedInodes &&
+                (img->inodeTable[(size_t)(inodeNum - 1) * INODE_SIZE + 1] & 0xF0) == (MODE_DIR >> 8 & 0xF0))
+            {
+                usedDirs++;
+            }
+        }
+        do_pwrite(img->fd, bitmap, img->blockSize, (off_t)((blockNum + 1) * img->blockSize));
+
+        do_pwrite(img->fd, img->inodeTable + (size_t)group * img->inodeTableBlocks * img->blockSize,
+                  (size_t)img->inodeTableBlocks * img->blockSize, (off_t)((blockNum + 2) * img->blockSize));
+
+        put32(gdt, group * BGD_SIZE, (uint32_t)blockNum);
+        put32(gdt, group * BGD_SIZE + 4, (uint32_t)blockNum + 1);
+        put32(gdt, group * BGD_SIZE + 8, (uint32_t)blockNum + 2);
+        put16(gdt, group * BGD_SIZE + 12, (uint16_t)freeBlocks);
+        put16(gdt, group * BGD_SIZE + 14, (uint16_t)freeInodes);
+        put16(gdt, group * BGD_SIZE + 16, (uint16_t)usedDirs);
+        totalFree += freeBlocks;
+        totalFreeInodes += freeInodes;
+    }
+
+    for (uint32_t group = 0; group < img->numGroups; group++)
+    {
+        if (hasSuperblockCopy(group))
+        {
+            writeSuperblock(img, group, totalFree, totalFreeInodes, hasLargeFile);
+            do_pwrite(img->fd, gdt, (size_t)img->gdtBlocks * img->blockSize,
+                      (off_t)((groupStart(img, group) + 1) * img->blockSize));
+        }
+    }
+
+    // Free the allocated memory.
+    free(gdt);
+    free(bitmap);
+}
+
+void writeSuperblock(struct Image *img, uint32_t group, uint64_t freeBlocks, uint32_t freeInodes,
+                     int hasLargeFile)
+{
+    uint32_t logBlockSize = img->blockSize == 1024 ? 0 : (img->blockSize == 2048 ? 1 : 2);
+
+    uint8_t sb[SB_SIZE];
+    memset(sb, 0, sizeof(sb));
+    put32(sb, 0, img->totalInodes);
+    put32(sb, 4, (uint32_t)img->totalBlocks);
+    put32(sb, 12, (uint32_t)freeBlocks);
+    put32(sb, 16, freeInodes);
+    put32(sb, 20, img->firstDataBlock);
+    put32(sb, 24, logBlockSize);
+    put32(sb, 28, logBlockSize);
+    put32(sb, 32, img->blocksPerGroup);
+    put32(sb, 36, img->blocksPerGroup);
+    put32(sb, 40, img->inodesPerGroup);
+    put32(sb, 48, TIMESTAMP);
+    put16(sb, 54, 0xFFFF); // No mount count limit.
+    put16(sb, 56, 0xEF53);
+    put16(sb, 58, 1); // Cleanly unmounted.
+    put16(sb, 60, 1); // Continue on errors.
+    put32(sb, 64, TIMESTAMP);
+    put32(sb, 76, 1); // Dynamic revision.
+    put32(sb, 84, LOST_FOUND_INODE_NUM);
+    put16(sb, 88, INODE_SIZE);
+    put16(sb, 90, (uint16_t)group);
+    put32(sb, 96, FEATURE_INCOMPAT_FILETYPE);
+    put32(sb, 100, FEATURE_RO_COMPAT_SPARSE_SUPER | (hasLargeFile ? FEATURE_RO_COMPAT_LARGE_FILE : 0));
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        sb[104 + i] = (uint8_t)(opts.seed >> (i % 8 * 8) ^ (i * 0x3D)); // UUID.
+    }
+    memcpy(sb + 120, "synthetic", 9);
+
+    // The primary superblock is 1024 bytes into the image whatever the block size.
+    do_pwrite(img->fd, sb, SB_SIZE,
+              group == 0 ? SB_ADDR : (off_t)(groupStart(img, group) * img->blockSize));
+}
+
+// HELPERS --------------------------------------------------------------------
+void put16(uint8_t *buf, uint32_t offset, uint16_t value)
+{
+    buf[offset] = (uint8_t)value;
+    buf[offset + 1] = (uint8_t)(value >> 8);
+}
+
+void put32(uint8_t *buf, uint32_t offset, uint32_t value)
+{
+    put16(buf, offset, (uint16_t)value);
+    put16(buf, offset + 2, (uint16_t)(value >> 16));
+}
+
+void do_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, buf, size, offset);
+        if (written <= 0)
+        {
+            perror("pwrite failed");
+            exit(1);
+        }
+
+        buf = (const uint8_t *)buf + written;
+        size -= (size_t)written;
+        offset += written;
+    }
+}
+
+// The allocation helpers of ext2read.c, which this tool does not link with.
+void *do_calloc(size_t count, size_t size)
+{
+    void *ptr = calloc(count, size);
+    if (ptr == NULL)
+    {
+        perror("calloc failed");
+        exit(1);
+    }
+
+    return ptr;
+}
+
+void *do_realloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (ptr == NULL)
+    {
+        perror("realloc failed");
+        exit(1);
+    }
+
+    return ptr;
+}
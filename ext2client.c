@@ -0,0 +1,576 @@
+// Client of the ext2 server (see ext2server.c), and a load generator for it.
+//
+//   gcc -O2 -pthread ext2client.c -o ext2client
+//
+// Usage: ext2client [OPTION]... COMMAND [ARG]...
+//   list PATH                   Entries of a directory: inode, mode (octal), size and name.
+//   stat PATH                   The same for a single file object.
+//   read PATH [OFFSET [COUNT]]  Copy (a range of) a file to stdout.
+//   extract PATH [DEST]         Extract a file object, like main does (DEST defaults to
+//                               ./output for a directory and to the name of a file). The
+//                               server only extracts under its --extract-root, into a
+//                               destination that does not exist yet.
+//   enumerate                   Every path of the image, like main with no path.
+//   load PATHLIST               Send REQUESTS requests over CONNECTIONS connections at once,
+//                               going round the paths of PATHLIST ("-" for stdin): a stat
+//                               for a directory and a read of the first READ_SIZE bytes for
+//                               a file. The throughput and latencies are printed as JSON.
+// Options:
+//   -s, --socket PATH       Socket of the server (default /tmp/ext2server.sock).
+//   -i, --image N           Image of the server to use (default 0).
+//   -c, --connections N     Connections of the load (default 8).
+//   -n, --requests N        Requests of the load (default 10000).
+//   -r, --read-size SIZE    Bytes read per file by the load, 0 to only stat (default 4096).
+
+#define _GNU_SOURCE // for getline.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <limits.h> // for PATH_MAX.
+#include <pthread.h>
+#include <time.h> // for clock_gettime.
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ext2read.h" // for the error codes.
+#include "ext2proto.h"
+
+#define MODE_DIR 0x4000
+
+// Payload of the last response of a connection.
+struct Response
+{
+    int status;
+    char *data;
+    uint64_t len;
+    uint64_t cap;
+};
+
+// A connection of the load and what it measured.
+struct LoadWorker
+{
+    pthread_t thread;
+    int id;
+    double *latencies; // Seconds, one per request (shared array, strided by connection).
+    uint64_t failures;
+};
+
+// Command line options.
+struct Options
+{
+    const char *socketPath;
+    uint32_t image;
+    int connections;
+    long requests;
+    uint64_t readSize;
+} opts = {PROTO_DEFAULT_SOCKET, 0, 8, 10000, 4096};
+
+// Paths of the load.
+char **paths;
+size_t numPaths;
+
+// Function prototypes.
+void parseOptions(int argc, char *argv[]);
+void usage(const char *prog);
+uint64_t parseNumber(char *str);
+int connectServer(void);
+int sendRequest(int fd, uint32_t op, const char *path, const char *arg, uint64_t offset, uint64_t count,
+                struct Response *response);
+void checkResponse(struct Response *response);
+void printStats(struct Response *response);
+int runLoad(const char *pathList);
+void *loadWorker(void *arg);
+int compareDoubles(const void *a, const void *b);
+double now(void);
+void readFull(int fd, void *buf, size_t len);
+void writeFull(int fd, const void *buf, size_t len);
+void *do_realloc(void *ptr, size_t size);
+
+int main(int argc, char *argv[])
+{
+    parseOptions(argc, argv);
+    const char *command = argv[optind];
+    const char *path = optind + 1 < argc ? argv[optind + 1] : NULL;
+    int numArgs = argc - optind;
+
+    if (strcmp(command, "load") == 0 && numArgs == 2)
+    {
+        return runLoad(path);
+    }
+
+    int fd = connectServer();
+    struct Response response = {0, NULL, 0, 0};
+    if (strcmp(command, "enumerate") == 0 && numArgs == 1)
+    {
+        sendRequest(fd, PROTO_ENUMERATE, "", "", 0, 0, &response);
+        checkResponse(&response);
+        fwrite(response.data, 1, response.len, stdout);
+    }
+    else if ((strcmp(command, "list") == 0 || strcmp(command, "stat") == 0) && numArgs == 2)
+    {
+        sendRequest(fd, command[0] == 'l' ? PROTO_LIST : PROTO_STAT, path, "", 0, 0, &response);
+        checkResponse(&response);
+        printStats(&response);
+    }
+    else if (strcmp(command, "read") == 0 && numArgs >= 2 && numArgs <= 4)
+    {
+        uint64_t offset = numArgs >= 3 ? parseNumber(argv[optind + 2]) : 0;
+        uint64_t count = numArgs == 4 ? parseNumber(argv[optind + 3]) : UINT64_MAX;
+
+        // The server caps every read, so a long range takes a few requests.
+        while (count > 0)
+        {
+            sendRequest(fd, PROTO_READ, path, "", offset, count < PROTO_MAX_READ ? count : PROTO_MAX_READ,
+                        &response);
+            checkResponse(&response);
+            if (response.len == 0)
+            {
+                break;
+            }
+
+            fwrite(response.data, 1, response.len, stdout);
+            offset += response.len;
+            count -= response.len;
+        }
+    }
+    else if (strcmp(command, "extract") == 0 && numArgs >= 2 && numArgs <= 3)
+    {
+        // Name the destination as main would (unless it is given).
+        const char *name;
+        if (numArgs == 3)
+        {
+            name = argv[optind + 2];
+        }
+        else
+        {
+            sendRequest(fd, PROTO_STAT, path, "", 0, 0, &response);
+            checkResponse(&response);
+
+            struct ProtoStat record;
+            memcpy(&record, response.data, sizeof(record));
+            response.data[sizeof(record) + record.nameLen] = '\0';
+            name = (record.mode & 0xF000) == MODE_DIR ? "output" : response.data + sizeof(record);
+        }
+
+        // The server resolves the destination, so it is made absolute here.
+        char dest[PATH_MAX];
+        if (name[0] == '/')
+        {
+            snprintf(dest, sizeof(dest), "%s", name);
+        }
+        else if (getcwd(dest, sizeof(dest)) == NULL ||
+                 (size_t)snprintf(dest + strlen(dest), sizeof(dest) - strlen(dest), "/%s", name) >=
+                     sizeof(dest) - strlen(dest))
+        {
+            fprintf(stderr, "Destination path too long.\n");
+            exit(1);
+        }
+
+        sendRequest(fd, PROTO_EXTRACT, path, dest, 0, 0, &response);
+        checkResponse(&response);
+    }
+    else
+    {
+        usage(argv[0]);
+    }
+
+    // Free the allocated memory.
+    close(fd);
+    free(response.data);
+
+    return 0;
+}
+
+// OPTIONS --------------------------------------------------------------------
+void parseOptions(int argc, char *argv[])
+{
+    static struct option longOpts[] = {
+        {"socket", required_argument, NULL, 's'},
+        {"image", required_argument, NULL, 'i'},
+        {"connections", required_argument, NULL, 'c'},
+        {"requests", required_argument, NULL, 'n'},
+        {"read-size", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}};
+
+    // Stop at the command, so that its arguments are left alone.
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+s:i:c:n:r:", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            opts.socketPath = optarg;
+            break;
+        case 'i':
+            opts.image = (uint32_t)parseNumber(optarg);
+            break;
+        case 'c':
+            opts.connections = atoi(optarg);
+            if (opts.connections < 1)
+            {
+                fprintf(stderr, "Invalid number of connections: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'n':
+            opts.requests = atol(optarg);
+            if (opts.requests < 1)
+            {
+                fprintf(stderr, "Invalid number of requests: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            opts.readSize = parseNumber(optarg);
+            if (opts.readSize > PROTO_MAX_READ)
+            {
+                fprintf(stderr, "Invalid read size: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind == argc)
+    {
+        usage(argv[0]);
+    }
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-s SOCKET] [-i IMAGE] COMMAND [ARG]...\n"
+            "  list PATH | stat PATH | read PATH [OFFSET [COUNT]] | extract PATH [DEST] | enumerate\n"
+            "  [-c CONNECTIONS] [-n REQUESTS] [-r READ_SIZE] load PATHLIST\n",
+            prog);
+    exit(1);
+}
+
+// Parse a plain decimal number (such as an offset or a count).
+uint64_t parseNumber(char *str)
+{
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(str, &end, 10);
+
+    if (end == str || *end != '\0' || str[0] == '-' || errno == ERANGE)
+    {
+        fprintf(stderr, "Invalid number: %s\n", str);
+        exit(1);
+    }
+
+    return number;
+}
+
+// REQUESTS -------------------------------------------------------------------
+int connectServer(void)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", opts.socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        perror(opts.socketPath);
+        exit(1);
+    }
+
+    return fd;
+}
+
+// Send a request and wait for its response. A broken connection ends the client, but a
+// failed request does not: its status is returned (and kept in the response).
+int sendRequest(int fd, uint32_t op, const char *path, const char *arg, uint64_t offset, uint64_t count,
+                struct Response *response)
+{
+    struct ProtoRequest request;
+    memset(&request, 0, sizeof(request));
+    request.magic = PROTO_MAGIC;
+    request.op = op;
+    request.image = opts.image;
+    request.pathLen = (uint32_t)strlen(path);
+    request.argLen = (uint32_t)strlen(arg);
+    request.offset = offset;
+    request.count = count;
+    if (request.pathLen > PROTO_MAX_PATH || request.argLen > PROTO_MAX_PATH)
+    {
+        fprintf(stderr, "Path too long.\n");
+        exit(1);
+    }
+
+    writeFull(fd, &request, sizeof(request));
+    writeFull(fd, path, request.pathLen);
+    writeFull(fd, arg, request.argLen);
+
+    struct ProtoResponse header;
+    readFull(fd, &header, sizeof(header));
+    if (header.magic != PROTO_MAGIC)
+    {
+        fprintf(stderr, "Malformed response.\n");
+        exit(1);
+    }
+
+    // One more byte, so that a message can be null terminated.
+    if (header.length + 1 > response->cap)
+    {
+        response->cap = header.length + 1;
+        response->data = (char *)do_realloc(response->data, response->cap);
+    }
+    readFull(fd, response->data, header.length);
+    response->status = header.status;
+    response->len = header.length;
+
+    return header.status;
+}
+
+// Exit on a failed request, the way main does.
+void checkResponse(struct Response *response)
+{
+    if (response->status == 0)
+    {
+        return;
+    }
+
+    response->data[response->len] = '\0';
+    fprintf(stderr, "%s\n", response->data);
+    exit(response->status == EXT2_ERR_INVALID_PATH ? -1 : 1);
+}
+
+// Print the ProtoStat records of a list or stat response, one per line.
+void printStats(struct Response *response)
+{
+    uint64_t offset = 0;
+    while (offset + sizeof(struct ProtoStat) <= response->len)
+    {
+        struct ProtoStat record;
+        memcpy(&record, response->data + offset, sizeof(record));
+        offset += sizeof(record);
+        if (offset + record.nameLen > response->len)
+        {
+            break;
+        }
+
+        printf("%u %06o %llu %.*s\n", record.inodeNum, record.mode, (unsigned long long)record.size,
+               (int)record.nameLen, response->data + offset);
+        offset += record.nameLen;
+    }
+}
+
+// LOAD -----------------------------------------------------------------------
+int runLoad(const char *pathList)
+{
+    // READ THE PATHS ---------------------------------------------------------
+    FILE *list = strcmp(pathList, "-") == 0 ? stdin : fopen(pathList, "r");
+    if (list == NULL)
+    {
+        perror(pathList);
+        exit(1);
+    }
+
+    char *line = NULL;
+    size_t lineSize = 0;
+    size_t maxPaths = 0;
+    ssize_t lineLen;
+    while ((lineLen = getline(&line, &lineSize, list)) != -1)
+    {
+        while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r'))
+        {
+            line[--lineLen] = '\0';
+        }
+        if (lineLen == 0)
+        {
+            continue;
+        }
+
+        if (numPaths == maxPaths)
+        {
+            maxPaths = maxPaths == 0 ? 1024 : maxPaths * 2;
+            paths = (char **)do_realloc(paths, maxPaths * sizeof(char *));
+        }
+        paths[numPaths++] = strdup(line);
+    }
+    free(line);
+    if (list != stdin)
+    {
+        fclose(list);
+    }
+
+    if (numPaths == 0)
+    {
+        fprintf(stderr, "No paths to load.\n");
+        exit(1);
+    }
+    // ------------------------------------------------------------------------
+
+    // RUN THE CONNECTIONS ----------------------------------------------------
+    double *latencies = (double *)do_realloc(NULL, opts.requests * sizeof(double));
+    struct LoadWorker *workers = (struct LoadWorker *)do_realloc(NULL, opts.connections * sizeof(struct LoadWorker));
+    double start = now();
+    for (int i = 0; i < opts.connections; i++)
+    {
+        workers[i].id = i;
+        workers[i].latencies = latencies;
+        workers[i].failures = 0;
+        if (pthread_create(&workers[i].thread, NULL, loadWorker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    uint64_t failures = 0;
+    for (int i = 0; i < opts.connections; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        failures += workers[i].failures;
+    }
+    double elapsed = now() - start;
+    // ------------------------------------------------------------------------
+
+    // PRINT THE STATISTICS ---------------------------------------------------
+    qsort(latencies, opts.requests, sizeof(double), compareDoubles);
+    double total = 0;
+    for (long i = 0; i < opts.requests; i++)
+    {
+        total += latencies[i];
+    }
+
+    printf("{\n");
+    printf("  \"connections\": %d,\n", opts.connections);
+    printf("  \"requests\": %ld,\n", opts.requests);
+    printf("  \"failures\": %llu,\n", (unsigned long long)failures);
+    printf("  \"seconds\": %.6f,\n", elapsed);
+    printf("  \"requests_per_s\": %.1f,\n", opts.requests / elapsed);
+    printf("  \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}\n",
+           total / opts.requests * 1e6, latencies[opts.requests / 2] * 1e6,
+           latencies[opts.requests * 9 / 10] * 1e6, latencies[opts.requests * 99 / 100] * 1e6,
+           latencies[opts.requests - 1] * 1e6);
+    printf("}\n");
+    // ------------------------------------------------------------------------
+
+    // Free the allocated memory.
+    for (size_t i = 0; i < numPaths; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+    free(latencies);
+    free(workers);
+
+    return failures > 0 ? 1 : 0;
+}
+
+// Requests id, id + connections, id + 2 * connections and so on, one at a time.
+void *loadWorker(void *arg)
+{
+    struct LoadWorker *worker = (struct LoadWorker *)arg;
+    struct Response response = {0, NULL, 0, 0};
+    int fd = connectServer();
+
+    for (long i = worker->id; i < opts.requests; i += opts.connections)
+    {
+        const char *path = paths[i % numPaths];
+        int isDir = path[strlen(path) - 1] == '/';
+
+        double start = now();
+        if (isDir || opts.readSize == 0)
+        {
+            sendRequest(fd, PROTO_STAT, path, "", 0, 0, &response);
+        }
+        else
+        {
+            sendRequest(fd, PROTO_READ, path, "", 0, opts.readSize, &response);
+        }
+        worker->latencies[i] = now() - start;
+
+        if (response.status != 0)
+        {
+            worker->failures++;
+        }
+    }
+
+    // Free the allocated memory.
+    close(fd);
+    free(response.data);
+
+    return NULL;
+}
+
+int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// I/O ------------------------------------------------------------------------
+// A connection that breaks ends the client.
+void readFull(int fd, void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            fprintf(stderr, "Connection to the server lost.\n");
+            exit(1);
+        }
+
+        buf = (char *)buf + n;
+        len -= n;
+    }
+}
+
+void writeFull(int fd, const void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            fprintf(stderr, "Connection to the server lost.\n");
+            exit(1);
+        }
+
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+}
+
+// Same as the do_realloc of ext2read.c, which the client does not link with.
+void *do_realloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (ptr == NULL)
+    {
+        perror("realloc failed");
+        exit(1);
+    }
+
+    return ptr;
+}
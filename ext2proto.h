@@ -0,0 +1,62 @@
+// Wire format of the ext2 server (see ext2server.c and ext2client.c).
+//
+// A connection carries any number of requests, one at a time: the client sends a request
+// header followed by the path and the argument it announces, and the server answers with a
+// response header followed by its payload. The socket is local, so the integers are in the
+// byte order of the host.
+//
+// Payloads of the successful responses:
+//   PROTO_LIST       One ProtoStat record per entry of the directory ("." and ".." left out).
+//   PROTO_STAT       One ProtoStat record.
+//   PROTO_READ       Up to count bytes of the file at offset (fewer at the end of the file).
+//   PROTO_EXTRACT    Nothing. The file object is extracted into the argument, an absolute
+//                    path on the server's side under its extraction root that does not
+//                    exist yet (see ext2Extract and the --extract-root option of ext2server.c).
+//   PROTO_ENUMERATE  Every path of the image, one per line (as main prints them).
+// A failed request gets the EXT2_ERR_* code as its status and the error message as payload.
+#ifndef EXT2PROTO_H
+#define EXT2PROTO_H
+
+#include <stdint.h>
+
+#define PROTO_MAGIC 0x32545845u // "EXT2".
+#define PROTO_DEFAULT_SOCKET "/tmp/ext2server.sock"
+#define PROTO_MAX_PATH 4096
+#define PROTO_MAX_READ (16 * 1024 * 1024)
+
+// Operations.
+#define PROTO_LIST 1
+#define PROTO_STAT 2
+#define PROTO_READ 3
+#define PROTO_EXTRACT 4
+#define PROTO_ENUMERATE 5
+
+struct ProtoRequest
+{
+    uint32_t magic;
+    uint32_t op;
+    uint32_t image;   // Index of the image in the command line of the server.
+    uint32_t pathLen; // Length of the path that follows (no null terminator).
+    uint32_t argLen;  // Length of the argument that follows the path.
+    uint32_t reserved;
+    uint64_t offset; // PROTO_READ only.
+    uint64_t count;  // PROTO_READ only (at most PROTO_MAX_READ).
+};
+
+struct ProtoResponse
+{
+    uint32_t magic;
+    int32_t status; // EXT2_OK or an EXT2_ERR_* code.
+    uint64_t length; // Length of the payload that follows.
+};
+
+// A file object (see struct Ext2Stat). Its name follows, without a null terminator.
+struct ProtoStat
+{
+    uint64_t size;
+    uint32_t inodeNum;
+    uint16_t mode;
+    uint16_t nameLen;
+};
+
+#endif
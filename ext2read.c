@@ -0,0 +1,7641 @@
+#define _GNU_SOURCE // for copy_file_range.
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h> // for offsetof.
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h> // for mmap.
+#include <sys/stat.h> // for mkdir.
+#include <sys/uio.h>  // for preadv.
+#include <sys/sendfile.h>
+#include <sys/syscall.h> // for the io_uring system calls.
+#include <linux/io_uring.h>
+#include <unistd.h>   // for pread.
+#include <errno.h>
+#include <stdarg.h>
+#if defined(__x86_64__)
+#include <cpuid.h>     // for the SHA extensions check.
+#include <immintrin.h> // for the CRC-32C and SHA-256 instructions.
+#endif
+#include "ext2read.h"
+
+#define SB_ADDR 1024
+#define SB_SIZE 1024
+#define BGD_SIZE 32
+#define INODE_RECORD_SIZE 128 // Part of the on-disk inode that is parsed.
+#define DBLOCK_PTR_SIZE 4
+#define DBLOCK_PTR_COUNT 12
+#define ROOT_INODE_NUM 2
+#define MAX_RUN_BYTES (64 * 1024 * 1024) // Upper bound of a single coalesced read.
+#define RING_SLOTS 4                        // Number of buffers in the extraction ring.
+#define DEFAULT_BUFFER_BUDGET (8 * 1024 * 1024)
+#define DEFAULT_CACHE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_DENTRY_CACHE_SIZE (16 * 1024 * 1024)
+#define MIN_CACHE_BUCKETS 64
+#define MIN_DEQUE_SIZE 64
+#define ERROR_MSG_SIZE 512
+#define EXT2_MAGIC 0xEF53
+#define MAX_BLOCK_SIZE_MULT 6 // Blocks of up to 64 KiB.
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define MIN_DENTRY_BUCKETS 256
+#define OUTPUT_BUFFER_SIZE (1024 * 1024) // Text output is written in chunks this large.
+#define SCAN_CHUNK_SIZE (4 * 1024 * 1024)  // Inode table bytes read at once by a scan.
+
+// Ways of copying a run of blocks from the image into a file (zero-copy mode).
+#define COPY_RANGE 0    // copy_file_range (shares the blocks on reflink file systems).
+#define COPY_SENDFILE 1 // sendfile.
+#define COPY_BUFFERED 2 // pread and pwrite through a buffer.
+
+// io_uring backend.
+#define URING_ENTRIES 64 // Submission queue size (two entries per buffer at most).
+#define URING_BUFS 16    // Registered buffers (i.e., runs in flight).
+#define URING_FILES 16   // Output files with writes in flight (fixed files 1 and up).
+#define DIR_ENTRY_MIN_SIZE 12 // 8-byte header plus a name padded to 4 bytes.
+
+// Physical order extraction (see extractOrdered).
+#define PLAN_OPEN_FILES 64   // Output files kept open at once.
+#define PLAN_MAX_GAP_BLOCKS 8 // Unused blocks read through to merge two runs into one read.
+
+// Path index sidecar (see buildPathIndex).
+#define INDEX_MAGIC "EXT2IDX1"
+#define INDEX_VERSION 1
+#define INDEX_SUFFIX ".idx" // Appended to the image path unless another path is given.
+#define MIN_INDEX_BUCKETS 16
+
+// Tar and cpio streams (see archiveFileObj).
+#define TAR_BLOCK_SIZE 512
+#define TAR_NAME_SIZE 100
+#define TAR_PREFIX_SIZE 155
+#define TAR_MAX_SIZE 077777777777ULL // Larger values go into pax records.
+#define TAR_MAX_ID 07777777
+#define TAR_PAX_NAME "././@PaxHeader"
+#define CPIO_HEADER_SIZE 110
+#define CPIO_ALIGN 4
+#define CPIO_MAX_SIZE 0xFFFFFFFFULL
+#define CPIO_TRAILER "TRAILER!!!"
+#define FAST_SYMLINK_MAX 60 // Shorter targets are kept in place of the block pointers.
+#define BLOCK_AREA_SIZE 60  // The block pointers (or the extent tree root) of an inode.
+
+// ext4 extent trees.
+#define EXTENTS_FL 0x80000 // The inode maps its blocks with an extent tree.
+#define EXTENT_MAGIC 0xF30A
+#define EXTENT_HEADER_SIZE 12
+#define EXTENT_ENTRY_SIZE 12     // Size of both the index and the leaf entries.
+#define EXTENT_MAX_DEPTH 5
+#define EXTENT_MAX_INIT_LEN 32768 // Longer extents are uninitialized (read as zeros).
+
+// Content digests (see ext2ExtractDigests).
+#define DIGEST_HEX_MAX 65 // Hex digits of the longest digest (SHA-256) plus the null terminator.
+#define CRC32C_POLY 0x82F63B78 // Reversed Castagnoli polynomial.
+#define SHA256_BLOCK_SIZE 64
+#define ZERO_BUFFER_SIZE (64 * 1024) // Zeros hashed at once for the holes.
+
+// File types (upper 4 bits of i_mode).
+#define TYPE_FIFO 0x1
+#define TYPE_CHR 0x2
+#define TYPE_DIR 0x4
+#define TYPE_BLK 0x6
+#define TYPE_REG 0x8
+#define TYPE_LINK 0xA
+
+// File system features (and the block group flags that come with them).
+#define FEATURE_RO_COMPAT_GDT_CSUM 0x0010      // Block groups can be left uninitialized.
+#define FEATURE_RO_COMPAT_METADATA_CSUM 0x0400 // Implies the above.
+#define FEATURE_INCOMPAT_64BIT 0x0080          // Block group descriptors of s_desc_size bytes.
+#define FEATURE_INCOMPAT_COMPRESSION 0x0001
+#define FEATURE_INCOMPAT_JOURNAL_DEV 0x0008
+#define FEATURE_INCOMPAT_META_BG 0x0010
+#define FEATURE_INCOMPAT_DIRDATA 0x1000
+#define FEATURE_INCOMPAT_INLINE_DATA 0x8000
+#define FEATURE_INCOMPAT_ENCRYPT 0x10000
+#define FEATURE_INCOMPAT_CASEFOLD 0x20000
+// Incompatible features that change the layout of what is read here.
+#define FEATURE_INCOMPAT_UNSUPPORTED (FEATURE_INCOMPAT_COMPRESSION | FEATURE_INCOMPAT_JOURNAL_DEV | \
+                                      FEATURE_INCOMPAT_META_BG | FEATURE_INCOMPAT_DIRDATA |       \
+                                      FEATURE_INCOMPAT_INLINE_DATA | FEATURE_INCOMPAT_ENCRYPT |   \
+                                      FEATURE_INCOMPAT_CASEFOLD)
+#define BGD_INODE_UNINIT 0x0001 // The inode table and bitmap of the group are not initialized.
+
+// Hashed (htree) directories.
+#define FEATURE_COMPAT_DIR_INDEX 0x0020
+#define INODE_INDEX_FL 0x1000    // The directory is hash indexed.
+#define FLAGS_UNSIGNED_HASH 0x02 // Hash names as unsigned chars.
+#define DX_HASH_LEGACY 0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA 2
+#define DX_HASH_UNSIGNED_DELTA 3 // Offset of the unsigned variants.
+#define DX_MAX_LEVELS 3          // Index levels under the root (ext4 largedir).
+
+// Kinds of the blocks read from the image, accounted separately
+// by the block cache and by the statistics (see ext2GetStats).
+#define READ_SUPERBLOCK EXT2_READ_SUPERBLOCK
+#define READ_BGDT EXT2_READ_BGDT
+#define READ_INODE EXT2_READ_INODE
+#define READ_INDIRECT EXT2_READ_INDIRECT
+#define READ_DIRECTORY EXT2_READ_DIRECTORY
+#define READ_FILE_DATA EXT2_READ_FILE_DATA
+#define READ_KINDS EXT2_READ_KINDS
+
+// block group descriptor struct.
+struct BGD
+{
+    uint64_t blockBitmap; // Block number of the block usage bitmap.
+    uint64_t inodeBitmap; // Block number of the inode usage bitmap.
+    uint64_t inodeTable;  // Starting block number of the inode table.
+    uint16_t flags;       // BGD_* flags (only with FEATURE_RO_COMPAT_GDT_CSUM).
+};
+
+// superblock struct.
+struct SB
+{
+    uint32_t totalInodes;
+    uint32_t totalBlocks;
+    uint32_t firstDataBlock;
+    uint32_t blockSizeMult;
+    uint32_t blocksPerBG;
+    uint32_t inodesPerBG;
+    uint32_t revLevel;
+    uint16_t inodeSize;
+    uint32_t featureCompat;
+    uint32_t featureIncompat;
+    uint32_t featureRoCompat;
+    uint16_t descSize; // Size of a block group descriptor.
+    uint32_t hashSeed[4]; // Seed of the directory hashes.
+    uint32_t flags;
+    uint16_t magic;
+    uint32_t freeBlocks;
+    uint32_t freeInodes;
+    uint32_t mountTime; // Last mount time (validates the path index).
+    uint32_t writeTime; // Last write time (validates the path index).
+    unsigned char uuid[16];
+
+    // Other derived values that is relevant to the program.
+    uint32_t blockSize;
+    uint32_t numOfBGs;
+    struct BGD *bgdt; // The whole block group descriptor table.
+};
+
+// A block held by the block cache. Entries are chained in a hash bucket
+// and in the LRU list (most recently used first).
+struct CacheEntry
+{
+    uint64_t blockNum;
+    int kind; // READ_INODE, READ_INDIRECT or READ_DIRECTORY.
+    unsigned char *data;
+    struct CacheEntry *hashNext;
+    struct CacheEntry *lruPrev;
+    struct CacheEntry *lruNext;
+};
+
+struct CacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t numEntries; // Number of blocks currently cached.
+};
+
+// LRU cache of the blocks that get read over and over again (inode table,
+// indirect and directory blocks). It sits between the parsing functions and
+// the image; mapped images bypass it since the page cache already does this.
+struct BlockCache
+{
+    struct CacheEntry **buckets;
+    size_t numBuckets; // Always a power of two.
+    struct CacheEntry *lruHead;
+    struct CacheEntry *lruTail;
+    size_t capacity; // Maximum number of cached blocks.
+    size_t numEntries;
+    struct CacheStats stats[READ_KINDS];
+    pthread_mutex_t lock;
+};
+
+// Used to sort the inode numbers of a batch (see parseInodes).
+struct InodeRef
+{
+    uint32_t inodeNum;
+    size_t index; // Index of the inode in the batch.
+};
+
+// Counters of the I/O and allocations of the process (see ext2GetStats).
+// They are shared by every handle and thread, hence the atomic adds.
+static struct Stats
+{
+    uint64_t reads;                 // Read system calls (or io_uring reads) on the image.
+    uint64_t bytesRead[READ_KINDS]; // Bytes read (or copied out of the mapping) from the image.
+    uint64_t seeks;
+    uint64_t copies; // copy_file_range and sendfile calls (zero-copy mode).
+    uint64_t writes;
+    uint64_t bytesWritten;
+    uint64_t allocs;
+    uint64_t allocBytes;
+    uint64_t mkdirs; // mkdir calls (including those of existing directories).
+} stats;
+
+static int statsEnabled = 0; // See ext2EnableStats.
+
+// Add to a statistics counter. Only tests a flag unless counting is enabled.
+#define ADD_STAT(counter, n)                                               \
+    do                                                                     \
+    {                                                                      \
+        if (statsEnabled)                                                  \
+        {                                                                  \
+            __atomic_fetch_add(&stats.counter, (n), __ATOMIC_RELAXED);     \
+        }                                                                  \
+    } while (0)
+
+// Collects the first error of the calling thread instead of exiting.
+// The do_* I/O helpers report into the sink of the calling thread if it
+// has one, and exit otherwise. Every call of the API sets one up.
+struct ErrorSink
+{
+    int failed;
+    int error; // EXT2_ERR_* code of the error.
+    char message[ERROR_MSG_SIZE];
+};
+
+static _Thread_local struct ErrorSink *errorSink = NULL;
+
+// Read-only memory mapping of the ext2 file system (see mapImage).
+// base is NULL when the image is not mapped, in which case
+// every read falls back to a positional read on the FILE *.
+struct ImageMap
+{
+    unsigned char *base;
+    uint64_t size;
+};
+
+struct Inode
+{
+    uint16_t type;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t mtime;
+    uint32_t FSizeLower;     // Lower 32 bits of the file size.
+    uint32_t FSizeUpper;     // Upper 32 bits of the file size (see getFileSize).
+    uint32_t flags;
+    uint32_t DBlockPtrs[12]; // Direct block pointers.
+    uint32_t SIBlockPtr;     // Singly indirect block pointer.
+    uint32_t DIBlockPtr;     // Doubly indirect block pointer.
+    uint32_t TIBlockPtr;     // Triply indirect block pointer.
+};
+
+// State of a zero-copy extraction (see extractFileZeroCopy).
+struct FileCopy
+{
+    int imageFd;
+    int fileFd;
+    int method;         // COPY_RANGE, COPY_SENDFILE or COPY_BUFFERED.
+    unsigned char *buf; // Buffer of the buffered copy (allocated on first use).
+    int failed;         // Set once a copy fails (the rest of the file is skipped).
+};
+
+// An output file with writes in flight on an io_uring.
+struct UringFile
+{
+    FILE *fileObj; // NULL when the slot is free.
+    char *name;
+    uint64_t size;    // Size of the file.
+    uint64_t endOffset; // End of the last queued run.
+    int pending;      // Number of runs in flight.
+    int closing;      // Set once every run of the file is queued.
+    int error;        // First error (a negative errno) of the file.
+};
+
+// A registered buffer. It holds a run from its read until its write is done.
+struct UringBuf
+{
+    unsigned char *data;
+    int file;          // File slot of the run.
+    uint32_t readLen;  // Bytes read from the image (whole blocks).
+    uint32_t writeLen; // Bytes written into the file.
+};
+
+// An io_uring with its rings mapped, its buffers registered and the image
+// as fixed file 0. Every thread that extracts files has its own.
+struct Uring
+{
+    int fd;
+    unsigned char *sqRing;
+    size_t sqRingSize;
+    unsigned char *cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned toSubmit; // Entries queued since the last submission.
+    int inFlight;      // Entries submitted but not completed yet.
+    struct UringBuf bufs[URING_BUFS];
+    size_t bufSize;
+    int freeBufs[URING_BUFS];
+    int numFreeBufs;
+    struct UringFile files[URING_FILES];
+    int currentFile; // File slot being queued by the block walker.
+};
+
+static _Thread_local struct Uring *uring = NULL;
+static _Thread_local int isUringUnavailable = 0;
+
+// A cached lookup of a name in a directory. Negative entries (i.e., the
+// name is not in the directory) have an inode number of 0.
+struct Dentry
+{
+    uint32_t parentInodeNum;
+    uint32_t inodeNum;
+    struct Inode inode; // Inode of the entry (positive entries only).
+    struct Dentry *hashNext;
+    struct Dentry *lruPrev;
+    struct Dentry *lruNext;
+    char name[];
+};
+
+// Cache of the path component lookups (see resolvePath). The least recently
+// used dentries are evicted to keep the cache under its memory cap, so they
+// are only ever read under the lock (lookupDentry copies them out).
+struct DentryCache
+{
+    int enabled; // Set once by ext2Open (buckets is reassigned under the lock as the table grows).
+    struct Dentry **buckets;
+    size_t numBuckets;
+    size_t count;
+    struct Dentry *lruHead;
+    struct Dentry *lruTail;
+    size_t capacity; // Memory cap (in bytes) of the dentries.
+    size_t size;     // Memory (in bytes) of the cached dentries.
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t lock;
+};
+
+// A directory entry. Its name is kept (null terminated) in the
+// names buffer of the directory it belongs to (see struct DirEntries).
+struct DirEntry
+{
+    uint32_t inodeNum;
+    uint32_t nameOffset; // Offset of the name in the names buffer.
+    uint8_t nameLen;
+    uint8_t fileType;
+};
+
+// All the entries of a directory (in on-disk order) as one flat array.
+// The array and the names buffer are allocated from an arena.
+struct DirEntries
+{
+    struct DirEntry *entries;
+    size_t count;
+    size_t maxCount;
+    char *names;
+    size_t namesLen;
+};
+
+// A chunk of memory of an arena.
+struct ArenaChunk
+{
+    struct ArenaChunk *prev;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+};
+
+// Bump allocator for the memory used while traversing the directory tree.
+// Nothing is freed on its own: the arena is released back to an earlier
+// mark (see markArena) or freed as a whole in one shot.
+struct Arena
+{
+    struct ArenaChunk *top;
+    struct ArenaChunk *spare; // Last released chunk, kept for reuse.
+};
+
+struct ArenaMark
+{
+    struct ArenaChunk *chunk;
+    size_t used;
+};
+
+// A directory on the stack of a tree walk.
+struct WalkFrame
+{
+    struct ArenaMark mark; // State of the arena before the entries were read.
+    struct DirEntries dirEntries;
+    struct Inode *entryInodes;
+    uint32_t inodeNum; // 0 for the directory the walk starts from (unless it is a scan).
+    size_t next;    // Index of the next entry.
+    size_t pathLen; // Length of the path of the directory (slash included).
+};
+
+// Depth-first walk of a directory tree in directory entry order with an
+// explicit stack instead of recursion (see nextTreeEntry), so the depth of
+// the tree is not bounded by the C stack. The path of the current entry is
+// built in a single buffer: a name is appended on the way down and cut off
+// on the way back up, so the walk does not allocate per entry.
+// The directories are read from the image as the walk gets to them, or come
+// from an inode table scan (see initScanWalk).
+struct TreeWalk
+{
+    FILE *ext2FS;
+    struct Arena *arena;   // Holds the entries of the directories on the stack.
+    struct InodeScan *scan; // Directories of the scan (NULL to read them from the image).
+    struct WalkFrame *frames;
+    size_t depth; // Number of directories on the stack.
+    size_t maxDepth;
+    char *path; // Path of the current entry (a directory has a trailing slash).
+    size_t pathLen;
+    size_t maxPathLen;
+    struct Inode *inode; // Inode of the current entry (NULL in a walk over a scan).
+    uint32_t inodeNum;
+    int descend; // Walk into the current entry next (cleared to skip a directory).
+};
+
+// A directory found by an inode table scan, with its entries.
+struct ScanDir
+{
+    uint32_t inodeNum;
+    struct DirEntries dirEntries;
+};
+
+// The directories of a block group found by an inode table scan (see
+// scanGroup), in inode number order. Their entries are in the arena.
+struct ScanGroup
+{
+    uint32_t groupNum;
+    struct ScanDir *dirs;
+    size_t numDirs;
+    size_t maxDirs;
+    struct Arena arena;
+    struct InodeScan *scan;
+};
+
+// What a scan of the inode tables found (see scanInodeTables).
+struct InodeScan
+{
+    struct ScanGroup *groups; // One per block group.
+    uint32_t numGroups;
+    unsigned char *isDir; // One bit per inode number: set for the directories in use.
+};
+
+// Text output gathered into large writes (see appendOutput).
+struct OutputBuffer
+{
+    FILE *out;
+    char *buf;
+    size_t len;
+};
+
+// A run of physically contiguous data blocks that is read
+// from the ext2 file system with a single positional read.
+struct BlockRun
+{
+    uint64_t physBlock;  // First physical block number of the run.
+    uint64_t numBlocks;  // Number of blocks in the run.
+    uint64_t fileOffset; // Byte offset in the file where the run starts.
+};
+
+// State shared by the block pointer walkers while reading a file's data.
+// Every run of contiguous blocks is handed to handleRun once it is complete.
+struct BlockWalker
+{
+    FILE *ext2FS;
+    struct Inode *inode;
+    uint64_t fileSize;     // Size of the file (in bytes).
+    uint64_t readBytes;    // Number of file bytes already mapped to a run.
+    uint64_t maxRunBytes;  // Upper bound of the size of a run.
+    struct BlockRun run;   // Pending run of contiguous blocks.
+    unsigned char *tail;   // Scratch space for the unused tail of the last block.
+    unsigned char *ptrBlocks[EXTENT_MAX_DEPTH]; // Scratch space for the SI, DI and TI blocks
+                                                // (or the extent tree nodes) of unmapped images.
+    int (*handleRun)(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes);
+    void *ctx;             // Context of the run handler.
+};
+
+// A buffer of the extraction ring.
+struct StreamSlot
+{
+    unsigned char *buf;
+    size_t len;      // Number of file bytes in the buffer.
+    uint64_t offset; // Offset in the file of the first byte of the buffer.
+};
+
+// Fixed ring of buffers between the reader (block walker) and the writer
+// of an extracted file. The reader fills the slot at head while a writer
+// thread drains the filled slots starting at tail, so reading from the
+// ext2 file system and writing the output file overlap.
+struct FileStream
+{
+    FILE *fileObj;
+    struct StreamSlot slots[RING_SLOTS];
+    size_t slotSize;
+    int head;     // Slot being filled by the reader.
+    int tail;     // Next slot to be written by the writer.
+    int filled;   // Number of slots waiting to be written.
+    int done;     // Set by the reader after the last slot is submitted.
+    int threaded; // Whether a writer thread drains the ring.
+    int failed;   // Set once a write fails (the rest of the file is skipped).
+    int readFailed; // Set by the reader once a read of the image fails.
+    uint64_t writeOffset; // File position after the last write.
+    struct Digest *digest;       // Digest of the file (NULL when it is not hashed).
+    struct ErrorSink *errorSink; // Error sink of the thread extracting the file.
+    pthread_mutex_t lock;
+    pthread_cond_t slotFilled;
+    pthread_cond_t slotFreed;
+};
+
+// A file object to be extracted by the worker pool (see extractDirParallel).
+struct ExtractTask
+{
+    struct Inode inode;
+    char *path;      // Output path (directories end with a slash).
+    uint32_t *order; // Entry index at every level (i.e., the position in the tree).
+    uint32_t *inodeNums; // Inode number at every level, itself included (0 for the root).
+    int depth;       // Number of levels in order.
+};
+
+// A directory listed by the worker pool (see enumeratePathsParallel).
+// The paths of its entries are buffered in out, and the listing of the
+// n-th subdirectory goes right after the first splits[n] bytes of out.
+struct EnumDir
+{
+    struct Inode inode;
+    char *path;
+    uint32_t *inodeNums; // Inode number of the directory and of its ancestors (0 for the root).
+    int depth;
+    char *out;
+    size_t outLen;
+    size_t outCap;
+    struct EnumDir **subdirs;
+    size_t *splits;
+    size_t numSubdirs;
+    size_t subdirsCap;
+    int done; // Set (under the pool lock) once out and subdirs are complete.
+};
+
+// Double-ended queue of tasks owned by a worker. The owner pushes and pops
+// at the bottom (newest first) while idle workers steal from the top.
+struct TaskDeque
+{
+    void **tasks;
+    size_t cap;
+    size_t head; // Index of the oldest task.
+    size_t size;
+    pthread_mutex_t lock;
+};
+
+// An output error, kept until the pool is done so that
+// the errors are reported in tree order no matter the scheduling.
+struct Failure
+{
+    uint32_t *order;
+    int depth;
+    int error; // EXT2_ERR_* code.
+    char *message;
+};
+
+struct PoolWorker;
+
+// Work-stealing thread pool. Tasks are generic pointers that
+// are handed to runTask (which also frees them).
+struct TaskPool
+{
+    int numWorkers;
+    struct TaskDeque *deques; // One per worker.
+    size_t queued;            // Number of tasks in the deques.
+    size_t pending;           // Number of tasks queued or running.
+    pthread_mutex_t lock;
+    pthread_cond_t workAvailable;
+    pthread_cond_t taskDone; // Broadcast whenever a task is done.
+    int (*runTask)(struct PoolWorker *worker, void *task);
+    struct PoolWorker *workers;
+    pthread_t *threads;
+    struct Failure *failures;
+    size_t numFailures;
+    size_t failuresCap;
+    struct Ext2FS *ext2FS; // Handle of the call that runs the pool.
+    struct Manifest *manifest; // Manifest of the call (NULL unless the files are hashed).
+};
+
+struct PoolWorker
+{
+    struct TaskPool *pool;
+    int id;
+    FILE *ext2FS;          // Image of the handle.
+    struct Arena arena;    // Released after every task.
+    struct ErrorSink sink; // Errors of the worker outside of a task's own sink.
+};
+
+// A directory waiting to be read by the extraction planner.
+struct PlanDir
+{
+    struct Inode inode;
+    uint64_t startBlock; // See getStartBlock.
+    char *path;
+};
+
+// A file of an extraction plan. It is opened when its first run is
+// written and closed after its last one (or to make room for another file).
+struct PlanFile
+{
+    struct Inode inode;
+    uint64_t startBlock; // See getStartBlock.
+    char *path;
+    uint64_t pendingRuns; // Runs that are not written yet.
+    FILE *fileObj;        // NULL while the file is closed.
+    uint64_t lastUse;     // Tick of the last write (to close the least recently used file).
+    int isCreated;        // The file was opened (and truncated) once already.
+    int failed;
+};
+
+// A run of blocks of a planned file.
+struct PlanRun
+{
+    uint64_t physBlock;
+    uint64_t numBlocks;
+    uint64_t fileOffset;
+    uint64_t fileBytes;
+    size_t file; // Index of the file in the plan.
+};
+
+// Extraction of a whole subtree in physical block order (see extractOrdered).
+struct Plan
+{
+    FILE *ext2FS;
+    struct PlanFile *files;
+    size_t numFiles;
+    size_t maxFiles;
+    struct PlanRun *runs;
+    size_t numRuns;
+    size_t maxRuns;
+    size_t currentFile;  // File whose block map is being walked.
+    uint64_t maxRunBytes; // Size of the read buffer (runs and merged reads never exceed it).
+    size_t openFiles[PLAN_OPEN_FILES];
+    size_t numOpenFiles;
+    uint64_t tick;
+    int failed;
+};
+
+// Header of the path index sidecar. The index is a cache local to the
+// machine, so it is written in the byte order of the host. It is only used
+// while the superblock fields it was built against are unchanged.
+struct IndexHeader
+{
+    char magic[8]; // INDEX_MAGIC.
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t totalInodes;
+    uint32_t totalBlocks;
+    uint32_t freeInodes;
+    uint32_t freeBlocks;
+    uint32_t mountTime;
+    uint32_t writeTime;
+    unsigned char uuid[16];
+    uint64_t numRecords;
+    uint64_t hashOffset; // Offset of the hash table (the records end there).
+    uint64_t numBuckets; // Always a power of two.
+};
+
+// A path of the index. The records follow the header in enumeration order,
+// each one padded to 8 bytes. The hash table that comes after them holds the
+// offsets of the records (0 for an empty bucket), hashed by path.
+struct IndexRecord
+{
+    uint64_t size;
+    uint32_t inodeNum;
+    uint16_t type;    // i_mode of the inode.
+    uint16_t pathLen; // Not including the null terminator.
+    char path[];
+};
+
+// State of a path index build (see buildPathIndex).
+struct IndexBuilder
+{
+    FILE *out;
+    uint64_t offset; // Offset of the next record.
+    uint64_t *offsets;
+    size_t *hashes;
+    size_t numRecords;
+    size_t maxRecords;
+};
+
+// A tar or cpio stream being written (see archiveFileObj). The headers and
+// the file data are gathered in one large buffer, so the stream goes out in
+// a few big writes however small the files are.
+struct Archive
+{
+    FILE *out;
+    int format; // EXT2_ARCHIVE_TAR or EXT2_ARCHIVE_CPIO.
+    unsigned char *buf;
+    size_t len;          // Bytes waiting in the buffer.
+    size_t size;         // Size of the buffer (whole blocks).
+    uint64_t offset;     // Bytes of the stream so far (the padding is relative to it).
+    uint64_t fileOffset; // Bytes of the current file already in the stream.
+    int failed; // A write failed, so the rest of the stream is dropped.
+};
+
+// What goes into the header of an archive entry.
+struct ArchiveEntry
+{
+    struct Inode *inode;
+    uint32_t inodeNum;
+    const char *name; // A directory is named with a trailing slash.
+    size_t nameLen;
+    uint64_t size;          // Size of the data that follows the header.
+    const char *linkTarget; // Target of a symbolic link (NULL otherwise).
+    uint32_t devMajor;      // Device number of a device file.
+    uint32_t devMinor;
+};
+
+// Running digest of a file. Its holes are hashed as zeros (as is the end
+// of a file that ends with one), so it is the digest of the file as read.
+struct Digest
+{
+    int algorithm;   // EXT2_DIGEST_*.
+    uint64_t offset; // Number of file bytes hashed so far.
+    uint32_t crc;    // CRC-32C (before the final inversion).
+    uint32_t state[8];                      // SHA-256.
+    unsigned char block[SHA256_BLOCK_SIZE]; // Bytes of the SHA-256 block being filled.
+    size_t blockLen;
+};
+
+// A file of a manifest.
+struct ManifestLine
+{
+    char *path;
+    char digest[DIGEST_HEX_MAX];
+};
+
+// Digests of the files of an extraction (see ext2ExtractDigests). The pool
+// workers add the files in whatever order they finish, so the lines are
+// only written once the extraction is done, sorted by path.
+struct Manifest
+{
+    int algorithm;  // EXT2_DIGEST_*.
+    int verifyOnly; // Hash the files without writing anything.
+    struct ManifestLine *lines;
+    size_t numLines;
+    size_t maxLines;
+    pthread_mutex_t lock;
+};
+
+// Read-only mapping of a valid path index (see loadPathIndex).
+// base is NULL when there is no index to use.
+struct PathIndex
+{
+    unsigned char *base;
+    uint64_t size;
+    struct IndexHeader *header;
+    int state; // EXT2_INDEX_NONE, EXT2_INDEX_IN_USE or EXT2_INDEX_STALE.
+};
+
+// An open image (see ext2Open). It owns everything the reads need.
+struct Ext2FS
+{
+    FILE *image;
+    char *imagePath;
+    char *indexPath;
+    struct Ext2Options opts;
+    struct SB sb;
+    struct ImageMap imageMap;
+    struct BlockCache blockCache;
+    struct DentryCache dentryCache;
+    struct PathIndex pathIndex;
+};
+
+// A directory stream (see ext2OpenDir). The entries and their inodes
+// are all read when the stream is opened.
+struct Ext2Dir
+{
+    struct Arena arena;
+    struct DirEntries dirEntries;
+    struct Inode *entryInodes;
+    size_t next; // Index of the next entry.
+};
+
+struct Ext2File
+{
+    struct Ext2FS *ext2FS;
+    struct Inode inode;
+};
+
+// Handle of the call the calling thread is in (see beginCall). The
+// internals reach the superblock, caches and options of the image through
+// it, and so do the pool workers of the call.
+static _Thread_local struct Ext2FS *currentFS = NULL;
+
+// Message of the last failed call of the calling thread (see ext2LastError).
+static _Thread_local char lastError[ERROR_MSG_SIZE];
+
+// Manifest of the call the calling thread is in (see ext2ExtractDigests),
+// NULL unless the extracted files are hashed. The pool workers share it.
+static _Thread_local struct Manifest *currentManifest = NULL;
+
+// Digest kernels, picked for the CPU on first use (see initDigestKernels).
+static pthread_once_t digestKernelsOnce = PTHREAD_ONCE_INIT;
+static uint32_t crc32cTable[8][256];
+static uint32_t (*crc32cUpdate)(uint32_t crc, const unsigned char *data, size_t len);
+static void (*sha256Blocks)(uint32_t state[8], const unsigned char *data, size_t numBlocks);
+
+// Function prototypes (everything but the API of ext2read.h is private to
+// the library, so that it links next to any other code).
+static int beginCall(struct Ext2FS *ext2FS, struct ErrorSink *sink);
+static int endCall(int status);
+static int failCall(int error, const char *format, ...);
+static void freeHandle(struct Ext2FS *ext2FS);
+static int lookupFileObj(struct Ext2FS *ext2FS, const char *path, struct Inode *fileObjInode, struct Ext2Stat *fileStat, int isStatOnly);
+static int resolvePath(FILE *ext2FS, const char *filePath, struct Inode *fileObjInode, uint32_t *fileObjInodeNum, unsigned char *fileObjName, struct Arena *arena, int isStatOnly);
+static int extractFileObj(struct Inode *fileObjInode, const char *destPath, FILE *ext2FS);
+static int extractFile(struct Inode *fileObjInode, unsigned char name[256], FILE *ext2FS);
+static int extractFileZeroCopy(struct Inode *fileObjInode, unsigned char name[256], FILE *ext2FS);
+static int extractFileUring(struct Uring *ring, struct Inode *fileObjInode, unsigned char name[256], FILE *ext2FS);
+static int extractDir(struct Inode *fileObjInode, FILE *ext2FS, char *currentPath, struct Arena *arena);
+static int createOutputDir(char *path);
+static int extractDirParallel(struct Inode *fileObjInode, char *currentPath);
+static int runExtractTask(struct PoolWorker *worker, void *arg);
+static int extractTaskFileObj(struct PoolWorker *worker, struct ExtractTask *task);
+static struct ExtractTask *createExtractTask(struct Inode *inode, uint32_t inodeNum, char *path, struct ExtractTask *parent, uint32_t entryIndex);
+static void freeExtractTask(struct ExtractTask *task);
+static void recordFailure(struct TaskPool *pool, struct ExtractTask *task, struct ErrorSink *sink);
+static int compareFailures(const void *a, const void *b);
+static int extractOrdered(struct Inode *fileObjInode, char *path, FILE *ext2FS);
+static int planDirs(struct Plan *plan, struct Inode *dirInode, char *path);
+static void addPlanFile(struct Plan *plan, struct Inode *inode, char *path);
+static int planRuns(struct Plan *plan);
+static int recordPlanRun(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes);
+static int writePlanRuns(struct Plan *plan);
+static int writePlanRun(struct Plan *plan, struct PlanRun *run, const unsigned char *data);
+static FILE *openPlanFile(struct Plan *plan, size_t fileIndex);
+static int closePlanFile(struct Plan *plan, size_t fileIndex, int isDone);
+static int comparePlanDirs(const void *a, const void *b);
+static int comparePlanFiles(const void *a, const void *b);
+static int comparePlanRuns(const void *a, const void *b);
+static int enumeratePathsParallel(struct Inode *inode, char *currentPath, FILE *out);
+static int buildPathIndex(struct Inode *rootInode, FILE *ext2FS);
+static void writeIndexRecord(struct IndexBuilder *builder, const char *path, size_t pathLen, struct Inode *inode, uint32_t inodeNum);
+static void fillIndexHeader(struct IndexHeader *header);
+static int loadPathIndex(void);
+static void unloadPathIndex(void);
+static const struct IndexRecord *lookupPathIndex(const char *path);
+static int resolveIndexedPath(FILE *ext2FS, const char *filePath, struct Inode *fileObjInode, uint32_t *fileObjInodeNum, unsigned char *fileObjName, int isStatOnly);
+static int enumerateIndex(FILE *out);
+static int archiveFileObj(struct Inode *fileObjInode, uint32_t inodeNum, const char *name, int format, FILE *out, FILE *ext2FS);
+static int archiveEntry(struct Archive *archive, const char *path, size_t pathLen, struct Inode *inode, uint32_t inodeNum, FILE *ext2FS);
+static void writeTarHeader(struct Archive *archive, struct ArchiveEntry *entry);
+static void writeCpioHeader(struct Archive *archive, struct ArchiveEntry *entry);
+static void sealTarHeader(unsigned char *header);
+static void addPaxRecord(char **records, size_t *len, const char *key, const char *value, size_t valueLen);
+static void putOctal(unsigned char *field, size_t size, uint64_t value);
+static char *readLinkTarget(struct Inode *inode, FILE *ext2FS);
+static void decodeDevice(struct Inode *inode, uint32_t *major, uint32_t *minor);
+static int appendFileData(struct Archive *archive, struct Inode *inode, FILE *ext2FS);
+static int readRunIntoArchive(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes);
+static void appendArchive(struct Archive *archive, const void *data, size_t len);
+static void appendArchiveZeros(struct Archive *archive, uint64_t len);
+static void padArchive(struct Archive *archive);
+static int flushArchive(struct Archive *archive);
+static size_t indexRecordSize(size_t pathLen);
+static int isCanonicalPath(const char *path);
+static int runEnumTask(struct PoolWorker *worker, void *arg);
+static struct EnumDir *createEnumDir(struct Inode *inode, uint32_t inodeNum, char *path, struct EnumDir *parent);
+static int isAncestorDir(const uint32_t *inodeNums, int depth, uint32_t inodeNum);
+static void appendEnumOutput(struct EnumDir *dir, const char *text, size_t len);
+static void emitEnumDir(struct TaskPool *pool, struct EnumDir *dir, FILE *out);
+static int enumerateScan(FILE *out);
+static int scanInodeTables(struct InodeScan *scan);
+static int runScanTask(struct PoolWorker *worker, void *arg);
+static int scanGroup(struct ScanGroup *group, FILE *ext2FS);
+static struct ScanDir *lookupScanDir(struct InodeScan *scan, uint32_t inodeNum);
+static int isScanDir(struct InodeScan *scan, uint32_t inodeNum);
+static void freeInodeScan(struct InodeScan *scan);
+static int initPool(struct TaskPool *pool, int numWorkers, int (*runTask)(struct PoolWorker *worker, void *task));
+static int startPool(struct TaskPool *pool);
+static int finishPool(struct TaskPool *pool);
+static void *poolWorker(void *arg);
+static void pushTask(struct TaskPool *pool, int workerId, void *task);
+static void *popTask(struct TaskPool *pool, int workerId);
+static void *stealTask(struct TaskPool *pool, int workerId);
+static void reportError(const char *format, ...);
+static void reportCorruption(const char *format, ...);
+static void vreportError(int error, const char *format, va_list args);
+static int enumeratePaths(struct Inode *inode, FILE *ext2FS, char *currentPath, struct Arena *arena, FILE *out);
+static int isInodeDir(struct Inode *inode);
+static uint64_t getFileSize(struct Inode *inode);
+static int parseSuperblock(FILE *ext2FS);
+static int parseInodes(const uint32_t *inodeNums, size_t count, struct Inode *inodes, FILE *ext2FS);
+static struct Inode *parseDirEntryInodes(struct DirEntries *dirEntries, FILE *ext2FS, struct Arena *arena);
+static uint64_t getInodeAddr(uint32_t inodeNum);
+static int decodeInode(const unsigned char *record, struct Inode *inode);
+static void getBlockArea(struct Inode *inode, unsigned char *area);
+static uint64_t getStartBlock(struct Inode *inode);
+static int compareInodeRefs(const void *a, const void *b);
+static unsigned char *readAllDataBlocks(struct Inode *inode, FILE *ext2FS);
+static int walkDataBlocks(struct BlockWalker *walker);
+static int readDataBlock(struct BlockWalker *walker, uint32_t dBlockPtr);
+static int queueBlocks(struct BlockWalker *walker, uint64_t physBlock, uint64_t numBlocks);
+static int skipHole(struct BlockWalker *walker, uint64_t numBlocks);
+static int flushBlockRun(struct BlockWalker *walker);
+static int readBlockRun(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes, unsigned char *dest);
+static int readRunIntoBuffer(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes);
+static int readRunIntoStream(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes);
+static int copyRunIntoFile(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes);
+static int queueRunIntoUring(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes);
+static struct Uring *getUring(FILE *ext2FS);
+static struct Uring *initUring(FILE *ext2FS);
+static void freeUring(void);
+static void drainUring(void);
+static struct io_uring_sqe *getUringSqe(struct Uring *ring);
+static int submitUring(struct Uring *ring, int minComplete);
+static int reapUring(struct Uring *ring);
+static int finishUringFile(struct Uring *ring, int slot);
+static int copyRange(struct FileCopy *copy, uint64_t imageOffset, uint64_t fileOffset, uint64_t len, struct BlockWalker *walker);
+static int submitStreamSlot(struct FileStream *stream);
+static int writeStreamSlot(struct FileStream *stream, struct StreamSlot *slot);
+static void *streamWriter(void *arg);
+static int read12DBlockPtrs(struct BlockWalker *walker);
+static int readSIBlockPtr(struct BlockWalker *walker, uint32_t sIBlockPtr);
+static int readDIBlockPtr(struct BlockWalker *walker, uint32_t dIBlockPtr);
+static int readTIBlockPtr(struct BlockWalker *walker, uint32_t tIBlockPtr);
+static const uint32_t *readIndirectBlock(struct BlockWalker *walker, uint32_t blockPtr, int level);
+static int checkExtentNode(const unsigned char *node, size_t nodeSize, int depth);
+static int readExtentNode(struct BlockWalker *walker, const unsigned char *node, size_t nodeSize, int depth);
+static int readExtent(struct BlockWalker *walker, const unsigned char *extent);
+static struct DirEntries readDirEntries(struct Inode *inode, FILE *ext2FS, struct Arena *arena);
+static int parseRunDirEntries(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes);
+static int parseDirEntryInfo(const unsigned char *data, size_t size, struct DirEntries *dirEntries);
+static int isDotEntry(struct DirEntries *dirEntries, struct DirEntry *dirEntry);
+static void initTreeWalk(struct TreeWalk *walk, struct Inode *dirInode, const char *dirPath, FILE *ext2FS, struct Arena *arena);
+static void initScanWalk(struct TreeWalk *walk, struct InodeScan *scan, uint32_t dirInodeNum, const char *dirPath);
+static void initWalkPath(struct TreeWalk *walk, const char *dirPath);
+static int pushWalkFrame(struct TreeWalk *walk);
+static int nextTreeEntry(struct TreeWalk *walk);
+static void freeTreeWalk(struct TreeWalk *walk);
+static void initOutput(struct OutputBuffer *output, FILE *out);
+static void appendOutput(struct OutputBuffer *output, const char *text, size_t len);
+static void flushOutput(struct OutputBuffer *output);
+static int lookupDirEntry(struct Inode *dirInode, const char *name, FILE *ext2FS, struct Arena *arena, uint32_t *inodeNum);
+static int lookupHtree(struct Inode *dirInode, const char *name, FILE *ext2FS, struct Arena *arena, uint32_t *inodeNum);
+static int findInDirBlock(struct Inode *dirInode, uint32_t fileBlock, const char *name, FILE *ext2FS, struct Arena *arena, uint32_t *inodeNum);
+static uint64_t getFileBlock(struct Inode *inode, uint64_t fileBlock, FILE *ext2FS, unsigned char *scratch);
+static uint64_t getExtentBlock(struct Inode *inode, uint64_t fileBlock, FILE *ext2FS, unsigned char *scratch);
+static uint32_t dirHash(const char *name, int len, int hashVersion);
+static uint32_t dxHackHash(const char *name, int len, int isUnsigned);
+static void str2HashBuf(const char *msg, int len, uint32_t *buf, int num, int isUnsigned);
+static void halfMD4Transform(uint32_t buf[4], const uint32_t in[8]);
+static void teaTransform(uint32_t buf[4], const uint32_t in[4]);
+static void initDigest(struct Digest *digest, int algorithm);
+static void updateDigest(struct Digest *digest, const unsigned char *data, size_t len);
+static void updateDigestAt(struct Digest *digest, const unsigned char *data, uint64_t fileOffset, size_t len);
+static void hashZeros(struct Digest *digest, uint64_t len);
+static void finishDigest(struct Digest *digest, uint64_t fileSize, char hex[DIGEST_HEX_MAX]);
+static void addManifestLine(struct Manifest *manifest, const char *path, struct Digest *digest, uint64_t fileSize);
+static int compareManifestLines(const void *a, const void *b);
+static int writeManifest(struct Manifest *manifest, FILE *out);
+static void initDigestKernels(void);
+static uint32_t crc32cSlice8(uint32_t crc, const unsigned char *data, size_t len);
+static void sha256Generic(uint32_t state[8], const unsigned char *data, size_t numBlocks);
+#if defined(__x86_64__)
+static uint32_t crc32cSse42(uint32_t crc, const unsigned char *data, size_t len);
+static void sha256ShaNi(uint32_t state[8], const unsigned char *data, size_t numBlocks);
+#endif
+static void *arenaAlloc(struct Arena *arena, size_t size);
+static struct ArenaMark markArena(struct Arena *arena);
+static void releaseArena(struct Arena *arena, struct ArenaMark mark);
+static void freeArena(struct Arena *arena);
+static int mapImage(FILE *ext2FS);
+static void unmapImage(void);
+static void setImagePhase(int advice);
+static void adviseImage(uint64_t offset, uint64_t len, int advice);
+static const unsigned char *readImage(FILE *ext2FS, uint64_t offset, size_t len, int kind, void *scratch);
+static int initBlockCache(void);
+static void freeBlockCache(void);
+static const unsigned char *readCachedBlocks(FILE *ext2FS, uint64_t physBlock, uint64_t numBlocks, int kind, unsigned char *dest);
+static struct CacheEntry *lookupCacheEntry(uint64_t blockNum);
+static void insertCacheEntry(uint64_t blockNum, int kind, const unsigned char *data);
+static void unlinkLRU(struct CacheEntry *entry);
+static void pushLRU(struct CacheEntry *entry);
+static int initDentryCache(void);
+static void freeDentryCache(void);
+static int lookupDentry(uint32_t parentInodeNum, const char *name, uint32_t *inodeNum, struct Inode *inode);
+static void insertDentry(uint32_t parentInodeNum, const char *name, uint32_t inodeNum, struct Inode *inode);
+static struct Dentry *findDentry(uint32_t parentInodeNum, const char *name);
+static void evictDentry(void);
+static void unlinkDentryLRU(struct Dentry *dentry);
+static void pushDentryLRU(struct Dentry *dentry);
+static size_t hashDentry(uint32_t parentInodeNum, const char *name);
+static uint16_t le16(const unsigned char *p);
+static uint32_t le32(const unsigned char *p);
+static void *do_malloc(size_t size);
+static void *do_calloc(size_t nmemb, size_t size);
+static void *do_realloc(void *ptr, size_t size);
+static FILE *do_fopen(char *name, char *mode);
+static int do_fseek(FILE *fp, uint64_t offset, int whence);
+static int do_fwrite(void *buffer, size_t size, size_t count, FILE *file);
+static int do_pread(FILE *file, void *buffer, size_t count, uint64_t offset);
+static int do_preadv(FILE *file, struct iovec *iov, int iovcnt, uint64_t offset);
+static int do_fclose(FILE *fp);
+static int do_ftruncate(FILE *fp, uint64_t length);
+static int do_mkdir(char *name);
+
+// LIBRARY API ----------------------------------------------------------------
+// Every call runs between beginCall and endCall: the handle becomes the
+// current one of the calling thread and the errors go into a sink of the
+// call instead of ending the process.
+static int beginCall(struct Ext2FS *ext2FS, struct ErrorSink *sink)
+{
+    if (ext2FS == NULL)
+    {
+        snprintf(lastError, ERROR_MSG_SIZE, "%s", ext2StrError(EXT2_ERR_INVALID_ARG));
+        return EXT2_ERR_INVALID_ARG;
+    }
+
+    memset(sink, 0, sizeof(struct ErrorSink));
+    currentFS = ext2FS;
+    errorSink = sink;
+
+    return 0;
+}
+
+// Leave the call. Returns the error of the sink if anything failed
+// (keeping its message for ext2LastError), and status otherwise.
+static int endCall(int status)
+{
+    if (errorSink->failed)
+    {
+        status = errorSink->error;
+        snprintf(lastError, ERROR_MSG_SIZE, "%s", errorSink->message);
+    }
+
+    currentFS = NULL;
+    errorSink = NULL;
+
+    return status;
+}
+
+// Report an error of a given kind into the sink of the call and return it.
+static int failCall(int error, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vreportError(error, format, args);
+    va_end(args);
+
+    return error;
+}
+
+void ext2DefaultOptions(struct Ext2Options *options)
+{
+    memset(options, 0, sizeof(struct Ext2Options));
+    options->bufferBudget = DEFAULT_BUFFER_BUDGET;
+    options->cacheSize = DEFAULT_CACHE_SIZE;
+    options->dentryCacheSize = DEFAULT_DENTRY_CACHE_SIZE;
+    options->numThreads = 1;
+}
+
+// Free whatever part of a handle is set up (the handle must be the current one).
+static void freeHandle(struct Ext2FS *ext2FS)
+{
+    freeDentryCache();
+    unloadPathIndex();
+    freeBlockCache();
+    unmapImage();
+    free(ext2FS->sb.bgdt);
+    if (ext2FS->image != NULL)
+    {
+        fclose(ext2FS->image);
+    }
+    free(ext2FS->imagePath);
+    free(ext2FS->indexPath);
+    free(ext2FS);
+}
+
+int ext2Open(const char *imagePath, const struct Ext2Options *options, struct Ext2FS **ext2FS)
+{
+    *ext2FS = NULL;
+
+    struct Ext2Options defaults;
+    if (options == NULL)
+    {
+        ext2DefaultOptions(&defaults);
+        options = &defaults;
+    }
+
+    // The physical order extraction does its own reads and writes.
+    if (imagePath == NULL || options->bufferBudget == 0 || options->numThreads < 1 ||
+        (options->physicalOrder && (options->numThreads > 1 || options->zeroCopy || options->useUring)))
+    {
+        snprintf(lastError, ERROR_MSG_SIZE, "%s", ext2StrError(EXT2_ERR_INVALID_ARG));
+        return EXT2_ERR_INVALID_ARG;
+    }
+
+    struct Ext2FS *handle = (struct Ext2FS *)do_calloc(1, sizeof(struct Ext2FS));
+    handle->opts = *options;
+    handle->imagePath = (char *)do_malloc(strlen(imagePath) + 1);
+    strcpy(handle->imagePath, imagePath);
+
+    // The path index lives next to the image unless told otherwise.
+    if (options->indexPath != NULL)
+    {
+        handle->indexPath = (char *)do_malloc(strlen(options->indexPath) + 1);
+        strcpy(handle->indexPath, options->indexPath);
+    }
+    else
+    {
+        handle->indexPath = (char *)do_malloc(strlen(imagePath) + sizeof(INDEX_SUFFIX));
+        strcpy(handle->indexPath, imagePath);
+        strcat(handle->indexPath, INDEX_SUFFIX);
+    }
+    handle->opts.indexPath = handle->indexPath;
+
+    struct ErrorSink sink;
+    beginCall(handle, &sink);
+
+    handle->image = do_fopen(handle->imagePath, "rb");
+    if (handle->image == NULL)
+    {
+        freeHandle(handle);
+        return endCall(EXT2_ERR_IO);
+    }
+
+    // Map the ext2 file system if requested. Images that
+    // cannot be mapped silently fall back to positional reads.
+    if (options->useMmap)
+    {
+        mapImage(handle->image);
+    }
+
+    // Read and parse the superblock.
+    if (parseSuperblock(handle->image) != 0 || sink.failed)
+    {
+        freeHandle(handle);
+        return endCall(EXT2_ERR_CORRUPT);
+    }
+
+    // Set up the block cache (its capacity depends on the block size).
+    initBlockCache();
+    if (options->useDentryCache && options->dentryCacheSize > 0)
+    {
+        initDentryCache();
+    }
+
+    // Map the path index if there is one that is still valid for the image.
+    if (!options->noIndex)
+    {
+        loadPathIndex();
+    }
+
+    *ext2FS = handle;
+
+    return endCall(0);
+}
+
+void ext2Close(struct Ext2FS *ext2FS)
+{
+    if (ext2FS == NULL)
+    {
+        return;
+    }
+
+    // The internals free the parts of the current handle.
+    struct Ext2FS *previousFS = currentFS;
+    currentFS = ext2FS;
+    freeHandle(ext2FS);
+    currentFS = previousFS;
+}
+
+const char *ext2LastError(void)
+{
+    return lastError;
+}
+
+const char *ext2StrError(int error)
+{
+    switch (error)
+    {
+    case EXT2_OK:
+        return "Success";
+    case EXT2_ERR_IO:
+        return "I/O error";
+    case EXT2_ERR_CORRUPT:
+        return "Not an ext2 file system (or a damaged one)";
+    case EXT2_ERR_INVALID_PATH:
+        return "INVALID PATH";
+    case EXT2_ERR_NOT_DIR:
+        return "Not a directory";
+    case EXT2_ERR_IS_DIR:
+        return "Is a directory";
+    case EXT2_ERR_INVALID_ARG:
+        return "Invalid argument";
+    default:
+        return "Unknown error";
+    }
+}
+
+// Resolve a path into the inode of its file object (and what ext2Stat tells
+// about it). isStatOnly is passed down to resolveIndexedPath. Must be called
+// inside of a call.
+static int lookupFileObj(struct Ext2FS *ext2FS, const char *path, struct Inode *fileObjInode, struct Ext2Stat *fileStat, int isStatOnly)
+{
+    // Path lookups jump around the image.
+    setImagePhase(MADV_RANDOM);
+
+    // The directory blocks read by the lookup live in this arena.
+    struct Arena arena = {0};
+    unsigned char fileObjName[256] = "/";
+    uint32_t fileObjInodeNum;
+    int isValid = path != NULL && resolvePath(ext2FS->image, path, fileObjInode, &fileObjInodeNum, fileObjName, &arena, isStatOnly) == 0;
+    freeArena(&arena);
+
+    if (!isValid)
+    {
+        return failCall(EXT2_ERR_INVALID_PATH, "INVALID PATH");
+    }
+
+    fileStat->inodeNum = fileObjInodeNum;
+    fileStat->mode = fileObjInode->type;
+    fileStat->size = getFileSize(fileObjInode);
+    strcpy(fileStat->name, (char *)fileObjName);
+
+    return 0;
+}
+
+int ext2Stat(struct Ext2FS *ext2FS, const char *path, struct Ext2Stat *fileStat)
+{
+    struct ErrorSink sink;
+    int status = beginCall(ext2FS, &sink);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    struct Inode fileObjInode;
+    status = lookupFileObj(ext2FS, path, &fileObjInode, fileStat, 1);
+
+    return endCall(status);
+}
+
+// The entries and their inodes are all read up front (in a single pass
+// over the inode table, see parseDirEntryInodes).
+int ext2OpenDir(struct Ext2FS *ext2FS, const char *path, struct Ext2Dir **dir)
+{
+    *dir = NULL;
+
+    struct ErrorSink sink;
+    int status = beginCall(ext2FS, &sink);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    struct Inode dirInode;
+    struct Ext2Stat dirStat;
+    status = lookupFileObj(ext2FS, path, &dirInode, &dirStat, 0);
+    if (status != 0)
+    {
+        return endCall(status);
+    }
+    if (!isInodeDir(&dirInode))
+    {
+        return endCall(failCall(EXT2_ERR_NOT_DIR, "Not a directory: %s", path));
+    }
+
+    struct Ext2Dir *newDir = (struct Ext2Dir *)do_calloc(1, sizeof(struct Ext2Dir));
+    newDir->dirEntries = readDirEntries(&dirInode, ext2FS->image, &newDir->arena);
+    newDir->entryInodes = parseDirEntryInodes(&newDir->dirEntries, ext2FS->image, &newDir->arena);
+
+    status = endCall(0);
+    if (status != 0)
+    {
+        ext2CloseDir(newDir);
+        return status;
+    }
+
+    *dir = newDir;
+
+    return 0;
+}
+
+int ext2ReadDir(struct Ext2Dir *dir, struct Ext2DirEntry *entry)
+{
+    while (dir->next < dir->dirEntries.count)
+    {
+        struct DirEntry *dirEntry = &dir->dirEntries.entries[dir->next];
+        struct Inode *inode = &dir->entryInodes[dir->next];
+        dir->next++;
+
+        // Skip the dot entries and the unused ones.
+        if (dirEntry->inodeNum == 0 || isDotEntry(&dir->dirEntries, dirEntry))
+        {
+            continue;
+        }
+
+        entry->inodeNum = dirEntry->inodeNum;
+        entry->mode = inode->type;
+        entry->size = getFileSize(inode);
+        memcpy(entry->name, &dir->dirEntries.names[dirEntry->nameOffset], dirEntry->nameLen);
+        entry->name[dirEntry->nameLen] = '\0';
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void ext2CloseDir(struct Ext2Dir *dir)
+{
+    if (dir != NULL)
+    {
+        freeArena(&dir->arena);
+        free(dir);
+    }
+}
+
+int ext2OpenFile(struct Ext2FS *ext2FS, const char *path, struct Ext2File **file)
+{
+    *file = NULL;
+
+    struct ErrorSink sink;
+    int status = beginCall(ext2FS, &sink);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    struct Inode fileInode;
+    struct Ext2Stat fileStat;
+    status = lookupFileObj(ext2FS, path, &fileInode, &fileStat, 0);
+    if (status != 0)
+    {
+        return endCall(status);
+    }
+    if (isInodeDir(&fileInode))
+    {
+        return endCall(failCall(EXT2_ERR_IS_DIR, "Is a directory: %s", path));
+    }
+
+    struct Ext2File *newFile = (struct Ext2File *)do_malloc(sizeof(struct Ext2File));
+    newFile->ext2FS = ext2FS;
+    newFile->inode = fileInode;
+    *file = newFile;
+
+    return endCall(0);
+}
+
+// Physically contiguous blocks are read with a single read (up to
+// MAX_RUN_BYTES), straight into buf unless the image is mapped.
+ssize_t ext2PRead(struct Ext2File *file, void *buf, size_t count, uint64_t offset)
+{
+    if (file == NULL)
+    {
+        snprintf(lastError, ERROR_MSG_SIZE, "%s", ext2StrError(EXT2_ERR_INVALID_ARG));
+        return EXT2_ERR_INVALID_ARG;
+    }
+
+    struct ErrorSink sink;
+    int status = beginCall(file->ext2FS, &sink);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    uint64_t fileSize = getFileSize(&file->inode);
+    if (offset >= fileSize || count == 0)
+    {
+        return endCall(0);
+    }
+    uint64_t end = count < fileSize - offset ? offset + count : fileSize;
+
+    FILE *image = file->ext2FS->image;
+    uint64_t blockSize = currentFS->sb.blockSize;
+    unsigned char *scratch = (unsigned char *)do_malloc(blockSize); // Indirect blocks.
+    unsigned char *dest = (unsigned char *)buf;
+
+    uint64_t pos = offset;
+    uint64_t fileBlock = pos / blockSize;
+    uint64_t physBlock = getFileBlock(&file->inode, fileBlock, image, scratch);
+    while (pos < end)
+    {
+        // Extend the run over the blocks that follow it on disk
+        // (or over the following holes if it is a hole).
+        uint64_t runStart = pos;
+        uint64_t runBlock = physBlock;
+        uint64_t numBlocks = 0;
+        do
+        {
+            numBlocks++;
+            fileBlock++;
+            pos = fileBlock * blockSize < end ? fileBlock * blockSize : end;
+            physBlock = pos < end ? getFileBlock(&file->inode, fileBlock, image, scratch) : 0;
+        } while (pos < end && pos - runStart < MAX_RUN_BYTES &&
+                 (runBlock == 0 ? physBlock == 0 : physBlock == runBlock + numBlocks));
+
+        unsigned char *runDest = &dest[runStart - offset];
+        size_t runLen = pos - runStart;
+        if (runBlock == 0)
+        {
+            memset(runDest, 0, runLen);
+        }
+        else
+        {
+            uint64_t addr = (uint64_t)runBlock * blockSize + runStart % blockSize;
+            const unsigned char *data = readImage(image, addr, runLen, READ_FILE_DATA, runDest);
+            if (data != runDest)
+            {
+                memcpy(runDest, data, runLen);
+            }
+        }
+    }
+
+    // Free the allocated memory.
+    free(scratch);
+
+    status = endCall(0);
+
+    return status != 0 ? status : (ssize_t)(end - offset);
+}
+
+void ext2CloseFile(struct Ext2File *file)
+{
+    free(file);
+}
+
+// Start path enumeration from the root directory
+// (or list the paths of the index, which are in the same order).
+int ext2Enumerate(struct Ext2FS *ext2FS, FILE *out)
+{
+    struct ErrorSink sink;
+    int status = beginCall(ext2FS, &sink);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    if (ext2FS->opts.scanInodes)
+    {
+        enumerateScan(out);
+    }
+    else if (ext2FS->pathIndex.base != NULL)
+    {
+        enumerateIndex(out);
+    }
+    else
+    {
+        uint32_t rootInodeNum = ROOT_INODE_NUM;
+        struct Inode rootInode;
+        parseInodes(&rootInodeNum, 1, &rootInode, ext2FS->image);
+
+        if (ext2FS->opts.numThreads > 1)
+        {
+            enumeratePathsParallel(&rootInode, "/", out);
+        }
+        else
+        {
+            struct Arena arena = {0};
+            enumeratePaths(&rootInode, ext2FS->image, "/", &arena, out);
+            freeArena(&arena);
+        }
+    }
+
+    if (fflush(out) != 0 || ferror(out))
+    {
+        reportError("write failed: %s", strerror(errno));
+    }
+
+    return endCall(0);
+}
+
+int ext2Extract(struct Ext2FS *ext2FS, uint32_t inodeNum, const char *destPath)
+{
+    struct ErrorSink sink;
+    int status = beginCall(ext2FS, &sink);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    if (inodeNum == 0 || inodeNum > ext2FS->sb.totalInodes || destPath == NULL)
+    {
+        return endCall(failCall(EXT2_ERR_INVALID_ARG, "%s", ext2StrError(EXT2_ERR_INVALID_ARG)));
+    }
+
+    struct Inode fileObjInode;
+    parseInodes(&inodeNum, 1, &fileObjInode, ext2FS->image);
+    status = extractFileObj(&fileObjInode, destPath, ext2FS->image);
+
+    // The io_uring of the thread has the image registered, so it
+    // does not outlive the call.
+    freeUring();
+
+    return endCall(status != 0 ? EXT2_ERR_IO : 0);
+}
+
+int ext2ExtractDigests(struct Ext2FS *ext2FS, uint32_t inodeNum, const char *destPath, int digest, int verifyOnly, FILE *manifest)
+{
+    struct ErrorSink sink;
+    int status = beginCall(ext2FS, &sink);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    if (inodeNum == 0 || inodeNum > ext2FS->sb.totalInodes || destPath == NULL || manifest == NULL ||
+        (digest != EXT2_DIGEST_CRC32C && digest != EXT2_DIGEST_SHA256))
+    {
+        return endCall(failCall(EXT2_ERR_INVALID_ARG, "%s", ext2StrError(EXT2_ERR_INVALID_ARG)));
+    }
+
+    pthread_once(&digestKernelsOnce, initDigestKernels);
+
+    struct Manifest digests = {0};
+    digests.algorithm = digest;
+    digests.verifyOnly = verifyOnly;
+    pthread_mutex_init(&digests.lock, NULL);
+    currentManifest = &digests;
+
+    struct Inode fileObjInode;
+    parseInodes(&inodeNum, 1, &fileObjInode, ext2FS->image);
+    status = extractFileObj(&fileObjInode, destPath, ext2FS->image);
+
+    // The files that were done go into the manifest even if others failed.
+    currentManifest = NULL;
+    writeManifest(&digests, manifest);
+    pthread_mutex_destroy(&digests.lock);
+
+    return endCall(status != 0 ? EXT2_ERR_IO : 0);
+}
+
+int ext2Archive(struct Ext2FS *ext2FS, uint32_t inodeNum, const char *name, int format, FILE *out)
+{
+    struct ErrorSink sink;
+    int status = beginCall(ext2FS, &sink);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    if (inodeNum == 0 || inodeNum > ext2FS->sb.totalInodes || name == NULL || name[0] == '\0' || out == NULL ||
+        (format != EXT2_ARCHIVE_TAR && format != EXT2_ARCHIVE_CPIO))
+    {
+        return endCall(failCall(EXT2_ERR_INVALID_ARG, "%s", ext2StrError(EXT2_ERR_INVALID_ARG)));
+    }
+
+    struct Inode fileObjInode;
+    parseInodes(&inodeNum, 1, &fileObjInode, ext2FS->image);
+    status = archiveFileObj(&fileObjInode, inodeNum, name, format, out, ext2FS->image);
+
+    return endCall(status != 0 ? EXT2_ERR_IO : 0);
+}
+
+int ext2BuildIndex(struct Ext2FS *ext2FS)
+{
+    struct ErrorSink sink;
+    int status = beginCall(ext2FS, &sink);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    uint32_t rootInodeNum = ROOT_INODE_NUM;
+    struct Inode rootInode;
+    parseInodes(&rootInodeNum, 1, &rootInode, ext2FS->image);
+    status = buildPathIndex(&rootInode, ext2FS->image);
+
+    return endCall(status != 0 ? EXT2_ERR_IO : 0);
+}
+
+int ext2IndexState(struct Ext2FS *ext2FS)
+{
+    return ext2FS->pathIndex.state;
+}
+
+void ext2EnableStats(int enabled)
+{
+    __atomic_store_n(&statsEnabled, enabled, __ATOMIC_RELAXED);
+}
+
+void ext2GetStats(struct Ext2FS *ext2FS, struct Ext2Stats *out)
+{
+    memset(out, 0, sizeof(struct Ext2Stats));
+
+    out->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+    for (int i = 0; i < READ_KINDS; i++)
+    {
+        out->bytesRead[i] = __atomic_load_n(&stats.bytesRead[i], __ATOMIC_RELAXED);
+    }
+    out->seeks = __atomic_load_n(&stats.seeks, __ATOMIC_RELAXED);
+    out->copies = __atomic_load_n(&stats.copies, __ATOMIC_RELAXED);
+    out->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+    out->bytesWritten = __atomic_load_n(&stats.bytesWritten, __ATOMIC_RELAXED);
+    out->allocs = __atomic_load_n(&stats.allocs, __ATOMIC_RELAXED);
+    out->allocBytes = __atomic_load_n(&stats.allocBytes, __ATOMIC_RELAXED);
+    out->mkdirs = __atomic_load_n(&stats.mkdirs, __ATOMIC_RELAXED);
+
+    if (ext2FS == NULL)
+    {
+        return;
+    }
+
+    if (ext2FS->blockCache.buckets != NULL)
+    {
+        pthread_mutex_lock(&ext2FS->blockCache.lock);
+        for (int i = 0; i < READ_KINDS; i++)
+        {
+            out->cacheHits[i] = ext2FS->blockCache.stats[i].hits;
+            out->cacheMisses[i] = ext2FS->blockCache.stats[i].misses;
+            out->cacheEvictions[i] = ext2FS->blockCache.stats[i].evictions;
+        }
+        pthread_mutex_unlock(&ext2FS->blockCache.lock);
+    }
+
+    if (ext2FS->dentryCache.enabled)
+    {
+        pthread_mutex_lock(&ext2FS->dentryCache.lock);
+        out->dentryHits = ext2FS->dentryCache.hits;
+        out->dentryMisses = ext2FS->dentryCache.misses;
+        pthread_mutex_unlock(&ext2FS->dentryCache.lock);
+    }
+}
+
+// UTILITY METHODS ------------------------------------------------------------
+// Resolve a path (starting from the root directory) into the inode of the
+// file object. The name of the file object is copied into fileObjName.
+// When the dentry cache is in use, every lookup of a name in a directory is
+// cached, including the ones that fail, so the shared ancestors of the paths
+// that are looked up over and over again are only read once (for as long as
+// they stay in the cache).
+// Canonical paths are answered by the path index instead, if there is one
+// (see isStatOnly in resolveIndexedPath).
+// Returns 0 on success and -1 if the path is invalid.
+static int resolvePath(FILE *ext2FS, const char *filePath, struct Inode *fileObjInode, uint32_t *fileObjInodeNum, unsigned char *fileObjName, struct Arena *arena, int isStatOnly)
+{
+    if (currentFS->pathIndex.base != NULL && isCanonicalPath(filePath))
+    {
+        return resolveIndexedPath(ext2FS, filePath, fileObjInode, fileObjInodeNum, fileObjName, isStatOnly);
+    }
+
+    // Create a copy of the file path.
+    // Note: strtok_r modifies the original string.
+    size_t pathLen = strlen(filePath);
+    char *filePathCopy = (char *)arenaAlloc(arena, pathLen + 1);
+    strcpy(filePathCopy, filePath);
+
+    // The seen inodes (i.e., the directories from the root directory down to
+    // the current file object). A path has at most pathLen / 2 + 1 names.
+    uint32_t *seenInodeNums = (uint32_t *)arenaAlloc(arena, (pathLen / 2 + 2) * sizeof(uint32_t));
+    struct Inode *seenInodes = (struct Inode *)arenaAlloc(arena, (pathLen / 2 + 2) * sizeof(struct Inode));
+    size_t depth = 0;
+
+    // Initialize the root inode.
+    seenInodeNums[0] = ROOT_INODE_NUM;
+    parseInodes(&seenInodeNums[0], 1, &seenInodes[0], ext2FS);
+
+    // TRAVERSE THE TOKENS -----------------------------------------------
+    int numTokens = 0;
+    char *savePtr;
+    char *nextToken = strtok_r(filePathCopy, "/", &savePtr);
+    while (nextToken != NULL)
+    {
+        // Get the current token name.
+        char *tokenName = nextToken;
+        nextToken = strtok_r(NULL, "/", &savePtr);
+        numTokens++;
+
+        // If tokenName is a dot (.), do nothing.
+        if (strcmp(tokenName, ".") == 0)
+        {
+            continue;
+        }
+
+        // If tokenName is a double dot (..), pop the last inode from the
+        // seen inodes (given that it is not the root inode).
+        if (strcmp(tokenName, "..") == 0)
+        {
+            if (depth > 0)
+            {
+                depth--;
+            }
+            continue;
+        }
+
+        // Look up the current token name in the current directory
+        // (i.e, the last seen inode), through the dentry cache if possible.
+        uint32_t parentInodeNum = seenInodeNums[depth];
+        uint32_t inodeNum = 0;
+        struct Inode *currInode = &seenInodes[depth + 1];
+        if (!lookupDentry(parentInodeNum, tokenName, &inodeNum, currInode))
+        {
+            // If the directory entry was found, then parse its inode.
+            if (lookupDirEntry(&seenInodes[depth], tokenName, ext2FS, arena, &inodeNum))
+            {
+                parseInodes(&inodeNum, 1, currInode, ext2FS);
+            }
+
+            insertDentry(parentInodeNum, tokenName, inodeNum, currInode);
+        }
+
+        // If the file object was not found, then this
+        // means that the file path is invalid.
+        if (inodeNum == 0)
+        {
+            return -1;
+        }
+
+        // If the inode is a file and it is not the last token,
+        // then the file path is invalid.
+        if (!isInodeDir(currInode) && nextToken != NULL)
+        {
+            return -1;
+        }
+
+        // Update the file object name.
+        strcpy((char *)fileObjName, tokenName);
+
+        // Add the inode to the seen inodes.
+        depth++;
+        seenInodeNums[depth] = inodeNum;
+    }
+    // -------------------------------------------------------------------
+
+    *fileObjInode = seenInodes[depth];
+    *fileObjInodeNum = seenInodeNums[depth];
+
+    // Determine if the last token follows the proper file path format.
+    // That is, if the last token is a directory, then it must end with a slash (/).
+    // If the last token is a file, then it must not end with a slash (/).
+    // (A path without any token is the root directory.)
+    if (numTokens > 0 &&
+        ((isInodeDir(fileObjInode) && filePath[pathLen - 1] != '/') ||
+         (!isInodeDir(fileObjInode) && filePath[pathLen - 1] == '/')))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Resolve a canonical path through the path index. Every path of the image
+// is in the index, so a path that is not in it is invalid (e.g., a directory
+// without its trailing slash). Only the inode of the file object is read
+// from the image, and not even that when the caller only needs its type and
+// size (isStatOnly), which the index has as well.
+// Returns 0 on success and -1 if the path is invalid.
+static int resolveIndexedPath(FILE *ext2FS, const char *filePath, struct Inode *fileObjInode, uint32_t *fileObjInodeNum, unsigned char *fileObjName, int isStatOnly)
+{
+    const struct IndexRecord *record = lookupPathIndex(filePath);
+    if (record == NULL)
+    {
+        return -1;
+    }
+
+    *fileObjInodeNum = record->inodeNum;
+
+    // The name is the last component of the path (the root keeps the name
+    // it was given).
+    size_t end = record->pathLen;
+    if (end > 1)
+    {
+        if (record->path[end - 1] == '/')
+        {
+            end--;
+        }
+        size_t start = end;
+        while (record->path[start - 1] != '/')
+        {
+            start--;
+        }
+        memcpy(fileObjName, &record->path[start], end - start);
+        fileObjName[end - start] = '\0';
+    }
+
+    if (isStatOnly)
+    {
+        memset(fileObjInode, 0, sizeof(struct Inode));
+        fileObjInode->type = record->type;
+        fileObjInode->FSizeLower = (uint32_t)record->size;
+        fileObjInode->FSizeUpper = (uint32_t)(record->size >> 32);
+    }
+    else
+    {
+        parseInodes(fileObjInodeNum, 1, fileObjInode, ext2FS);
+    }
+
+    return 0;
+}
+
+// Determine if a path is in the form of the paths of the index. That is, an
+// absolute path without empty, dot (.) or double dot (..) components.
+static int isCanonicalPath(const char *path)
+{
+    if (path[0] != '/')
+    {
+        return 0;
+    }
+
+    const char *name = &path[1];
+    while (*name != '\0')
+    {
+        const char *slash = strchr(name, '/');
+        size_t nameLen = slash != NULL ? (size_t)(slash - name) : strlen(name);
+
+        if (nameLen == 0 ||
+            (nameLen == 1 && name[0] == '.') ||
+            (nameLen == 2 && name[0] == '.' && name[1] == '.'))
+        {
+            return 0;
+        }
+
+        name = slash != NULL ? slash + 1 : name + nameLen;
+    }
+
+    return 1;
+}
+
+// Extract a file into the file destPath, or the contents of a directory
+// into the directory destPath (which is created if needed).
+static int extractFileObj(struct Inode *fileObjInode, const char *destPath, FILE *ext2FS)
+{
+    // Determine if the file object is a directory or a file.
+    int isDir = isInodeDir(fileObjInode);
+
+    // From here on the file data is read front to back.
+    setImagePhase(MADV_SEQUENTIAL);
+
+    // Dir
+    if (isDir)
+    {
+        // Create the destination directory.
+        if (createOutputDir((char *)destPath) != 0)
+        {
+            return -1;
+        }
+
+        // The paths of the entries are appended to the directory path.
+        size_t pathLen = strlen(destPath);
+        char *dirPath = (char *)do_malloc(pathLen + 2);
+        strcpy(dirPath, destPath);
+        if (pathLen == 0 || dirPath[pathLen - 1] != '/')
+        {
+            strcat(dirPath, "/");
+        }
+
+        // Digests are computed in file order (see ext2ExtractDigests).
+        int status = 0;
+        if (currentFS->opts.physicalOrder && currentManifest == NULL)
+        {
+            status = extractOrdered(fileObjInode, dirPath, ext2FS);
+        }
+        else if (currentFS->opts.numThreads > 1)
+        {
+            status = extractDirParallel(fileObjInode, dirPath);
+        }
+        else
+        {
+            struct Arena arena = {0};
+            extractDir(fileObjInode, ext2FS, dirPath, &arena);
+            freeArena(&arena);
+        }
+
+        // Free the allocated memory.
+        free(dirPath);
+
+        if (status != 0)
+        {
+            return status;
+        }
+    }
+    // File
+    else
+    {
+        if (currentFS->opts.physicalOrder && currentManifest == NULL)
+        {
+            return extractOrdered(fileObjInode, (char *)destPath, ext2FS);
+        }
+        extractFile(fileObjInode, (unsigned char *)destPath, ext2FS);
+    }
+
+    // Wait for the writes that are still in flight (io_uring backend).
+    drainUring();
+
+    return 0;
+}
+
+// The data is streamed from the ext2 file system into the file through a
+// fixed ring of buffers (see struct FileStream), so memory use is capped by
+// the buffer budget no matter how big the file is.
+// Returns -1 if writing the file failed (only when the calling thread has
+// an error sink, otherwise the do_* helpers exit).
+static int extractFile(struct Inode *fileObjInode, unsigned char name[256], FILE *ext2FS)
+{
+    // The data of a hashed file has to go through the ring.
+    if (currentFS->opts.zeroCopy && currentManifest == NULL)
+    {
+        return extractFileZeroCopy(fileObjInode, name, ext2FS);
+    }
+
+    // Without io_uring (e.g., old kernels or seccomp filters),
+    // the files are streamed with positional reads instead.
+    struct Uring *ring = currentFS->opts.useUring && currentManifest == NULL ? getUring(ext2FS) : NULL;
+    if (ring != NULL)
+    {
+        return extractFileUring(ring, fileObjInode, name, ext2FS);
+    }
+
+    // Open the the file in binary write mode (unless it is only hashed).
+    FILE *fileObj = NULL;
+    if (currentManifest == NULL || !currentManifest->verifyOnly)
+    {
+        fileObj = do_fopen((char *)name, "wb");
+        if (fileObj == NULL)
+        {
+            return -1;
+        }
+    }
+
+    // Split the buffer budget between the ring slots.
+    // Each slot holds at least one block.
+    size_t slotSize = currentFS->opts.bufferBudget / RING_SLOTS;
+    slotSize -= slotSize % currentFS->sb.blockSize;
+    if (slotSize == 0)
+    {
+        slotSize = currentFS->sb.blockSize;
+    }
+
+    // Initialize the ring.
+    struct FileStream stream = {0};
+    stream.fileObj = fileObj;
+    stream.slotSize = slotSize;
+    stream.errorSink = errorSink;
+
+    // The file is hashed as the slots are written.
+    struct Digest digest;
+    if (currentManifest != NULL)
+    {
+        initDigest(&digest, currentManifest->algorithm);
+        stream.digest = &digest;
+    }
+
+    // Files that fit in a single slot are read then written directly.
+    // Larger files are drained by a writer thread while the rest is read.
+    pthread_t writer;
+    stream.threaded = getFileSize(fileObjInode) > slotSize;
+    if (stream.threaded)
+    {
+        pthread_mutex_init(&stream.lock, NULL);
+        pthread_cond_init(&stream.slotFilled, NULL);
+        pthread_cond_init(&stream.slotFreed, NULL);
+        pthread_create(&writer, NULL, streamWriter, &stream);
+    }
+
+    // Initialize the block walker.
+    struct BlockWalker walker = {0};
+    walker.ext2FS = ext2FS;
+    walker.inode = fileObjInode;
+    walker.maxRunBytes = slotSize;
+    walker.handleRun = readRunIntoStream;
+    walker.ctx = &stream;
+
+    // Read all the data blocks into the ring.
+    walkDataBlocks(&walker);
+
+    // Submit the last (partially filled) slot.
+    if (stream.slots[stream.head].len > 0)
+    {
+        submitStreamSlot(&stream);
+    }
+
+    // Wait for the writer to drain the ring.
+    if (stream.threaded)
+    {
+        pthread_mutex_lock(&stream.lock);
+        stream.done = 1;
+        pthread_cond_signal(&stream.slotFilled);
+        pthread_mutex_unlock(&stream.lock);
+
+        pthread_join(writer, NULL);
+
+        pthread_mutex_destroy(&stream.lock);
+        pthread_cond_destroy(&stream.slotFilled);
+        pthread_cond_destroy(&stream.slotFreed);
+    }
+
+    // A file that ends with a hole is extended to its full size
+    // (the hole stays a hole in the file).
+    if (fileObj != NULL && !stream.failed && stream.writeOffset < getFileSize(fileObjInode) &&
+        do_ftruncate(fileObj, getFileSize(fileObjInode)) != 0)
+    {
+        stream.failed = 1;
+    }
+
+    // Close the file.
+    int closeFailed = fileObj != NULL && do_fclose(fileObj) != 0;
+
+    // Only the files that made it out whole go into the manifest.
+    if (stream.digest != NULL && !stream.failed && !stream.readFailed && !closeFailed)
+    {
+        addManifestLine(currentManifest, (char *)name, stream.digest, getFileSize(fileObjInode));
+    }
+
+    // Free the allocated memory.
+    for (int i = 0; i < RING_SLOTS; i++)
+    {
+        free(stream.slots[i].buf);
+    }
+
+    return stream.failed || stream.readFailed || closeFailed ? -1 : 0;
+}
+
+// Zero-copy variant of extractFile: every run of blocks is copied from the
+// image into the file by the kernel, so the data never enters user space.
+// copy_file_range is tried first (it shares the blocks outright on file
+// systems with reflinks), then sendfile, then a buffered copy for kernels
+// and file systems that support neither (e.g., EXDEV or ENOSYS).
+// Holes are skipped as in extractFile.
+static int extractFileZeroCopy(struct Inode *fileObjInode, unsigned char name[256], FILE *ext2FS)
+{
+    // Open the the file in binary write mode.
+    FILE *fileObj = do_fopen((char *)name, "wb");
+    if (fileObj == NULL)
+    {
+        return -1;
+    }
+
+    struct FileCopy copy = {0};
+    copy.imageFd = fileno(ext2FS);
+    copy.fileFd = fileno(fileObj);
+    copy.method = COPY_RANGE;
+
+    // Initialize the block walker. The runs are capped by the buffer
+    // budget in case the copy falls back to a buffered one.
+    struct BlockWalker walker = {0};
+    walker.ext2FS = ext2FS;
+    walker.inode = fileObjInode;
+    walker.maxRunBytes = currentFS->opts.bufferBudget - currentFS->opts.bufferBudget % currentFS->sb.blockSize;
+    if (walker.maxRunBytes == 0)
+    {
+        walker.maxRunBytes = currentFS->sb.blockSize;
+    }
+    walker.handleRun = copyRunIntoFile;
+    walker.ctx = &copy;
+
+    // Copy all the data blocks.
+    walkDataBlocks(&walker);
+
+    // Set the size of the file (the file may end with a hole).
+    if (!copy.failed && ftruncate(copy.fileFd, getFileSize(fileObjInode)) != 0)
+    {
+        reportError("ftruncate failed: %s", strerror(errno));
+        copy.failed = 1;
+    }
+
+    // Close the file.
+    int closeFailed = do_fclose(fileObj) != 0;
+
+    // Free the allocated memory.
+    free(copy.buf);
+
+    return copy.failed || closeFailed ? -1 : 0;
+}
+
+// io_uring variant of extractFile: the runs of the file are queued on the
+// io_uring of the calling thread as linked (read, write) pairs through the
+// registered buffers, so up to URING_BUFS runs are in flight at once. The
+// file is not waited for: its last writes overlap with the next files, and
+// it is closed once they complete (see finishUringFile). Write errors are
+// thus reported later, at the latest by drainUring.
+static int extractFileUring(struct Uring *ring, struct Inode *fileObjInode, unsigned char name[256], FILE *ext2FS)
+{
+    // Open the the file in binary write mode.
+    FILE *fileObj = do_fopen((char *)name, "wb");
+    if (fileObj == NULL)
+    {
+        return -1;
+    }
+
+    // Take a free file slot, waiting for a file to be done if there is none.
+    int slot = -1;
+    while (slot < 0)
+    {
+        for (int i = 0; i < URING_FILES && slot < 0; i++)
+        {
+            if (ring->files[i].fileObj == NULL)
+            {
+                slot = i;
+            }
+        }
+
+        if (slot < 0)
+        {
+            if (submitUring(ring, 1) != 0)
+            {
+                do_fclose(fileObj);
+                return -1;
+            }
+            reapUring(ring);
+        }
+    }
+
+    // Install the file as a fixed file.
+    int fd = fileno(fileObj);
+    struct io_uring_files_update update = {0};
+    update.offset = slot + 1;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0)
+    {
+        reportError("io_uring_register failed: %s", strerror(errno));
+        do_fclose(fileObj);
+        return -1;
+    }
+
+    struct UringFile *file = &ring->files[slot];
+    memset(file, 0, sizeof(struct UringFile));
+    file->fileObj = fileObj;
+    file->name = strdup((char *)name);
+    file->size = getFileSize(fileObjInode);
+
+    // Initialize the block walker. Runs never exceed a buffer.
+    struct BlockWalker walker = {0};
+    walker.ext2FS = ext2FS;
+    walker.inode = fileObjInode;
+    walker.maxRunBytes = ring->bufSize;
+    walker.handleRun = queueRunIntoUring;
+    walker.ctx = ring;
+    ring->currentFile = slot;
+
+    // Queue all the data blocks.
+    walkDataBlocks(&walker);
+
+    // Hand the queued runs over to the kernel.
+    file->closing = 1;
+    submitUring(ring, 0);
+    if (file->pending == 0)
+    {
+        finishUringFile(ring, slot);
+    }
+
+    return 0;
+}
+
+// Extract the contents of the given dir inode and save a copy of it.
+static int extractDir(struct Inode *fileObjInode, FILE *ext2FS, char *currentPath, struct Arena *arena)
+{
+    struct TreeWalk walk;
+    initTreeWalk(&walk, fileObjInode, currentPath, ext2FS, arena);
+
+    // A directory is created before its entries are walked.
+    while (nextTreeEntry(&walk))
+    {
+        if (isInodeDir(walk.inode))
+        {
+            createOutputDir(walk.path);
+        }
+        else
+        {
+            extractFile(walk.inode, (unsigned char *)walk.path, ext2FS);
+        }
+    }
+
+    freeTreeWalk(&walk);
+
+    return 0;
+}
+
+// Create a directory of the extraction, unless the files are only hashed
+// (see ext2ExtractDigests).
+static int createOutputDir(char *path)
+{
+    if (currentManifest != NULL && currentManifest->verifyOnly)
+    {
+        return 0;
+    }
+
+    return do_mkdir(path);
+}
+
+// Extract the contents of the given dir inode with a pool of numThreads
+// workers. Every directory entry becomes a task; a directory task creates the
+// directories of its entries before queueing them, so a directory always
+// exists before anything inside it is extracted. Output errors do not stop
+// the other tasks. Once the pool is done, the first of them in tree order is
+// reported, along with how many there were.
+// Returns -1 if any of them failed.
+static int extractDirParallel(struct Inode *fileObjInode, char *currentPath)
+{
+    struct TaskPool pool;
+    initPool(&pool, currentFS->opts.numThreads, runExtractTask);
+
+    // Seed the pool with the root of the subtree.
+    pushTask(&pool, 0, createExtractTask(fileObjInode, 0, currentPath, NULL, 0));
+
+    startPool(&pool);
+    finishPool(&pool);
+
+    // Report the first failure in tree order.
+    if (pool.numFailures > 1)
+    {
+        qsort(pool.failures, pool.numFailures, sizeof(struct Failure), compareFailures);
+    }
+    if (pool.numFailures == 1)
+    {
+        failCall(pool.failures[0].error, "%s", pool.failures[0].message);
+    }
+    else if (pool.numFailures > 1)
+    {
+        failCall(pool.failures[0].error, "%s (and %zu more failures)", pool.failures[0].message, pool.numFailures - 1);
+    }
+    for (size_t i = 0; i < pool.numFailures; i++)
+    {
+        free(pool.failures[i].order);
+        free(pool.failures[i].message);
+    }
+    free(pool.failures);
+
+    return pool.numFailures > 0 ? -1 : 0;
+}
+
+// Pool task: extract a file object while collecting its output errors.
+static int runExtractTask(struct PoolWorker *worker, void *arg)
+{
+    struct ExtractTask *task = (struct ExtractTask *)arg;
+
+    struct ErrorSink sink = {0};
+    errorSink = &sink;
+    extractTaskFileObj(worker, task);
+    drainUring();
+    errorSink = &worker->sink;
+
+    if (sink.failed)
+    {
+        recordFailure(worker->pool, task, &sink);
+    }
+    freeExtractTask(task);
+
+    return 0;
+}
+
+// Extract a file, or queue the entries of a directory as new tasks.
+static int extractTaskFileObj(struct PoolWorker *worker, struct ExtractTask *task)
+{
+    if (!isInodeDir(&task->inode))
+    {
+        return extractFile(&task->inode, (unsigned char *)task->path, worker->ext2FS);
+    }
+
+    // Read and parse the directory entries (released along with the
+    // arena of the worker once the task is done).
+    struct DirEntries dirEntries = readDirEntries(&task->inode, worker->ext2FS, &worker->arena);
+
+    // Parse the inodes of all the directory entries at once.
+    struct Inode *entryInodes = parseDirEntryInodes(&dirEntries, worker->ext2FS, &worker->arena);
+
+    // Traverse the directory entries.
+    for (size_t entryIndex = 0; entryIndex < dirEntries.count; entryIndex++)
+    {
+        struct DirEntry *dirEntry = &dirEntries.entries[entryIndex];
+        struct Inode *currInode = &entryInodes[entryIndex];
+
+        // Disregard the current directory (.), the parent directory (..)
+        // and the entries with an inode number of 0.
+        if (!isDotEntry(&dirEntries, dirEntry) && dirEntry->inodeNum != 0)
+        {
+            int isDir = isInodeDir(currInode);
+
+            // A directory that points back to an ancestor (a corrupted
+            // image) would queue tasks forever.
+            if (isDir && isAncestorDir(task->inodeNums, task->depth, dirEntry->inodeNum))
+            {
+                reportCorruption("Directory cycle at inode %u", dirEntry->inodeNum);
+                continue;
+            }
+
+            // Append the file object name (and a slash (/) if it is
+            // a directory) into the current path.
+            char *newPath = (char *)do_malloc(strlen(task->path) + dirEntry->nameLen + 2);
+            sprintf(newPath, "%s%s%s", task->path, &dirEntries.names[dirEntry->nameOffset], isDir ? "/" : "");
+
+            // Create the directory before any of its entries is queued.
+            // If it cannot be created, its whole subtree is skipped.
+            if (!isDir || createOutputDir(newPath) == 0)
+            {
+                pushTask(worker->pool, worker->id, createExtractTask(currInode, dirEntry->inodeNum, newPath, task, entryIndex));
+            }
+
+            // Free the allocated memory.
+            free(newPath);
+        }
+    }
+
+    return 0;
+}
+
+static struct ExtractTask *createExtractTask(struct Inode *inode, uint32_t inodeNum, char *path, struct ExtractTask *parent, uint32_t entryIndex)
+{
+    struct ExtractTask *task = (struct ExtractTask *)do_malloc(sizeof(struct ExtractTask));
+    task->inode = *inode;
+
+    task->path = (char *)do_malloc(strlen(path) + 1);
+    strcpy(task->path, path);
+
+    // The position of a task is the position of its parent plus its own entry index.
+    task->depth = parent == NULL ? 0 : parent->depth + 1;
+    task->order = (uint32_t *)do_malloc((task->depth + 1) * sizeof(uint32_t));
+    task->inodeNums = (uint32_t *)do_malloc((task->depth + 1) * sizeof(uint32_t));
+    if (parent != NULL)
+    {
+        memcpy(task->order, parent->order, parent->depth * sizeof(uint32_t));
+        task->order[parent->depth] = entryIndex;
+        memcpy(task->inodeNums, parent->inodeNums, (parent->depth + 1) * sizeof(uint32_t));
+    }
+    task->inodeNums[task->depth] = inodeNum;
+
+    return task;
+}
+
+static void freeExtractTask(struct ExtractTask *task)
+{
+    free(task->path);
+    free(task->order);
+    free(task->inodeNums);
+    free(task);
+}
+
+static void recordFailure(struct TaskPool *pool, struct ExtractTask *task, struct ErrorSink *sink)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->numFailures == pool->failuresCap)
+    {
+        pool->failuresCap = pool->failuresCap == 0 ? 16 : 2 * pool->failuresCap;
+        pool->failures = (struct Failure *)realloc(pool->failures, pool->failuresCap * sizeof(struct Failure));
+        if (pool->failures == NULL)
+        {
+            perror("realloc failed");
+            exit(1);
+        }
+    }
+
+    struct Failure *failure = &pool->failures[pool->numFailures++];
+    failure->depth = task->depth;
+    failure->error = sink->error;
+    failure->order = (uint32_t *)do_malloc((task->depth + 1) * sizeof(uint32_t));
+    memcpy(failure->order, task->order, task->depth * sizeof(uint32_t));
+    failure->message = (char *)do_malloc(strlen(task->path) + strlen(sink->message) + 3);
+    sprintf(failure->message, "%s: %s", task->path, sink->message);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Order the failures as a serial (depth-first) extraction would meet them.
+static int compareFailures(const void *a, const void *b)
+{
+    const struct Failure *failureA = (const struct Failure *)a;
+    const struct Failure *failureB = (const struct Failure *)b;
+
+    for (int i = 0; i < failureA->depth && i < failureB->depth; i++)
+    {
+        if (failureA->order[i] != failureB->order[i])
+        {
+            return failureA->order[i] < failureB->order[i] ? -1 : 1;
+        }
+    }
+
+    // A directory comes before the things inside it.
+    return (failureA->depth > failureB->depth) - (failureA->depth < failureB->depth);
+}
+
+// Extract a subtree (or a single file) in physical block order, for images
+// on disks where seeking is what costs (e.g., HDDs and network volumes).
+// Instead of reading every file in turn, wherever its blocks are:
+// 1. the directories are read one tree level at a time, in the order of
+//    their first block, and the inodes of a whole level are parsed at once
+//    (i.e., in inode table order);
+// 2. the block maps of the files are walked in the order of their first
+//    block, which also reads the indirect blocks mostly in ascending order;
+// 3. the runs of all the files are sorted by physical block and read in one
+//    ascending sweep (elevator order). Runs that are close enough are merged
+//    into a single read. Each file is written as its runs come along and
+//    closed once its last one is written.
+// Returns -1 if any file failed (only when the calling thread has an error
+// sink, otherwise the do_* helpers exit).
+static int extractOrdered(struct Inode *fileObjInode, char *path, FILE *ext2FS)
+{
+    struct Plan plan = {0};
+    plan.ext2FS = ext2FS;
+
+    // The read buffer holds whole blocks (at least one).
+    plan.maxRunBytes = currentFS->opts.bufferBudget - currentFS->opts.bufferBudget % currentFS->sb.blockSize;
+    if (plan.maxRunBytes == 0)
+    {
+        plan.maxRunBytes = currentFS->sb.blockSize;
+    }
+
+    if (isInodeDir(fileObjInode))
+    {
+        planDirs(&plan, fileObjInode, path);
+    }
+    else
+    {
+        addPlanFile(&plan, fileObjInode, strdup(path));
+    }
+
+    planRuns(&plan);
+    writePlanRuns(&plan);
+
+    // Free the allocated memory.
+    for (size_t i = 0; i < plan.numFiles; i++)
+    {
+        free(plan.files[i].path);
+    }
+    free(plan.files);
+    free(plan.runs);
+
+    return plan.failed ? -1 : 0;
+}
+
+// Read the directories of the subtree breadth first, creating them on the way
+// and adding their files to the plan.
+static int planDirs(struct Plan *plan, struct Inode *dirInode, char *path)
+{
+    // The directories planned so far, one bit per inode. The walk is breadth
+    // first, so a directory that comes round again (a corrupted image with a
+    // cycle) is checked against all of them rather than its ancestors only.
+    unsigned char *isPlanned = (unsigned char *)do_calloc((size_t)currentFS->sb.totalInodes / 8 + 1, 1);
+
+    struct PlanDir *level = (struct PlanDir *)do_malloc(sizeof(struct PlanDir));
+    size_t levelCount = 1;
+    level[0].inode = *dirInode;
+    level[0].startBlock = getStartBlock(dirInode);
+    level[0].path = strdup(path);
+
+    while (levelCount > 0)
+    {
+        struct Arena arena = {0};
+
+        // Read the entries of the level's directories in physical order.
+        qsort(level, levelCount, sizeof(struct PlanDir), comparePlanDirs);
+        struct DirEntries *dirEntries = (struct DirEntries *)arenaAlloc(&arena, levelCount * sizeof(struct DirEntries));
+        size_t numEntries = 0;
+        for (size_t i = 0; i < levelCount; i++)
+        {
+            dirEntries[i] = readDirEntries(&level[i].inode, plan->ext2FS, &arena);
+            numEntries += dirEntries[i].count;
+        }
+
+        // Parse the inodes of the whole level at once (the dot
+        // entries are left out, as are the entries without an inode).
+        uint32_t *inodeNums = (uint32_t *)arenaAlloc(&arena, (numEntries + 1) * sizeof(uint32_t));
+        struct Inode *inodes = (struct Inode *)arenaAlloc(&arena, (numEntries + 1) * sizeof(struct Inode));
+        size_t n = 0;
+        for (size_t i = 0; i < levelCount; i++)
+        {
+            for (size_t j = 0; j < dirEntries[i].count; j++, n++)
+            {
+                struct DirEntry *dirEntry = &dirEntries[i].entries[j];
+                inodeNums[n] = isDotEntry(&dirEntries[i], dirEntry) ? 0 : dirEntry->inodeNum;
+            }
+        }
+        parseInodes(inodeNums, numEntries, inodes, plan->ext2FS);
+
+        // Create the subdirectories (the next level) and plan the files.
+        struct PlanDir *nextLevel = NULL;
+        size_t nextCount = 0;
+        n = 0;
+        for (size_t i = 0; i < levelCount; i++)
+        {
+            for (size_t j = 0; j < dirEntries[i].count; j++, n++)
+            {
+                if (inodeNums[n] == 0)
+                {
+                    continue;
+                }
+
+                struct DirEntry *dirEntry = &dirEntries[i].entries[j];
+                int isDir = isInodeDir(&inodes[n]);
+
+                // Nothing is created for a directory that was met before.
+                if (isDir)
+                {
+                    if ((isPlanned[inodeNums[n] / 8] >> (inodeNums[n] % 8)) & 1)
+                    {
+                        reportCorruption("Directory cycle at inode %u", inodeNums[n]);
+                        plan->failed = 1;
+                        continue;
+                    }
+                    isPlanned[inodeNums[n] / 8] |= (unsigned char)(1 << (inodeNums[n] % 8));
+                }
+
+                // The path of the entry, with a slash (/) at the end for directories.
+                char *newPath = (char *)do_malloc(strlen(level[i].path) + dirEntry->nameLen + 2);
+                strcpy(newPath, level[i].path);
+                strcat(newPath, &dirEntries[i].names[dirEntry->nameOffset]);
+
+                if (!isDir)
+                {
+                    addPlanFile(plan, &inodes[n], newPath);
+                    continue;
+                }
+
+                strcat(newPath, "/");
+                if (do_mkdir(newPath) != 0)
+                {
+                    plan->failed = 1;
+                    free(newPath);
+                    continue;
+                }
+
+                nextLevel = (struct PlanDir *)do_realloc(nextLevel, (nextCount + 1) * sizeof(struct PlanDir));
+                nextLevel[nextCount].inode = inodes[n];
+                nextLevel[nextCount].startBlock = getStartBlock(&inodes[n]);
+                nextLevel[nextCount].path = newPath;
+                nextCount++;
+            }
+        }
+
+        // Move on to the next level.
+        for (size_t i = 0; i < levelCount; i++)
+        {
+            free(level[i].path);
+        }
+        free(level);
+        freeArena(&arena);
+        level = nextLevel;
+        levelCount = nextCount;
+    }
+
+    free(level);
+    free(isPlanned);
+
+    return 0;
+}
+
+// Add a file to the plan (the plan takes over the path).
+static void addPlanFile(struct Plan *plan, struct Inode *inode, char *path)
+{
+    if (plan->numFiles == plan->maxFiles)
+    {
+        plan->maxFiles = plan->maxFiles == 0 ? 64 : 2 * plan->maxFiles;
+        plan->files = (struct PlanFile *)do_realloc(plan->files, plan->maxFiles * sizeof(struct PlanFile));
+    }
+
+    struct PlanFile *file = &plan->files[plan->numFiles++];
+    memset(file, 0, sizeof(struct PlanFile));
+    file->inode = *inode;
+    file->startBlock = getStartBlock(inode);
+    file->path = path;
+}
+
+// Walk the block maps of the files (in the order of their first block) into
+// the runs of the plan. The files without any data are created right away.
+static int planRuns(struct Plan *plan)
+{
+    if (plan->numFiles > 1)
+    {
+        qsort(plan->files, plan->numFiles, sizeof(struct PlanFile), comparePlanFiles);
+    }
+
+    for (size_t i = 0; i < plan->numFiles; i++)
+    {
+        struct BlockWalker walker = {0};
+        walker.ext2FS = plan->ext2FS;
+        walker.inode = &plan->files[i].inode;
+        walker.maxRunBytes = plan->maxRunBytes;
+        walker.handleRun = recordPlanRun;
+        walker.ctx = plan;
+        plan->currentFile = i;
+
+        walkDataBlocks(&walker);
+
+        if (plan->files[i].pendingRuns == 0 && openPlanFile(plan, i) != NULL)
+        {
+            closePlanFile(plan, i, 1);
+        }
+    }
+
+    return 0;
+}
+
+// Run handler: add the run to the plan.
+static int recordPlanRun(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes)
+{
+    struct Plan *plan = (struct Plan *)walker->ctx;
+
+    if (plan->numRuns == plan->maxRuns)
+    {
+        plan->maxRuns = plan->maxRuns == 0 ? 256 : 2 * plan->maxRuns;
+        plan->runs = (struct PlanRun *)do_realloc(plan->runs, plan->maxRuns * sizeof(struct PlanRun));
+    }
+
+    struct PlanRun *planRun = &plan->runs[plan->numRuns++];
+    planRun->physBlock = run->physBlock;
+    planRun->numBlocks = run->numBlocks;
+    planRun->fileOffset = run->fileOffset;
+    planRun->fileBytes = fileBytes;
+    planRun->file = plan->currentFile;
+    plan->files[plan->currentFile].pendingRuns++;
+
+    return 0;
+}
+
+// Read the runs in ascending physical order and write them into their files.
+// A run that starts at most PLAN_MAX_GAP_BLOCKS after the previous one is
+// read along with it, as long as the read fits in the buffer.
+static int writePlanRuns(struct Plan *plan)
+{
+    if (plan->numRuns > 1)
+    {
+        qsort(plan->runs, plan->numRuns, sizeof(struct PlanRun), comparePlanRuns);
+    }
+
+    uint64_t maxSpanBlocks = plan->maxRunBytes / currentFS->sb.blockSize;
+    unsigned char *buf = (unsigned char *)do_malloc(plan->maxRunBytes);
+
+    size_t i = 0;
+    while (i < plan->numRuns)
+    {
+        uint64_t spanStart = plan->runs[i].physBlock;
+        uint64_t spanEnd = spanStart + plan->runs[i].numBlocks;
+
+        size_t j = i + 1;
+        while (j < plan->numRuns && plan->runs[j].physBlock <= spanEnd + PLAN_MAX_GAP_BLOCKS)
+        {
+            uint64_t runEnd = plan->runs[j].physBlock + plan->runs[j].numBlocks;
+            uint64_t newEnd = runEnd > spanEnd ? runEnd : spanEnd;
+            if (newEnd - spanStart > maxSpanBlocks)
+            {
+                break;
+            }
+
+            spanEnd = newEnd;
+            j++;
+        }
+
+        const unsigned char *data = readImage(plan->ext2FS, spanStart * currentFS->sb.blockSize,
+                                              (spanEnd - spanStart) * currentFS->sb.blockSize, READ_FILE_DATA, buf);
+        for (; i < j; i++)
+        {
+            struct PlanRun *run = &plan->runs[i];
+            writePlanRun(plan, run, &data[(run->physBlock - spanStart) * currentFS->sb.blockSize]);
+        }
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+// Write a run into its file, and close the file after its last run.
+static int writePlanRun(struct Plan *plan, struct PlanRun *run, const unsigned char *data)
+{
+    struct PlanFile *file = &plan->files[run->file];
+    file->pendingRuns--;
+
+    if (file->failed || openPlanFile(plan, run->file) == NULL)
+    {
+        return -1;
+    }
+
+    int fd = fileno(file->fileObj);
+    uint64_t written = 0;
+    while (written < run->fileBytes)
+    {
+        ADD_STAT(writes, 1);
+        ssize_t n = pwrite(fd, &data[written], run->fileBytes - written, run->fileOffset + written);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            reportError("pwrite failed: %s", n < 0 ? strerror(errno) : "no progress");
+            file->failed = 1;
+            plan->failed = 1;
+            break;
+        }
+
+        written += n;
+    }
+    ADD_STAT(bytesWritten, written);
+
+    if (file->pendingRuns == 0 || file->failed)
+    {
+        return closePlanFile(plan, run->file, 1);
+    }
+
+    return 0;
+}
+
+// Get the file open for writing, closing the least recently used
+// open file if PLAN_OPEN_FILES are already open.
+static FILE *openPlanFile(struct Plan *plan, size_t fileIndex)
+{
+    struct PlanFile *file = &plan->files[fileIndex];
+    file->lastUse = ++plan->tick;
+    if (file->fileObj != NULL)
+    {
+        return file->fileObj;
+    }
+
+    if (plan->numOpenFiles == PLAN_OPEN_FILES)
+    {
+        size_t lru = 0;
+        for (size_t i = 1; i < plan->numOpenFiles; i++)
+        {
+            if (plan->files[plan->openFiles[i]].lastUse < plan->files[plan->openFiles[lru]].lastUse)
+            {
+                lru = i;
+            }
+        }
+        closePlanFile(plan, plan->openFiles[lru], 0);
+    }
+
+    // Reopening a file must not truncate what was written already.
+    file->fileObj = do_fopen(file->path, file->isCreated ? "r+b" : "wb");
+    if (file->fileObj == NULL)
+    {
+        file->failed = 1;
+        plan->failed = 1;
+        return NULL;
+    }
+    file->isCreated = 1;
+    plan->openFiles[plan->numOpenFiles++] = fileIndex;
+
+    return file->fileObj;
+}
+
+// Close the file. Once it is done, it is first set to its full size
+// (the file may end with a hole).
+static int closePlanFile(struct Plan *plan, size_t fileIndex, int isDone)
+{
+    struct PlanFile *file = &plan->files[fileIndex];
+    if (file->fileObj == NULL)
+    {
+        return file->failed ? -1 : 0;
+    }
+
+    if (isDone && !file->failed && do_ftruncate(file->fileObj, getFileSize(&file->inode)) != 0)
+    {
+        file->failed = 1;
+    }
+    if (do_fclose(file->fileObj) != 0)
+    {
+        file->failed = 1;
+    }
+    file->fileObj = NULL;
+
+    for (size_t i = 0; i < plan->numOpenFiles; i++)
+    {
+        if (plan->openFiles[i] == fileIndex)
+        {
+            plan->openFiles[i] = plan->openFiles[--plan->numOpenFiles];
+            break;
+        }
+    }
+
+    plan->failed |= file->failed;
+
+    return file->failed ? -1 : 0;
+}
+
+// Order the directories by their first block.
+static int comparePlanDirs(const void *a, const void *b)
+{
+    uint64_t blockA = ((const struct PlanDir *)a)->startBlock;
+    uint64_t blockB = ((const struct PlanDir *)b)->startBlock;
+
+    return (blockA > blockB) - (blockA < blockB);
+}
+
+// Order the files by their first block.
+static int comparePlanFiles(const void *a, const void *b)
+{
+    uint64_t blockA = ((const struct PlanFile *)a)->startBlock;
+    uint64_t blockB = ((const struct PlanFile *)b)->startBlock;
+
+    return (blockA > blockB) - (blockA < blockB);
+}
+
+// Order the runs by physical block.
+static int comparePlanRuns(const void *a, const void *b)
+{
+    uint64_t blockA = ((const struct PlanRun *)a)->physBlock;
+    uint64_t blockB = ((const struct PlanRun *)b)->physBlock;
+
+    return (blockA > blockB) - (blockA < blockB);
+}
+
+// Write the paths of the subtree into out, one per line.
+static int enumeratePaths(struct Inode *inode, FILE *ext2FS, char *currentPath, struct Arena *arena, FILE *out)
+{
+    struct OutputBuffer output;
+    initOutput(&output, out);
+
+    // Print the current path.
+    appendOutput(&output, currentPath, strlen(currentPath));
+    appendOutput(&output, "\n", 1);
+
+    // Print the paths of the subtree of a directory.
+    if (isInodeDir(inode))
+    {
+        struct TreeWalk walk;
+        initTreeWalk(&walk, inode, currentPath, ext2FS, arena);
+        while (nextTreeEntry(&walk))
+        {
+            // The null terminator is replaced by the newline.
+            walk.path[walk.pathLen] = '\n';
+            appendOutput(&output, walk.path, walk.pathLen + 1);
+            walk.path[walk.pathLen] = '\0';
+        }
+        freeTreeWalk(&walk);
+    }
+
+    flushOutput(&output);
+
+    return 0;
+}
+
+// Enumerate the paths with a pool of numThreads workers. Every directory
+// is a task that buffers the paths of its entries, while the main thread
+// stitches the buffers together in directory entry order as they complete.
+// The output is byte for byte the same as the one of enumeratePaths.
+static int enumeratePathsParallel(struct Inode *inode, char *currentPath, FILE *out)
+{
+    // Print the current path.
+    fprintf(out, "%s\n", currentPath);
+
+    if (!isInodeDir(inode))
+    {
+        return 0;
+    }
+
+    struct TaskPool pool;
+    initPool(&pool, currentFS->opts.numThreads, runEnumTask);
+
+    struct EnumDir *rootDir = createEnumDir(inode, 0, currentPath, NULL);
+    pushTask(&pool, 0, rootDir);
+
+    startPool(&pool);
+    emitEnumDir(&pool, rootDir, out);
+    finishPool(&pool);
+
+    return 0;
+}
+
+// Pool task: buffer the paths of the entries of a directory
+// and queue its subdirectories as new tasks.
+static int runEnumTask(struct PoolWorker *worker, void *arg)
+{
+    struct EnumDir *dir = (struct EnumDir *)arg;
+
+    // Read and parse the directory entries (released along with the
+    // arena of the worker once the task is done).
+    struct DirEntries dirEntries = readDirEntries(&dir->inode, worker->ext2FS, &worker->arena);
+
+    // Parse the inodes of all the directory entries at once.
+    struct Inode *entryInodes = parseDirEntryInodes(&dirEntries, worker->ext2FS, &worker->arena);
+
+    // Traverse the directory entries.
+    for (size_t entryIndex = 0; entryIndex < dirEntries.count; entryIndex++)
+    {
+        struct DirEntry *currDirEntry = &dirEntries.entries[entryIndex];
+        struct Inode *currInode = &entryInodes[entryIndex];
+
+        // Disregard the current directory (.), the parent directory (..)
+        // and the entries with an inode number of 0.
+        if (!isDotEntry(&dirEntries, currDirEntry) && currDirEntry->inodeNum != 0)
+        {
+            int isDir = isInodeDir(currInode);
+
+            // A directory that points back to an ancestor (a corrupted
+            // image) would queue tasks forever.
+            if (isDir && isAncestorDir(dir->inodeNums, dir->depth, currDirEntry->inodeNum))
+            {
+                reportCorruption("Directory cycle at inode %u", currDirEntry->inodeNum);
+                continue;
+            }
+
+            // Append the file object name (and a slash (/) if it is
+            // a directory) into the current path.
+            size_t pathLen = strlen(dir->path) + currDirEntry->nameLen + isDir;
+            char *newPath = (char *)do_malloc(pathLen + 2);
+            sprintf(newPath, "%s%s%s\n", dir->path, &dirEntries.names[currDirEntry->nameOffset], isDir ? "/" : "");
+
+            appendEnumOutput(dir, newPath, pathLen + 1);
+
+            // The listing of the subdirectory goes right after its own path.
+            if (isDir)
+            {
+                newPath[pathLen] = '\0';
+                struct EnumDir *subdir = createEnumDir(currInode, currDirEntry->inodeNum, newPath, dir);
+
+                if (dir->numSubdirs == dir->subdirsCap)
+                {
+                    dir->subdirsCap = dir->subdirsCap == 0 ? 8 : 2 * dir->subdirsCap;
+                    dir->subdirs = (struct EnumDir **)realloc(dir->subdirs, dir->subdirsCap * sizeof(struct EnumDir *));
+                    dir->splits = (size_t *)realloc(dir->splits, dir->subdirsCap * sizeof(size_t));
+                    if (dir->subdirs == NULL || dir->splits == NULL)
+                    {
+                        perror("realloc failed");
+                        exit(1);
+                    }
+                }
+
+                dir->subdirs[dir->numSubdirs] = subdir;
+                dir->splits[dir->numSubdirs] = dir->outLen;
+                dir->numSubdirs++;
+
+                pushTask(worker->pool, worker->id, subdir);
+            }
+
+            // Free the allocated memory.
+            free(newPath);
+        }
+    }
+
+    // Hand the directory over to the main thread.
+    pthread_mutex_lock(&worker->pool->lock);
+    dir->done = 1;
+    pthread_cond_broadcast(&worker->pool->taskDone);
+    pthread_mutex_unlock(&worker->pool->lock);
+
+    return 0;
+}
+
+static struct EnumDir *createEnumDir(struct Inode *inode, uint32_t inodeNum, char *path, struct EnumDir *parent)
+{
+    struct EnumDir *dir = (struct EnumDir *)do_calloc(1, sizeof(struct EnumDir));
+    dir->inode = *inode;
+
+    dir->path = (char *)do_malloc(strlen(path) + 1);
+    strcpy(dir->path, path);
+
+    // The ancestors of a directory are those of its parent plus the parent.
+    dir->depth = parent == NULL ? 0 : parent->depth + 1;
+    dir->inodeNums = (uint32_t *)do_malloc((dir->depth + 1) * sizeof(uint32_t));
+    if (parent != NULL)
+    {
+        memcpy(dir->inodeNums, parent->inodeNums, (parent->depth + 1) * sizeof(uint32_t));
+    }
+    dir->inodeNums[dir->depth] = inodeNum;
+
+    return dir;
+}
+
+// Whether a directory is one of the depth + 1 directories of inodeNums.
+static int isAncestorDir(const uint32_t *inodeNums, int depth, uint32_t inodeNum)
+{
+    for (int i = 0; i <= depth; i++)
+    {
+        if (inodeNums[i] == inodeNum)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void appendEnumOutput(struct EnumDir *dir, const char *text, size_t len)
+{
+    if (dir->outLen + len > dir->outCap)
+    {
+        while (dir->outLen + len > dir->outCap)
+        {
+            dir->outCap = dir->outCap == 0 ? 256 : 2 * dir->outCap;
+        }
+
+        dir->out = (char *)realloc(dir->out, dir->outCap);
+        if (dir->out == NULL)
+        {
+            perror("realloc failed");
+            exit(1);
+        }
+    }
+
+    memcpy(&dir->out[dir->outLen], text, len);
+    dir->outLen += len;
+}
+
+// Write out the listing of a directory (waiting for it to be complete),
+// with the listing of each subdirectory spliced in at its place.
+// The directory is freed once it is written.
+static void emitEnumDir(struct TaskPool *pool, struct EnumDir *dir, FILE *out)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (!dir->done)
+    {
+        pthread_cond_wait(&pool->taskDone, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // A directory without entries has no output at all (out is NULL).
+    size_t written = 0;
+    for (size_t i = 0; i < dir->numSubdirs; i++)
+    {
+        if (dir->splits[i] > written)
+        {
+            fwrite(&dir->out[written], 1, dir->splits[i] - written, out);
+            written = dir->splits[i];
+        }
+
+        emitEnumDir(pool, dir->subdirs[i], out);
+    }
+    if (dir->outLen > written)
+    {
+        fwrite(&dir->out[written], 1, dir->outLen - written, out);
+    }
+
+    // Free the allocated memory.
+    free(dir->path);
+    free(dir->inodeNums);
+    free(dir->out);
+    free(dir->subdirs);
+    free(dir->splits);
+    free(dir);
+}
+
+// List every path of the image from a scan of the inode tables instead of a
+// walk of the tree: the inode tables are read front to back in large reads,
+// and then the blocks of every directory once, so most of the reads are
+// sequential. The paths are then put together from the directories in
+// memory, in the same order as enumeratePaths.
+// Note: The calling thread must have an error sink.
+static int enumerateScan(FILE *out)
+{
+    struct InodeScan scan;
+    scanInodeTables(&scan);
+
+    struct OutputBuffer output;
+    initOutput(&output, out);
+    appendOutput(&output, "/\n", 2);
+
+    struct TreeWalk walk;
+    initScanWalk(&walk, &scan, ROOT_INODE_NUM, "/");
+    while (nextTreeEntry(&walk))
+    {
+        // The null terminator is replaced by the newline.
+        walk.path[walk.pathLen] = '\n';
+        appendOutput(&output, walk.path, walk.pathLen + 1);
+        walk.path[walk.pathLen] = '\0';
+    }
+    freeTreeWalk(&walk);
+
+    flushOutput(&output);
+    freeInodeScan(&scan);
+
+    return 0;
+}
+
+// Scan the inode tables of every block group, on the worker pool when there
+// is more than one thread (the groups are independent).
+static int scanInodeTables(struct InodeScan *scan)
+{
+    scan->numGroups = currentFS->sb.numOfBGs;
+    scan->groups = (struct ScanGroup *)do_calloc(scan->numGroups, sizeof(struct ScanGroup));
+    scan->isDir = (unsigned char *)do_calloc((size_t)currentFS->sb.totalInodes / 8 + 1, 1);
+    for (uint32_t i = 0; i < scan->numGroups; i++)
+    {
+        scan->groups[i].groupNum = i;
+        scan->groups[i].scan = scan;
+    }
+
+    if (currentFS->opts.numThreads > 1)
+    {
+        struct TaskPool pool;
+        initPool(&pool, currentFS->opts.numThreads, runScanTask);
+        for (uint32_t i = 0; i < scan->numGroups; i++)
+        {
+            pushTask(&pool, 0, &scan->groups[i]);
+        }
+        startPool(&pool);
+        finishPool(&pool);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < scan->numGroups; i++)
+        {
+            scanGroup(&scan->groups[i], currentFS->image);
+        }
+    }
+
+    return 0;
+}
+
+// Pool task: scan the inode table of a block group.
+static int runScanTask(struct PoolWorker *worker, void *arg)
+{
+    return scanGroup((struct ScanGroup *)arg, worker->ext2FS);
+}
+
+// Find the directories of a block group in its inode table and read their
+// entries. Only the inode table up to the last inode in use (as the inode
+// bitmap tells) is read.
+static int scanGroup(struct ScanGroup *group, FILE *ext2FS)
+{
+    uint32_t blockSize = currentFS->sb.blockSize;
+    uint32_t inodeSize = currentFS->sb.inodeSize;
+    struct BGD *bgd = &currentFS->sb.bgdt[group->groupNum];
+
+    // The last group may have fewer inodes than the others.
+    uint32_t firstInodeNum = group->groupNum * currentFS->sb.inodesPerBG + 1;
+    uint32_t numInodes = currentFS->sb.inodesPerBG;
+    if (firstInodeNum - 1 + numInodes > currentFS->sb.totalInodes)
+    {
+        numInodes = currentFS->sb.totalInodes - (firstInodeNum - 1);
+    }
+
+    // Nothing of an uninitialized group is in use (nor even written).
+    if (bgd->flags & BGD_INODE_UNINIT)
+    {
+        return 0;
+    }
+
+    // READ THE INODE BITMAP -------------------------------------------------
+    unsigned char *bitmapBuf = (unsigned char *)do_malloc(blockSize);
+    const unsigned char *bitmap = readImage(ext2FS, (uint64_t)bgd->inodeBitmap * blockSize, blockSize, READ_INODE, bitmapBuf);
+    if (numInodes > blockSize * 8)
+    {
+        reportCorruption("More inodes per group than bits in the inode bitmap");
+        numInodes = blockSize * 8;
+    }
+
+    uint32_t usedInodes = numInodes;
+    while (usedInodes > 0 && !(bitmap[(usedInodes - 1) / 8] & (1 << ((usedInodes - 1) % 8))))
+    {
+        usedInodes--;
+    }
+    // ------------------------------------------------------------------------
+
+    // SCAN THE INODE TABLE ---------------------------------------------------
+    // The table is read in chunks of whole inodes.
+    uint32_t chunkInodes = SCAN_CHUNK_SIZE / inodeSize;
+    if (chunkInodes > usedInodes)
+    {
+        chunkInodes = usedInodes;
+    }
+    unsigned char *chunkBuf = (unsigned char *)do_malloc((size_t)chunkInodes * inodeSize + 1);
+    uint64_t tableAddr = (uint64_t)bgd->inodeTable * blockSize;
+
+    // The inodes of the directories are only needed until their entries are read.
+    struct Inode *dirInodes = NULL;
+
+    for (uint32_t start = 0; start < usedInodes; start += chunkInodes)
+    {
+        uint32_t count = usedInodes - start < chunkInodes ? usedInodes - start : chunkInodes;
+        const unsigned char *table = readImage(ext2FS, tableAddr + (uint64_t)start * inodeSize, (size_t)count * inodeSize, READ_INODE, chunkBuf);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t index = start + i;
+            const unsigned char *record = &table[(size_t)i * inodeSize];
+            if (!(bitmap[index / 8] & (1 << (index % 8))) || le16(&record[0]) >> 12 != TYPE_DIR)
+            {
+                continue;
+            }
+
+            // Directories are found in inode number order.
+            if (group->numDirs == group->maxDirs)
+            {
+                group->maxDirs = group->maxDirs == 0 ? 64 : group->maxDirs * 2;
+                group->dirs = (struct ScanDir *)do_realloc(group->dirs, group->maxDirs * sizeof(struct ScanDir));
+                dirInodes = (struct Inode *)do_realloc(dirInodes, group->maxDirs * sizeof(struct Inode));
+            }
+            struct ScanDir *dir = &group->dirs[group->numDirs];
+            dir->inodeNum = firstInodeNum + index;
+            decodeInode(record, &dirInodes[group->numDirs]);
+            group->numDirs++;
+
+            uint32_t bit = dir->inodeNum;
+            __atomic_fetch_or(&group->scan->isDir[bit / 8], (unsigned char)(1 << (bit % 8)), __ATOMIC_RELAXED);
+        }
+    }
+    // ------------------------------------------------------------------------
+
+    // READ THE DIRECTORIES ---------------------------------------------------
+    // Only once the table is read, so that the reads of the table stay
+    // sequential. readDirEntries sizes its buffers for the worst case, so
+    // the entries are copied into buffers of their actual size to be kept.
+    struct Arena scratch = {0};
+    for (size_t i = 0; i < group->numDirs; i++)
+    {
+        struct ArenaMark mark = markArena(&scratch);
+        struct DirEntries dirEntries = readDirEntries(&dirInodes[i], ext2FS, &scratch);
+
+        struct DirEntries *kept = &group->dirs[i].dirEntries;
+        memset(kept, 0, sizeof(struct DirEntries));
+        kept->count = dirEntries.count;
+        kept->maxCount = dirEntries.count;
+        kept->namesLen = dirEntries.namesLen;
+        kept->entries = (struct DirEntry *)arenaAlloc(&group->arena, dirEntries.count * sizeof(struct DirEntry));
+        kept->names = (char *)arenaAlloc(&group->arena, dirEntries.namesLen);
+        memcpy(kept->entries, dirEntries.entries, dirEntries.count * sizeof(struct DirEntry));
+        memcpy(kept->names, dirEntries.names, dirEntries.namesLen);
+
+        releaseArena(&scratch, mark);
+    }
+    freeArena(&scratch);
+    // ------------------------------------------------------------------------
+
+    // Free the allocated memory.
+    free(dirInodes);
+    free(chunkBuf);
+    free(bitmapBuf);
+
+    return 0;
+}
+
+// Find a directory of the scan (NULL if it was not found in use).
+static struct ScanDir *lookupScanDir(struct InodeScan *scan, uint32_t inodeNum)
+{
+    uint32_t groupNum = (inodeNum - 1) / currentFS->sb.inodesPerBG;
+    if (inodeNum == 0 || groupNum >= scan->numGroups)
+    {
+        return NULL;
+    }
+
+    // The directories of a group are in inode number order.
+    struct ScanGroup *group = &scan->groups[groupNum];
+    size_t low = 0;
+    size_t high = group->numDirs;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (group->dirs[mid].inodeNum < inodeNum)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    if (low < group->numDirs && group->dirs[low].inodeNum == inodeNum)
+    {
+        return &group->dirs[low];
+    }
+
+    return NULL;
+}
+
+static int isScanDir(struct InodeScan *scan, uint32_t inodeNum)
+{
+    if (inodeNum > currentFS->sb.totalInodes)
+    {
+        return 0;
+    }
+
+    return (scan->isDir[inodeNum / 8] >> (inodeNum % 8)) & 1;
+}
+
+static void freeInodeScan(struct InodeScan *scan)
+{
+    for (uint32_t i = 0; i < scan->numGroups; i++)
+    {
+        freeArena(&scan->groups[i].arena);
+        free(scan->groups[i].dirs);
+    }
+    free(scan->groups);
+    free(scan->isDir);
+}
+
+// Build the path index sidecar of the image in a single pass over the
+// directory tree. The records are streamed out in enumeration order as the
+// directories are read, and the hash table is appended once they are all
+// known. The index is written to a temporary file that is renamed over the
+// old index, so a reader never sees a partial one. Each build has a
+// temporary file of its own (next to the index, so that the rename stays on
+// one file system), so builds that run at the same time do not clobber
+// each other: the last one to finish wins.
+// Note: The calling thread must have an error sink.
+static int buildPathIndex(struct Inode *rootInode, FILE *ext2FS)
+{
+    char *tmpPath = (char *)do_malloc(strlen(currentFS->indexPath) + sizeof(".XXXXXX"));
+    strcpy(tmpPath, currentFS->indexPath);
+    strcat(tmpPath, ".XXXXXX");
+
+    int fd = mkstemp(tmpPath);
+    if (fd == -1)
+    {
+        reportError("mkstemp failed: %s", strerror(errno));
+        free(tmpPath);
+        return -1;
+    }
+
+    // The file is created for its owner only, but the index is no secret
+    // (an index that stays private still works).
+    fchmod(fd, 0644);
+
+    struct IndexBuilder builder = {0};
+    builder.out = fdopen(fd, "wb");
+    if (builder.out == NULL)
+    {
+        reportError("fdopen failed: %s", strerror(errno));
+        close(fd);
+        remove(tmpPath);
+        free(tmpPath);
+        return -1;
+    }
+
+    // The header is written last. Until then its place is zero filled.
+    struct IndexHeader header = {0};
+    do_fwrite(&header, sizeof(header), 1, builder.out);
+    builder.offset = sizeof(header);
+
+    // WRITE THE RECORDS ------------------------------------------------------
+    // Same paths in the same order as enumeratePaths.
+    writeIndexRecord(&builder, "/", 1, rootInode, ROOT_INODE_NUM);
+
+    struct Arena arena = {0};
+    struct TreeWalk walk;
+    initTreeWalk(&walk, rootInode, "/", ext2FS, &arena);
+    while (nextTreeEntry(&walk))
+    {
+        writeIndexRecord(&builder, walk.path, walk.pathLen, walk.inode, walk.inodeNum);
+    }
+    freeTreeWalk(&walk);
+    freeArena(&arena);
+    // ------------------------------------------------------------------------
+
+    // WRITE THE HASH TABLE ---------------------------------------------------
+    // The table is at most half full, so the probes stay short.
+    size_t numBuckets = MIN_INDEX_BUCKETS;
+    while (numBuckets < builder.numRecords * 2)
+    {
+        numBuckets *= 2;
+    }
+
+    uint64_t *buckets = (uint64_t *)do_calloc(numBuckets, sizeof(uint64_t));
+    for (size_t i = 0; i < builder.numRecords; i++)
+    {
+        size_t bucket = builder.hashes[i] & (numBuckets - 1);
+        while (buckets[bucket] != 0)
+        {
+            bucket = (bucket + 1) & (numBuckets - 1);
+        }
+        buckets[bucket] = builder.offsets[i];
+    }
+    do_fwrite(buckets, sizeof(uint64_t), numBuckets, builder.out);
+    // ------------------------------------------------------------------------
+
+    // Fill in the header.
+    fillIndexHeader(&header);
+    header.numRecords = builder.numRecords;
+    header.hashOffset = builder.offset;
+    header.numBuckets = numBuckets;
+    do_fseek(builder.out, 0, SEEK_SET);
+    do_fwrite(&header, sizeof(header), 1, builder.out);
+
+    // Only a complete index replaces the old one.
+    int status = 0;
+    if (do_fclose(builder.out) != 0 || errorSink->failed)
+    {
+        remove(tmpPath);
+        status = -1;
+    }
+    else if (rename(tmpPath, currentFS->indexPath) != 0)
+    {
+        reportError("rename failed: %s", strerror(errno));
+        remove(tmpPath);
+        status = -1;
+    }
+
+    // Free the allocated memory.
+    free(buckets);
+    free(builder.offsets);
+    free(builder.hashes);
+    free(tmpPath);
+
+    return status;
+}
+
+// Write the record of a path and remember where it went for the hash table.
+static void writeIndexRecord(struct IndexBuilder *builder, const char *path, size_t pathLen, struct Inode *inode, uint32_t inodeNum)
+{
+    // The index is not written at all then (see buildPathIndex).
+    if (pathLen > UINT16_MAX)
+    {
+        reportError("Path too long for the index: %s", path);
+        return;
+    }
+
+    if (builder->numRecords == builder->maxRecords)
+    {
+        builder->maxRecords = builder->maxRecords == 0 ? 1024 : builder->maxRecords * 2;
+        builder->offsets = (uint64_t *)do_realloc(builder->offsets, builder->maxRecords * sizeof(uint64_t));
+        builder->hashes = (size_t *)do_realloc(builder->hashes, builder->maxRecords * sizeof(size_t));
+    }
+    builder->offsets[builder->numRecords] = builder->offset;
+    builder->hashes[builder->numRecords] = hashDentry(0, path);
+    builder->numRecords++;
+
+    struct IndexRecord record = {0};
+    record.size = getFileSize(inode);
+    record.inodeNum = inodeNum;
+    record.type = inode->type;
+    record.pathLen = (uint16_t)pathLen;
+
+    // The path is written with its null terminator and padded to 8 bytes.
+    static const char padding[8] = {0};
+    size_t recordSize = indexRecordSize(pathLen);
+    size_t pathBytes = pathLen + 1;
+    do_fwrite(&record, sizeof(record), 1, builder->out);
+    do_fwrite((void *)path, 1, pathBytes, builder->out);
+    do_fwrite((void *)padding, 1, recordSize - sizeof(record) - pathBytes, builder->out);
+
+    builder->offset += recordSize;
+}
+
+// Fill in the superblock fields of an index header. Any write to the image
+// (or mount of it) changes at least one of them.
+static void fillIndexHeader(struct IndexHeader *header)
+{
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->version = INDEX_VERSION;
+    header->headerSize = sizeof(struct IndexHeader);
+    header->totalInodes = currentFS->sb.totalInodes;
+    header->totalBlocks = currentFS->sb.totalBlocks;
+    header->freeInodes = currentFS->sb.freeInodes;
+    header->freeBlocks = currentFS->sb.freeBlocks;
+    header->mountTime = currentFS->sb.mountTime;
+    header->writeTime = currentFS->sb.writeTime;
+    memcpy(header->uuid, currentFS->sb.uuid, sizeof(header->uuid));
+}
+
+// Map the path index (the indexPath of the handle) if it exists and was built
+// for the image as it is now. A stale or malformed index is ignored (see
+// ext2IndexState). Returns 0 if the index is in use.
+static int loadPathIndex(void)
+{
+    FILE *indexFile = fopen(currentFS->indexPath, "rb");
+    if (indexFile == NULL)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fileno(indexFile), &st) == 0 && (uint64_t)st.st_size >= sizeof(struct IndexHeader))
+    {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(indexFile), 0);
+    }
+    fclose(indexFile);
+
+    if (base == MAP_FAILED)
+    {
+        currentFS->pathIndex.state = EXT2_INDEX_STALE;
+        return -1;
+    }
+
+    // The header must match the one the image would get now, and the
+    // records and hash table must fill the file exactly.
+    const struct IndexHeader *header = (const struct IndexHeader *)base;
+    struct IndexHeader expected = {0};
+    fillIndexHeader(&expected);
+
+    uint64_t size = st.st_size;
+    int isValid = memcmp(header, &expected, offsetof(struct IndexHeader, numRecords)) == 0 &&
+                  header->hashOffset >= sizeof(struct IndexHeader) &&
+                  header->hashOffset % 8 == 0 &&
+                  header->numBuckets != 0 &&
+                  (header->numBuckets & (header->numBuckets - 1)) == 0 &&
+                  header->numBuckets <= (size - header->hashOffset) / sizeof(uint64_t) &&
+                  header->hashOffset + header->numBuckets * sizeof(uint64_t) == size;
+    if (!isValid)
+    {
+        currentFS->pathIndex.state = EXT2_INDEX_STALE;
+        munmap(base, size);
+        return -1;
+    }
+
+    currentFS->pathIndex.base = (unsigned char *)base;
+    currentFS->pathIndex.size = size;
+    currentFS->pathIndex.header = (struct IndexHeader *)base;
+    currentFS->pathIndex.state = EXT2_INDEX_IN_USE;
+
+    return 0;
+}
+
+static void unloadPathIndex(void)
+{
+    if (currentFS->pathIndex.base != NULL)
+    {
+        munmap(currentFS->pathIndex.base, currentFS->pathIndex.size);
+        memset(&currentFS->pathIndex, 0, sizeof(currentFS->pathIndex));
+    }
+}
+
+// Find the record of a path in the index (NULL if the path is not in it).
+static const struct IndexRecord *lookupPathIndex(const char *path)
+{
+    const uint64_t *buckets = (const uint64_t *)&currentFS->pathIndex.base[currentFS->pathIndex.header->hashOffset];
+    uint64_t mask = currentFS->pathIndex.header->numBuckets - 1;
+    size_t pathLen = strlen(path);
+
+    // The table is never full, so the probes end at an empty bucket. A
+    // malformed index may have no empty bucket, hence the bound on the probes
+    // (a path that is not found after all of them is not in the index).
+    uint64_t bucket = hashDentry(0, path) & mask;
+    for (uint64_t probe = 0; probe <= mask && buckets[bucket] != 0; probe++, bucket = (bucket + 1) & mask)
+    {
+        uint64_t offset = buckets[bucket];
+        if (offset < sizeof(struct IndexHeader) || offset + sizeof(struct IndexRecord) > currentFS->pathIndex.header->hashOffset)
+        {
+            return NULL;
+        }
+
+        const struct IndexRecord *record = (const struct IndexRecord *)&currentFS->pathIndex.base[offset];
+        if (record->pathLen == pathLen && offset + indexRecordSize(pathLen) <= currentFS->pathIndex.header->hashOffset &&
+            memcmp(record->path, path, pathLen) == 0)
+        {
+            return record;
+        }
+    }
+
+    return NULL;
+}
+
+// Write the paths of the index into out. They are in the order of enumeratePaths.
+static int enumerateIndex(FILE *out)
+{
+    struct OutputBuffer output;
+    initOutput(&output, out);
+
+    uint64_t offset = sizeof(struct IndexHeader);
+    while (offset + sizeof(struct IndexRecord) <= currentFS->pathIndex.header->hashOffset)
+    {
+        const struct IndexRecord *record = (const struct IndexRecord *)&currentFS->pathIndex.base[offset];
+        offset += indexRecordSize(record->pathLen);
+        if (offset > currentFS->pathIndex.header->hashOffset)
+        {
+            break;
+        }
+
+        appendOutput(&output, record->path, record->pathLen);
+        appendOutput(&output, "\n", 1);
+    }
+
+    flushOutput(&output);
+
+    return 0;
+}
+
+// Size of an index record, including the path and its padding.
+static size_t indexRecordSize(size_t pathLen)
+{
+    return (sizeof(struct IndexRecord) + pathLen + 1 + 7) & ~(size_t)7;
+}
+
+// Write a file object (and the whole subtree of a directory) to out as a
+// single tar or cpio stream whose entries are named from name. Extracting
+// the stream gives the same tree as extractFileObj into the path name.
+// Note: The calling thread must have an error sink.
+static int archiveFileObj(struct Inode *fileObjInode, uint32_t inodeNum, const char *name, int format, FILE *out, FILE *ext2FS)
+{
+    struct Archive archive = {0};
+    archive.out = out;
+    archive.format = format;
+
+    // The buffer holds whole blocks, so a run of blocks is always read
+    // straight into it (see readRunIntoArchive).
+    archive.size = currentFS->opts.bufferBudget;
+    archive.size -= archive.size % currentFS->sb.blockSize;
+    if (archive.size == 0)
+    {
+        archive.size = currentFS->sb.blockSize;
+    }
+    archive.buf = (unsigned char *)do_malloc(archive.size);
+
+    // The entries are named like the paths of the image below name, with a
+    // trailing slash for the directories.
+    size_t nameLen = strlen(name);
+    while (nameLen > 1 && name[nameLen - 1] == '/')
+    {
+        nameLen--;
+    }
+    char *rootPath = (char *)do_malloc(nameLen + 2);
+    memcpy(rootPath, name, nameLen);
+    if (isInodeDir(fileObjInode) && rootPath[nameLen - 1] != '/')
+    {
+        rootPath[nameLen++] = '/';
+    }
+    rootPath[nameLen] = '\0';
+
+    // From here on the file data is read front to back.
+    setImagePhase(MADV_SEQUENTIAL);
+
+    // Same entries in the same order as enumeratePaths.
+    archiveEntry(&archive, rootPath, nameLen, fileObjInode, inodeNum, ext2FS);
+    if (isInodeDir(fileObjInode))
+    {
+        struct Arena arena = {0};
+        struct TreeWalk walk;
+        initTreeWalk(&walk, fileObjInode, rootPath, ext2FS, &arena);
+        while (nextTreeEntry(&walk))
+        {
+            archiveEntry(&archive, walk.path, walk.pathLen, walk.inode, walk.inodeNum, ext2FS);
+        }
+        freeTreeWalk(&walk);
+        freeArena(&arena);
+    }
+
+    // End of the archive: two zero blocks for tar, a trailer entry for cpio.
+    if (format == EXT2_ARCHIVE_TAR)
+    {
+        appendArchiveZeros(&archive, 2 * TAR_BLOCK_SIZE);
+    }
+    else
+    {
+        struct Inode trailerInode = {0};
+        struct ArchiveEntry trailer = {0};
+        trailer.inode = &trailerInode;
+        trailer.name = CPIO_TRAILER;
+        trailer.nameLen = strlen(CPIO_TRAILER);
+        writeCpioHeader(&archive, &trailer);
+    }
+    flushArchive(&archive);
+
+    if (!archive.failed && fflush(out) != 0)
+    {
+        reportError("write failed: %s", strerror(errno));
+        archive.failed = 1;
+    }
+
+    // Free the allocated memory.
+    free(archive.buf);
+    free(rootPath);
+
+    return archive.failed ? -1 : 0;
+}
+
+// Write the entry of a file object (its header and its data). Sockets are
+// left out, as tar has no type for them. Hard links are archived as
+// separate files.
+static int archiveEntry(struct Archive *archive, const char *path, size_t pathLen, struct Inode *inode, uint32_t inodeNum, FILE *ext2FS)
+{
+    struct ArchiveEntry entry = {0};
+    entry.inode = inode;
+    entry.inodeNum = inodeNum;
+    entry.name = path;
+    entry.nameLen = pathLen;
+
+    char *linkTarget = NULL;
+    switch (inode->type >> 12)
+    {
+    case TYPE_REG:
+        entry.size = getFileSize(inode);
+        break;
+    case TYPE_LINK:
+        // The target is the data of a cpio entry and a header field of tar.
+        linkTarget = readLinkTarget(inode, ext2FS);
+        entry.linkTarget = linkTarget;
+        entry.size = archive->format == EXT2_ARCHIVE_CPIO ? strlen(linkTarget) : 0;
+        break;
+    case TYPE_CHR:
+    case TYPE_BLK:
+        decodeDevice(inode, &entry.devMajor, &entry.devMinor);
+        break;
+    case TYPE_DIR:
+    case TYPE_FIFO:
+        break;
+    default:
+        return 0;
+    }
+
+    if (archive->format == EXT2_ARCHIVE_CPIO && entry.size > CPIO_MAX_SIZE)
+    {
+        reportError("%s: too big for a cpio archive", path);
+        return -1;
+    }
+
+    // HEADER AND DATA --------------------------------------------------------
+    if (archive->format == EXT2_ARCHIVE_TAR)
+    {
+        writeTarHeader(archive, &entry);
+    }
+    else
+    {
+        writeCpioHeader(archive, &entry);
+    }
+
+    if (linkTarget != NULL)
+    {
+        appendArchive(archive, linkTarget, entry.size);
+        free(linkTarget);
+    }
+    else if (entry.size > 0)
+    {
+        appendFileData(archive, inode, ext2FS);
+    }
+    padArchive(archive);
+    // ------------------------------------------------------------------------
+
+    return 0;
+}
+
+// Write the ustar header of an entry. It is preceded by a pax extended
+// header for what does not fit in it: long paths and link targets, files of
+// 8 GiB and more, and user and group ids past 21 bits.
+static void writeTarHeader(struct Archive *archive, struct ArchiveEntry *entry)
+{
+    unsigned char header[TAR_BLOCK_SIZE] = {0};
+    char *records = NULL;
+    size_t recordsLen = 0;
+    char number[32];
+
+    // PATH -------------------------------------------------------------------
+    // A path longer than the name field is split at a slash between the
+    // prefix and the name fields, or else goes into a pax record.
+    const char *name = entry->name;
+    size_t nameLen = entry->nameLen;
+    if (nameLen > TAR_NAME_SIZE)
+    {
+        size_t split = nameLen - TAR_NAME_SIZE - 1;
+        while (split < nameLen - 1 && split <= TAR_PREFIX_SIZE && (split == 0 || name[split] != '/'))
+        {
+            split++;
+        }
+
+        if (split < nameLen - 1 && split <= TAR_PREFIX_SIZE)
+        {
+            memcpy(&header[345], name, split);
+            name += split + 1;
+            nameLen -= split + 1;
+        }
+        else
+        {
+            addPaxRecord(&records, &recordsLen, "path", entry->name, entry->nameLen);
+            nameLen = TAR_NAME_SIZE;
+        }
+    }
+    memcpy(&header[0], name, nameLen);
+    // ------------------------------------------------------------------------
+
+    // Link target, size and ids.
+    if (entry->linkTarget != NULL)
+    {
+        size_t targetLen = strlen(entry->linkTarget);
+        if (targetLen > TAR_NAME_SIZE)
+        {
+            addPaxRecord(&records, &recordsLen, "linkpath", entry->linkTarget, targetLen);
+            targetLen = TAR_NAME_SIZE;
+        }
+        memcpy(&header[157], entry->linkTarget, targetLen);
+    }
+    if (entry->size > TAR_MAX_SIZE)
+    {
+        snprintf(number, sizeof(number), "%llu", (unsigned long long)entry->size);
+        addPaxRecord(&records, &recordsLen, "size", number, strlen(number));
+    }
+    if (entry->inode->uid > TAR_MAX_ID)
+    {
+        snprintf(number, sizeof(number), "%u", entry->inode->uid);
+        addPaxRecord(&records, &recordsLen, "uid", number, strlen(number));
+    }
+    if (entry->inode->gid > TAR_MAX_ID)
+    {
+        snprintf(number, sizeof(number), "%u", entry->inode->gid);
+        addPaxRecord(&records, &recordsLen, "gid", number, strlen(number));
+    }
+
+    // The pax header is an entry of its own whose data are the records.
+    if (records != NULL)
+    {
+        unsigned char paxHeader[TAR_BLOCK_SIZE] = {0};
+        memcpy(&paxHeader[0], TAR_PAX_NAME, strlen(TAR_PAX_NAME));
+        putOctal(&paxHeader[100], 8, 0644);
+        putOctal(&paxHeader[108], 8, 0);
+        putOctal(&paxHeader[116], 8, 0);
+        putOctal(&paxHeader[124], 12, recordsLen);
+        putOctal(&paxHeader[136], 12, entry->inode->mtime);
+        paxHeader[156] = 'x';
+        sealTarHeader(paxHeader);
+
+        appendArchive(archive, paxHeader, TAR_BLOCK_SIZE);
+        appendArchive(archive, records, recordsLen);
+        padArchive(archive);
+        free(records);
+    }
+
+    // FIELDS -----------------------------------------------------------------
+    char typeFlag;
+    switch (entry->inode->type >> 12)
+    {
+    case TYPE_DIR:
+        typeFlag = '5';
+        break;
+    case TYPE_LINK:
+        typeFlag = '2';
+        break;
+    case TYPE_CHR:
+        typeFlag = '3';
+        break;
+    case TYPE_BLK:
+        typeFlag = '4';
+        break;
+    case TYPE_FIFO:
+        typeFlag = '6';
+        break;
+    default:
+        typeFlag = '0';
+        break;
+    }
+
+    putOctal(&header[100], 8, entry->inode->type & 07777);
+    putOctal(&header[108], 8, entry->inode->uid > TAR_MAX_ID ? 0 : entry->inode->uid);
+    putOctal(&header[116], 8, entry->inode->gid > TAR_MAX_ID ? 0 : entry->inode->gid);
+    putOctal(&header[124], 12, entry->size > TAR_MAX_SIZE ? 0 : entry->size);
+    putOctal(&header[136], 12, entry->inode->mtime);
+    header[156] = typeFlag;
+    if (typeFlag == '3' || typeFlag == '4')
+    {
+        putOctal(&header[329], 8, entry->devMajor);
+        putOctal(&header[337], 8, entry->devMinor);
+    }
+    sealTarHeader(header);
+    // ------------------------------------------------------------------------
+
+    appendArchive(archive, header, TAR_BLOCK_SIZE);
+}
+
+// Write the cpio header of an entry (the "newc" format, as written by
+// cpio -H newc), followed by its name.
+static void writeCpioHeader(struct Archive *archive, struct ArchiveEntry *entry)
+{
+    // cpio names directories without the trailing slash.
+    size_t nameLen = entry->nameLen;
+    if (isInodeDir(entry->inode) && nameLen > 1)
+    {
+        nameLen--;
+    }
+
+    char header[CPIO_HEADER_SIZE + 1];
+    snprintf(header, sizeof(header),
+             "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+             entry->inodeNum,
+             entry->inode->type,
+             entry->inode->uid,
+             entry->inode->gid,
+             isInodeDir(entry->inode) ? 2 : 1, // No hard links.
+             entry->inode->mtime,
+             (uint32_t)entry->size,
+             0, 0, // Device of the image.
+             entry->devMajor,
+             entry->devMinor,
+             (uint32_t)nameLen + 1,
+             0);
+
+    appendArchive(archive, header, CPIO_HEADER_SIZE);
+    appendArchive(archive, entry->name, nameLen);
+    appendArchiveZeros(archive, 1);
+    padArchive(archive);
+}
+
+// Fill in the magic of a ustar header and then its checksum, which is taken
+// with its own field filled with spaces.
+static void sealTarHeader(unsigned char *header)
+{
+    memcpy(&header[257], "ustar", 6);
+    memcpy(&header[263], "00", 2);
+
+    unsigned int checksum = 0;
+    memset(&header[148], ' ', 8);
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+    {
+        checksum += header[i];
+    }
+    snprintf((char *)&header[148], 8, "%06o", checksum);
+}
+
+// Append a "length key=value\n" pax record. The length counts the whole
+// record, its own digits included.
+static void addPaxRecord(char **records, size_t *len, const char *key, const char *value, size_t valueLen)
+{
+    size_t fieldsLen = strlen(key) + valueLen + 3; // Space, equal sign and newline.
+    size_t recordLen = fieldsLen + 1;
+    for (size_t limit = 10; recordLen >= limit; limit *= 10)
+    {
+        recordLen++;
+    }
+
+    *records = (char *)do_realloc(*records, *len + recordLen + 1);
+    char *record = &(*records)[*len];
+    int prefixLen = sprintf(record, "%zu %s=", recordLen, key);
+    memcpy(&record[prefixLen], value, valueLen);
+    record[prefixLen + valueLen] = '\n';
+
+    *len += recordLen;
+}
+
+// Write a number into a tar header field as zero padded octal digits
+// followed by a null terminator.
+static void putOctal(unsigned char *field, size_t size, uint64_t value)
+{
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%0*llo", (int)size - 1, (unsigned long long)value);
+    memcpy(field, digits, size);
+}
+
+// Read the target of a symbolic link. A target shorter than 60 bytes is
+// kept in place of the block pointers (a fast symbolic link), a longer one
+// in a data block.
+static char *readLinkTarget(struct Inode *inode, FILE *ext2FS)
+{
+    uint64_t size = getFileSize(inode);
+    if (size > currentFS->sb.blockSize)
+    {
+        reportCorruption("Symbolic link target larger than a block");
+        size = 0;
+    }
+
+    // On ext4, targets in a data block are mapped by an extent tree (even short ones).
+    char *target = (char *)do_malloc(size + 1);
+    if (size < FAST_SYMLINK_MAX && !(inode->flags & EXTENTS_FL))
+    {
+        unsigned char raw[BLOCK_AREA_SIZE];
+        getBlockArea(inode, raw);
+        memcpy(target, raw, size);
+    }
+    else
+    {
+        unsigned char *data = readAllDataBlocks(inode, ext2FS);
+        memcpy(target, data, size);
+        free(data);
+    }
+    target[size] = '\0';
+
+    return target;
+}
+
+// Get the device number of a device file from its first block pointers:
+// the old 8:8 bit encoding in the first one, or else the new 12:20 bit
+// encoding in the second one.
+static void decodeDevice(struct Inode *inode, uint32_t *major, uint32_t *minor)
+{
+    uint32_t dev = inode->DBlockPtrs[0];
+    if (dev != 0)
+    {
+        *major = (dev >> 8) & 0xFF;
+        *minor = dev & 0xFF;
+        return;
+    }
+
+    dev = inode->DBlockPtrs[1];
+    *major = (dev >> 8) & 0xFFF;
+    *minor = (dev & 0xFF) | ((dev >> 12) & 0xFFF00);
+}
+
+// Append the data of a file to the archive. Its runs of blocks are read
+// straight into the buffer, and its holes are written as zeros.
+static int appendFileData(struct Archive *archive, struct Inode *inode, FILE *ext2FS)
+{
+    archive->fileOffset = 0;
+
+    // Initialize the block walker.
+    struct BlockWalker walker = {0};
+    walker.ext2FS = ext2FS;
+    walker.inode = inode;
+    walker.maxRunBytes = archive->size;
+    walker.handleRun = readRunIntoArchive;
+    walker.ctx = archive;
+
+    // Read all the data blocks into the archive.
+    walkDataBlocks(&walker);
+
+    // A file that ends with a hole.
+    appendArchiveZeros(archive, getFileSize(inode) - archive->fileOffset);
+
+    return 0;
+}
+
+// Run handler: read the run into the archive buffer after the zeros of the
+// hole before it. Runs never exceed the buffer (see maxRunBytes), so a run
+// that does not fit in the rest of it has it written out first.
+static int readRunIntoArchive(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes)
+{
+    struct Archive *archive = (struct Archive *)walker->ctx;
+
+    appendArchiveZeros(archive, run->fileOffset - archive->fileOffset);
+
+    if (archive->len + fileBytes > archive->size)
+    {
+        flushArchive(archive);
+    }
+
+    // A failed image read is reported, and the stream keeps its layout.
+    readBlockRun(walker, run, fileBytes, &archive->buf[archive->len]);
+    archive->len += fileBytes;
+    archive->offset += fileBytes;
+    archive->fileOffset = run->fileOffset + fileBytes;
+
+    return 0;
+}
+
+static void appendArchive(struct Archive *archive, const void *data, size_t len)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    archive->offset += len;
+
+    while (len > 0)
+    {
+        if (archive->len == archive->size)
+        {
+            flushArchive(archive);
+        }
+
+        size_t chunk = archive->size - archive->len;
+        chunk = chunk < len ? chunk : len;
+        memcpy(&archive->buf[archive->len], bytes, chunk);
+        archive->len += chunk;
+        bytes += chunk;
+        len -= chunk;
+    }
+}
+
+static void appendArchiveZeros(struct Archive *archive, uint64_t len)
+{
+    archive->offset += len;
+
+    while (len > 0)
+    {
+        if (archive->len == archive->size)
+        {
+            flushArchive(archive);
+        }
+
+        size_t chunk = archive->size - archive->len;
+        chunk = chunk < len ? chunk : len;
+        memset(&archive->buf[archive->len], 0, chunk);
+        archive->len += chunk;
+        len -= chunk;
+    }
+}
+
+// Pad the stream to the alignment of the format with zeros.
+static void padArchive(struct Archive *archive)
+{
+    uint64_t align = archive->format == EXT2_ARCHIVE_TAR ? TAR_BLOCK_SIZE : CPIO_ALIGN;
+
+    appendArchiveZeros(archive, (align - archive->offset % align) % align);
+}
+
+// Write out the buffer. After a failed write the buffer is still emptied,
+// but nothing more reaches the output.
+static int flushArchive(struct Archive *archive)
+{
+    if (!archive->failed && archive->len > 0 && do_fwrite(archive->buf, 1, archive->len, archive->out) != 0)
+    {
+        archive->failed = 1;
+    }
+    archive->len = 0;
+
+    return archive->failed ? -1 : 0;
+}
+
+static int initPool(struct TaskPool *pool, int numWorkers, int (*runTask)(struct PoolWorker *worker, void *task))
+{
+    memset(pool, 0, sizeof(struct TaskPool));
+    pool->ext2FS = currentFS;
+    pool->manifest = currentManifest;
+    pool->numWorkers = numWorkers;
+    pool->runTask = runTask;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->workAvailable, NULL);
+    pthread_cond_init(&pool->taskDone, NULL);
+
+    pool->deques = (struct TaskDeque *)do_calloc(numWorkers, sizeof(struct TaskDeque));
+    for (int i = 0; i < numWorkers; i++)
+    {
+        pool->deques[i].cap = MIN_DEQUE_SIZE;
+        pool->deques[i].tasks = (void **)do_malloc(MIN_DEQUE_SIZE * sizeof(void *));
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+
+    return 0;
+}
+
+// Start the workers. They share the image of the handle, since every read
+// of it is a positional one.
+static int startPool(struct TaskPool *pool)
+{
+    pool->workers = (struct PoolWorker *)do_calloc(pool->numWorkers, sizeof(struct PoolWorker));
+    pool->threads = (pthread_t *)do_malloc(pool->numWorkers * sizeof(pthread_t));
+
+    for (int i = 0; i < pool->numWorkers; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        pool->workers[i].ext2FS = pool->ext2FS->image;
+        pthread_create(&pool->threads[i], NULL, poolWorker, &pool->workers[i]);
+    }
+
+    return 0;
+}
+
+// Wait for every task to be done, then stop the workers. The first error
+// of the workers (outside of the sinks of the tasks) goes to the calling thread.
+// Note: The failures are left for the caller to report and free.
+static int finishPool(struct TaskPool *pool)
+{
+    for (int i = 0; i < pool->numWorkers; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+        freeArena(&pool->workers[i].arena);
+
+        struct ErrorSink *sink = &pool->workers[i].sink;
+        if (sink->failed)
+        {
+            failCall(sink->error, "%s", sink->message);
+        }
+    }
+
+    // Free the allocated memory.
+    for (int i = 0; i < pool->numWorkers; i++)
+    {
+        free(pool->deques[i].tasks);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    free(pool->deques);
+    free(pool->workers);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->workAvailable);
+    pthread_cond_destroy(&pool->taskDone);
+
+    return 0;
+}
+
+static void *poolWorker(void *arg)
+{
+    struct PoolWorker *worker = (struct PoolWorker *)arg;
+    struct TaskPool *pool = worker->pool;
+
+    // Work on behalf of the call that runs the pool.
+    currentFS = pool->ext2FS;
+    currentManifest = pool->manifest;
+    errorSink = &worker->sink;
+
+    while (1)
+    {
+        // Take the newest task of the own deque, or else steal the oldest
+        // task of another worker (which tends to be a large subtree).
+        void *task = popTask(pool, worker->id);
+        if (task == NULL)
+        {
+            task = stealTask(pool, worker->id);
+        }
+
+        if (task == NULL)
+        {
+            // Wait for new tasks, unless every task is done.
+            pthread_mutex_lock(&pool->lock);
+            while (pool->queued == 0 && pool->pending > 0)
+            {
+                pthread_cond_wait(&pool->workAvailable, &pool->lock);
+            }
+            int isDone = pool->pending == 0;
+            pthread_mutex_unlock(&pool->lock);
+
+            if (isDone)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        struct ArenaMark mark = markArena(&worker->arena);
+        pool->runTask(worker, task);
+        releaseArena(&worker->arena, mark);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->pending -= 1;
+        if (pool->pending == 0)
+        {
+            pthread_cond_broadcast(&pool->workAvailable);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    // Tear down the io_uring of the worker (if it has one).
+    freeUring();
+
+    return NULL;
+}
+
+// Push a task at the bottom of the deque of the worker.
+static void pushTask(struct TaskPool *pool, int workerId, void *task)
+{
+    struct TaskDeque *deque = &pool->deques[workerId];
+
+    pthread_mutex_lock(&deque->lock);
+
+    // Grow the deque (unwrapping the ring) if it is full.
+    if (deque->size == deque->cap)
+    {
+        void **tasks = (void **)do_malloc(2 * deque->cap * sizeof(void *));
+        for (size_t i = 0; i < deque->size; i++)
+        {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->cap];
+        }
+
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->cap *= 2;
+        deque->head = 0;
+    }
+
+    deque->tasks[(deque->head + deque->size) % deque->cap] = task;
+    deque->size += 1;
+
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued += 1;
+    pool->pending += 1;
+    pthread_cond_signal(&pool->workAvailable);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Pop the newest task from the bottom of the deque of the worker.
+static void *popTask(struct TaskPool *pool, int workerId)
+{
+    struct TaskDeque *deque = &pool->deques[workerId];
+    void *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->size > 0)
+    {
+        deque->size -= 1;
+        task = deque->tasks[(deque->head + deque->size) % deque->cap];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    if (task != NULL)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued -= 1;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return task;
+}
+
+// Steal the oldest task from the top of the deque of another worker.
+static void *stealTask(struct TaskPool *pool, int workerId)
+{
+    for (int i = 1; i < pool->numWorkers; i++)
+    {
+        struct TaskDeque *deque = &pool->deques[(workerId + i) % pool->numWorkers];
+        void *task = NULL;
+
+        pthread_mutex_lock(&deque->lock);
+        if (deque->size > 0)
+        {
+            task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->cap;
+            deque->size -= 1;
+        }
+        pthread_mutex_unlock(&deque->lock);
+
+        if (task != NULL)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pool->queued -= 1;
+            pthread_mutex_unlock(&pool->lock);
+
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+static int isInodeDir(struct Inode *inode)
+{
+    return inode->type >> 12 == 4 ? 1 : 0;
+}
+
+// Get the 64-bit size of the file. Directories are never that large: their
+// upper 32 bits are the (unused) i_dir_acl field instead of i_size_high.
+static uint64_t getFileSize(struct Inode *inode)
+{
+    if (isInodeDir(inode))
+    {
+        return inode->FSizeLower;
+    }
+
+    return ((uint64_t)inode->FSizeUpper << 32) | inode->FSizeLower;
+}
+
+static int parseSuperblock(FILE *ext2FS)
+{
+    // Get the raw superblock (a pointer into the mapping if there is one).
+    unsigned char sbBuf[SB_SIZE];
+    const unsigned char *rawSB = readImage(ext2FS, SB_ADDR, SB_SIZE, READ_SUPERBLOCK, sbBuf);
+
+    currentFS->sb.totalInodes = le32(&rawSB[0]);
+    currentFS->sb.totalBlocks = le32(&rawSB[4]);
+    currentFS->sb.firstDataBlock = le32(&rawSB[20]);
+    currentFS->sb.blockSizeMult = le32(&rawSB[24]);
+    currentFS->sb.blocksPerBG = le32(&rawSB[32]);
+    currentFS->sb.inodesPerBG = le32(&rawSB[40]);
+    currentFS->sb.revLevel = le32(&rawSB[76]);
+    currentFS->sb.inodeSize = le16(&rawSB[88]);
+    currentFS->sb.featureCompat = le32(&rawSB[92]);
+    currentFS->sb.featureIncompat = le32(&rawSB[96]);
+    currentFS->sb.featureRoCompat = le32(&rawSB[100]);
+    currentFS->sb.descSize = le16(&rawSB[254]);
+    for (int i = 0; i < 4; i++)
+    {
+        currentFS->sb.hashSeed[i] = le32(&rawSB[236 + (4 * i)]);
+    }
+    currentFS->sb.flags = le32(&rawSB[352]);
+    currentFS->sb.magic = le16(&rawSB[56]);
+    currentFS->sb.freeBlocks = le32(&rawSB[12]);
+    currentFS->sb.freeInodes = le32(&rawSB[16]);
+    currentFS->sb.mountTime = le32(&rawSB[44]);
+    currentFS->sb.writeTime = le32(&rawSB[48]);
+    memcpy(currentFS->sb.uuid, &rawSB[104], sizeof(currentFS->sb.uuid));
+
+    // Revision 0 file systems have fixed 128-byte inodes
+    // and none of the extended fields.
+    if (currentFS->sb.revLevel == 0)
+    {
+        currentFS->sb.inodeSize = INODE_RECORD_SIZE;
+        currentFS->sb.featureCompat = 0;
+        currentFS->sb.featureIncompat = 0;
+        currentFS->sb.featureRoCompat = 0;
+    }
+
+    // Without the 64bit feature the descriptors have the original size.
+    if (!(currentFS->sb.featureIncompat & FEATURE_INCOMPAT_64BIT))
+    {
+        currentFS->sb.descSize = BGD_SIZE;
+    }
+
+    // Everything else is derived from these, so they have to make sense.
+    // Inodes never span across two blocks (see parseInodes).
+    uint16_t inodeSize = currentFS->sb.inodeSize;
+    if (currentFS->sb.magic != EXT2_MAGIC ||
+        currentFS->sb.blockSizeMult > MAX_BLOCK_SIZE_MULT ||
+        currentFS->sb.totalInodes == 0 ||
+        currentFS->sb.inodesPerBG == 0 ||
+        inodeSize < INODE_RECORD_SIZE ||
+        (inodeSize & (inodeSize - 1)) != 0 ||
+        inodeSize > (1024u << currentFS->sb.blockSizeMult) ||
+        currentFS->sb.descSize < BGD_SIZE ||
+        currentFS->sb.descSize > (1024u << currentFS->sb.blockSizeMult) ||
+        (currentFS->sb.descSize & (currentFS->sb.descSize - 1)) != 0)
+    {
+        reportCorruption("Not an ext2 file system (bad superblock)");
+        return -1;
+    }
+
+    // ext3 and ext4 file systems are read like ext2 ones, as long as they
+    // do not use a feature that changes the layout of the parsed structures.
+    if (currentFS->sb.featureIncompat & FEATURE_INCOMPAT_UNSUPPORTED)
+    {
+        reportCorruption("Unsupported file system features (0x%x)",
+                         currentFS->sb.featureIncompat & FEATURE_INCOMPAT_UNSUPPORTED);
+        return -1;
+    }
+
+    // Calculate the block size.
+    currentFS->sb.blockSize = 1024 << currentFS->sb.blockSizeMult;
+
+    // Calculate the number of block groups.
+    currentFS->sb.numOfBGs = (currentFS->sb.totalInodes + currentFS->sb.inodesPerBG - 1) / currentFS->sb.inodesPerBG;
+
+    // READ THE WHOLE BLOCK GROUP DESCRIPTOR TABLE ----------------------------
+    // The BGDT starts at the block right after the superblock
+    // (i.e., block 2 for 1 KiB blocks and block 1 otherwise).
+    uint64_t bgdtAddr = (uint64_t)(currentFS->sb.firstDataBlock + 1) * currentFS->sb.blockSize;
+    size_t bgdtSize = (size_t)currentFS->sb.numOfBGs * currentFS->sb.descSize;
+
+    unsigned char *bgdtBuf = (unsigned char *)do_malloc(bgdtSize);
+    const unsigned char *rawBGDT = readImage(ext2FS, bgdtAddr, bgdtSize, READ_BGDT, bgdtBuf);
+
+    // Groups are only left uninitialized with the group descriptor checksums.
+    int hasUninitGroups = (currentFS->sb.featureRoCompat &
+                           (FEATURE_RO_COMPAT_GDT_CSUM | FEATURE_RO_COMPAT_METADATA_CSUM)) != 0;
+
+    currentFS->sb.bgdt = (struct BGD *)do_malloc(currentFS->sb.numOfBGs * sizeof(struct BGD));
+    for (uint32_t i = 0; i < currentFS->sb.numOfBGs; i++)
+    {
+        const unsigned char *bgdtEntry = &rawBGDT[(size_t)i * currentFS->sb.descSize];
+        struct BGD *bgd = &currentFS->sb.bgdt[i];
+        bgd->blockBitmap = le32(&bgdtEntry[0]);
+        bgd->inodeBitmap = le32(&bgdtEntry[4]);
+        bgd->inodeTable = le32(&bgdtEntry[8]);
+        bgd->flags = hasUninitGroups ? le16(&bgdtEntry[18]) : 0;
+
+        // The upper 32 bits of the block numbers (64bit feature).
+        if (currentFS->sb.descSize >= 2 * BGD_SIZE)
+        {
+            bgd->blockBitmap |= (uint64_t)le32(&bgdtEntry[32]) << 32;
+            bgd->inodeBitmap |= (uint64_t)le32(&bgdtEntry[36]) << 32;
+            bgd->inodeTable |= (uint64_t)le32(&bgdtEntry[40]) << 32;
+        }
+    }
+
+    // Free the allocated memory.
+    free(bgdtBuf);
+    // ------------------------------------------------------------------------
+
+    return 0;
+}
+
+// Parse many inodes at once: inodes[i] receives the inode inodeNums[i]
+// (entries with an inode number of 0 are left untouched). The inodes are
+// visited in ascending order so that each inode table block is read once
+// no matter how many of the inodes it holds.
+static int parseInodes(const uint32_t *inodeNums, size_t count, struct Inode *inodes, FILE *ext2FS)
+{
+    // Sort the inode numbers while remembering their place in the batch.
+    struct InodeRef *refs = (struct InodeRef *)do_malloc(count * sizeof(struct InodeRef));
+    for (size_t i = 0; i < count; i++)
+    {
+        refs[i].inodeNum = inodeNums[i];
+        refs[i].index = i;
+    }
+    qsort(refs, count, sizeof(struct InodeRef), compareInodeRefs);
+
+    unsigned char *blockBuf = (unsigned char *)do_malloc(currentFS->sb.blockSize);
+    const unsigned char *block = NULL;
+    uint64_t blockAddr = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (refs[i].inodeNum == 0)
+        {
+            continue;
+        }
+
+        // A damaged directory entry may point anywhere.
+        if (refs[i].inodeNum > currentFS->sb.totalInodes)
+        {
+            reportCorruption("Inode number out of range: %u", refs[i].inodeNum);
+            continue;
+        }
+
+        // Read the inode table block holding the inode
+        // (unless it is the block that was read last).
+        // Note: The inode size always divides the block size,
+        //       so an inode never spans across two blocks.
+        uint64_t inodeAddr = getInodeAddr(refs[i].inodeNum);
+        uint64_t inodeBlockAddr = inodeAddr - (inodeAddr % currentFS->sb.blockSize);
+        if (block == NULL || inodeBlockAddr != blockAddr)
+        {
+            block = readCachedBlocks(ext2FS, inodeBlockAddr / currentFS->sb.blockSize, 1, READ_INODE, blockBuf);
+            blockAddr = inodeBlockAddr;
+        }
+
+        decodeInode(&block[inodeAddr - blockAddr], &inodes[refs[i].index]);
+    }
+
+    // Free the allocated memory.
+    free(blockBuf);
+    free(refs);
+
+    return 0;
+}
+
+// Parse the inodes of all the entries of a directory with a single batch.
+// The returned array (allocated from the arena) is parallel to the entries
+// (i.e., the n-th inode belongs to the n-th entry). The (.) and (..) entries
+// are not parsed.
+static struct Inode *parseDirEntryInodes(struct DirEntries *dirEntries, FILE *ext2FS, struct Arena *arena)
+{
+    // Gather the inode numbers.
+    uint32_t *inodeNums = (uint32_t *)arenaAlloc(arena, dirEntries->count * sizeof(uint32_t));
+    for (size_t i = 0; i < dirEntries->count; i++)
+    {
+        struct DirEntry *dirEntry = &dirEntries->entries[i];
+        inodeNums[i] = isDotEntry(dirEntries, dirEntry) ? 0 : dirEntry->inodeNum;
+    }
+
+    struct Inode *inodes = (struct Inode *)arenaAlloc(arena, dirEntries->count * sizeof(struct Inode));
+    memset(inodes, 0, dirEntries->count * sizeof(struct Inode));
+    parseInodes(inodeNums, dirEntries->count, inodes, ext2FS);
+
+    return inodes;
+}
+
+// Compute for the inode address (byte offset) using the cached BGDT.
+static uint64_t getInodeAddr(uint32_t inodeNum)
+{
+    // Determine which block group the corresponding inode is in.
+    uint32_t inodeBGNum = (inodeNum - 1) / currentFS->sb.inodesPerBG;
+
+    // Determine the index of the inode in the inode table.
+    uint32_t inodeIndex = (inodeNum - 1) % currentFS->sb.inodesPerBG;
+
+    // Get the inode table address.
+    uint64_t inodeTableAddr = (uint64_t)currentFS->sb.bgdt[inodeBGNum].inodeTable * currentFS->sb.blockSize;
+
+    // Get the inode address.
+    return inodeTableAddr + ((uint64_t)inodeIndex * currentFS->sb.inodeSize);
+}
+
+// Build the inode struct from the raw on-disk inode record.
+static int decodeInode(const unsigned char *record, struct Inode *inode)
+{
+    // Get the type.
+    inode->type = le16(&record[0]);
+
+    // Get the owner and the modification time. The upper 16 bits of the
+    // ids are in the OS dependent area (Linux layout).
+    inode->uid = le16(&record[2]) | (uint32_t)le16(&record[120]) << 16;
+    inode->gid = le16(&record[24]) | (uint32_t)le16(&record[122]) << 16;
+    inode->mtime = le32(&record[16]);
+
+    // Get lower 32 bits of the file size.
+    inode->FSizeLower = le32(&record[4]);
+
+    // Get upper 32 bits of the file size.
+    inode->FSizeUpper = le32(&record[108]);
+
+    // Get the flags.
+    inode->flags = le32(&record[32]);
+
+    // Get the 12 direct block pointers.
+    for (int i = 0; i < 12; i++)
+    {
+        inode->DBlockPtrs[i] = le32(&record[40 + (4 * i)]);
+    }
+
+    // Get the singly, doubly and triply indirect block pointers.
+    inode->SIBlockPtr = le32(&record[88]);
+    inode->DIBlockPtr = le32(&record[92]);
+    inode->TIBlockPtr = le32(&record[96]);
+
+    return 0;
+}
+
+// Get the 15 block pointers back in their on-disk byte order, i.e., the
+// raw area that holds a fast symbolic link or the root of an extent tree.
+static void getBlockArea(struct Inode *inode, unsigned char *area)
+{
+    uint32_t ptrs[15];
+    memcpy(ptrs, inode->DBlockPtrs, sizeof(inode->DBlockPtrs));
+    ptrs[12] = inode->SIBlockPtr;
+    ptrs[13] = inode->DIBlockPtr;
+    ptrs[14] = inode->TIBlockPtr;
+    for (int i = 0; i < 15; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            area[4 * i + j] = (unsigned char)(ptrs[i] >> (8 * j));
+        }
+    }
+}
+
+// Get (an estimate of) the physical block where the data of the inode
+// starts, without reading anything: the first direct block, or the first
+// block the root of the extent tree points to.
+static uint64_t getStartBlock(struct Inode *inode)
+{
+    if (!(inode->flags & EXTENTS_FL))
+    {
+        return inode->DBlockPtrs[0];
+    }
+
+    unsigned char root[BLOCK_AREA_SIZE];
+    getBlockArea(inode, root);
+    if (le16(&root[0]) != EXTENT_MAGIC || le16(&root[2]) == 0)
+    {
+        return 0;
+    }
+
+    // A leaf entry keeps its block number at byte 6, an index entry at byte 4.
+    const unsigned char *entry = &root[EXTENT_HEADER_SIZE];
+    if (le16(&root[6]) == 0)
+    {
+        return ((uint64_t)le16(&entry[6]) << 32) | le32(&entry[8]);
+    }
+
+    return ((uint64_t)le16(&entry[8]) << 32) | le32(&entry[4]);
+}
+
+static int compareInodeRefs(const void *a, const void *b)
+{
+    uint32_t numA = ((const struct InodeRef *)a)->inodeNum;
+    uint32_t numB = ((const struct InodeRef *)b)->inodeNum;
+
+    return (numA > numB) - (numA < numB);
+}
+
+// Get all the block data pointed by the 12 direct block pointers,
+// singly indirect block pointer, and doubly indirect block pointer.
+static unsigned char *readAllDataBlocks(struct Inode *inode, FILE *ext2FS)
+{
+    // Allocate memory for the data.
+    unsigned char *data = (unsigned char *)do_calloc(getFileSize(inode), sizeof(unsigned char));
+
+    // Initialize the block walker.
+    struct BlockWalker walker = {0};
+    walker.ext2FS = ext2FS;
+    walker.inode = inode;
+    walker.maxRunBytes = MAX_RUN_BYTES;
+    walker.handleRun = readRunIntoBuffer;
+    walker.ctx = data;
+
+    // Read all the data blocks.
+    walkDataBlocks(&walker);
+
+    return data;
+}
+
+// Walk all the block pointers of the inode (in file order) and hand every
+// run of contiguous data blocks to the walker's run handler.
+static int walkDataBlocks(struct BlockWalker *walker)
+{
+    walker->fileSize = getFileSize(walker->inode);
+    walker->tail = (unsigned char *)do_malloc(currentFS->sb.blockSize);
+
+    // The root of the extent tree (ext4) is in place of the block pointers.
+    unsigned char root[BLOCK_AREA_SIZE];
+    int isExtentTree = (walker->inode->flags & EXTENTS_FL) != 0;
+    int levels = 3;
+    if (isExtentTree)
+    {
+        getBlockArea(walker->inode, root);
+        levels = le16(&root[6]) < EXTENT_MAX_DEPTH ? le16(&root[6]) : EXTENT_MAX_DEPTH;
+    }
+
+    // Indirect blocks (and extent tree nodes) are used in place when the image is mapped.
+    if (currentFS->imageMap.base == NULL)
+    {
+        for (int i = 0; i < levels; i++)
+        {
+            walker->ptrBlocks[i] = (unsigned char *)do_malloc(currentFS->sb.blockSize);
+        }
+    }
+
+    if (isExtentTree)
+    {
+        readExtentNode(walker, root, sizeof(root), -1);
+
+        // The blocks past the last extent are a hole.
+        skipHole(walker, (walker->fileSize - walker->readBytes + currentFS->sb.blockSize - 1) / currentFS->sb.blockSize);
+    }
+    else
+    {
+        read12DBlockPtrs(walker);
+        readSIBlockPtr(walker, walker->inode->SIBlockPtr);
+        readDIBlockPtr(walker, walker->inode->DIBlockPtr);
+        readTIBlockPtr(walker, walker->inode->TIBlockPtr);
+    }
+
+    // Hand over the last pending run of blocks.
+    flushBlockRun(walker);
+
+    // Free the allocated memory.
+    free(walker->tail);
+    walker->tail = NULL;
+    for (int i = 0; i < EXTENT_MAX_DEPTH; i++)
+    {
+        free(walker->ptrBlocks[i]);
+        walker->ptrBlocks[i] = NULL;
+    }
+
+    return 0;
+}
+
+// Queue a data block into the pending run. The run is only read (flushed)
+// once a block that is not physically contiguous with it comes along,
+// so a contiguous file is read with a handful of large reads.
+static int readDataBlock(struct BlockWalker *walker, uint32_t dBlockPtr)
+{
+    // A missing data block is a hole of a single block.
+    if (dBlockPtr == 0)
+    {
+        return skipHole(walker, 1);
+    }
+
+    return queueBlocks(walker, dBlockPtr, 1);
+}
+
+// Queue numBlocks physically contiguous data blocks (e.g., an extent) into
+// the pending run, at most as many as the rest of the file needs. The run is
+// extended by all of them at once, and is only split where it would grow
+// past maxRunBytes.
+static int queueBlocks(struct BlockWalker *walker, uint64_t physBlock, uint64_t numBlocks)
+{
+    struct BlockRun *run = &walker->run;
+    uint64_t blockSize = currentFS->sb.blockSize;
+    uint64_t maxRunBlocks = walker->maxRunBytes > blockSize ? walker->maxRunBytes / blockSize : 1;
+
+    while (numBlocks > 0 && walker->readBytes < walker->fileSize)
+    {
+        // Extend the pending run if the blocks directly follow it.
+        if (run->numBlocks == 0 ||
+            run->physBlock + run->numBlocks != physBlock ||
+            run->numBlocks == maxRunBlocks)
+        {
+            flushBlockRun(walker);
+
+            run->physBlock = physBlock;
+            run->numBlocks = 0;
+            run->fileOffset = walker->readBytes;
+        }
+
+        uint64_t count = maxRunBlocks - run->numBlocks;
+        count = count < numBlocks ? count : numBlocks;
+
+        // Number of file bytes that these blocks hold.
+        uint64_t remBytes = walker->fileSize - walker->readBytes;
+        if (count * blockSize >= remBytes)
+        {
+            count = (remBytes + blockSize - 1) / blockSize;
+            walker->readBytes = walker->fileSize;
+        }
+        else
+        {
+            walker->readBytes += count * blockSize;
+        }
+
+        run->numBlocks += count;
+        physBlock += count;
+        numBlocks -= count;
+    }
+
+    return 0;
+}
+
+// Skip a hole (i.e., numBlocks unallocated blocks) in the file. Holes read
+// as zeros, so nothing is read for them: the run handlers see a gap between
+// the file offsets of two runs instead.
+static int skipHole(struct BlockWalker *walker, uint64_t numBlocks)
+{
+    // The pending run ends where the hole starts.
+    flushBlockRun(walker);
+
+    uint64_t remBytes = walker->fileSize - walker->readBytes;
+    uint64_t holeBytes = numBlocks * currentFS->sb.blockSize;
+    walker->readBytes += holeBytes < remBytes ? holeBytes : remBytes;
+
+    return 0;
+}
+
+// Hand the pending run of blocks over to the run handler.
+static int flushBlockRun(struct BlockWalker *walker)
+{
+    struct BlockRun *run = &walker->run;
+
+    if (run->numBlocks == 0)
+    {
+        return 0;
+    }
+
+    walker->handleRun(walker, run, walker->readBytes - run->fileOffset);
+
+    run->numBlocks = 0;
+
+    return 0;
+}
+
+// Read a run of blocks with a single vectored positional read.
+// The file bytes go straight into the destination buffer while the unused
+// tail of the last block (past the end of the file) goes into a scratch
+// buffer, so that only whole blocks are ever read from the file system.
+static int readBlockRun(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes, unsigned char *dest)
+{
+    uint64_t runBytes = run->numBlocks * currentFS->sb.blockSize;
+    uint64_t runAddr = run->physBlock * currentFS->sb.blockSize;
+
+    // Mapped images are copied straight out of the mapping.
+    if (currentFS->imageMap.base != NULL && runAddr + runBytes <= currentFS->imageMap.size)
+    {
+        ADD_STAT(bytesRead[READ_FILE_DATA], fileBytes);
+        memcpy(dest, &currentFS->imageMap.base[runAddr], fileBytes);
+        return 0;
+    }
+
+    ADD_STAT(bytesRead[READ_FILE_DATA], runBytes);
+
+    struct iovec iov[2];
+    int iovcnt = 1;
+    iov[0].iov_base = dest;
+    iov[0].iov_len = fileBytes;
+
+    if (fileBytes < runBytes)
+    {
+        iov[1].iov_base = walker->tail;
+        iov[1].iov_len = runBytes - fileBytes;
+        iovcnt = 2;
+    }
+
+    return do_preadv(walker->ext2FS, iov, iovcnt, runAddr);
+}
+
+// Run handler: read the run into its place in a buffer holding the whole file.
+static int readRunIntoBuffer(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes)
+{
+    unsigned char *data = (unsigned char *)walker->ctx;
+
+    return readBlockRun(walker, run, fileBytes, &data[run->fileOffset]);
+}
+
+// Run handler: read the run into the slot that is currently being filled.
+// Runs never exceed a slot (see maxRunBytes), so a run that does not fit in
+// the rest of the current slot moves on to the next one. So does a run that
+// follows a hole, since a slot holds a contiguous range of the file.
+static int readRunIntoStream(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes)
+{
+    struct FileStream *stream = (struct FileStream *)walker->ctx;
+    struct StreamSlot *slot = &stream->slots[stream->head];
+
+    // There is no point in reading the rest of a file that cannot be written.
+    if (stream->failed)
+    {
+        return 0;
+    }
+
+    if (slot->len > 0 &&
+        (slot->len + run->numBlocks * currentFS->sb.blockSize > stream->slotSize ||
+         slot->offset + slot->len != run->fileOffset))
+    {
+        submitStreamSlot(stream);
+        slot = &stream->slots[stream->head];
+    }
+
+    if (slot->len == 0)
+    {
+        slot->offset = run->fileOffset;
+    }
+
+    // Ask for the run to be paged in ahead of the copy.
+    adviseImage(run->physBlock * currentFS->sb.blockSize, run->numBlocks * currentFS->sb.blockSize, MADV_WILLNEED);
+
+    // Allocate the slot on first use. Files smaller than a slot only
+    // get a buffer as big as the file (rounded up to a whole block).
+    if (slot->buf == NULL)
+    {
+        uint64_t remBytes = walker->fileSize - run->fileOffset;
+        size_t bufSize = remBytes < stream->slotSize ? remBytes : stream->slotSize;
+        bufSize += (currentFS->sb.blockSize - bufSize % currentFS->sb.blockSize) % currentFS->sb.blockSize;
+        slot->buf = (unsigned char *)do_malloc(bufSize);
+    }
+
+    if (readBlockRun(walker, run, fileBytes, &slot->buf[slot->len]) != 0)
+    {
+        stream->readFailed = 1;
+    }
+    slot->len += fileBytes;
+
+    return 0;
+}
+
+// Run handler: copy the run into its place in the file.
+static int copyRunIntoFile(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes)
+{
+    struct FileCopy *copy = (struct FileCopy *)walker->ctx;
+
+    // There is no point in copying the rest of a file that cannot be written.
+    if (copy->failed)
+    {
+        return 0;
+    }
+
+    if (copyRange(copy, run->physBlock * currentFS->sb.blockSize, run->fileOffset, fileBytes, walker) != 0)
+    {
+        copy->failed = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Copy len bytes from the image into the file with the current copy method,
+// moving on to the next method when the kernel does not support one.
+static int copyRange(struct FileCopy *copy, uint64_t imageOffset, uint64_t fileOffset, uint64_t len, struct BlockWalker *walker)
+{
+    while (len > 0)
+    {
+        ssize_t n;
+        if (copy->method == COPY_RANGE)
+        {
+            loff_t inOffset = imageOffset;
+            loff_t outOffset = fileOffset;
+            n = copy_file_range(copy->imageFd, &inOffset, copy->fileFd, &outOffset, len, 0);
+            ADD_STAT(copies, 1);
+        }
+        else if (copy->method == COPY_SENDFILE)
+        {
+            // sendfile writes at the file position.
+            off_t inOffset = imageOffset;
+            n = lseek(copy->fileFd, fileOffset, SEEK_SET) < 0 ? -1 : sendfile(copy->fileFd, copy->imageFd, &inOffset, len);
+            ADD_STAT(seeks, 1);
+            ADD_STAT(copies, 1);
+        }
+        else
+        {
+            // Runs never exceed maxRunBytes, so a single buffer holds any run.
+            if (copy->buf == NULL)
+            {
+                copy->buf = (unsigned char *)do_malloc(walker->maxRunBytes);
+            }
+
+            if (do_pread(walker->ext2FS, copy->buf, len, imageOffset) != 0)
+            {
+                return -1;
+            }
+
+            n = pwrite(copy->fileFd, copy->buf, len, fileOffset);
+            ADD_STAT(writes, 1);
+        }
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        // Move on to the next method if the kernel (or the file system)
+        // does not support this one.
+        if (n < 0 && copy->method != COPY_BUFFERED &&
+            (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+        {
+            copy->method++;
+            continue;
+        }
+
+        if (n <= 0)
+        {
+            reportError("copy failed: %s", n < 0 ? strerror(errno) : "unexpected end of file");
+            return -1;
+        }
+
+        // The bytes went both ways, whatever the method.
+        ADD_STAT(bytesRead[READ_FILE_DATA], (uint64_t)n);
+        ADD_STAT(bytesWritten, (uint64_t)n);
+
+        imageOffset += n;
+        fileOffset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Run handler: queue the read of the run into a free registered buffer,
+// linked with the write of the buffer into the file.
+static int queueRunIntoUring(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes)
+{
+    struct Uring *ring = (struct Uring *)walker->ctx;
+    struct UringFile *file = &ring->files[ring->currentFile];
+
+    // There is no point in reading the rest of a file that cannot be written.
+    if (file->error != 0)
+    {
+        return 0;
+    }
+
+    // Wait for a buffer to be released if they are all in flight.
+    while (ring->numFreeBufs == 0)
+    {
+        if (submitUring(ring, 1) != 0)
+        {
+            file->error = -EIO;
+            return -1;
+        }
+        reapUring(ring);
+    }
+
+    int bufIndex = ring->freeBufs[--ring->numFreeBufs];
+    struct UringBuf *buf = &ring->bufs[bufIndex];
+    buf->file = ring->currentFile;
+    buf->readLen = run->numBlocks * currentFS->sb.blockSize;
+    buf->writeLen = fileBytes;
+
+    // The read (from the image, fixed file 0). The linked write only
+    // starts once the read is complete.
+    struct io_uring_sqe *sqe = getUringSqe(ring);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->fd = 0;
+    sqe->addr = (uint64_t)(uintptr_t)buf->data;
+    sqe->len = buf->readLen;
+    sqe->off = run->physBlock * currentFS->sb.blockSize;
+    sqe->buf_index = bufIndex;
+    sqe->user_data = (uint64_t)bufIndex * 2;
+
+    // The write (into the file, at the offset of the run).
+    sqe = getUringSqe(ring);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = ring->currentFile + 1;
+    sqe->addr = (uint64_t)(uintptr_t)buf->data;
+    sqe->len = buf->writeLen;
+    sqe->off = run->fileOffset;
+    sqe->buf_index = bufIndex;
+    sqe->user_data = (uint64_t)bufIndex * 2 + 1;
+
+    file->pending += 1;
+    file->endOffset = run->fileOffset + fileBytes;
+
+    ADD_STAT(reads, 1);
+    ADD_STAT(bytesRead[READ_FILE_DATA], buf->readLen);
+    ADD_STAT(writes, 1);
+    ADD_STAT(bytesWritten, buf->writeLen);
+
+    // Keep the device busy while the walker moves on.
+    submitUring(ring, 0);
+
+    return 0;
+}
+
+// Get the io_uring of the calling thread, setting it up on first use.
+// Returns NULL if io_uring is not available.
+static struct Uring *getUring(FILE *ext2FS)
+{
+    if (uring == NULL && !isUringUnavailable)
+    {
+        uring = initUring(ext2FS);
+        isUringUnavailable = uring == NULL;
+    }
+
+    return uring;
+}
+
+// Set up an io_uring: map its rings, register the buffers (carved out of
+// the buffer budget) and the files (the image, plus empty output slots).
+// Returns NULL if any of it fails (the io_uring is then not used at all).
+static struct Uring *initUring(FILE *ext2FS)
+{
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct Uring *ring = (struct Uring *)do_calloc(1, sizeof(struct Uring));
+    ring->fd = fd;
+
+    // MAP THE RINGS ----------------------------------------------------------
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        uring = ring;
+        freeUring();
+        return NULL;
+    }
+
+    ring->sqHead = (unsigned *)(ring->sqRing + params.sq_off.head);
+    ring->sqTail = (unsigned *)(ring->sqRing + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(ring->sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(ring->sqRing + params.sq_off.array);
+    ring->cqHead = (unsigned *)(ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned *)(ring->cqRing + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ring->cqRing + params.cq_off.cqes);
+    // ------------------------------------------------------------------------
+
+    // REGISTER THE BUFFERS ---------------------------------------------------
+    // Split the buffer budget between the buffers. Each holds at least one block.
+    ring->bufSize = currentFS->opts.bufferBudget / URING_BUFS;
+    ring->bufSize -= ring->bufSize % currentFS->sb.blockSize;
+    if (ring->bufSize == 0)
+    {
+        ring->bufSize = currentFS->sb.blockSize;
+    }
+
+    struct iovec iov[URING_BUFS];
+    for (int i = 0; i < URING_BUFS; i++)
+    {
+        ring->bufs[i].data = (unsigned char *)do_malloc(ring->bufSize);
+        iov[i].iov_base = ring->bufs[i].data;
+        iov[i].iov_len = ring->bufSize;
+        ring->freeBufs[i] = i;
+    }
+    ring->numFreeBufs = URING_BUFS;
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_BUFS) < 0)
+    {
+        uring = ring;
+        freeUring();
+        return NULL;
+    }
+    // ------------------------------------------------------------------------
+
+    // REGISTER THE FILES -----------------------------------------------------
+    int fds[URING_FILES + 1];
+    fds[0] = fileno(ext2FS);
+    for (int i = 1; i <= URING_FILES; i++)
+    {
+        fds[i] = -1;
+    }
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, fds, URING_FILES + 1) < 0)
+    {
+        uring = ring;
+        freeUring();
+        return NULL;
+    }
+    // ------------------------------------------------------------------------
+
+    return ring;
+}
+
+// Wait for the writes in flight and tear down the io_uring
+// of the calling thread (if it has one).
+static void freeUring(void)
+{
+    struct Uring *ring = uring;
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    drainUring();
+    uring = NULL;
+
+    // Free the allocated memory.
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED)
+    {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED)
+    {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqes != NULL && (void *)ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    for (int i = 0; i < URING_BUFS; i++)
+    {
+        free(ring->bufs[i].data);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+// Wait until every file of the io_uring of the calling thread is done.
+static void drainUring(void)
+{
+    struct Uring *ring = uring;
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    while (ring->inFlight > 0 || ring->toSubmit > 0)
+    {
+        if (submitUring(ring, 1) != 0)
+        {
+            break;
+        }
+        reapUring(ring);
+    }
+}
+
+// Get the next free submission queue entry (cleared).
+static struct io_uring_sqe *getUringSqe(struct Uring *ring)
+{
+    // The queue only fills up if it has not been submitted for a while.
+    unsigned tail = *ring->sqTail;
+    if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == *ring->sqMask + 1)
+    {
+        submitUring(ring, 0);
+    }
+
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqArray[index] = index;
+
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit += 1;
+
+    return sqe;
+}
+
+// Submit the queued entries and wait for at least minComplete completions.
+static int submitUring(struct Uring *ring, int minComplete)
+{
+    // Nothing to wait for.
+    if (ring->inFlight + ring->toSubmit == 0)
+    {
+        minComplete = 0;
+    }
+    if (ring->toSubmit == 0 && minComplete == 0)
+    {
+        return 0;
+    }
+
+    while (1)
+    {
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, minComplete,
+                        minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            reportError("io_uring_enter failed: %s", strerror(errno));
+            return -1;
+        }
+
+        ring->toSubmit -= n;
+        ring->inFlight += n;
+
+        return 0;
+    }
+}
+
+// Process the completions. A buffer is released once its write completes
+// (a failed read cancels its linked write, which completes as well).
+static int reapUring(struct Uring *ring)
+{
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+        int bufIndex = cqe->user_data / 2;
+        int isWrite = cqe->user_data % 2;
+        int res = cqe->res;
+        head++;
+        ring->inFlight -= 1;
+
+        struct UringBuf *buf = &ring->bufs[bufIndex];
+        struct UringFile *file = &ring->files[buf->file];
+
+        // Keep the first error of the file. The error of a read
+        // takes precedence over the cancellation of its write.
+        uint32_t expected = isWrite ? buf->writeLen : buf->readLen;
+        if (file->error == 0 && (res < 0 || (uint32_t)res != expected))
+        {
+            file->error = res < 0 ? res : -EIO;
+        }
+
+        if (isWrite)
+        {
+            ring->freeBufs[ring->numFreeBufs++] = bufIndex;
+            file->pending -= 1;
+            if (file->pending == 0 && file->closing)
+            {
+                __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+                finishUringFile(ring, buf->file);
+            }
+        }
+    }
+
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// Close a file once all its writes are done. A file that ends
+// with a hole is extended to its full size.
+static int finishUringFile(struct Uring *ring, int slot)
+{
+    struct UringFile *file = &ring->files[slot];
+
+    if (file->error == 0 && file->endOffset < file->size &&
+        ftruncate(fileno(file->fileObj), file->size) != 0)
+    {
+        file->error = -errno;
+    }
+
+    if (file->error != 0)
+    {
+        reportError("%s: write failed: %s", file->name, strerror(-file->error));
+    }
+
+    // The fixed file slot keeps the file open until it is replaced.
+    int isFailed = file->error != 0;
+    do_fclose(file->fileObj);
+    free(file->name);
+    file->fileObj = NULL;
+    file->name = NULL;
+
+    return isFailed ? -1 : 0;
+}
+
+// Hand the slot at head over to the writer and move on to the next slot,
+// waiting for it to be drained if the writer is behind.
+static int submitStreamSlot(struct FileStream *stream)
+{
+    if (!stream->threaded)
+    {
+        struct StreamSlot *slot = &stream->slots[stream->head];
+        if (writeStreamSlot(stream, slot) != 0)
+        {
+            stream->failed = 1;
+        }
+        slot->len = 0;
+
+        return 0;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+
+    stream->filled += 1;
+    pthread_cond_signal(&stream->slotFilled);
+
+    stream->head = (stream->head + 1) % RING_SLOTS;
+    while (stream->filled == RING_SLOTS)
+    {
+        pthread_cond_wait(&stream->slotFreed, &stream->lock);
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+
+    return 0;
+}
+
+// Write a slot at its offset in the file. Seeking past the last write
+// leaves the bytes in between as a hole in the file.
+static int writeStreamSlot(struct FileStream *stream, struct StreamSlot *slot)
+{
+    // The slots come in file order, so the file is hashed on the way
+    // (by the writer thread, while the reader fills the next slots).
+    if (stream->digest != NULL)
+    {
+        updateDigestAt(stream->digest, slot->buf, slot->offset, slot->len);
+    }
+
+    // A file that is only hashed is not written.
+    if (stream->fileObj == NULL)
+    {
+        stream->writeOffset = slot->offset + slot->len;
+        return 0;
+    }
+
+    if (stream->writeOffset != slot->offset)
+    {
+        ADD_STAT(seeks, 1);
+        if (fseeko(stream->fileObj, slot->offset, SEEK_SET) != 0)
+        {
+            reportError("fseek failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    if (do_fwrite(slot->buf, sizeof(unsigned char), slot->len, stream->fileObj) != 0)
+    {
+        return -1;
+    }
+    stream->writeOffset = slot->offset + slot->len;
+
+    return 0;
+}
+
+// Writer thread: write the filled slots (in ring order) into the file.
+static void *streamWriter(void *arg)
+{
+    struct FileStream *stream = (struct FileStream *)arg;
+
+    // Report into the error sink of the thread extracting the file.
+    errorSink = stream->errorSink;
+
+    while (1)
+    {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->filled == 0 && !stream->done)
+        {
+            pthread_cond_wait(&stream->slotFilled, &stream->lock);
+        }
+
+        // The reader is done and every slot has been written.
+        if (stream->filled == 0)
+        {
+            pthread_mutex_unlock(&stream->lock);
+            break;
+        }
+        pthread_mutex_unlock(&stream->lock);
+
+        // The slot at tail is owned by the writer until it is released.
+        // Once a write fails, the remaining slots are just released.
+        struct StreamSlot *slot = &stream->slots[stream->tail];
+        int writeFailed = !stream->failed && writeStreamSlot(stream, slot) != 0;
+        slot->len = 0;
+        stream->tail = (stream->tail + 1) % RING_SLOTS;
+
+        pthread_mutex_lock(&stream->lock);
+        if (writeFailed)
+        {
+            stream->failed = 1;
+        }
+        stream->filled -= 1;
+        pthread_cond_signal(&stream->slotFreed);
+        pthread_mutex_unlock(&stream->lock);
+    }
+
+    return NULL;
+}
+
+static int read12DBlockPtrs(struct BlockWalker *walker)
+{
+    for (int i = 0; i < DBLOCK_PTR_COUNT; i++)
+    {
+        if (walker->readBytes == walker->fileSize)
+        {
+            break;
+        }
+
+        // Queue the corresponding direct data block.
+        readDataBlock(walker, walker->inode->DBlockPtrs[i]);
+    }
+
+    return 0;
+}
+
+static int readSIBlockPtr(struct BlockWalker *walker, uint32_t sIBlockPtr)
+{
+    if (walker->readBytes == walker->fileSize)
+    {
+        return 0;
+    }
+
+    // A missing singly indirect block is a hole of a block's worth of blocks.
+    uint64_t ptrsPerBlock = currentFS->sb.blockSize / DBLOCK_PTR_SIZE;
+    if (sIBlockPtr == 0)
+    {
+        return skipHole(walker, ptrsPerBlock);
+    }
+
+    // Get all the direct block pointers (four bytes each - in little endian).
+    const uint32_t *dBlockPtrs = readIndirectBlock(walker, sIBlockPtr, 0);
+
+    int numOfDBlockPtrs = currentFS->sb.blockSize / DBLOCK_PTR_SIZE;
+    for (int i = 0; i < numOfDBlockPtrs; i++)
+    {
+        if (walker->readBytes == walker->fileSize)
+        {
+            break;
+        }
+
+        // Queue the corresponding direct data block.
+        readDataBlock(walker, dBlockPtrs[i]);
+    }
+
+    return 0;
+}
+
+static int readDIBlockPtr(struct BlockWalker *walker, uint32_t dIBlockPtr)
+{
+    if (walker->readBytes == walker->fileSize)
+    {
+        return 0;
+    }
+
+    // A missing doubly indirect block skips its whole subtree.
+    uint64_t ptrsPerBlock = currentFS->sb.blockSize / DBLOCK_PTR_SIZE;
+    if (dIBlockPtr == 0)
+    {
+        return skipHole(walker, ptrsPerBlock * ptrsPerBlock);
+    }
+
+    // Get all the singly indirect block pointers (four bytes each - in little endian).
+    const uint32_t *sIBlockPtrs = readIndirectBlock(walker, dIBlockPtr, 1);
+
+    int numOfSIBlockPtrs = currentFS->sb.blockSize / DBLOCK_PTR_SIZE;
+    for (int i = 0; i < numOfSIBlockPtrs; i++)
+    {
+        if (walker->readBytes == walker->fileSize)
+        {
+            break;
+        }
+
+        // Read the corresponding singly indirect data block.
+        readSIBlockPtr(walker, sIBlockPtrs[i]);
+    }
+
+    return 0;
+}
+
+static int readTIBlockPtr(struct BlockWalker *walker, uint32_t tIBlockPtr)
+{
+    if (walker->readBytes == walker->fileSize)
+    {
+        return 0;
+    }
+
+    // A missing triply indirect block skips its whole subtree.
+    uint64_t ptrsPerBlock = currentFS->sb.blockSize / DBLOCK_PTR_SIZE;
+    if (tIBlockPtr == 0)
+    {
+        return skipHole(walker, ptrsPerBlock * ptrsPerBlock * ptrsPerBlock);
+    }
+
+    // Get all the doubly indirect block pointers (four bytes each - in little endian).
+    const uint32_t *dIBlockPtrs = readIndirectBlock(walker, tIBlockPtr, 2);
+
+    int numOfDIBlockPtrs = currentFS->sb.blockSize / DBLOCK_PTR_SIZE;
+    for (int i = 0; i < numOfDIBlockPtrs; i++)
+    {
+        if (walker->readBytes == walker->fileSize)
+        {
+            break;
+        }
+
+        // Read the corresponding doubly indirect data block.
+        readDIBlockPtr(walker, dIBlockPtrs[i]);
+    }
+
+    return 0;
+}
+
+// Read a whole indirect block (i.e., an array of block pointers) at once.
+// The level (0 = SI, 1 = DI, 2 = TI) picks the scratch buffer so that the
+// nested walkers do not overwrite each other's blocks.
+static const uint32_t *readIndirectBlock(struct BlockWalker *walker, uint32_t blockPtr, int level)
+{
+    return (const uint32_t *)readCachedBlocks(walker->ext2FS,
+                                              blockPtr,
+                                              1,
+                                              READ_INDIRECT,
+                                              walker->ptrBlocks[level]);
+}
+
+// Check the header of an extent tree node of nodeSize bytes (the root in the
+// inode, or a block) and its depth, unless depth is negative (the root).
+static int checkExtentNode(const unsigned char *node, size_t nodeSize, int depth)
+{
+    uint16_t numEntries = le16(&node[2]);
+    uint16_t maxEntries = le16(&node[4]);
+    uint16_t nodeDepth = le16(&node[6]);
+
+    if (le16(&node[0]) != EXTENT_MAGIC ||
+        numEntries > maxEntries ||
+        EXTENT_HEADER_SIZE + (size_t)maxEntries * EXTENT_ENTRY_SIZE > nodeSize ||
+        nodeDepth > EXTENT_MAX_DEPTH ||
+        (depth >= 0 && nodeDepth != depth))
+    {
+        reportCorruption("Bad extent tree node");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Walk an extent tree node: the index nodes (depth above 0) point to the
+// nodes of the next level down, and the leaves hold the extents, all of
+// them in file order.
+static int readExtentNode(struct BlockWalker *walker, const unsigned char *node, size_t nodeSize, int depth)
+{
+    if (checkExtentNode(node, nodeSize, depth) != 0)
+    {
+        return -1;
+    }
+
+    uint16_t numEntries = le16(&node[2]);
+    depth = le16(&node[6]);
+    for (uint16_t i = 0; i < numEntries; i++)
+    {
+        if (walker->readBytes == walker->fileSize)
+        {
+            break;
+        }
+
+        const unsigned char *entry = &node[EXTENT_HEADER_SIZE + (size_t)i * EXTENT_ENTRY_SIZE];
+        if (depth == 0)
+        {
+            readExtent(walker, entry);
+            continue;
+        }
+
+        // Index entry: the first file block of the child (bytes 0 to 3), and
+        // the child's block number (lower 32 bits at byte 4, upper 16 at byte 8).
+        uint64_t childBlock = ((uint64_t)le16(&entry[8]) << 32) | le32(&entry[4]);
+        const unsigned char *child = readCachedBlocks(walker->ext2FS,
+                                                      childBlock,
+                                                      1,
+                                                      READ_INDIRECT,
+                                                      walker->ptrBlocks[depth - 1]);
+        if (readExtentNode(walker, child, currentFS->sb.blockSize, depth - 1) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Queue the blocks of a leaf entry: the first file block of the extent
+// (bytes 0 to 3), its length (bytes 4 and 5), and its first physical block
+// (upper 16 bits at byte 6, lower 32 at byte 8).
+static int readExtent(struct BlockWalker *walker, const unsigned char *extent)
+{
+    uint64_t blockSize = currentFS->sb.blockSize;
+    uint32_t fileBlock = le32(&extent[0]);
+    uint16_t len = le16(&extent[4]);
+    uint64_t physBlock = ((uint64_t)le16(&extent[6]) << 32) | le32(&extent[8]);
+
+    // The blocks between the previous extent and this one are a hole.
+    uint64_t nextBlock = walker->readBytes / blockSize;
+    if (fileBlock < nextBlock)
+    {
+        reportCorruption("Overlapping extents");
+        return -1;
+    }
+    if (fileBlock > nextBlock)
+    {
+        skipHole(walker, fileBlock - nextBlock);
+    }
+
+    // Uninitialized extents (allocated but never written) read as zeros.
+    if (len > EXTENT_MAX_INIT_LEN)
+    {
+        return skipHole(walker, len - EXTENT_MAX_INIT_LEN);
+    }
+
+    return queueBlocks(walker, physBlock, len);
+}
+
+// Read and parse all the directory entries of a directory inode.
+// The entries are parsed run by run, straight out of the mapping when
+// the image is mapped, so the directory is never copied as a whole.
+// Only the names are copied (into the arena, along with the entries).
+static struct DirEntries readDirEntries(struct Inode *inode, FILE *ext2FS, struct Arena *arena)
+{
+    // Size the entries array and the names buffer for the worst case, so that
+    // they never have to grow: every entry takes at least DIR_ENTRY_MIN_SIZE
+    // bytes on disk, of which at least 7 are not part of its name.
+    struct DirEntries dirEntries = {0};
+    dirEntries.maxCount = getFileSize(inode) / DIR_ENTRY_MIN_SIZE;
+    dirEntries.entries = (struct DirEntry *)arenaAlloc(arena, dirEntries.maxCount * sizeof(struct DirEntry));
+    dirEntries.names = (char *)arenaAlloc(arena, getFileSize(inode));
+
+    // Initialize the block walker.
+    struct BlockWalker walker = {0};
+    walker.ext2FS = ext2FS;
+    walker.inode = inode;
+    walker.maxRunBytes = MAX_RUN_BYTES;
+    walker.handleRun = parseRunDirEntries;
+    walker.ctx = &dirEntries;
+
+    walkDataBlocks(&walker);
+
+    return dirEntries;
+}
+
+// Run handler: parse the directory entries held by the run.
+// Directory entries never span across blocks, so each run can be parsed
+// on its own.
+static int parseRunDirEntries(struct BlockWalker *walker, struct BlockRun *run, uint64_t fileBytes)
+{
+    struct DirEntries *dirEntries = (struct DirEntries *)walker->ctx;
+
+    // Runs inside the mapping are parsed in place.
+    uint64_t runBytes = run->numBlocks * currentFS->sb.blockSize;
+    uint64_t runAddr = run->physBlock * currentFS->sb.blockSize;
+    unsigned char *scratch = NULL;
+    if (currentFS->imageMap.base == NULL || runAddr + runBytes > currentFS->imageMap.size)
+    {
+        scratch = (unsigned char *)do_malloc(runBytes);
+    }
+
+    const unsigned char *data = readCachedBlocks(walker->ext2FS, run->physBlock, run->numBlocks, READ_DIRECTORY, scratch);
+    parseDirEntryInfo(data, fileBytes, dirEntries);
+
+    // Free the allocated memory.
+    free(scratch);
+
+    return 0;
+}
+
+// Parse the data block/s (when it is a directory entry information)
+// and append the directory entries into the given entries array.
+// Note: A directory is never empty (i.e., it always has at least two entries:
+//       the current directory (.) and the parent directory (..)).
+static int parseDirEntryInfo(const unsigned char *data, size_t size, struct DirEntries *dirEntries)
+{
+    // Traverse the every byte of data.
+    uint32_t i = 0;
+    while (i + 8 <= size && dirEntries->count < dirEntries->maxCount)
+    {
+        struct DirEntry *dirEntry = &dirEntries->entries[dirEntries->count];
+
+        // Get the inode number (byte 0 to byte 3 - in little endian).
+        dirEntry->inodeNum = le32(&data[i]);
+
+        // Get the entry size (byte 4 to byte 5 - in little endian).
+        uint16_t entrySize = le16(&data[i + 4]);
+
+        // Get the name length (byte 6) and the file type (byte 7).
+        dirEntry->nameLen = data[i + 6];
+        dirEntry->fileType = data[i + 7];
+
+        // Stop at a corrupted entry instead of looping forever.
+        if (entrySize < 8 || i + 8 + dirEntry->nameLen > size)
+        {
+            break;
+        }
+
+        // Copy the name (byte 8 to byte 8 + nameLen - 1) into the names buffer
+        // and add the null terminator.
+        dirEntry->nameOffset = dirEntries->namesLen;
+        memcpy(&dirEntries->names[dirEntries->namesLen], &data[i + 8], dirEntry->nameLen);
+        dirEntries->names[dirEntries->namesLen + dirEntry->nameLen] = '\0';
+        dirEntries->namesLen += dirEntry->nameLen + 1;
+
+        // Cases for when inodeNum is 0 will be handled by the caller
+        // of this function.
+        dirEntries->count++;
+
+        // Update i for the next directory entry.
+        i += entrySize;
+    }
+
+    return 0;
+}
+
+// Whether the entry is the current directory (.) or the parent directory (..).
+static int isDotEntry(struct DirEntries *dirEntries, struct DirEntry *dirEntry)
+{
+    const char *name = &dirEntries->names[dirEntry->nameOffset];
+
+    return (dirEntry->nameLen == 1 && name[0] == '.') ||
+           (dirEntry->nameLen == 2 && name[0] == '.' && name[1] == '.');
+}
+
+// Start a walk of the subtree of a directory whose path is dirPath (with a
+// trailing slash). The directory itself is not one of the entries.
+static void initTreeWalk(struct TreeWalk *walk, struct Inode *dirInode, const char *dirPath, FILE *ext2FS, struct Arena *arena)
+{
+    memset(walk, 0, sizeof(struct TreeWalk));
+    walk->ext2FS = ext2FS;
+    walk->arena = arena;
+    initWalkPath(walk, dirPath);
+
+    walk->inode = dirInode;
+    walk->descend = 1;
+}
+
+// Start a walk over the directories of an inode table scan. The entries of
+// the walk have no inode (walk->inode is NULL), only an inode number.
+static void initScanWalk(struct TreeWalk *walk, struct InodeScan *scan, uint32_t dirInodeNum, const char *dirPath)
+{
+    memset(walk, 0, sizeof(struct TreeWalk));
+    walk->scan = scan;
+    initWalkPath(walk, dirPath);
+
+    walk->inodeNum = dirInodeNum;
+    walk->descend = 1;
+}
+
+static void initWalkPath(struct TreeWalk *walk, const char *dirPath)
+{
+    walk->pathLen = strlen(dirPath);
+    walk->maxPathLen = walk->pathLen + 256;
+    walk->path = (char *)do_malloc(walk->maxPathLen);
+    memcpy(walk->path, dirPath, walk->pathLen + 1);
+}
+
+// Push the current entry (a directory) onto the stack, with its entries
+// (and their inodes) read from the image or taken from the scan.
+// A directory that is already on the stack (an entry of a corrupted image
+// that points back to an ancestor) would make the walk go on forever.
+static int pushWalkFrame(struct TreeWalk *walk)
+{
+    for (size_t i = 0; i < walk->depth; i++)
+    {
+        if (walk->frames[i].inodeNum == walk->inodeNum)
+        {
+            reportCorruption("Directory cycle at inode %u", walk->inodeNum);
+            return -1;
+        }
+    }
+
+    if (walk->depth == walk->maxDepth)
+    {
+        walk->maxDepth = walk->maxDepth == 0 ? 16 : walk->maxDepth * 2;
+        walk->frames = (struct WalkFrame *)do_realloc(walk->frames, walk->maxDepth * sizeof(struct WalkFrame));
+    }
+
+    struct WalkFrame *frame = &walk->frames[walk->depth++];
+    memset(frame, 0, sizeof(struct WalkFrame));
+    frame->inodeNum = walk->inodeNum;
+    frame->pathLen = walk->pathLen;
+
+    if (walk->scan != NULL)
+    {
+        struct ScanDir *dir = lookupScanDir(walk->scan, walk->inodeNum);
+        if (dir != NULL)
+        {
+            frame->dirEntries = dir->dirEntries;
+        }
+    }
+    else
+    {
+        frame->mark = markArena(walk->arena);
+        frame->dirEntries = readDirEntries(walk->inode, walk->ext2FS, walk->arena);
+        frame->entryInodes = parseDirEntryInodes(&frame->dirEntries, walk->ext2FS, walk->arena);
+    }
+
+    return 0;
+}
+
+// Move on to the next entry: the first entry of the current one if it is a
+// directory, or else the next entry of the deepest directory that has any
+// left. Returns 0 once the whole subtree has been walked (or the walk has
+// run into a directory cycle).
+static int nextTreeEntry(struct TreeWalk *walk)
+{
+    if (walk->descend)
+    {
+        walk->descend = 0;
+        if (pushWalkFrame(walk) != 0)
+        {
+            return 0;
+        }
+    }
+
+    while (walk->depth > 0)
+    {
+        struct WalkFrame *frame = &walk->frames[walk->depth - 1];
+
+        // The directory is done: release its entries and go back up.
+        if (frame->next == frame->dirEntries.count)
+        {
+            if (walk->scan == NULL)
+            {
+                releaseArena(walk->arena, frame->mark);
+            }
+            walk->depth--;
+            continue;
+        }
+
+        size_t i = frame->next++;
+        struct DirEntry *dirEntry = &frame->dirEntries.entries[i];
+
+        // Disregard the dot entries and the unused entries.
+        if (isDotEntry(&frame->dirEntries, dirEntry) || dirEntry->inodeNum == 0)
+        {
+            continue;
+        }
+
+        walk->inodeNum = dirEntry->inodeNum;
+        if (walk->scan != NULL)
+        {
+            walk->inode = NULL;
+            walk->descend = isScanDir(walk->scan, walk->inodeNum);
+        }
+        else
+        {
+            walk->inode = &frame->entryInodes[i];
+            walk->descend = isInodeDir(walk->inode);
+        }
+
+        // Put the name (and a slash for a directory) in place of the name of
+        // the previous entry. +2 is for the slash and the null terminator.
+        size_t pathLen = frame->pathLen + dirEntry->nameLen + walk->descend;
+        if (pathLen + 2 > walk->maxPathLen)
+        {
+            walk->maxPathLen = (pathLen + 2) * 2;
+            walk->path = (char *)do_realloc(walk->path, walk->maxPathLen);
+        }
+        memcpy(&walk->path[frame->pathLen], &frame->dirEntries.names[dirEntry->nameOffset], dirEntry->nameLen);
+        if (walk->descend)
+        {
+            walk->path[pathLen - 1] = '/';
+        }
+        walk->path[pathLen] = '\0';
+        walk->pathLen = pathLen;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static void freeTreeWalk(struct TreeWalk *walk)
+{
+    // A walk that was stopped early still holds the entries of its directories.
+    if (walk->depth > 0 && walk->scan == NULL)
+    {
+        releaseArena(walk->arena, walk->frames[0].mark);
+    }
+
+    // Free the allocated memory.
+    free(walk->frames);
+    free(walk->path);
+}
+
+static void initOutput(struct OutputBuffer *output, FILE *out)
+{
+    output->out = out;
+    output->buf = (char *)do_malloc(OUTPUT_BUFFER_SIZE);
+    output->len = 0;
+}
+
+// Append text to the buffer, which is written out whenever it fills up.
+// Write errors are left to the caller (see ferror).
+static void appendOutput(struct OutputBuffer *output, const char *text, size_t len)
+{
+    if (output->len + len > OUTPUT_BUFFER_SIZE)
+    {
+        fwrite(output->buf, 1, output->len, output->out);
+        output->len = 0;
+
+        // Text larger than the whole buffer is written as is.
+        if (len > OUTPUT_BUFFER_SIZE)
+        {
+            fwrite(text, 1, len, output->out);
+            return;
+        }
+    }
+
+    memcpy(&output->buf[output->len], text, len);
+    output->len += len;
+}
+
+// Write out what is left in the buffer and free it.
+static void flushOutput(struct OutputBuffer *output)
+{
+    if (output->len > 0)
+    {
+        fwrite(output->buf, 1, output->len, output->out);
+    }
+
+    free(output->buf);
+    output->buf = NULL;
+}
+
+// Find the entry with the given name in a directory and get its inode number.
+// Hash indexed directories are looked up through their htree, so that only
+// the index blocks and the leaf block that holds the name are read.
+// Otherwise (or if the index cannot be used), all the entries are scanned.
+// Returns 1 if the entry was found and 0 otherwise.
+static int lookupDirEntry(struct Inode *dirInode, const char *name, FILE *ext2FS, struct Arena *arena, uint32_t *inodeNum)
+{
+    struct ArenaMark mark = markArena(arena);
+
+    int isFound = -1;
+    if ((currentFS->sb.featureCompat & FEATURE_COMPAT_DIR_INDEX) && (dirInode->flags & INODE_INDEX_FL))
+    {
+        isFound = lookupHtree(dirInode, name, ext2FS, arena, inodeNum);
+    }
+
+    // Fall back to a linear scan of the directory entries.
+    if (isFound < 0)
+    {
+        isFound = 0;
+
+        struct DirEntries dirEntries = readDirEntries(dirInode, ext2FS, arena);
+        for (size_t i = 0; i < dirEntries.count; i++)
+        {
+            struct DirEntry *dirEntry = &dirEntries.entries[i];
+            if (dirEntry->inodeNum != 0 && strcmp(&dirEntries.names[dirEntry->nameOffset], name) == 0)
+            {
+                *inodeNum = dirEntry->inodeNum;
+                isFound = 1;
+                break;
+            }
+        }
+    }
+
+    // Release the directory blocks.
+    releaseArena(arena, mark);
+
+    return isFound;
+}
+
+// Descend the htree of a hash indexed directory to the leaf block/s
+// that may hold the name and search them.
+// Block 0 of the directory is the root of the tree. It starts with the
+// (.) and (..) entries, the latter of which spans the rest of the block
+// and hides the root info (at byte 24) and the index entries from the
+// directory entry parsers. Every index entry is a (hash, block) pair,
+// except for the first one, which has a (limit, count) header in place
+// of its hash. Interior index blocks are a single empty directory entry
+// followed by the same (limit, count) header and index entries.
+// Returns 1 if found, 0 if not and -1 if the index cannot be used.
+static int lookupHtree(struct Inode *dirInode, const char *name, FILE *ext2FS, struct Arena *arena, uint32_t *inodeNum)
+{
+    unsigned char *scratch = (unsigned char *)arenaAlloc(arena, currentFS->sb.blockSize);
+    uint64_t numBlocks = (getFileSize(dirInode) + currentFS->sb.blockSize - 1) / currentFS->sb.blockSize;
+
+    // Read the root block.
+    uint64_t rootBlock = getFileBlock(dirInode, 0, ext2FS, scratch);
+    if (rootBlock == 0)
+    {
+        return -1;
+    }
+    unsigned char *block = (unsigned char *)arenaAlloc(arena, currentFS->sb.blockSize);
+    const unsigned char *data = readCachedBlocks(ext2FS, rootBlock, 1, READ_DIRECTORY, block);
+
+    // Parse the root info.
+    uint32_t reservedZero = le32(&data[24]);
+    uint8_t hashVersion = data[28];
+    uint8_t infoLength = data[29];
+    uint8_t indirectLevels = data[30];
+    if (reservedZero != 0 || hashVersion > DX_HASH_TEA || infoLength != 8 || indirectLevels >= DX_MAX_LEVELS)
+    {
+        return -1;
+    }
+
+    // File systems created on unsigned char platforms say so in the superblock.
+    if (currentFS->sb.flags & FLAGS_UNSIGNED_HASH)
+    {
+        hashVersion += DX_HASH_UNSIGNED_DELTA;
+    }
+    uint32_t hash = dirHash(name, strlen(name), hashVersion);
+
+    // Descend to the leaf level.
+    const unsigned char *entries = &data[24 + infoLength];
+    for (int level = 0;; level++)
+    {
+        uint16_t limit = le16(&entries[0]);
+        uint16_t count = le16(&entries[2]);
+        if (count == 0 || count > limit || (size_t)(entries - data) + (size_t)limit * 8 > currentFS->sb.blockSize)
+        {
+            return -1;
+        }
+
+        // Binary search for the last index entry whose hash is not above the
+        // hash of the name. The first entry covers the hashes below the second.
+        uint16_t low = 1;
+        uint16_t high = count - 1;
+        while (low <= high)
+        {
+            uint16_t mid = low + (high - low) / 2;
+            if (le32(&entries[mid * 8]) > hash)
+            {
+                high = mid - 1;
+            }
+            else
+            {
+                low = mid + 1;
+            }
+        }
+        uint16_t at = low - 1;
+        uint32_t childBlock = le32(&entries[at * 8 + 4]) & 0x0FFFFFFF; // Upper bits are reserved.
+        if (childBlock >= numBlocks)
+        {
+            return -1;
+        }
+
+        // Search the leaf block. Names with the same hash may spill over into
+        // the next leaf blocks, whose index entries then have the lowest bit
+        // of their hash set (i.e., the collision bit).
+        if (level == indirectLevels)
+        {
+            for (;;)
+            {
+                int isFound = findInDirBlock(dirInode, childBlock, name, ext2FS, arena, inodeNum);
+                if (isFound)
+                {
+                    return 1;
+                }
+
+                at++;
+                if (at >= count)
+                {
+                    // The collision chain may continue in the next
+                    // index block. Let the linear scan settle it.
+                    return (le32(&entries[(at - 1) * 8]) & ~1u) == hash && at > 1 ? -1 : 0;
+                }
+
+                uint32_t nextHash = le32(&entries[at * 8]);
+                if ((nextHash & 1) == 0 || (nextHash & ~1u) != hash)
+                {
+                    return 0;
+                }
+
+                childBlock = le32(&entries[at * 8 + 4]) & 0x0FFFFFFF;
+                if (childBlock >= numBlocks)
+                {
+                    return -1;
+                }
+            }
+        }
+
+        // Read the interior index block.
+        uint64_t physBlock = getFileBlock(dirInode, childBlock, ext2FS, scratch);
+        if (physBlock == 0)
+        {
+            return -1;
+        }
+        block = (unsigned char *)arenaAlloc(arena, currentFS->sb.blockSize);
+        data = readCachedBlocks(ext2FS, physBlock, 1, READ_DIRECTORY, block);
+        entries = &data[8];
+    }
+}
+
+// Search a single block (given by its block number within the directory)
+// for the entry with the given name.
+static int findInDirBlock(struct Inode *dirInode, uint32_t fileBlock, const char *name, FILE *ext2FS, struct Arena *arena, uint32_t *inodeNum)
+{
+    unsigned char *scratch = (unsigned char *)arenaAlloc(arena, currentFS->sb.blockSize);
+    uint64_t physBlock = getFileBlock(dirInode, fileBlock, ext2FS, scratch);
+    if (physBlock == 0)
+    {
+        return 0;
+    }
+    const unsigned char *data = readCachedBlocks(ext2FS, physBlock, 1, READ_DIRECTORY, scratch);
+
+    // Compare the names in place.
+    size_t nameLen = strlen(name);
+    uint32_t i = 0;
+    while (i + 8 <= currentFS->sb.blockSize)
+    {
+        uint32_t entryInodeNum = le32(&data[i]);
+        uint16_t entrySize = le16(&data[i + 4]);
+        uint8_t entryNameLen = data[i + 6];
+        if (entrySize < 8 || i + 8 + entryNameLen > currentFS->sb.blockSize)
+        {
+            break;
+        }
+
+        if (entryInodeNum != 0 && entryNameLen == nameLen && memcmp(&data[i + 8], name, nameLen) == 0)
+        {
+            *inodeNum = entryInodeNum;
+            return 1;
+        }
+
+        i += entrySize;
+    }
+
+    return 0;
+}
+
+// Map a block number within a file to the physical block number
+// (0 for holes). The scratch buffer holds the indirect blocks.
+static uint64_t getFileBlock(struct Inode *inode, uint64_t fileBlock, FILE *ext2FS, unsigned char *scratch)
+{
+    if (inode->flags & EXTENTS_FL)
+    {
+        return getExtentBlock(inode, fileBlock, ext2FS, scratch);
+    }
+
+    uint64_t ptrsPerBlock = currentFS->sb.blockSize / DBLOCK_PTR_SIZE;
+
+    // Direct block pointers.
+    if (fileBlock < DBLOCK_PTR_COUNT)
+    {
+        return inode->DBlockPtrs[fileBlock];
+    }
+    fileBlock -= DBLOCK_PTR_COUNT;
+
+    // Pick the indirect block pointer (and the number of indirections).
+    uint32_t blockPtr;
+    int levels;
+    if (fileBlock < ptrsPerBlock)
+    {
+        blockPtr = inode->SIBlockPtr;
+        levels = 1;
+    }
+    else if ((fileBlock -= ptrsPerBlock) < ptrsPerBlock * ptrsPerBlock)
+    {
+        blockPtr = inode->DIBlockPtr;
+        levels = 2;
+    }
+    else
+    {
+        fileBlock -= ptrsPerBlock * ptrsPerBlock;
+        blockPtr = inode->TIBlockPtr;
+        levels = 3;
+    }
+
+    // Follow the indirect blocks.
+    while (levels > 0 && blockPtr != 0)
+    {
+        levels--;
+
+        uint64_t span = 1;
+        for (int i = 0; i < levels; i++)
+        {
+            span *= ptrsPerBlock;
+        }
+
+        const unsigned char *ptrs = readCachedBlocks(ext2FS, blockPtr, 1, READ_INDIRECT, scratch);
+        blockPtr = le32(&ptrs[(fileBlock / span) * DBLOCK_PTR_SIZE]);
+        fileBlock %= span;
+    }
+
+    return blockPtr;
+}
+
+// Get the physical block of a file block from the extent tree of the inode
+// (0 for a hole or an uninitialized extent): down from the root, the entry
+// that covers the file block is the last one that starts at or before it.
+static uint64_t getExtentBlock(struct Inode *inode, uint64_t fileBlock, FILE *ext2FS, unsigned char *scratch)
+{
+    unsigned char root[BLOCK_AREA_SIZE];
+    getBlockArea(inode, root);
+
+    const unsigned char *node = root;
+    size_t nodeSize = sizeof(root);
+    int depth = -1;
+    while (checkExtentNode(node, nodeSize, depth) == 0)
+    {
+        // Binary search of the entries (sorted by their first file block).
+        uint16_t numEntries = le16(&node[2]);
+        const unsigned char *entry = NULL;
+        size_t low = 0;
+        size_t high = numEntries;
+        while (low < high)
+        {
+            size_t mid = (low + high) / 2;
+            const unsigned char *midEntry = &node[EXTENT_HEADER_SIZE + mid * EXTENT_ENTRY_SIZE];
+            if (le32(&midEntry[0]) <= fileBlock)
+            {
+                entry = midEntry;
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        if (entry == NULL)
+        {
+            return 0;
+        }
+
+        // A leaf: the extent either covers the file block or it is a hole.
+        depth = le16(&node[6]);
+        if (depth == 0)
+        {
+            uint64_t start = le32(&entry[0]);
+            uint16_t len = le16(&entry[4]);
+            if (len > EXTENT_MAX_INIT_LEN || fileBlock >= start + len)
+            {
+                return 0;
+            }
+
+            return (((uint64_t)le16(&entry[6]) << 32) | le32(&entry[8])) + (fileBlock - start);
+        }
+
+        // An index entry: go down to its child.
+        uint64_t childBlock = ((uint64_t)le16(&entry[8]) << 32) | le32(&entry[4]);
+        node = readCachedBlocks(ext2FS, childBlock, 1, READ_INDIRECT, scratch);
+        nodeSize = currentFS->sb.blockSize;
+        depth--;
+    }
+
+    return 0;
+}
+
+// Hash a name the way the htree of a directory does (see hashVersion).
+static uint32_t dirHash(const char *name, int len, int hashVersion)
+{
+    // Default seed, used when the superblock has none.
+    uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    if (currentFS->sb.hashSeed[0] | currentFS->sb.hashSeed[1] | currentFS->sb.hashSeed[2] | currentFS->sb.hashSeed[3])
+    {
+        memcpy(buf, currentFS->sb.hashSeed, sizeof(buf));
+    }
+
+    int isUnsigned = hashVersion >= DX_HASH_UNSIGNED_DELTA;
+    uint32_t in[8];
+    uint32_t hash = 0;
+
+    switch (hashVersion % DX_HASH_UNSIGNED_DELTA)
+    {
+    case DX_HASH_LEGACY:
+        hash = dxHackHash(name, len, isUnsigned);
+        break;
+    case DX_HASH_HALF_MD4:
+        // Hash the name 32 bytes at a time.
+        for (const char *p = name; len > 0; len -= 32, p += 32)
+        {
+            str2HashBuf(p, len, in, 8, isUnsigned);
+            halfMD4Transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case DX_HASH_TEA:
+        // Hash the name 16 bytes at a time.
+        for (const char *p = name; len > 0; len -= 16, p += 16)
+        {
+            str2HashBuf(p, len, in, 4, isUnsigned);
+            teaTransform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    }
+
+    // The lowest bit is the collision bit of the index entries and
+    // the highest hash value is reserved for the end of the directory.
+    hash &= ~1u;
+    if (hash == (0x7fffffffu << 1))
+    {
+        hash = (0x7fffffffu - 1) << 1;
+    }
+
+    return hash;
+}
+
+// The legacy hash of the htree.
+static uint32_t dxHackHash(const char *name, int len, int isUnsigned)
+{
+    uint32_t hash;
+    uint32_t hash0 = 0x12a3fe2d;
+    uint32_t hash1 = 0x37abe8f9;
+
+    for (int i = 0; i < len; i++)
+    {
+        int c = isUnsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        if (hash & 0x80000000)
+        {
+            hash -= 0x7fffffff;
+        }
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+// Pack (up to) num * 4 bytes of the name into num words, padding
+// the rest with a value derived from the length of the name.
+static void str2HashBuf(const char *msg, int len, uint32_t *buf, int num, int isUnsigned)
+{
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    if (len > num * 4)
+    {
+        len = num * 4;
+    }
+
+    for (int i = 0; i < len; i++)
+    {
+        int c = isUnsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = (uint32_t)c + (val << 8);
+        if ((i % 4) == 3)
+        {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+
+    if (--num >= 0)
+    {
+        *buf++ = val;
+    }
+    while (--num >= 0)
+    {
+        *buf++ = pad;
+    }
+}
+
+#define ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ROL32(a, s))
+#define MD4_K2 013240474631u
+#define MD4_K3 015666365641u
+
+// The cut down (i.e., 3 rounds of 8 steps) MD4 transform of the htree.
+static void halfMD4Transform(uint32_t buf[4], const uint32_t in[8])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    // Round 1.
+    MD4_ROUND(MD4_F, a, b, c, d, in[0], 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[1], 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[2], 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[3], 19);
+    MD4_ROUND(MD4_F, a, b, c, d, in[4], 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[5], 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[6], 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[7], 19);
+
+    // Round 2.
+    MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+    // Round 3.
+    MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// The TEA transform (16 cycles) of the htree.
+static void teaTransform(uint32_t buf[4], const uint32_t in[4])
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int n = 0; n < 16; n++)
+    {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+// CONTENT DIGESTS ------------------------------------------------------------
+static void initDigest(struct Digest *digest, int algorithm)
+{
+    static const uint32_t sha256IV[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    memset(digest, 0, sizeof(struct Digest));
+    digest->algorithm = algorithm;
+    digest->crc = 0xFFFFFFFF;
+    memcpy(digest->state, sha256IV, sizeof(sha256IV));
+}
+
+static void updateDigest(struct Digest *digest, const unsigned char *data, size_t len)
+{
+    digest->offset += len;
+
+    if (digest->algorithm == EXT2_DIGEST_CRC32C)
+    {
+        digest->crc = crc32cUpdate(digest->crc, data, len);
+        return;
+    }
+
+    // Complete the pending block first, then hash the whole blocks in place.
+    if (digest->blockLen > 0)
+    {
+        size_t fill = SHA256_BLOCK_SIZE - digest->blockLen < len ? SHA256_BLOCK_SIZE - digest->blockLen : len;
+        memcpy(&digest->block[digest->blockLen], data, fill);
+        digest->blockLen += fill;
+        data += fill;
+        len -= fill;
+
+        if (digest->blockLen < SHA256_BLOCK_SIZE)
+        {
+            return;
+        }
+        sha256Blocks(digest->state, digest->block, 1);
+        digest->blockLen = 0;
+    }
+
+    size_t numBlocks = len / SHA256_BLOCK_SIZE;
+    if (numBlocks > 0)
+    {
+        sha256Blocks(digest->state, data, numBlocks);
+        data += numBlocks * SHA256_BLOCK_SIZE;
+        len -= numBlocks * SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(digest->block, data, len);
+    digest->blockLen = len;
+}
+
+// Hash len file bytes at fileOffset, after the hole (if any) before them.
+static void updateDigestAt(struct Digest *digest, const unsigned char *data, uint64_t fileOffset, size_t len)
+{
+    if (fileOffset > digest->offset)
+    {
+        hashZeros(digest, fileOffset - digest->offset);
+    }
+
+    updateDigest(digest, data, len);
+}
+
+static void hashZeros(struct Digest *digest, uint64_t len)
+{
+    static const unsigned char zeros[ZERO_BUFFER_SIZE];
+
+    while (len > 0)
+    {
+        size_t chunk = len < ZERO_BUFFER_SIZE ? len : ZERO_BUFFER_SIZE;
+        updateDigest(digest, zeros, chunk);
+        len -= chunk;
+    }
+}
+
+// Hash the hole at the end of the file (if any) and write the digest
+// as hex digits (big endian, as the usual tools print them).
+static void finishDigest(struct Digest *digest, uint64_t fileSize, char hex[DIGEST_HEX_MAX])
+{
+    if (fileSize > digest->offset)
+    {
+        hashZeros(digest, fileSize - digest->offset);
+    }
+
+    if (digest->algorithm == EXT2_DIGEST_CRC32C)
+    {
+        snprintf(hex, DIGEST_HEX_MAX, "%08x", digest->crc ^ 0xFFFFFFFF);
+        return;
+    }
+
+    // Pad with a one bit and zeros up to the last 8 bytes of a block,
+    // which get the length of the data in bits.
+    uint64_t bitLen = digest->offset * 8;
+    unsigned char padding[2 * SHA256_BLOCK_SIZE] = {0x80};
+    size_t padLen = (digest->blockLen < SHA256_BLOCK_SIZE - 8 ? SHA256_BLOCK_SIZE : 2 * SHA256_BLOCK_SIZE) - 8 - digest->blockLen;
+    for (int i = 0; i < 8; i++)
+    {
+        padding[padLen + i] = (unsigned char)(bitLen >> (56 - 8 * i));
+    }
+    updateDigest(digest, padding, padLen + 8);
+
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(&hex[8 * i], DIGEST_HEX_MAX - 8 * i, "%08x", digest->state[i]);
+    }
+}
+
+// Add the digest of a file to the manifest (from any thread).
+static void addManifestLine(struct Manifest *manifest, const char *path, struct Digest *digest, uint64_t fileSize)
+{
+    char hex[DIGEST_HEX_MAX];
+    finishDigest(digest, fileSize, hex);
+
+    pthread_mutex_lock(&manifest->lock);
+
+    if (manifest->numLines == manifest->maxLines)
+    {
+        manifest->maxLines = manifest->maxLines == 0 ? 64 : 2 * manifest->maxLines;
+        manifest->lines = (struct ManifestLine *)do_realloc(manifest->lines, manifest->maxLines * sizeof(struct ManifestLine));
+    }
+
+    struct ManifestLine *line = &manifest->lines[manifest->numLines++];
+    line->path = strdup(path);
+    memcpy(line->digest, hex, DIGEST_HEX_MAX);
+
+    pthread_mutex_unlock(&manifest->lock);
+}
+
+static int compareManifestLines(const void *a, const void *b)
+{
+    return strcmp(((const struct ManifestLine *)a)->path, ((const struct ManifestLine *)b)->path);
+}
+
+// Write the lines of the manifest sorted by path (and free them).
+static int writeManifest(struct Manifest *manifest, FILE *out)
+{
+    if (manifest->numLines > 1)
+    {
+        qsort(manifest->lines, manifest->numLines, sizeof(struct ManifestLine), compareManifestLines);
+    }
+
+    struct OutputBuffer output;
+    initOutput(&output, out);
+    for (size_t i = 0; i < manifest->numLines; i++)
+    {
+        struct ManifestLine *line = &manifest->lines[i];
+        appendOutput(&output, line->digest, strlen(line->digest));
+        appendOutput(&output, "  ", 2);
+        appendOutput(&output, line->path, strlen(line->path));
+        appendOutput(&output, "\n", 1);
+        free(line->path);
+    }
+    flushOutput(&output);
+
+    // Free the allocated memory.
+    free(manifest->lines);
+    manifest->lines = NULL;
+    manifest->numLines = 0;
+
+    if (fflush(out) != 0 || ferror(out))
+    {
+        reportError("write failed: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Build the tables of crc32cSlice8 and pick the fastest kernels the CPU
+// has: the CRC32 instruction of SSE4.2 and the SHA extensions.
+static void initDigestKernels(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        }
+        crc32cTable[0][i] = crc;
+    }
+    for (int t = 1; t < 8; t++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            crc32cTable[t][i] = (crc32cTable[t - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[t - 1][i] & 0xFF];
+        }
+    }
+
+    crc32cUpdate = crc32cSlice8;
+    sha256Blocks = sha256Generic;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32cUpdate = crc32cSse42;
+    }
+
+    unsigned int eax, ebx, ecx, edx;
+    if (__builtin_cpu_supports("sse4.1") && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA))
+    {
+        sha256Blocks = sha256ShaNi;
+    }
+#endif
+}
+
+// Portable CRC-32C, eight bytes at a time (slicing-by-8).
+static uint32_t crc32cSlice8(uint32_t crc, const unsigned char *data, size_t len)
+{
+    for (; len >= 8; data += 8, len -= 8)
+    {
+        uint32_t low = le32(&data[0]) ^ crc;
+        uint32_t high = le32(&data[4]);
+        crc = crc32cTable[7][low & 0xFF] ^ crc32cTable[6][(low >> 8) & 0xFF] ^
+              crc32cTable[5][(low >> 16) & 0xFF] ^ crc32cTable[4][low >> 24] ^
+              crc32cTable[3][high & 0xFF] ^ crc32cTable[2][(high >> 8) & 0xFF] ^
+              crc32cTable[1][(high >> 16) & 0xFF] ^ crc32cTable[0][high >> 24];
+    }
+
+    for (; len > 0; data++, len--)
+    {
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *data) & 0xFF];
+    }
+
+    return crc;
+}
+
+#define ROR32(x, s) (((x) >> (s)) | ((x) << (32 - (s))))
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+// Portable SHA-256 compression of whole 64-byte blocks.
+static void sha256Generic(uint32_t state[8], const unsigned char *data, size_t numBlocks)
+{
+    for (; numBlocks > 0; numBlocks--, data += SHA256_BLOCK_SIZE)
+    {
+        // The message schedule (the words of the block are big endian).
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 |
+                   (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+            uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+// CRC-32C with the CRC32 instruction (SSE4.2), eight bytes at a time.
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const unsigned char *data, size_t len)
+{
+    uint64_t crc64 = crc;
+    for (; len >= 8; data += 8, len -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = (uint32_t)crc64;
+    for (; len > 0; data++, len--)
+    {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+
+    return crc;
+}
+
+// SHA-256 compression with the SHA extensions. The state is kept as the
+// two halves the SHA256RNDS2 instruction works on (ABEF and CDGH), and
+// every iteration does four rounds while it schedules four more words.
+__attribute__((target("sha,sse4.1")))
+static void sha256ShaNi(uint32_t state[8], const unsigned char *data, size_t numBlocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1); // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);    // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);         // CDGH
+
+    for (; numBlocks > 0; numBlocks--, data += SHA256_BLOCK_SIZE)
+    {
+        __m128i savedState0 = state0;
+        __m128i savedState1 = state1;
+
+        __m128i msgs[4];
+        for (int i = 0; i < 4; i++)
+        {
+            msgs[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[16 * i]), byteSwap);
+        }
+
+        for (int i = 0; i < 16; i++)
+        {
+            __m128i msg = _mm_add_epi32(msgs[i % 4], _mm_loadu_si128((const __m128i *)&sha256K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+
+            // Words 4 * (i + 4) on, from the four groups of words before them.
+            if (i < 12)
+            {
+                __m128i next = _mm_sha256msg1_epu32(msgs[i % 4], msgs[(i + 1) % 4]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(msgs[(i + 3) % 4], msgs[(i + 2) % 4], 4));
+                msgs[i % 4] = _mm_sha256msg2_epu32(next, msgs[(i + 3) % 4]);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, savedState0);
+        state1 = _mm_add_epi32(state1, savedState1);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);    // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);    // HGFE
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif
+// ------------------------------------------------------------------------
+
+// Allocate size bytes (8-byte aligned) from the top chunk of the arena,
+// or from a new chunk if the top chunk is full.
+static void *arenaAlloc(struct Arena *arena, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+
+    struct ArenaChunk *chunk = arena->top;
+    if (chunk == NULL || chunk->used + size > chunk->size)
+    {
+        // Reuse the spare chunk if it is big enough.
+        if (arena->spare != NULL && arena->spare->size >= size)
+        {
+            chunk = arena->spare;
+            arena->spare = NULL;
+        }
+        else
+        {
+            size_t chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+            chunk = (struct ArenaChunk *)do_malloc(sizeof(struct ArenaChunk) + chunkSize);
+            chunk->size = chunkSize;
+        }
+
+        chunk->used = 0;
+        chunk->prev = arena->top;
+        arena->top = chunk;
+    }
+
+    void *ptr = &chunk->data[chunk->used];
+    chunk->used += size;
+
+    return ptr;
+}
+
+static struct ArenaMark markArena(struct Arena *arena)
+{
+    struct ArenaMark mark;
+    mark.chunk = arena->top;
+    mark.used = arena->top != NULL ? arena->top->used : 0;
+
+    return mark;
+}
+
+// Release everything allocated from the arena since the mark was taken.
+static void releaseArena(struct Arena *arena, struct ArenaMark mark)
+{
+    while (arena->top != mark.chunk)
+    {
+        struct ArenaChunk *chunk = arena->top;
+        arena->top = chunk->prev;
+
+        // Keep one chunk around so that a directory that straddles
+        // two chunks does not cost a malloc and a free every time.
+        if (arena->spare == NULL)
+        {
+            arena->spare = chunk;
+        }
+        else
+        {
+            free(chunk);
+        }
+    }
+
+    if (arena->top != NULL)
+    {
+        arena->top->used = mark.used;
+    }
+}
+
+static void freeArena(struct Arena *arena)
+{
+    struct ArenaMark start = {NULL, 0};
+    releaseArena(arena, start);
+
+    free(arena->spare);
+    arena->spare = NULL;
+}
+
+// Map the whole ext2 file system read-only. Metadata lookups jump around
+// the image, so the mapping starts out with random access advice.
+static int mapImage(FILE *ext2FS)
+{
+    int fd = fileno(ext2FS);
+
+    // Block devices report a size of zero, so ask for the end instead.
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        return -1;
+    }
+    uint64_t size = st.st_size;
+    if (size == 0)
+    {
+        off_t end = lseek(fd, 0, SEEK_END);
+        size = end > 0 ? end : 0;
+    }
+
+    if (size == 0)
+    {
+        return -1;
+    }
+
+    void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    currentFS->imageMap.base = (unsigned char *)base;
+    currentFS->imageMap.size = size;
+    setImagePhase(MADV_RANDOM);
+
+    return 0;
+}
+
+static void unmapImage(void)
+{
+    if (currentFS->imageMap.base != NULL)
+    {
+        munmap(currentFS->imageMap.base, currentFS->imageMap.size);
+        currentFS->imageMap.base = NULL;
+        currentFS->imageMap.size = 0;
+    }
+}
+
+// Set the access advice (MADV_RANDOM or MADV_SEQUENTIAL) of the whole mapping.
+static void setImagePhase(int advice)
+{
+    if (currentFS->imageMap.base != NULL)
+    {
+        madvise(currentFS->imageMap.base, currentFS->imageMap.size, advice);
+    }
+}
+
+// Give access advice for a byte range of the mapping.
+// madvise needs a page aligned address, so the range is widened.
+static void adviseImage(uint64_t offset, uint64_t len, int advice)
+{
+    if (currentFS->imageMap.base == NULL || offset >= currentFS->imageMap.size)
+    {
+        return;
+    }
+
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - (offset % pageSize);
+    uint64_t end = offset + len < currentFS->imageMap.size ? offset + len : currentFS->imageMap.size;
+
+    madvise(&currentFS->imageMap.base[start], end - start, advice);
+}
+
+// Get len bytes (of the given READ_* kind) of the ext2 file system starting at offset.
+// When the image is mapped, this is a pointer into the mapping (zero-copy).
+// Otherwise, the bytes are read into scratch and scratch is returned. If the
+// read fails, the error is reported and the bytes read as zeros, which the
+// parsers treat as empty (e.g., holes and the end of a directory).
+static const unsigned char *readImage(FILE *ext2FS, uint64_t offset, size_t len, int kind, void *scratch)
+{
+    ADD_STAT(bytesRead[kind], len);
+
+    if (currentFS->imageMap.base != NULL && offset + len <= currentFS->imageMap.size)
+    {
+        return &currentFS->imageMap.base[offset];
+    }
+
+    if (do_pread(ext2FS, scratch, len, offset) != 0)
+    {
+        memset(scratch, 0, len);
+    }
+
+    return (const unsigned char *)scratch;
+}
+
+// Size the block cache after the cache memory cap.
+static int initBlockCache(void)
+{
+    currentFS->blockCache.capacity = currentFS->opts.cacheSize / currentFS->sb.blockSize;
+
+    // Use about one bucket per cached block.
+    currentFS->blockCache.numBuckets = MIN_CACHE_BUCKETS;
+    while (currentFS->blockCache.numBuckets < currentFS->blockCache.capacity)
+    {
+        currentFS->blockCache.numBuckets <<= 1;
+    }
+
+    currentFS->blockCache.buckets = (struct CacheEntry **)do_calloc(currentFS->blockCache.numBuckets, sizeof(struct CacheEntry *));
+    pthread_mutex_init(&currentFS->blockCache.lock, NULL);
+
+    return 0;
+}
+
+static void freeBlockCache(void)
+{
+    if (currentFS->blockCache.buckets == NULL)
+    {
+        return;
+    }
+
+    struct CacheEntry *entry = currentFS->blockCache.lruHead;
+    while (entry != NULL)
+    {
+        struct CacheEntry *next = entry->lruNext;
+        free(entry->data);
+        free(entry);
+        entry = next;
+    }
+
+    free(currentFS->blockCache.buckets);
+    pthread_mutex_destroy(&currentFS->blockCache.lock);
+    memset(&currentFS->blockCache, 0, sizeof(currentFS->blockCache));
+}
+
+// Get numBlocks contiguous blocks starting at physBlock.
+// Mapped images return a pointer into the mapping. Otherwise, the blocks
+// are copied into dest: from the cache if they are all cached, or else
+// with a single read of the whole run (which is then cached block by block).
+static const unsigned char *readCachedBlocks(FILE *ext2FS, uint64_t physBlock, uint64_t numBlocks, int kind, unsigned char *dest)
+{
+    uint64_t addr = physBlock * currentFS->sb.blockSize;
+    uint64_t len = numBlocks * currentFS->sb.blockSize;
+
+    if ((currentFS->imageMap.base != NULL && addr + len <= currentFS->imageMap.size) || currentFS->blockCache.capacity == 0)
+    {
+        return readImage(ext2FS, addr, len, kind, dest);
+    }
+
+    pthread_mutex_lock(&currentFS->blockCache.lock);
+
+    // Copy out the cached blocks while looking for a missing one.
+    int isRunCached = 1;
+    for (uint64_t i = 0; i < numBlocks; i++)
+    {
+        struct CacheEntry *entry = lookupCacheEntry(physBlock + i);
+        if (entry == NULL)
+        {
+            isRunCached = 0;
+            break;
+        }
+
+        memcpy(&dest[i * currentFS->sb.blockSize], entry->data, currentFS->sb.blockSize);
+    }
+
+    if (isRunCached)
+    {
+        currentFS->blockCache.stats[kind].hits += numBlocks;
+        pthread_mutex_unlock(&currentFS->blockCache.lock);
+
+        return dest;
+    }
+
+    currentFS->blockCache.stats[kind].misses += numBlocks;
+    pthread_mutex_unlock(&currentFS->blockCache.lock);
+
+    // Read the whole run and cache its blocks (unless the read failed,
+    // see readImage).
+    ADD_STAT(bytesRead[kind], len);
+    if (do_pread(ext2FS, dest, len, addr) != 0)
+    {
+        memset(dest, 0, len);
+        return dest;
+    }
+
+    pthread_mutex_lock(&currentFS->blockCache.lock);
+    for (uint64_t i = 0; i < numBlocks; i++)
+    {
+        if (lookupCacheEntry(physBlock + i) == NULL)
+        {
+            insertCacheEntry(physBlock + i, kind, &dest[i * currentFS->sb.blockSize]);
+        }
+    }
+    pthread_mutex_unlock(&currentFS->blockCache.lock);
+
+    return dest;
+}
+
+static int initDentryCache(void)
+{
+    currentFS->dentryCache.numBuckets = MIN_DENTRY_BUCKETS;
+    currentFS->dentryCache.buckets = (struct Dentry **)do_calloc(currentFS->dentryCache.numBuckets, sizeof(struct Dentry *));
+    currentFS->dentryCache.capacity = currentFS->opts.dentryCacheSize;
+    pthread_mutex_init(&currentFS->dentryCache.lock, NULL);
+    currentFS->dentryCache.enabled = 1;
+
+    return 0;
+}
+
+static void freeDentryCache(void)
+{
+    if (!currentFS->dentryCache.enabled)
+    {
+        return;
+    }
+
+    struct Dentry *dentry = currentFS->dentryCache.lruHead;
+    while (dentry != NULL)
+    {
+        struct Dentry *next = dentry->lruNext;
+        free(dentry);
+        dentry = next;
+    }
+
+    free(currentFS->dentryCache.buckets);
+    pthread_mutex_destroy(&currentFS->dentryCache.lock);
+    memset(&currentFS->dentryCache, 0, sizeof(currentFS->dentryCache));
+}
+
+// Look up a name in a directory through the cache. On a hit, the cached
+// lookup is copied into inodeNum and inode (an inode number of 0 means
+// that the name is not in the directory) and 1 is returned. Returns 0 on a
+// miss or if the cache is not in use.
+static int lookupDentry(uint32_t parentInodeNum, const char *name, uint32_t *inodeNum, struct Inode *inode)
+{
+    if (!currentFS->dentryCache.enabled)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&currentFS->dentryCache.lock);
+
+    struct Dentry *dentry = findDentry(parentInodeNum, name);
+    if (dentry != NULL)
+    {
+        *inodeNum = dentry->inodeNum;
+        if (dentry->inodeNum != 0)
+        {
+            *inode = dentry->inode;
+        }
+        if (dentry != currentFS->dentryCache.lruHead)
+        {
+            unlinkDentryLRU(dentry);
+            pushDentryLRU(dentry);
+        }
+        currentFS->dentryCache.hits++;
+    }
+    else
+    {
+        currentFS->dentryCache.misses++;
+    }
+
+    pthread_mutex_unlock(&currentFS->dentryCache.lock);
+
+    return dentry != NULL;
+}
+
+// Cache the lookup of a name in a directory (an inode number of 0 caches
+// that the name is not in the directory), evicting the least recently used
+// dentries to make room for it. The hash table doubles in size once it
+// holds more dentries than buckets.
+static void insertDentry(uint32_t parentInodeNum, const char *name, uint32_t inodeNum, struct Inode *inode)
+{
+    if (!currentFS->dentryCache.enabled)
+    {
+        return;
+    }
+
+    // A dentry larger than the whole cache is not kept.
+    size_t dentrySize = sizeof(struct Dentry) + strlen(name) + 1;
+    if (dentrySize > currentFS->dentryCache.capacity)
+    {
+        return;
+    }
+
+    // Set up the dentry before taking the lock.
+    struct Dentry *dentry = (struct Dentry *)do_calloc(1, dentrySize);
+    dentry->parentInodeNum = parentInodeNum;
+    dentry->inodeNum = inodeNum;
+    if (inodeNum != 0)
+    {
+        dentry->inode = *inode;
+    }
+    strcpy(dentry->name, name);
+
+    pthread_mutex_lock(&currentFS->dentryCache.lock);
+
+    // Another thread may have cached the same lookup in the meantime.
+    if (findDentry(parentInodeNum, name) != NULL)
+    {
+        pthread_mutex_unlock(&currentFS->dentryCache.lock);
+        free(dentry);
+        return;
+    }
+
+    while (currentFS->dentryCache.size + dentrySize > currentFS->dentryCache.capacity)
+    {
+        evictDentry();
+    }
+
+    if (currentFS->dentryCache.count >= currentFS->dentryCache.numBuckets)
+    {
+        size_t numBuckets = currentFS->dentryCache.numBuckets * 2;
+        struct Dentry **buckets = (struct Dentry **)do_calloc(numBuckets, sizeof(struct Dentry *));
+
+        for (size_t i = 0; i < currentFS->dentryCache.numBuckets; i++)
+        {
+            struct Dentry *moved = currentFS->dentryCache.buckets[i];
+            while (moved != NULL)
+            {
+                struct Dentry *next = moved->hashNext;
+                size_t bucket = hashDentry(moved->parentInodeNum, moved->name) & (numBuckets - 1);
+                moved->hashNext = buckets[bucket];
+                buckets[bucket] = moved;
+                moved = next;
+            }
+        }
+
+        free(currentFS->dentryCache.buckets);
+        currentFS->dentryCache.buckets = buckets;
+        currentFS->dentryCache.numBuckets = numBuckets;
+    }
+
+    size_t bucket = hashDentry(parentInodeNum, name) & (currentFS->dentryCache.numBuckets - 1);
+    dentry->hashNext = currentFS->dentryCache.buckets[bucket];
+    currentFS->dentryCache.buckets[bucket] = dentry;
+    pushDentryLRU(dentry);
+    currentFS->dentryCache.count++;
+    currentFS->dentryCache.size += dentrySize;
+
+    pthread_mutex_unlock(&currentFS->dentryCache.lock);
+}
+
+// Find the dentry of a name in a directory (NULL if it is not cached).
+// Note: The dentry cache lock must be held.
+static struct Dentry *findDentry(uint32_t parentInodeNum, const char *name)
+{
+    struct Dentry *dentry = currentFS->dentryCache.buckets[hashDentry(parentInodeNum, name) & (currentFS->dentryCache.numBuckets - 1)];
+    while (dentry != NULL && (dentry->parentInodeNum != parentInodeNum || strcmp(dentry->name, name) != 0))
+    {
+        dentry = dentry->hashNext;
+    }
+
+    return dentry;
+}
+
+// Free the least recently used dentry.
+// Note: The dentry cache lock must be held.
+static void evictDentry(void)
+{
+    struct Dentry *dentry = currentFS->dentryCache.lruTail;
+    unlinkDentryLRU(dentry);
+
+    struct Dentry **link = &currentFS->dentryCache.buckets[hashDentry(dentry->parentInodeNum, dentry->name) & (currentFS->dentryCache.numBuckets - 1)];
+    while (*link != dentry)
+    {
+        link = &(*link)->hashNext;
+    }
+    *link = dentry->hashNext;
+
+    currentFS->dentryCache.count--;
+    currentFS->dentryCache.size -= sizeof(struct Dentry) + strlen(dentry->name) + 1;
+    free(dentry);
+}
+
+static void unlinkDentryLRU(struct Dentry *dentry)
+{
+    if (dentry->lruPrev != NULL)
+    {
+        dentry->lruPrev->lruNext = dentry->lruNext;
+    }
+    else
+    {
+        currentFS->dentryCache.lruHead = dentry->lruNext;
+    }
+
+    if (dentry->lruNext != NULL)
+    {
+        dentry->lruNext->lruPrev = dentry->lruPrev;
+    }
+    else
+    {
+        currentFS->dentryCache.lruTail = dentry->lruPrev;
+    }
+}
+
+static void pushDentryLRU(struct Dentry *dentry)
+{
+    dentry->lruPrev = NULL;
+    dentry->lruNext = currentFS->dentryCache.lruHead;
+
+    if (currentFS->dentryCache.lruHead != NULL)
+    {
+        currentFS->dentryCache.lruHead->lruPrev = dentry;
+    }
+    else
+    {
+        currentFS->dentryCache.lruTail = dentry;
+    }
+
+    currentFS->dentryCache.lruHead = dentry;
+}
+
+// FNV-1a hash of the name, seeded with the parent inode number.
+static size_t hashDentry(uint32_t parentInodeNum, const char *name)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ parentInodeNum;
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++)
+    {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return (size_t)(hash ^ (hash >> 32));
+}
+
+// Find a cached block and mark it as the most recently used.
+// Note: The cache lock must be held.
+static struct CacheEntry *lookupCacheEntry(uint64_t blockNum)
+{
+    struct CacheEntry *entry = currentFS->blockCache.buckets[blockNum & (currentFS->blockCache.numBuckets - 1)];
+    while (entry != NULL && entry->blockNum != blockNum)
+    {
+        entry = entry->hashNext;
+    }
+
+    if (entry != NULL && entry != currentFS->blockCache.lruHead)
+    {
+        unlinkLRU(entry);
+        pushLRU(entry);
+    }
+
+    return entry;
+}
+
+// Cache a copy of a block, evicting the least recently used block if the
+// cache is full (its buffer is then reused for the new block).
+// Note: The cache lock must be held.
+static void insertCacheEntry(uint64_t blockNum, int kind, const unsigned char *data)
+{
+    struct CacheEntry *entry;
+
+    if (currentFS->blockCache.numEntries < currentFS->blockCache.capacity)
+    {
+        entry = (struct CacheEntry *)do_malloc(sizeof(struct CacheEntry));
+        entry->data = (unsigned char *)do_malloc(currentFS->sb.blockSize);
+        currentFS->blockCache.numEntries++;
+    }
+    else
+    {
+        // Evict the least recently used block.
+        entry = currentFS->blockCache.lruTail;
+        unlinkLRU(entry);
+
+        struct CacheEntry **link = &currentFS->blockCache.buckets[entry->blockNum & (currentFS->blockCache.numBuckets - 1)];
+        while (*link != entry)
+        {
+            link = &(*link)->hashNext;
+        }
+        *link = entry->hashNext;
+
+        currentFS->blockCache.stats[entry->kind].evictions++;
+        currentFS->blockCache.stats[entry->kind].numEntries--;
+    }
+
+    entry->blockNum = blockNum;
+    entry->kind = kind;
+    memcpy(entry->data, data, currentFS->sb.blockSize);
+    currentFS->blockCache.stats[kind].numEntries++;
+
+    // Link the entry into its bucket and at the front of the LRU list.
+    struct CacheEntry **bucket = &currentFS->blockCache.buckets[blockNum & (currentFS->blockCache.numBuckets - 1)];
+    entry->hashNext = *bucket;
+    *bucket = entry;
+    pushLRU(entry);
+}
+
+static void unlinkLRU(struct CacheEntry *entry)
+{
+    if (entry->lruPrev != NULL)
+    {
+        entry->lruPrev->lruNext = entry->lruNext;
+    }
+    else
+    {
+        currentFS->blockCache.lruHead = entry->lruNext;
+    }
+
+    if (entry->lruNext != NULL)
+    {
+        entry->lruNext->lruPrev = entry->lruPrev;
+    }
+    else
+    {
+        currentFS->blockCache.lruTail = entry->lruPrev;
+    }
+}
+
+static void pushLRU(struct CacheEntry *entry)
+{
+    entry->lruPrev = NULL;
+    entry->lruNext = currentFS->blockCache.lruHead;
+
+    if (currentFS->blockCache.lruHead != NULL)
+    {
+        currentFS->blockCache.lruHead->lruPrev = entry;
+    }
+    else
+    {
+        currentFS->blockCache.lruTail = entry;
+    }
+
+    currentFS->blockCache.lruHead = entry;
+}
+
+// Decode little endian values of the on-disk structures.
+static uint16_t le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void *do_malloc(size_t size)
+{
+    ADD_STAT(allocs, 1);
+    ADD_STAT(allocBytes, size);
+
+    void *ptr = malloc(size);
+    if (ptr == NULL)
+    {
+        perror("malloc failed");
+        exit(1);
+    }
+
+    return ptr;
+}
+
+static void *do_calloc(size_t nmemb, size_t size)
+{
+    ADD_STAT(allocs, 1);
+    ADD_STAT(allocBytes, nmemb * size);
+
+    void *ptr = calloc(nmemb, size);
+    if (ptr == NULL)
+    {
+        perror("calloc failed");
+        exit(1);
+    }
+
+    return ptr;
+}
+
+static void *do_realloc(void *ptr, size_t size)
+{
+    ADD_STAT(allocs, 1);
+    ADD_STAT(allocBytes, size);
+
+    ptr = realloc(ptr, size);
+    if (ptr == NULL)
+    {
+        perror("realloc failed");
+        exit(1);
+    }
+
+    return ptr;
+}
+
+static FILE *do_fopen(char *name, char *mode)
+{
+    FILE *fp = fopen(name, mode);
+    if (fp == NULL)
+    {
+        reportError("fopen failed: %s", strerror(errno));
+    }
+
+    return fp;
+}
+
+static int do_fseek(FILE *fp, uint64_t offset, int whence)
+{
+    ADD_STAT(seeks, 1);
+
+    if (fseek(fp, offset, whence) != 0)
+    {
+        reportError("fseek failed: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int do_fwrite(void *buffer, size_t size, size_t count, FILE *file)
+{
+    ADD_STAT(writes, 1);
+    ADD_STAT(bytesWritten, size * count);
+
+    if (fwrite(buffer, size, count, file) != count)
+    {
+        reportError("fwrite failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Positional read (does not move the file position of the stream).
+static int do_pread(FILE *file, void *buffer, size_t count, uint64_t offset)
+{
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = count;
+
+    return do_preadv(file, &iov, 1, offset);
+}
+
+// Vectored positional read. Short reads are resumed until
+// every buffer in the vector is filled.
+static int do_preadv(FILE *file, struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    int fd = fileno(file);
+
+    while (iovcnt > 0)
+    {
+        ADD_STAT(reads, 1);
+        ssize_t n = preadv(fd, iov, iovcnt, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            reportError("pread failed: %s", n < 0 ? strerror(errno) : "unexpected end of the image");
+            return -1;
+        }
+
+        offset += n;
+
+        // Skip the buffers that are already filled.
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        // Adjust the partially filled buffer.
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (unsigned char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static int do_fclose(FILE *fp)
+{
+    if (fclose(fp) != 0)
+    {
+        reportError("fclose failed: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Set the size of the file (flushing the stream first).
+static int do_ftruncate(FILE *fp, uint64_t length)
+{
+    if (fflush(fp) != 0 || ftruncate(fileno(fp), length) != 0)
+    {
+        reportError("ftruncate failed: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int do_mkdir(char *name)
+{
+    ADD_STAT(mkdirs, 1);
+
+    // Create a new directory with read, write, and execute permissions
+    // for owner, group, and others.
+    if (mkdir(name, 0777) != 0)
+    {
+        if (errno != EEXIST)
+        {
+            reportError("mkdir failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Report an I/O error (of the image or of an output file).
+static void reportError(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vreportError(EXT2_ERR_IO, format, args);
+    va_end(args);
+}
+
+// Report damaged on-disk structures.
+static void reportCorruption(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vreportError(EXT2_ERR_CORRUPT, format, args);
+    va_end(args);
+}
+
+// Keep the error in the error sink of the calling thread (only the first
+// error of a sink is kept), or print it and exit if the thread has none.
+static void vreportError(int error, const char *format, va_list args)
+{
+    if (errorSink == NULL)
+    {
+        vfprintf(stderr, format, args);
+        fprintf(stderr, "\n");
+        exit(1);
+    }
+
+    if (!errorSink->failed)
+    {
+        vsnprintf(errorSink->message, ERROR_MSG_SIZE, format, args);
+        errorSink->error = error;
+        errorSink->failed = 1;
+    }
+}
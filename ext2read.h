@@ -0,0 +1,179 @@
+// Read-only access to ext2 file system images.
+//
+// ext3 and ext4 images are read the same way (their journal is ignored), extent
+// mapped files included. Images that use a feature that changes the on-disk
+// layout of what is read (e.g., inline data, meta_bg or encryption) are
+// refused as EXT2_ERR_CORRUPT.
+//
+// An image is opened into a handle (struct Ext2FS) that owns everything the
+// reads need: the superblock, the block group descriptor table, the block and
+// dentry caches, the mapping of the image (if any) and its path index. Only
+// the statistics counters are process-wide, so one process can have many
+// images open at once, and every call is safe to make from many threads at
+// once on the same handle (except for the calls on a single directory stream,
+// see ext2ReadDir).
+//
+// Nothing exits the process: every call returns 0 (or a count) on success and
+// one of the negative EXT2_ERR_* codes on failure, in which case
+// ext2LastError tells what went wrong. Running out of memory is the exception:
+// it still aborts, as the parser is not written to unwind out of it.
+//
+// Paths are absolute (e.g., "/dir1/file.txt") and follow the rules of the
+// command line tool: a directory is named with a trailing slash ("/dir1/"),
+// a file without one, and "." and ".." components are resolved on the way.
+#ifndef EXT2READ_H
+#define EXT2READ_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h> // for ssize_t.
+
+// Error codes.
+#define EXT2_OK 0
+#define EXT2_ERR_IO -1           // A read of the image (or a write of an output file) failed.
+#define EXT2_ERR_CORRUPT -2      // The image is not an ext2 file system (or is damaged).
+#define EXT2_ERR_INVALID_PATH -3 // No such file object (or a malformed path).
+#define EXT2_ERR_NOT_DIR -4
+#define EXT2_ERR_IS_DIR -5
+#define EXT2_ERR_INVALID_ARG -6
+
+// Kinds of the reads of the image (see struct Ext2Stats).
+#define EXT2_READ_SUPERBLOCK 0
+#define EXT2_READ_BGDT 1
+#define EXT2_READ_INODE 2     // Inode table blocks.
+#define EXT2_READ_INDIRECT 3  // Indirect blocks.
+#define EXT2_READ_DIRECTORY 4 // Directory entries and htree index blocks.
+#define EXT2_READ_FILE_DATA 5
+#define EXT2_READ_KINDS 6
+
+// State of the path index of a handle (see ext2IndexState).
+#define EXT2_INDEX_NONE 0   // There is no index (or it is disabled).
+#define EXT2_INDEX_IN_USE 1
+#define EXT2_INDEX_STALE 2  // There is one, but not for the image as it is now.
+
+// Formats of ext2Archive.
+#define EXT2_ARCHIVE_TAR 0  // POSIX (ustar with pax extended headers).
+#define EXT2_ARCHIVE_CPIO 1 // cpio "newc" (files of up to 4 GiB).
+
+// Digests of ext2ExtractDigests.
+#define EXT2_DIGEST_CRC32C 0 // CRC-32C (Castagnoli), as 8 hex digits.
+#define EXT2_DIGEST_SHA256 1
+
+struct Ext2FS;
+struct Ext2Dir;
+struct Ext2File;
+
+// Settings of a handle. Start from ext2DefaultOptions and change what is needed.
+struct Ext2Options
+{
+    size_t bufferBudget;    // Memory cap (in bytes) of the buffers of an extraction.
+    int useMmap;            // Serve reads from a read-only mapping of the image.
+    size_t cacheSize;       // Memory cap (in bytes) of the block cache (0 disables it).
+    int useDentryCache;     // Cache the path component lookups (for many lookups of related paths).
+    size_t dentryCacheSize; // Memory cap (in bytes) of the dentry cache (0 disables it).
+    int numThreads;         // Number of worker threads of the whole tree operations.
+    int zeroCopy;           // Extract by copying the file data inside the kernel.
+    int useUring;           // Extract through io_uring (falls back when unavailable).
+    int physicalOrder;      // Extract in physical block order (single threaded only).
+    const char *indexPath;  // Path of the path index (NULL for the image path plus ".idx").
+    int noIndex;            // Never use the path index.
+    int scanInodes;         // Enumerate from a scan of the inode tables (see ext2Enumerate).
+};
+
+// What ext2Stat tells about a file object.
+struct Ext2Stat
+{
+    uint32_t inodeNum;
+    uint16_t mode; // i_mode (the file type is in the upper 4 bits, as in st_mode).
+    uint64_t size;
+    char name[256]; // Last component of the path ("/" for the root directory).
+};
+
+// An entry of a directory stream (the "." and ".." entries are left out).
+struct Ext2DirEntry
+{
+    uint32_t inodeNum;
+    uint16_t mode;
+    uint64_t size;
+    char name[256];
+};
+
+// Counters of the I/O and allocations. They add up the work of every handle
+// of the process, except for the cache counters which are per handle.
+struct Ext2Stats
+{
+    uint64_t reads;                      // Read system calls (or io_uring reads) on the image.
+    uint64_t bytesRead[EXT2_READ_KINDS]; // Bytes read (or copied out of the mapping) from the image.
+    uint64_t seeks;
+    uint64_t copies; // copy_file_range and sendfile calls (zero-copy mode).
+    uint64_t writes;
+    uint64_t bytesWritten;
+    uint64_t allocs;
+    uint64_t allocBytes;
+    uint64_t mkdirs;
+    uint64_t cacheHits[EXT2_READ_KINDS];
+    uint64_t cacheMisses[EXT2_READ_KINDS];
+    uint64_t cacheEvictions[EXT2_READ_KINDS];
+    uint64_t dentryHits;
+    uint64_t dentryMisses;
+};
+
+void ext2DefaultOptions(struct Ext2Options *options);
+
+// Open an image (options may be NULL for the defaults).
+int ext2Open(const char *imagePath, const struct Ext2Options *options, struct Ext2FS **ext2FS);
+void ext2Close(struct Ext2FS *ext2FS);
+
+// The message of the last failed call of the calling thread.
+const char *ext2LastError(void);
+const char *ext2StrError(int error);
+
+int ext2Stat(struct Ext2FS *ext2FS, const char *path, struct Ext2Stat *fileStat);
+
+// Directory streams. ext2ReadDir returns 1 for an entry, 0 at the end of the
+// directory and an error code otherwise. A stream must not be read by two
+// threads at once.
+int ext2OpenDir(struct Ext2FS *ext2FS, const char *path, struct Ext2Dir **dir);
+int ext2ReadDir(struct Ext2Dir *dir, struct Ext2DirEntry *entry);
+void ext2CloseDir(struct Ext2Dir *dir);
+
+// Files. ext2PRead reads up to count bytes at offset (fewer at the end of the
+// file) and returns how many it read. Holes read as zeros.
+int ext2OpenFile(struct Ext2FS *ext2FS, const char *path, struct Ext2File **file);
+ssize_t ext2PRead(struct Ext2File *file, void *buf, size_t count, uint64_t offset);
+void ext2CloseFile(struct Ext2File *file);
+
+// Whole tree operations (with the settings of the handle).
+// ext2Enumerate writes every path of the image, one per line, in directory
+// entry order. With scanInodes it reads the inode tables front to back and
+// every directory once instead of walking the tree, which is faster on large
+// images as the reads are mostly sequential (it takes memory for all the
+// directory entries of the image, though). ext2Extract copies a file object
+// out of the image: a file into the file destPath, a directory into the
+// directory destPath (created if needed). ext2Archive writes the same file
+// object to out as a single tar or cpio stream whose entries are named as
+// ext2Extract would name them with destPath name (hard links become separate
+// files and sockets are left out). ext2BuildIndex writes the path index of
+// the image.
+int ext2Enumerate(struct Ext2FS *ext2FS, FILE *out);
+int ext2Extract(struct Ext2FS *ext2FS, uint32_t inodeNum, const char *destPath);
+int ext2Archive(struct Ext2FS *ext2FS, uint32_t inodeNum, const char *name, int format, FILE *out);
+int ext2BuildIndex(struct Ext2FS *ext2FS);
+int ext2IndexState(struct Ext2FS *ext2FS);
+
+// ext2ExtractDigests is ext2Extract that also hashes every file as its data
+// streams out (in the writer thread of the file, so that the hashing
+// overlaps with the reads), and writes the digests to manifest: a line
+// "<digest in hex>  <path of the extracted file>" per file, sorted by path,
+// which is what sha256sum -c reads. With verifyOnly, nothing but the
+// manifest is written (the files are read and hashed all the same), to
+// check an image against the manifest of an earlier extraction. The data
+// has to go through user space in file order for this, so zero-copy,
+// io_uring and physical order are not used.
+int ext2ExtractDigests(struct Ext2FS *ext2FS, uint32_t inodeNum, const char *destPath, int digest, int verifyOnly, FILE *manifest);
+
+// Statistics. Counting is off until enabled (it costs a few atomic adds).
+void ext2EnableStats(int enabled);
+void ext2GetStats(struct Ext2FS *ext2FS, struct Ext2Stats *out);
+
+#endif
@@ -0,0 +1,715 @@
+// Serve list, stat, read and extract requests on ext2 images over a Unix domain socket.
+//
+// The images are opened once and stay open for the life of the server, so the superblock
+// is parsed once and the inode, dentry and block caches stay warm from one request to the
+// next: a lookup of a path whose ancestors were seen before costs a few hash lookups
+// instead of a process startup. Every connection is served by a thread of its own (up to
+// a limit), and the threads share the handles (see ext2read.h). The wire format is in ext2proto.h;
+// ext2client.c is a client and a load generator for it (see also loadtest.sh).
+//
+//   gcc -O2 -pthread ext2server.c ext2read.c -o ext2server
+//
+// Usage: ext2server [OPTION]... IMAGE...
+//   -s, --socket PATH        Socket to listen on (default /tmp/ext2server.sock).
+//   -C, --cache-size SIZE    Block cache of each image, K/M/G suffixes allowed (default 64M).
+//   -D, --dentry-cache SIZE  Dentry cache of each image, which keeps the lookups of the
+//                            paths most recently asked for (default 16M).
+//   -j, --jobs N             Worker threads of each extraction (default 1).
+//   -c, --max-connections N  Connections served at once (default 64). The clients that
+//                            come on top wait in the backlog of the socket.
+//   -M, --mmap               Serve the reads from a mapping of the images.
+//   -x, --extract-root DIR   Directory the extractions are confined to. Without it, the
+//                            extract requests are turned down. The server creates the
+//                            destination of an extraction itself, so it must not exist.
+// The requests name the images by their position on the command line (0 for the first).
+
+#define _GNU_SOURCE // for open_memstream.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h> // for PATH_MAX.
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "ext2read.h"
+#include "ext2proto.h"
+
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+#define DEFAULT_DENTRY_CACHE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_MAX_CONNECTIONS 64
+
+// Payload of a response, reused from one request of a connection to the next.
+struct Payload
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+// Command line options.
+struct Options
+{
+    const char *socketPath;
+    size_t cacheSize;
+    size_t dentryCacheSize;
+    int numThreads;
+    int maxConnections;
+    int useMmap;
+    const char *extractRoot; // NULL to turn down the extract requests.
+} opts = {PROTO_DEFAULT_SOCKET, DEFAULT_CACHE_SIZE, DEFAULT_DENTRY_CACHE_SIZE, 1, DEFAULT_MAX_CONNECTIONS, 0, NULL};
+
+// The open images, in command line order.
+struct Ext2FS **images;
+int numImages;
+
+// Extraction root with its symbolic links resolved (NULL without --extract-root), and
+// a descriptor of it that the destinations of the extractions are walked from.
+char *extractRoot;
+int extractRootFd = -1;
+
+// Connections being served (each has a thread and a payload buffer of its own, so there
+// are at most opts.maxConnections of them).
+int numConnections;
+pthread_mutex_t connectionsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t connectionsCond = PTHREAD_COND_INITIALIZER;
+
+// Function prototypes.
+void parseOptions(int argc, char *argv[]);
+void usage(const char *prog);
+size_t parseSize(char *str);
+int listenOn(const char *path);
+void stopServer(int sig);
+void *serveConnection(void *arg);
+void endConnection(void);
+int handleRequest(struct ProtoRequest *request, const char *path, const char *arg, struct Payload *payload,
+                  const char **message);
+int createDestination(const char *dest, int isDir, const char **message);
+int listDir(struct Ext2FS *ext2FS, const char *path, struct Payload *payload);
+int readRange(struct Ext2FS *ext2FS, const char *path, uint64_t offset, uint64_t count, struct Payload *payload);
+int enumerateImage(struct Ext2FS *ext2FS, struct Payload *payload);
+void appendStat(struct Payload *payload, uint32_t inodeNum, uint16_t mode, uint64_t size, const char *name);
+char *reservePayload(struct Payload *payload, size_t len);
+int sendResponse(int fd, int status, const void *data, uint64_t len);
+int readFull(int fd, void *buf, size_t len);
+int writeFull(int fd, const void *buf, size_t len);
+void *do_realloc(void *ptr, size_t size);
+
+int main(int argc, char *argv[])
+{
+    parseOptions(argc, argv);
+
+    // The destinations of the extractions are checked against the root as
+    // the kernel sees it, and then walked from it (see createDestination).
+    if (opts.extractRoot != NULL)
+    {
+        extractRoot = realpath(opts.extractRoot, NULL);
+        if (extractRoot == NULL || (extractRootFd = open(extractRoot, O_RDONLY | O_DIRECTORY)) == -1)
+        {
+            fprintf(stderr, "%s: %s\n", opts.extractRoot, strerror(errno));
+            exit(1);
+        }
+    }
+
+    // The paths of the requests share most of their ancestors, which is what the dentry
+    // cache is for. It is capped, since the clients may ask for any number of paths.
+    struct Ext2Options ext2Opts;
+    ext2DefaultOptions(&ext2Opts);
+    ext2Opts.cacheSize = opts.cacheSize;
+    ext2Opts.numThreads = opts.numThreads;
+    ext2Opts.useMmap = opts.useMmap;
+    ext2Opts.useDentryCache = 1;
+    ext2Opts.dentryCacheSize = opts.dentryCacheSize;
+
+    numImages = argc - optind;
+    images = (struct Ext2FS **)do_realloc(NULL, numImages * sizeof(struct Ext2FS *));
+    for (int i = 0; i < numImages; i++)
+    {
+        if (ext2Open(argv[optind + i], &ext2Opts, &images[i]) != EXT2_OK)
+        {
+            fprintf(stderr, "%s: %s\n", argv[optind + i], ext2LastError());
+            exit(1);
+        }
+    }
+
+    // A client that goes away mid-response must not take the server down with it.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServer;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int listenFd = listenOn(opts.socketPath);
+    fprintf(stderr, "Serving %d image%s on %s\n", numImages, numImages == 1 ? "" : "s", opts.socketPath);
+
+    for (;;)
+    {
+        // Stop accepting while every connection is taken.
+        pthread_mutex_lock(&connectionsLock);
+        while (numConnections >= opts.maxConnections)
+        {
+            pthread_cond_wait(&connectionsCond, &connectionsLock);
+        }
+        numConnections++;
+        pthread_mutex_unlock(&connectionsLock);
+
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                perror("accept failed");
+            }
+            endConnection();
+            continue;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serveConnection, (void *)(intptr_t)fd) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            close(fd);
+            endConnection();
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+// OPTIONS --------------------------------------------------------------------
+void parseOptions(int argc, char *argv[])
+{
+    static struct option longOpts[] = {
+        {"socket", required_argument, NULL, 's'},
+        {"cache-size", required_argument, NULL, 'C'},
+        {"dentry-cache", required_argument, NULL, 'D'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"max-connections", required_argument, NULL, 'c'},
+        {"mmap", no_argument, NULL, 'M'},
+        {"extract-root", required_argument, NULL, 'x'},
+        {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:C:D:j:c:Mx:", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            opts.socketPath = optarg;
+            break;
+        case 'C':
+            opts.cacheSize = parseSize(optarg);
+            break;
+        case 'D':
+            opts.dentryCacheSize = parseSize(optarg);
+            break;
+        case 'j':
+            opts.numThreads = atoi(optarg);
+            if (opts.numThreads < 1)
+            {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            opts.maxConnections = atoi(optarg);
+            if (opts.maxConnections < 1)
+            {
+                fprintf(stderr, "Invalid number of connections: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'M':
+            opts.useMmap = 1;
+            break;
+        case 'x':
+            opts.extractRoot = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind == argc)
+    {
+        usage(argv[0]);
+    }
+    if (strlen(opts.socketPath) >= sizeof(((struct sockaddr_un *)NULL)->sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", opts.socketPath);
+        exit(1);
+    }
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s SOCKET] [-C CACHE_SIZE] [-D DENTRY_CACHE_SIZE] [-j JOBS] [-c MAX_CONNECTIONS] [-M] [-x EXTRACT_ROOT] IMAGE...\n", prog);
+    exit(1);
+}
+
+// Parse a size such as 4096, 512K, 16M or 1G (in bytes), as main does.
+size_t parseSize(char *str)
+{
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        size <<= 10;
+        // Fall through.
+    case 'M':
+    case 'm':
+        size <<= 10;
+        // Fall through.
+    case 'K':
+    case 'k':
+        size <<= 10;
+        end++;
+        break;
+    }
+
+    if (end == str || *end != '\0' || size == 0)
+    {
+        fprintf(stderr, "Invalid size: %s\n", str);
+        exit(1);
+    }
+
+    return size;
+}
+
+// SOCKET ---------------------------------------------------------------------
+// Listen on a Unix domain socket. A socket left behind by a server that is gone is
+// replaced, but a live one (or any other kind of file) is not.
+int listenOn(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno == ECONNREFUSED)
+        {
+            unlink(path);
+        }
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    return fd;
+}
+
+// Remove the socket on the way out (the images are read-only, so there is nothing else
+// to clean up).
+void stopServer(int sig)
+{
+    (void)sig;
+    unlink(opts.socketPath);
+    _exit(0);
+}
+
+// REQUESTS -------------------------------------------------------------------
+// Serve the requests of a connection, one at a time, until the client hangs up or breaks
+// the protocol.
+void *serveConnection(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    struct Payload payload = {NULL, 0, 0};
+    char path[PROTO_MAX_PATH + 1];
+    char argument[PROTO_MAX_PATH + 1];
+
+    struct ProtoRequest request;
+    while (readFull(fd, &request, sizeof(request)) == 0)
+    {
+        if (request.magic != PROTO_MAGIC || request.pathLen > PROTO_MAX_PATH || request.argLen > PROTO_MAX_PATH ||
+            readFull(fd, path, request.pathLen) != 0 || readFull(fd, argument, request.argLen) != 0)
+        {
+            break;
+        }
+        path[request.pathLen] = '\0';
+        argument[request.argLen] = '\0';
+
+        payload.len = 0;
+        const char *message = NULL;
+        int status = handleRequest(&request, path, argument, &payload, &message);
+        if (status != EXT2_OK)
+        {
+            // The payload of a failure is the message.
+            if (message == NULL)
+            {
+                message = ext2LastError();
+            }
+            status = sendResponse(fd, status, message, strlen(message));
+        }
+        else
+        {
+            status = sendResponse(fd, EXT2_OK, payload.data, payload.len);
+        }
+
+        if (status != 0)
+        {
+            break;
+        }
+    }
+
+    // Free the allocated memory.
+    free(payload.data);
+    close(fd);
+    endConnection();
+
+    return NULL;
+}
+
+// Give the slot of a connection back.
+void endConnection(void)
+{
+    pthread_mutex_lock(&connectionsLock);
+    numConnections--;
+    pthread_cond_signal(&connectionsCond);
+    pthread_mutex_unlock(&connectionsLock);
+}
+
+// Run a request, leaving the payload of its response in payload.
+// Returns EXT2_OK or the error of the request, whose message is ext2LastError unless the
+// request was turned down before reaching the library (then it is left in message).
+int handleRequest(struct ProtoRequest *request, const char *path, const char *arg, struct Payload *payload,
+                  const char **message)
+{
+    if (request->image >= (uint32_t)numImages)
+    {
+        *message = "No such image";
+        return EXT2_ERR_INVALID_ARG;
+    }
+    struct Ext2FS *ext2FS = images[request->image];
+
+    struct Ext2Stat fileStat;
+    int status;
+    switch (request->op)
+    {
+    case PROTO_LIST:
+        return listDir(ext2FS, path, payload);
+    case PROTO_STAT:
+        status = ext2Stat(ext2FS, path, &fileStat);
+        if (status == EXT2_OK)
+        {
+            appendStat(payload, fileStat.inodeNum, fileStat.mode, fileStat.size, fileStat.name);
+        }
+        return status;
+    case PROTO_READ:
+        return readRange(ext2FS, path, request->offset, request->count, payload);
+    case PROTO_EXTRACT:
+    {
+        status = ext2Stat(ext2FS, path, &fileStat);
+        if (status != EXT2_OK)
+        {
+            return status;
+        }
+
+        int isDir = S_ISDIR(fileStat.mode);
+        int destFd = createDestination(arg, isDir, message);
+        if (destFd == -1)
+        {
+            return EXT2_ERR_INVALID_ARG;
+        }
+
+        // The library writes through the descriptor of the destination, not through its
+        // path, whose directories may have been swapped since they were walked.
+        char destPath[64];
+        snprintf(destPath, sizeof(destPath), "/proc/self/fd/%d", destFd);
+        status = ext2Extract(ext2FS, fileStat.inodeNum, destPath);
+
+        // A directory is opened up to the others once nothing is written into it anymore.
+        if (isDir)
+        {
+            fchmod(destFd, 0755);
+        }
+        close(destFd);
+
+        return status;
+    }
+    case PROTO_ENUMERATE:
+        return enumerateImage(ext2FS, payload);
+    default:
+        *message = "Unknown operation";
+        return EXT2_ERR_INVALID_ARG;
+    }
+}
+
+// Create the destination of an extraction (an absolute path, as the server resolves it,
+// under the extraction root) and return a descriptor of it, or -1 with the reason in message.
+// Its directories are walked one at a time from the descriptor of the root without following
+// any symbolic link, and the destination itself must not exist: a file is created exclusively,
+// and a directory is created accessible to the server alone, so nobody else can put a link
+// in it while the extraction writes there.
+int createDestination(const char *dest, int isDir, const char **message)
+{
+    if (extractRoot == NULL)
+    {
+        *message = "Extraction is disabled on this server (see --extract-root)";
+        return -1;
+    }
+
+    // Anything below the root (with "/" as the root, anything at all).
+    size_t rootLen = strcmp(extractRoot, "/") == 0 ? 0 : strlen(extractRoot);
+    if (dest[0] != '/' || strncmp(dest, extractRoot, rootLen) != 0 || dest[rootLen] != '/')
+    {
+        *message = "The destination must be an absolute path under the extraction root";
+        return -1;
+    }
+    if (strlen(dest) >= PATH_MAX)
+    {
+        *message = "Invalid destination";
+        return -1;
+    }
+
+    // Walk the directories of the destination, leaving its last component in name.
+    char components[PATH_MAX];
+    strcpy(components, dest + rootLen + 1);
+    char *savePtr;
+    char *name = strtok_r(components, "/", &savePtr);
+    char *next;
+    int dirFd = extractRootFd;
+    while (name != NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+           (next = strtok_r(NULL, "/", &savePtr)) != NULL)
+    {
+        int subdirFd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (dirFd != extractRootFd)
+        {
+            close(dirFd);
+        }
+        if (subdirFd == -1)
+        {
+            *message = errno == ENOENT ? "The directory of the destination does not exist"
+                                       : "The directory of the destination is a symbolic link or not a directory";
+            return -1;
+        }
+        dirFd = subdirFd;
+        name = next;
+    }
+
+    int fd = -1;
+    if (name == NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        *message = "Invalid destination";
+    }
+    else
+    {
+        if (isDir)
+        {
+            if (mkdirat(dirFd, name, 0700) == 0)
+            {
+                fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            }
+        }
+        else
+        {
+            fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0666);
+        }
+
+        if (fd == -1)
+        {
+            *message = errno == EEXIST ? "The destination already exists" : "The destination cannot be created";
+        }
+    }
+
+    // Turn down a directory that was swapped between its creation and its opening.
+    struct stat st;
+    if (fd != -1 && isDir && (fstat(fd, &st) != 0 || st.st_uid != geteuid() || (st.st_mode & 077) != 0))
+    {
+        close(fd);
+        fd = -1;
+        *message = "The destination cannot be created";
+    }
+
+    if (dirFd != extractRootFd)
+    {
+        close(dirFd);
+    }
+
+    return fd;
+}
+
+int listDir(struct Ext2FS *ext2FS, const char *path, struct Payload *payload)
+{
+    struct Ext2Dir *dir;
+    int status = ext2OpenDir(ext2FS, path, &dir);
+    if (status != EXT2_OK)
+    {
+        return status;
+    }
+
+    struct Ext2DirEntry entry;
+    while ((status = ext2ReadDir(dir, &entry)) == 1)
+    {
+        appendStat(payload, entry.inodeNum, entry.mode, entry.size, entry.name);
+    }
+    ext2CloseDir(dir);
+
+    return status;
+}
+
+int readRange(struct Ext2FS *ext2FS, const char *path, uint64_t offset, uint64_t count, struct Payload *payload)
+{
+    if (count > PROTO_MAX_READ)
+    {
+        count = PROTO_MAX_READ;
+    }
+
+    struct Ext2File *file;
+    int status = ext2OpenFile(ext2FS, path, &file);
+    if (status != EXT2_OK)
+    {
+        return status;
+    }
+
+    ssize_t numRead = ext2PRead(file, reservePayload(payload, count), count, offset);
+    ext2CloseFile(file);
+    if (numRead < 0)
+    {
+        return (int)numRead;
+    }
+    payload->len = numRead;
+
+    return EXT2_OK;
+}
+
+int enumerateImage(struct Ext2FS *ext2FS, struct Payload *payload)
+{
+    char *data = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&data, &len);
+    if (out == NULL)
+    {
+        perror("open_memstream failed");
+        exit(1);
+    }
+    int status = ext2Enumerate(ext2FS, out);
+    fclose(out);
+
+    // Hand the buffer of the stream over to the payload.
+    free(payload->data);
+    payload->data = data;
+    payload->len = len;
+    payload->cap = len;
+
+    return status;
+}
+
+void appendStat(struct Payload *payload, uint32_t inodeNum, uint16_t mode, uint64_t size, const char *name)
+{
+    size_t nameLen = strlen(name);
+    char *dest = reservePayload(payload, sizeof(struct ProtoStat) + nameLen);
+
+    struct ProtoStat record;
+    record.size = size;
+    record.inodeNum = inodeNum;
+    record.mode = mode;
+    record.nameLen = (uint16_t)nameLen;
+    memcpy(dest, &record, sizeof(record));
+    memcpy(dest + sizeof(record), name, nameLen);
+    payload->len += sizeof(record) + nameLen;
+}
+
+// Make room for len more bytes at the end of the payload (without adding them to it).
+char *reservePayload(struct Payload *payload, size_t len)
+{
+    if (payload->len + len > payload->cap)
+    {
+        payload->cap = payload->cap * 2 > payload->len + len ? payload->cap * 2 : payload->len + len;
+        payload->data = (char *)do_realloc(payload->data, payload->cap);
+    }
+
+    return payload->data + payload->len;
+}
+
+// I/O ------------------------------------------------------------------------
+int sendResponse(int fd, int status, const void *data, uint64_t len)
+{
+    struct ProtoResponse response;
+    response.magic = PROTO_MAGIC;
+    response.status = status;
+    response.length = len;
+    if (writeFull(fd, &response, sizeof(response)) != 0)
+    {
+        return -1;
+    }
+
+    return writeFull(fd, data, len);
+}
+
+// Returns 0 once len bytes are read, and -1 at the end of the stream or on an error.
+int readFull(int fd, void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+
+        buf = (char *)buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int writeFull(int fd, const void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            return -1;
+        }
+
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Same as the do_realloc of ext2read.c, which the library keeps to itself.
+void *do_realloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (ptr == NULL)
+    {
+        perror("realloc failed");
+        exit(1);
+    }
+
+    return ptr;
+}
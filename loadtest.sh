@@ -0,0 +1,70 @@
+#!/bin/sh
+# Load test of the ext2 server (see ext2server.c) against one process per request.
+#
+# Builds main, ext2server and ext2client into a scratch directory, starts a server on
+# IMAGE, warms it up with one pass over every path of the image, and then runs the load of
+# ext2client over CONNECTIONS connections. For comparison, the same kind of lookups are
+# then timed one process of main at a time (--batch --resolve-only with a single path),
+# which is the cost the server takes away. Images can be made with create_ext2_image.c.
+#
+# Usage: loadtest.sh IMAGE [CONNECTIONS [REQUESTS [PROCESS_REQUESTS]]]
+#   CONNECTIONS       Concurrent connections of the load (default 8).
+#   REQUESTS          Requests of the load (default 100000).
+#   PROCESS_REQUESTS  Lookups timed one process at a time (default 200).
+
+set -e
+
+if [ $# -lt 1 ] || [ $# -gt 4 ]; then
+    echo "Usage: $0 IMAGE [CONNECTIONS [REQUESTS [PROCESS_REQUESTS]]]" >&2
+    exit 1
+fi
+IMAGE=$1
+CONNECTIONS=${2:-8}
+REQUESTS=${3:-100000}
+PROCESS_REQUESTS=${4:-200}
+SRC=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+SOCKET=$WORK/ext2server.sock
+SERVER_PID=
+
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null || true
+        wait "$SERVER_PID" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+gcc -O2 -pthread "$SRC/main.c" "$SRC/ext2read.c" -o "$WORK/main"
+gcc -O2 -pthread "$SRC/ext2server.c" "$SRC/ext2read.c" -o "$WORK/ext2server"
+gcc -O2 -pthread "$SRC/ext2client.c" -o "$WORK/ext2client"
+
+"$WORK/main" --no-index "$IMAGE" > "$WORK/paths"
+NUM_PATHS=$(wc -l < "$WORK/paths")
+
+"$WORK/ext2server" -s "$SOCKET" "$IMAGE" 2>/dev/null &
+SERVER_PID=$!
+while [ ! -S "$SOCKET" ]; do
+    kill -0 "$SERVER_PID" 2>/dev/null || { echo "The server did not start." >&2; exit 1; }
+    sleep 0.1
+done
+
+# Warm the caches of the server with every path once.
+"$WORK/ext2client" -s "$SOCKET" -c "$CONNECTIONS" -n "$NUM_PATHS" load "$WORK/paths" > /dev/null
+
+echo "Server ($NUM_PATHS paths, warm caches):"
+"$WORK/ext2client" -s "$SOCKET" -c "$CONNECTIONS" -n "$REQUESTS" load "$WORK/paths"
+
+# One process per lookup, spread over the paths.
+STEP=$(( (NUM_PATHS + PROCESS_REQUESTS - 1) / PROCESS_REQUESTS ))
+awk -v step="$STEP" 'NR % step == 0' "$WORK/paths" > "$WORK/sample"
+COUNT=$(wc -l < "$WORK/sample")
+START=$(date +%s%N)
+while IFS= read -r path; do
+    printf '%s\n' "$path" | "$WORK/main" --no-index --batch - --resolve-only "$IMAGE" > /dev/null
+done < "$WORK/sample"
+END=$(date +%s%N)
+echo "One process per request ($COUNT lookups, one at a time):"
+awk -v ns=$((END - START)) -v n="$COUNT" \
+    'BEGIN { printf "{\n  \"requests\": %d,\n  \"seconds\": %.6f,\n  \"latency_us\": {\"mean\": %.1f}\n}\n", n, ns / 1e9, ns / n / 1e3 }'
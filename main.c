@@ -1,108 +1,188 @@
+// Command line client of the ext2read library (see ext2read.h).
+//   gcc -O2 -pthread main.c ext2read.c -o main
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h> // for mkdir.
 #include <errno.h>
-
-#define SB_ADDR 1024
-#define BGD_SIZE 32
-#define DBLOCK_PTR_SIZE 4
-#define DBLOCK_PTR_COUNT 12
-#define ROOT_INODE_NUM 2
-#define newLine printf("\n")
-
-// superblock struct.
-struct SB
-{
-    uint32_t totalInodes;
-    uint32_t totalBlocks;
-    uint32_t blockSizeMult;
-    uint32_t blocksPerBG;
-    uint32_t inodesPerBG;
-    uint16_t inodeSize;
-
-    // Other derived values that is relevant to the program.
-    uint32_t blockSize;
-} sb;
-
-struct Inode
-{
-    uint16_t type;
-    uint32_t FSizeLower;     // Lower 32 bits of the file size.
-    uint32_t DBlockPtrs[12]; // Direct block pointers.
-    uint32_t SIBlockPtr;     // Singly indirect block pointer.
-    uint32_t DIBlockPtr;     // Doubly indirect block pointer.
-    uint32_t TIBlockPtr;     // Triply indirect block pointer.
-};
-
-struct DirEntry
-{
-    uint32_t inodeNum;
-    uint16_t entrySize;
-    uint8_t nameLen;
-    // Assumption: max file name length is 256 chars (inclusive of '/0').
-    unsigned char name[256];
-};
-
-struct Node
-{
-    void *data; // Generic pointer (i.e., generics).
-    struct Node *next;
-    struct Node *prev;
-};
+#include <getopt.h>
+#include <time.h> // for clock_gettime.
+#include "ext2read.h"
+
+#define INDEX_SUFFIX ".idx" // Appended to the image path unless another path is given.
+
+// Phases of the run timed by the statistics.
+#define PHASE_SETUP 0 // Opening the image.
+#define PHASE_LOOKUP 1
+#define PHASE_ENUMERATE 2
+#define PHASE_EXTRACT 3
+#define PHASES 4
+
+// Output formats of the statistics.
+#define STATS_OFF 0
+#define STATS_TABLE 1
+#define STATS_JSON 2
+
+// Command line options (the rest are the options of the handle).
+struct Options
+{
+    char *batchPath; // File listing the paths of a batch ("-" for stdin).
+    int resolveOnly; // Only resolve the paths of the batch (no extraction).
+    int statsFormat; // Print the statistics at exit (STATS_TABLE or STATS_JSON).
+    int buildIndex;  // Build the path index and exit (see ext2BuildIndex).
+    int archiveFormat; // Write the file object as an archive (EXT2_ARCHIVE_*, -1 for none).
+    char *archiveFile; // File of the archive (NULL or "-" for stdout).
+    int digest;        // Hash the extracted files (EXT2_DIGEST_*, -1 for none).
+    char *manifestFile; // File of the digest manifest (NULL or "-" for stdout).
+    int verifyOnly;    // Only hash the files, do not write them.
+} opts = {NULL, 0, STATS_OFF, 0, -1, NULL, -1, NULL, 0};
+
+// Time of the run (see --stats). The library counts everything else.
+double phaseTime[PHASES]; // Seconds.
+double startTime;
 
 // Function prototypes.
-struct Inode *getFileObjInode(FILE *ext2FS, char *filePath, unsigned char *fileObjName);
-int extractFileObj(struct Inode *fileObjInode, unsigned char name[256], FILE *ext2FS);
-int extractFile(struct Inode *fileObjInode, unsigned char name[256], FILE *ext2FS);
-int extractDir(struct Inode *fileObjInode, FILE *ext2FS, char *currentPath);
-int enumeratePaths(struct Inode *inode, FILE *ext2FS, char *currentPath);
-int isInodeDir(struct Inode *inode);
-int parseSuperblock(FILE *ext2FS);
-struct Inode *parseInode(uint32_t inodeNum, FILE *ext2FS);
-unsigned char *readAllDataBlocks(struct Inode *inode, FILE *ext2FS);
-int readDataBlock(unsigned char *data,
-                  uint64_t dBlockAddr,
-                  size_t *bytesToRead,
-                  struct Inode *inode,
-                  FILE *ext2FS);
-int read12DBlockPtrs(unsigned char *data,
-                     size_t *bytesToRead,
-                     struct Inode *inode,
-                     FILE *ext2FS);
-int readSIBlockPtr(unsigned char *data,
-                   uint64_t sIBlockAddr,
-                   size_t *bytesToRead,
-                   struct Inode *inode,
-                   FILE *ext2FS);
-int readDIBlockPtr(unsigned char *data,
-                   uint64_t dIBlockAddr,
-                   size_t *bytesToRead,
-                   struct Inode *inode,
-                   FILE *ext2FS);
-int readTIBlockPtr(unsigned char *data,
-                   uint64_t tIBlockAddr,
-                   size_t *bytesToRead,
-                   struct Inode *inode,
-                   FILE *ext2FS);
-struct Node *parseDirEntryInfo(unsigned char *data, struct Inode *inode);
-struct Node *createNode(void *data);
-void append(struct Node **head, void *newData);
-struct Node *pop(struct Node **head);
-void freeList(struct Node *head);
-void *do_malloc(size_t size);
-void *do_calloc(size_t nmemb, size_t size);
-FILE *do_fopen(char *name, char *mode);
-int do_fseek(FILE *fp, uint64_t offset, int whence);
-int do_fread(void *buffer, size_t size, size_t count, FILE *file);
-int do_fwrite(void *buffer, size_t size, size_t count, FILE *file);
-int do_fclose(FILE *fp);
-int do_mkdir(char *name);
+int runBatch(struct Ext2FS *ext2FS);
+int extractPath(struct Ext2FS *ext2FS, struct Ext2Stat *fileStat);
+int writeArchive(struct Ext2FS *ext2FS, struct Ext2Stat *fileStat);
+int extractDigests(struct Ext2FS *ext2FS, struct Ext2Stat *fileStat);
+size_t parseSize(char *str);
+double startPhase(void);
+void endPhase(int phase, double start);
+void printStats(struct Ext2FS *ext2FS, FILE *out);
 
 int main(int argc, char *argv[])
 {
+    struct Ext2Options ext2Opts;
+    ext2DefaultOptions(&ext2Opts);
+
     // GET CMD LINE ARGUMENTS -------------------------------------------------
+    // Options come first (e.g., -B 16M), followed by the positional arguments.
+    static struct option longOpts[] = {
+        {"buffer-budget", required_argument, NULL, 'B'},
+        {"mmap", no_argument, NULL, 'M'},
+        {"cache-size", required_argument, NULL, 'C'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"batch", required_argument, NULL, 'b'},
+        {"resolve-only", no_argument, NULL, 'n'},
+        {"zero-copy", no_argument, NULL, 'Z'},
+        {"io-uring", no_argument, NULL, 'U'},
+        {"stats", optional_argument, NULL, 'S'},
+        {"physical-order", no_argument, NULL, 'O'},
+        {"build-index", no_argument, NULL, 'I'},
+        {"index", required_argument, NULL, 'X'},
+        {"no-index", no_argument, NULL, 'N'},
+        {"tar", optional_argument, NULL, 'T'},
+        {"cpio", optional_argument, NULL, 'P'},
+        {"scan-inodes", no_argument, NULL, 'Q'},
+        {"digest", required_argument, NULL, 'D'},
+        {"manifest", required_argument, NULL, 'F'},
+        {"verify-only", no_argument, NULL, 'V'},
+        {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "B:MC:j:b:nZUO", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'I':
+            opts.buildIndex = 1;
+            break;
+        case 'T':
+        case 'P':
+            // --tar or --cpio writes to stdout, --tar=FILE or --cpio=FILE to FILE.
+            opts.archiveFormat = opt == 'T' ? EXT2_ARCHIVE_TAR : EXT2_ARCHIVE_CPIO;
+            opts.archiveFile = optarg;
+            break;
+        case 'D':
+            if (strcmp(optarg, "crc32c") == 0)
+            {
+                opts.digest = EXT2_DIGEST_CRC32C;
+            }
+            else if (strcmp(optarg, "sha256") == 0)
+            {
+                opts.digest = EXT2_DIGEST_SHA256;
+            }
+            else
+            {
+                fprintf(stderr, "Invalid digest: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'F':
+            opts.manifestFile = optarg;
+            break;
+        case 'V':
+            opts.verifyOnly = 1;
+            break;
+        case 'X':
+            ext2Opts.indexPath = optarg;
+            break;
+        case 'N':
+            ext2Opts.noIndex = 1;
+            break;
+        case 'Q':
+            ext2Opts.scanInodes = 1;
+            break;
+        case 'O':
+            ext2Opts.physicalOrder = 1;
+            break;
+        case 'S':
+            // --stats or --stats=table prints a table, --stats=json prints JSON.
+            if (optarg == NULL || strcmp(optarg, "table") == 0)
+            {
+                opts.statsFormat = STATS_TABLE;
+            }
+            else if (strcmp(optarg, "json") == 0)
+            {
+                opts.statsFormat = STATS_JSON;
+            }
+            else
+            {
+                fprintf(stderr, "Invalid stats format: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'U':
+            ext2Opts.useUring = 1;
+            break;
+        case 'Z':
+            ext2Opts.zeroCopy = 1;
+            break;
+        case 'b':
+            opts.batchPath = optarg;
+            break;
+        case 'n':
+            opts.resolveOnly = 1;
+            break;
+        case 'j':
+            ext2Opts.numThreads = atoi(optarg);
+            if (ext2Opts.numThreads < 1)
+            {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'C':
+            // A size of 0 disables the block cache.
+            ext2Opts.cacheSize = strcmp(optarg, "0") == 0 ? 0 : parseSize(optarg);
+            break;
+        case 'B':
+            ext2Opts.bufferBudget = parseSize(optarg);
+            break;
+        case 'M':
+            ext2Opts.useMmap = 1;
+            break;
+        default:
+            exit(1);
+        }
+    }
+
+    // Drop the options so that argv only holds the positional arguments.
+    argv[optind - 1] = argv[0];
+    argc -= optind - 1;
+    argv += optind - 1;
+
     // Must be able to take in one or more two command line arguments.
     // Check if at least one argument is provided.
     if (argc < 2)
@@ -110,902 +190,474 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Arg1 is required");
         exit(1);
     }
-    // ------------------------------------------------------------------------
-
-    // Open the ext2 file system.
-    FILE *ext2FS = do_fopen(argv[1], "rb");
-
-    // Read and parse the superblock.
-    parseSuperblock(ext2FS);
-
-    // Read and parse the root inode.
-    struct Inode *rootInode = parseInode(ROOT_INODE_NUM, ext2FS);
 
-    // PATH ENUMERATION. ------------------------------------------------------
-    if (argc == 2)
+    // The paths of a batch take the place of the second argument.
+    if (opts.batchPath != NULL && argc != 2)
     {
-        // Start path enumeration from the root directory.
-        enumeratePaths(rootInode, ext2FS, "/");
+        fprintf(stderr, "A batch takes no path argument\n");
+        exit(1);
     }
-    // ------------------------------------------------------------------------
-
-    // FILE SYSTEM OBJECT EXTRACTION ------------------------------------------
-    if (argc == 3)
+    if (opts.resolveOnly && opts.batchPath == NULL)
     {
-        // The getFileObjInode function implicitly begins from the
-        // root directory and it also verifies the file path's validity.
-        unsigned char fileObjName[256] = "/";
-
-        struct Inode *fileObjInode = getFileObjInode(ext2FS, argv[2], fileObjName);
-
-        // Extract the file object.
-        extractFileObj(fileObjInode, fileObjName, ext2FS);
+        fprintf(stderr, "--resolve-only requires --batch\n");
+        exit(1);
+    }
+    // The physical order extraction does its own reads and writes.
+    if (ext2Opts.physicalOrder && (ext2Opts.numThreads > 1 || ext2Opts.zeroCopy || ext2Opts.useUring))
+    {
+        fprintf(stderr, "--physical-order cannot be combined with --jobs, --zero-copy or --io-uring\n");
+        exit(1);
+    }
+    // An archive is a single stream written in directory entry order.
+    if (opts.archiveFormat != -1 && argc != 3)
+    {
+        fprintf(stderr, "--tar and --cpio take a single path argument\n");
+        exit(1);
+    }
+    if (opts.archiveFormat != -1 && (ext2Opts.physicalOrder || ext2Opts.numThreads > 1 || ext2Opts.zeroCopy || ext2Opts.useUring))
+    {
+        fprintf(stderr, "--tar and --cpio cannot be combined with --physical-order, --jobs, --zero-copy or --io-uring\n");
+        exit(1);
+    }
+    // The digests are taken as the files are written, in file order.
+    if (opts.digest != -1 && (argc != 3 || opts.archiveFormat != -1))
+    {
+        fprintf(stderr, "--digest takes a single path argument and no --tar or --cpio\n");
+        exit(1);
+    }
+    if (opts.digest != -1 && (ext2Opts.physicalOrder || ext2Opts.zeroCopy || ext2Opts.useUring))
+    {
+        fprintf(stderr, "--digest cannot be combined with --physical-order, --zero-copy or --io-uring\n");
+        exit(1);
+    }
+    if (opts.digest == -1 && (opts.manifestFile != NULL || opts.verifyOnly))
+    {
+        fprintf(stderr, "--manifest and --verify-only require --digest\n");
+        exit(1);
+    }
+    if (ext2Opts.scanInodes && (argc != 2 || opts.batchPath != NULL || opts.buildIndex))
+    {
+        fprintf(stderr, "--scan-inodes only applies to the listing of every path\n");
+        exit(1);
+    }
+    if (opts.buildIndex && (argc != 2 || opts.batchPath != NULL))
+    {
+        fprintf(stderr, "--build-index takes no path argument or batch\n");
+        exit(1);
+    }
 
-        // Free the allocated memory.
-        free(fileObjInode);
+    // The paths of a batch share most of their ancestors. An index
+    // build walks the whole tree, so it has no use for the old index.
+    ext2Opts.useDentryCache = opts.batchPath != NULL;
+    if (opts.buildIndex)
+    {
+        ext2Opts.noIndex = 1;
     }
     // ------------------------------------------------------------------------
 
-    // Free the allocated memory.
-    free(rootInode);
-    do_fclose(ext2FS);
-
-    return 0;
-}
-
-// UTILITY METHODS ------------------------------------------------------------
-// This function also verifies the file path's validity by using
-// the proper Directory Entry Tables.
-struct Inode *getFileObjInode(FILE *ext2FS, char *filePath, unsigned char *fileObjName)
-{
-    // Initialize the root inode.
-    struct Inode *rootInode = parseInode(ROOT_INODE_NUM, ext2FS);
-
-    // Create a copy of the file path.
-    char *filePathCopy = (char *)do_malloc(sizeof(char) * (strlen(filePath) + 1));
-    strcpy(filePathCopy, filePath);
-
-    // Tokenize the file path.
-    // Note: strtok modifies the original string.
-    struct Node *tokensList = NULL;
-    char *token = strtok(filePathCopy, "/");
-
-    while (token != NULL)
+    if (opts.statsFormat != STATS_OFF)
     {
-        char *tokenCopy = (char *)do_malloc(sizeof(char) * (strlen(token) + 1));
-        strcpy(tokenCopy, token);
-        append(&tokensList, tokenCopy);
-
-        token = strtok(NULL, "/");
+        ext2EnableStats(1);
     }
+    startTime = startPhase();
+    double phaseStart = startTime;
 
-    // If the tokens list is still empty at this point,
-    // then it means that it is a root directory.
-    if (tokensList == NULL)
+    // Open the ext2 file system.
+    struct Ext2FS *ext2FS;
+    if (ext2Open(argv[1], &ext2Opts, &ext2FS) != EXT2_OK)
     {
-        return rootInode;
+        fprintf(stderr, "%s\n", ext2LastError());
+        exit(1);
     }
+    endPhase(PHASE_SETUP, phaseStart);
 
-    // Build and initialize the seen nodes list.
-    struct Node *seenNodesList = NULL;
-    append(&seenNodesList, rootInode);
-
-    // TRAVERSE THE TOKENS LIST ----------------------------------
-    struct Node *currToken = tokensList;
-    do
+    // The library does not print, so tell about the index it had to ignore.
+    if (ext2IndexState(ext2FS) == EXT2_INDEX_STALE)
     {
-        // Get the current token name.
-        char *tokenName = (char *)currToken->data;
-
-        // If tokenName is a dot (.), do nothing.
-        if (strcmp(tokenName, ".") == 0)
+        if (ext2Opts.indexPath != NULL)
         {
-            currToken = currToken->next;
-            continue;
+            fprintf(stderr, "Ignoring the path index %s: stale or malformed\n", ext2Opts.indexPath);
         }
-
-        // If tokenName is a double dot (..), pop and free the last inode
-        // from the seen nodes list (given that it is not the root inode).
-        if (strcmp(tokenName, "..") == 0)
+        else
         {
-            if (seenNodesList->prev != seenNodesList)
-            {
-                struct Node *lastNode = pop(&seenNodesList);
-                free(lastNode->data); // Free the inode data.
-                free(lastNode);       // Free the node itself.
-            }
-
-            currToken = currToken->next;
-            continue;
+            fprintf(stderr, "Ignoring the path index %s%s: stale or malformed\n", argv[1], INDEX_SUFFIX);
         }
+    }
 
-        // Get the current directory inode
-        // (i.e, the last inode in the seen nodes list).
-        struct Inode *currInode = (struct Inode *)seenNodesList->prev->data;
-
-        // Read all the data blocks.
-        unsigned char *data = readAllDataBlocks(currInode, ext2FS);
-
-        // Parse the directory entries.
-        struct Node *dirEntriesList = parseDirEntryInfo(data, currInode);
-
-        // Initialize the isFileObjFound flag.
-        int isFileObjFound = 0;
-
-        // TRAVERSE THE DIRECTORY ENTRIES -------------------------------------
-        struct Node *currDirEntry = dirEntriesList;
-        do
-        {
-            // Get the data of the current directory entry.
-            struct DirEntry *dirEntry = (struct DirEntry *)currDirEntry->data;
-
-            // If the current directory entry name is equal to the current token name,
-            // then get the inode number and parse the inode.
-            if (strcmp(dirEntry->name, tokenName) == 0)
-            {
-                // Update the isFileObjFound flag.
-                isFileObjFound = 1;
-
-                // Update the file object name.
-                strcpy(fileObjName, dirEntry->name);
-
-                // Get the inode number.
-                uint32_t inodeNum = dirEntry->inodeNum;
-
-                // Get the inode of the current directory entry.
-                struct Inode *currInode = parseInode(inodeNum, ext2FS);
-
-                // Determine if the inode is a directory or a file.
-                int isDir = isInodeDir(currInode);
-
-                // If the inode is a directory, add it to the seen nodes list.
-                if (isDir)
-                {
-                    append(&seenNodesList, currInode);
-                    break;
-                }
-
-                // If the inode is a file and it is not the last token,
-                // print an error message and exit the program.
-                if (!isDir && currToken->next != tokensList)
-                {
-                    fprintf(stderr, "INVALID PATH\n");
-                    exit(-1);
-                }
-
-                // If the inode is a file and it is the last token,
-                // add it to the seen nodes list.
-                if (!isDir && currToken->next == tokensList)
-                {
-                    append(&seenNodesList, currInode);
-                }
-
-                break;
-            }
-
-            currDirEntry = currDirEntry->next;
-        } while (currDirEntry != dirEntriesList);
-        // --------------------------------------------------------------------
-
-        // Free the allocated memory.
-        freeList(dirEntriesList);
-        free(data);
+    // Exit status of the program.
+    int status = 0;
 
-        // If the file object was not found, then this
-        // means that the file path is invalid.
-        if (!isFileObjFound)
+    // PATH INDEX BUILD -------------------------------------------------------
+    if (opts.buildIndex)
+    {
+        phaseStart = startPhase();
+        if (ext2BuildIndex(ext2FS) != EXT2_OK)
         {
-            fprintf(stderr, "INVALID PATH\n");
-            exit(-1);
+            fprintf(stderr, "%s\n", ext2LastError());
+            status = 1;
         }
-
-        // Move to the next token.
-        currToken = currToken->next;
-    } while (currToken != tokensList);
-    // -----------------------------------------------------------
-
-    // Create a copy of the last inode in the seen nodes list.
-    struct Inode *fileObjInode = (struct Inode *)do_malloc(sizeof(struct Inode));
-    memcpy(fileObjInode, seenNodesList->prev->data, sizeof(struct Inode));
-
-    // Determine if the last token follows the proper file path format.
-    // That is, if the last token is a directory, then it must end with a slash (/).
-    // If the last token is a file, then it must not end with a slash (/).
-    if ((isInodeDir(fileObjInode) && filePath[strlen(filePath) - 1] != '/') ||
-        (!isInodeDir(fileObjInode) && filePath[strlen(filePath) - 1] == '/'))
-    {
-        fprintf(stderr, "INVALID PATH\n");
-        exit(-1);
+        endPhase(PHASE_ENUMERATE, phaseStart);
     }
+    // ------------------------------------------------------------------------
 
-    // Free the allocated memory.
-    freeList(tokensList);
-    freeList(seenNodesList);
-    free(filePathCopy);
-
-    // Return the file object inode.
-    return fileObjInode;
-}
-
-int extractFileObj(struct Inode *fileObjInode, unsigned char name[256], FILE *ext2FS)
-{
-    // Determine if the file object is a directory or a file.
-    int isDir = isInodeDir(fileObjInode);
-
-    // Dir
-    if (isDir)
-    {
-        // Create "output" directory.
-        do_mkdir("output");
-        extractDir(fileObjInode, ext2FS, "./output/");
-    }
-    // File
-    else
+    // PATH ENUMERATION. ------------------------------------------------------
+    if (argc == 2 && opts.batchPath == NULL && !opts.buildIndex)
     {
-        // The file will be extracted in the current directory of this program.
-        extractFile(fileObjInode, name, ext2FS);
+        phaseStart = startPhase();
+        if (ext2Enumerate(ext2FS, stdout) != EXT2_OK)
+        {
+            fprintf(stderr, "%s\n", ext2LastError());
+            status = 1;
+        }
+        endPhase(PHASE_ENUMERATE, phaseStart);
     }
+    // ------------------------------------------------------------------------
 
-    return 0;
-}
-
-int extractFile(struct Inode *fileObjInode, unsigned char name[256], FILE *ext2FS)
-{
-    // Get the data.
-    unsigned char *data = readAllDataBlocks(fileObjInode, ext2FS);
-
-    // Open the the file in binary write mode.
-    FILE *fileObj = do_fopen(name, "wb");
-
-    // Write the data into the file.
-    do_fwrite(data, sizeof(unsigned char), fileObjInode->FSizeLower, fileObj);
-
-    // Close the file.
-    do_fclose(fileObj);
-
-    // Free the allocated memory.
-    free(data);
-
-    return 0;
-}
-
-// Extract the contents of the given dir inode and save a copy of it.
-int extractDir(struct Inode *fileObjInode, FILE *ext2FS, char *currentPath)
-{
-    // Determine if the file object is a directory or a file.
-    int isDir = isInodeDir(fileObjInode);
-
-    // Base case: If the file object is a file, extract it.
-    if (!isDir)
+    // FILE SYSTEM OBJECT EXTRACTION ------------------------------------------
+    if (argc == 3)
     {
-        extractFile(fileObjInode, currentPath, ext2FS);
-        return 0;
-    }
+        // The lookup implicitly begins from the root
+        // directory and it also verifies the file path's validity.
+        struct Ext2Stat fileStat;
 
-    // Create a copy of the current path.
-    char *currentPathCopy = (char *)do_malloc(sizeof(char) * (strlen(currentPath) + 1));
-    strcpy(currentPathCopy, currentPath);
+        phaseStart = startPhase();
+        int lookupStatus = ext2Stat(ext2FS, argv[2], &fileStat);
+        endPhase(PHASE_LOOKUP, phaseStart);
 
-    // Get the data.
-    unsigned char *data = readAllDataBlocks(fileObjInode, ext2FS);
-
-    // Parse the directory entries.
-    struct Node *dirEntriesList = parseDirEntryInfo(data, fileObjInode);
-
-    // Traverse the directory entries.
-    struct Node *currDirEntry = dirEntriesList;
-    do
-    {
-        // Get the data of the current directory entry.
-        struct DirEntry *dirEntry = (struct DirEntry *)currDirEntry->data;
-
-        // Disregard the current directory (.) and parent directory (..).
-        if (strcmp(dirEntry->name, ".") == 0 ||
-            strcmp(dirEntry->name, "..") == 0)
+        if (lookupStatus == EXT2_ERR_INVALID_PATH)
         {
-            currDirEntry = currDirEntry->next;
-            continue;
+            fprintf(stderr, "INVALID PATH\n");
+            exit(-1);
         }
-
-        // Get the inode number.
-        uint32_t inodeNum = dirEntry->inodeNum;
-
-        // Edge case. The directory "lost+found" sometimes have an inode number of 0
-        if (inodeNum == 0)
+        if (opts.archiveFormat != -1 && lookupStatus == EXT2_OK)
         {
-            currDirEntry = currDirEntry->next;
-            continue;
+            status = writeArchive(ext2FS, &fileStat) != 0;
         }
-
-        // Get the inode of the current directory entry.
-        struct Inode *currInode = parseInode(inodeNum, ext2FS);
-
-        // Get the file object name.
-        // Note: nameLen does not include the null terminator.
-        // Due to this, +2 is for the null terminator and the potential slash (/).
-        char *fileObjName = (char *)do_malloc(sizeof(char) * (dirEntry->nameLen + 2));
-        strcpy(fileObjName, dirEntry->name);
-
-        // Determine if the inode is a directory or a file.
-        int isDir = isInodeDir(currInode);
-
-        // Add the slash (/) at the end of the file object name if it is a directory.
-        if (isDir)
+        else if (opts.digest != -1 && lookupStatus == EXT2_OK)
         {
-            strcat(fileObjName, "/\0");
+            status = extractDigests(ext2FS, &fileStat) != 0;
         }
-
-        // Append the file object name into the current path.
-        char *newPath = (char *)do_malloc(sizeof(char) * (strlen(currentPath) + strlen(fileObjName) + 1));
-        strcpy(newPath, currentPath);
-        strcat(newPath, fileObjName);
-
-        // If the file object is a directory, create a directory
-        // using the new path.
-        if (isDir)
+        else if (lookupStatus != EXT2_OK || extractPath(ext2FS, &fileStat) != EXT2_OK)
         {
-            do_mkdir(newPath);
+            fprintf(stderr, "%s\n", ext2LastError());
+            status = 1;
         }
+    }
+    // ------------------------------------------------------------------------
 
-        // Recursively extract the file object.
-        extractDir(currInode, ext2FS, newPath);
-
-        // Free the allocated memory.
-        free(currInode);
-        free(fileObjName);
-        free(newPath);
-
-        currDirEntry = currDirEntry->next;
-    } while (currDirEntry != dirEntriesList);
-
-    // Free the allocated memory.
-    freeList(dirEntriesList);
-    free(data);
-
-    return 0;
-}
-
-int enumeratePaths(struct Inode *inode, FILE *ext2FS, char *currentPath)
-{
-    // Print the current path.
-    printf("%s\n", currentPath);
-
-    // Determine if the inode is a directory or a file.
-    int isDir = isInodeDir(inode);
-
-    // If the inode is a directory, get the directory entries.
-    if (isDir)
+    // BATCH PATH RESOLUTION (AND EXTRACTION) ---------------------------------
+    if (opts.batchPath != NULL)
     {
-        // Read all the data blocks.
-        unsigned char *data = readAllDataBlocks(inode, ext2FS);
-
-        // Parse the directory entries.
-        struct Node *dirEntriesList = parseDirEntryInfo(data, inode);
-
-        // Traverse the directory entries.
-        struct Node *current = dirEntriesList;
-        do
+        // The batch carries on past the bad paths. The exit status
+        // only tells whether any of them failed.
+        if (runBatch(ext2FS) > 0)
         {
-            // Get the data of the current directory entry.
-            struct DirEntry *currDirEntry = (struct DirEntry *)current->data;
-
-            // Disregard the current directory (.) and parent directory (..).
-            if (strcmp(currDirEntry->name, ".") == 0 ||
-                strcmp(currDirEntry->name, "..") == 0)
-            {
-                current = current->next;
-                continue;
-            }
-
-            // Get the inode number.
-            uint32_t inodeNum = currDirEntry->inodeNum;
-
-            // Edge case. The directory "lost+found" sometimes have an inode number of 0
-            if (inodeNum == 0)
-            {
-                current = current->next;
-                continue;
-            }
-
-            // Get the inode of the current directory entry.
-            struct Inode *currInode = parseInode(inodeNum, ext2FS);
-
-            // Get the file object name.
-            // Note: nameLen does not include the null terminator.
-            // Due to this, +2 is for the null terminator and the potential slash (/).
-            char *fileObjName = (char *)do_malloc(sizeof(char) * (currDirEntry->nameLen + 2));
-            strcpy(fileObjName, currDirEntry->name);
-
-            // Add the slash (/) at the end of the file object name if it is a directory.
-            if (isInodeDir(currInode))
-            {
-                strcat(fileObjName, "/\0");
-            }
-
-            // Append the file object name into the current path.
-            char *newPath = (char *)do_malloc(sizeof(char) * (strlen(currentPath) + strlen(fileObjName) + 1));
-            strcpy(newPath, currentPath);
-            strcat(newPath, fileObjName);
-
-            // Recursively enumerate the paths.
-            enumeratePaths(currInode, ext2FS, newPath);
-
-            // Free the allocated memory.
-            free(currInode);
-            free(fileObjName);
-            free(newPath);
-
-            current = current->next;
-        } while (current != dirEntriesList);
-
-        // Free the allocated memory.
-        freeList(dirEntriesList);
-        free(data);
+            status = 1;
+        }
     }
+    // ------------------------------------------------------------------------
 
-    return 0;
-}
-
-int isInodeDir(struct Inode *inode)
-{
-    return inode->type >> 12 == 4 ? 1 : 0;
-}
-
-int parseSuperblock(FILE *ext2FS)
-{
-    do_fseek(ext2FS, SB_ADDR, SEEK_SET);
-    do_fread(&sb.totalInodes, sizeof(sb.totalInodes), 1, ext2FS);
-
-    do_fseek(ext2FS, SB_ADDR + 4, SEEK_SET);
-    do_fread(&sb.totalBlocks, sizeof(sb.totalBlocks), 1, ext2FS);
-
-    do_fseek(ext2FS, SB_ADDR + 24, SEEK_SET);
-    do_fread(&sb.blockSizeMult, sizeof(sb.blockSizeMult), 1, ext2FS);
-
-    do_fseek(ext2FS, SB_ADDR + 32, SEEK_SET);
-    do_fread(&sb.blocksPerBG, sizeof(sb.blocksPerBG), 1, ext2FS);
-
-    do_fseek(ext2FS, SB_ADDR + 40, SEEK_SET);
-    do_fread(&sb.inodesPerBG, sizeof(sb.inodesPerBG), 1, ext2FS);
-
-    do_fseek(ext2FS, SB_ADDR + 88, SEEK_SET);
-    do_fread(&sb.inodeSize, sizeof(sb.inodeSize), 1, ext2FS);
-
-    // Calculate the block size.
-    sb.blockSize = 1024 << sb.blockSizeMult;
-
-    return 0;
-}
-
-struct Inode *parseInode(uint32_t inodeNum, FILE *ext2FS)
-{
-    // COMPUTE FOR THE INODE ADDRESS (BYTE OFFSET) ------------------------------
-    // Determine which block group the corresponding inode is in.
-    uint32_t inodeBGNum = (inodeNum - 1) / sb.inodesPerBG;
-
-    // Determine the index of the inode in the inode table.
-    uint32_t inodeIndex = (inodeNum - 1) % sb.inodesPerBG;
-
-    // Get the block group descriptor table entry address.
-    uint64_t bgdtEntryAddr = sb.blockSize + (inodeBGNum * BGD_SIZE);
-
-    // Get the inode table address.
-    uint32_t relInodeTableAddr;
-    do_fseek(ext2FS, bgdtEntryAddr + 8, SEEK_SET);
-    do_fread(&relInodeTableAddr, sizeof(relInodeTableAddr), 1, ext2FS);
-    uint64_t inodeTableAddr = relInodeTableAddr * sb.blockSize;
-
-    // Get the inode address.
-    uint64_t inodeAddr = inodeTableAddr + (inodeIndex * sb.inodeSize);
-    // -------------------------------------------------------------------------
-
-    // PARSE THE INODE AND BUILD ITS INODE STRUCT ------------------------------
-    // Allocate memory for the inode struct.
-    struct Inode *inode = (struct Inode *)do_malloc(sizeof(struct Inode));
-
-    // Get the type.
-    do_fseek(ext2FS, inodeAddr, SEEK_SET);
-    do_fread(&inode->type, sizeof(inode->type), 1, ext2FS);
-
-    // Get lower 32 bits of the file size.
-    do_fseek(ext2FS, inodeAddr + 4, SEEK_SET);
-    do_fread(&inode->FSizeLower, sizeof(inode->FSizeLower), 1, ext2FS);
-
-    // Get the 12 direct block pointers.
-    do_fseek(ext2FS, inodeAddr + 40, SEEK_SET);
-    for (int i = 0; i < 12; i++)
+    if (opts.statsFormat != STATS_OFF)
     {
-        do_fread(&inode->DBlockPtrs[i], sizeof(inode->DBlockPtrs[i]), 1, ext2FS);
+        printStats(ext2FS, stderr);
     }
 
-    // Get the singly indirect block pointer.
-    do_fseek(ext2FS, inodeAddr + 88, SEEK_SET);
-    do_fread(&inode->SIBlockPtr, sizeof(inode->SIBlockPtr), 1, ext2FS);
-
-    // Get the doubly indirect block pointer.
-    do_fseek(ext2FS, inodeAddr + 92, SEEK_SET);
-    do_fread(&inode->DIBlockPtr, sizeof(inode->DIBlockPtr), 1, ext2FS);
-
-    // Get the triply indirect block pointer.
-    do_fseek(ext2FS, inodeAddr + 96, SEEK_SET);
-    do_fread(&inode->TIBlockPtr, sizeof(inode->TIBlockPtr), 1, ext2FS);
-    // -------------------------------------------------------------------------
+    ext2Close(ext2FS);
 
-    return inode;
+    return status;
 }
 
-// Get all the block data pointed by the 12 direct block pointers,
-// singly indirect block pointer, and doubly indirect block pointer.
-unsigned char *readAllDataBlocks(struct Inode *inode, FILE *ext2FS)
+// Extract a file object into the current directory: a directory into
+// "output" and a file under its own name.
+int extractPath(struct Ext2FS *ext2FS, struct Ext2Stat *fileStat)
 {
-    // Allocate memory for the data.
-    unsigned char *data = (unsigned char *)do_calloc(inode->FSizeLower, sizeof(unsigned char));
+    const char *destPath = (fileStat->mode & 0xF000) == 0x4000 ? "output" : fileStat->name;
 
-    // Read all the data blocks.
-    size_t readBytes = 0;
-    read12DBlockPtrs(data, &readBytes, inode, ext2FS);
-    readSIBlockPtr(data, inode->SIBlockPtr * sb.blockSize, &readBytes, inode, ext2FS);
-    readDIBlockPtr(data, inode->DIBlockPtr * sb.blockSize, &readBytes, inode, ext2FS);
-    readTIBlockPtr(data, inode->TIBlockPtr * sb.blockSize, &readBytes, inode, ext2FS);
+    double phaseStart = startPhase();
+    int status = ext2Extract(ext2FS, fileStat->inodeNum, destPath);
+    endPhase(PHASE_EXTRACT, phaseStart);
 
-    return data;
+    return status;
 }
 
-int readDataBlock(unsigned char *data,
-                  uint64_t dBlockAddr,
-                  size_t *readBytes,
-                  struct Inode *inode,
-                  FILE *ext2FS)
+// Write a file object as an archive, its entries named as extractPath
+// would name the extracted files. Returns -1 (after telling why) on failure.
+int writeArchive(struct Ext2FS *ext2FS, struct Ext2Stat *fileStat)
 {
-    // Read byte by byte (per data block).
-    do_fseek(ext2FS, dBlockAddr, SEEK_SET);
-    for (int i = 0; i < sb.blockSize; i++)
+    const char *name = (fileStat->mode & 0xF000) == 0x4000 ? "output" : fileStat->name;
+
+    FILE *out = stdout;
+    if (opts.archiveFile != NULL && strcmp(opts.archiveFile, "-") != 0)
     {
-        if (*readBytes == inode->FSizeLower)
+        out = fopen(opts.archiveFile, "wb");
+        if (out == NULL)
         {
-            break;
+            fprintf(stderr, "Cannot open %s: %s\n", opts.archiveFile, strerror(errno));
+            return -1;
         }
-
-        do_fread(&data[*readBytes], 1, 1, ext2FS);
-        *readBytes += 1;
     }
 
-    return 0;
-}
-
-int read12DBlockPtrs(unsigned char *data,
-                     size_t *readBytes,
-                     struct Inode *inode,
-                     FILE *ext2FS)
-{
-    for (int i = 0; i < DBLOCK_PTR_COUNT; i++)
+    double phaseStart = startPhase();
+    int status = 0;
+    if (ext2Archive(ext2FS, fileStat->inodeNum, name, opts.archiveFormat, out) != EXT2_OK)
     {
-        if (*readBytes == inode->FSizeLower)
-        {
-            break;
-        }
-
-        // Get the direct block pointer.
-        uint32_t dBlockPtr = inode->DBlockPtrs[i];
-
-        // Get the direct block address.
-        uint64_t dBlockAddr = dBlockPtr * sb.blockSize;
-
-        // Read the corresponding direct data block.
-        readDataBlock(data, dBlockAddr, readBytes, inode, ext2FS);
+        fprintf(stderr, "%s\n", ext2LastError());
+        status = -1;
     }
+    endPhase(PHASE_EXTRACT, phaseStart);
 
-    return 0;
-}
-
-int readSIBlockPtr(unsigned char *data,
-                   uint64_t sIBlockAddr,
-                   size_t *readBytes,
-                   struct Inode *inode,
-                   FILE *ext2FS)
-{
-    // Read byte by byte (per data block).
-    int numOfDBlockPtrs = sb.blockSize / DBLOCK_PTR_SIZE;
-    for (int i = 0; i < numOfDBlockPtrs; i++)
+    if (out != stdout && fclose(out) != 0 && status == 0)
     {
-        // Adjust the file pointer to the corresponding direct block.
-        do_fseek(ext2FS, sIBlockAddr + (4 * i), SEEK_SET);
-
-        if (*readBytes == inode->FSizeLower)
-        {
-            break;
-        }
-
-        // Get the direct block pointer (four bytes - in little endian).
-        uint32_t dBlockPtr;
-        do_fread(&dBlockPtr, sizeof(dBlockPtr), 1, ext2FS);
-
-        // Get the direct block address.
-        uint64_t dBlockAddr = dBlockPtr * sb.blockSize;
-
-        // Read the corresponding direct data block.
-        readDataBlock(data, dBlockAddr, readBytes, inode, ext2FS);
+        fprintf(stderr, "Cannot write %s: %s\n", opts.archiveFile, strerror(errno));
+        status = -1;
     }
 
-    return 0;
+    return status;
 }
 
-int readDIBlockPtr(unsigned char *data,
-                   uint64_t dIBlockAddr,
-                   size_t *readBytes,
-                   struct Inode *inode,
-                   FILE *ext2FS)
+// Extract a file object as extractPath does (or only read it, with
+// --verify-only) and write the digests of its files to the manifest.
+// Returns -1 (after telling why) on failure.
+int extractDigests(struct Ext2FS *ext2FS, struct Ext2Stat *fileStat)
 {
-    // Read byte by byte (per data block).
-    int numOfSIBlockPtrs = sb.blockSize / DBLOCK_PTR_SIZE;
-    for (int i = 0; i < numOfSIBlockPtrs; i++)
-    {
-        // Adjust the file pointer to the corresponding singly indirect block.
-        do_fseek(ext2FS, dIBlockAddr + (4 * i), SEEK_SET);
+    const char *destPath = (fileStat->mode & 0xF000) == 0x4000 ? "output" : fileStat->name;
 
-        if (*readBytes == inode->FSizeLower)
+    FILE *out = stdout;
+    if (opts.manifestFile != NULL && strcmp(opts.manifestFile, "-") != 0)
+    {
+        out = fopen(opts.manifestFile, "w");
+        if (out == NULL)
         {
-            break;
+            fprintf(stderr, "Cannot open %s: %s\n", opts.manifestFile, strerror(errno));
+            return -1;
         }
-
-        // Get the singly indirect block pointer (four bytes - in little endian).
-        uint32_t sIBlockPtr;
-        do_fread(&sIBlockPtr, sizeof(sIBlockPtr), 1, ext2FS);
-
-        // Get the singly indirect block address.
-        uint64_t sIBlockAddr = sIBlockPtr * sb.blockSize;
-
-        // Read the corresponding singly indirect data block.
-        readSIBlockPtr(data, sIBlockAddr, readBytes, inode, ext2FS);
     }
 
-    return 0;
-}
-
-int readTIBlockPtr(unsigned char *data,
-                   uint64_t tIBlockAddr,
-                   size_t *readBytes,
-                   struct Inode *inode,
-                   FILE *ext2FS)
-{
-    // Read byte by byte (per data block).
-    int numOfDIBlockPtrs = sb.blockSize / DBLOCK_PTR_SIZE;
-    for (int i = 0; i < numOfDIBlockPtrs; i++)
+    double phaseStart = startPhase();
+    int status = 0;
+    if (ext2ExtractDigests(ext2FS, fileStat->inodeNum, destPath, opts.digest, opts.verifyOnly, out) != EXT2_OK)
     {
-        // Adjust the file pointer to the corresponding doubly indirect block.
-        do_fseek(ext2FS, tIBlockAddr + (4 * i), SEEK_SET);
-
-        if (*readBytes == inode->FSizeLower)
-        {
-            break;
-        }
-
-        // Get the doubly indirect block pointer (four bytes - in little endian).
-        uint32_t dIBlockPtr;
-        do_fread(&dIBlockPtr, sizeof(dIBlockPtr), 1, ext2FS);
-
-        // Get the doubly indirect block address.
-        uint64_t dIBlockAddr = dIBlockPtr * sb.blockSize;
+        fprintf(stderr, "%s\n", ext2LastError());
+        status = -1;
+    }
+    endPhase(PHASE_EXTRACT, phaseStart);
 
-        // Read the corresponding doubly indirect data block.
-        readDIBlockPtr(data, dIBlockAddr, readBytes, inode, ext2FS);
+    if (out != stdout && fclose(out) != 0 && status == 0)
+    {
+        fprintf(stderr, "Cannot write %s: %s\n", opts.manifestFile, strerror(errno));
+        status = -1;
     }
 
-    return 0;
+    return status;
 }
 
-// Parse the data block/s (when it is a directory entry information).
-// Note: A directory is never empty (i.e., it always has at least two entries:
-//       the current directory (.) and the parent directory (..)).
-struct Node *parseDirEntryInfo(unsigned char *data, struct Inode *inode)
+// Resolve (and extract, unless opts.resolveOnly) every path listed in the
+// batch file, one per line, in a single pass. Unlike the single path mode,
+// a bad path does not end the program: every path gets a result line.
+//   OK <inode number> <path>
+//   INVALID PATH <path>
+//   FAILED <path> (the errors are printed to stderr)
+// Returns the number of paths that failed.
+int runBatch(struct Ext2FS *ext2FS)
 {
-    struct Node *dirEntriesList = NULL;
-
-    // Traverse the every byte of data.
-    uint32_t i = 0;
-    while (i < inode->FSizeLower)
+    FILE *batchFile = strcmp(opts.batchPath, "-") == 0 ? stdin : fopen(opts.batchPath, "r");
+    if (batchFile == NULL)
     {
-        struct DirEntry *dirEntry = (struct DirEntry *)malloc(sizeof(struct DirEntry));
-
-        // Get the inode number (byte 0 to byte 3 - in little endian).
-        dirEntry->inodeNum = data[i] | data[i + 1] << 8 | data[i + 2] << 16 | data[i + 3] << 24;
-        i += 4;
-
-        // Get the entry size (byte 4 to byte 5 - in little endian).
-        dirEntry->entrySize = data[i] | data[i + 1] << 8;
-        i += 2;
-
-        // Get the name length (byte 6).
-        dirEntry->nameLen = data[i];
-        i += 1;
-        i += 1; // Skip the file type byte.
+        perror("fopen failed");
+        exit(1);
+    }
 
-        // Get the name (byte 8 to byte 8 + nameLen - 1).
-        for (int j = 0; j < dirEntry->nameLen; j++)
+    int numFailed = 0;
+    char *line = NULL;
+    size_t lineSize = 0;
+    ssize_t lineLen;
+    while ((lineLen = getline(&line, &lineSize, batchFile)) != -1)
+    {
+        // Strip the line ending and skip the blank lines.
+        while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r'))
         {
-            dirEntry->name[j] = data[i + j];
+            line[--lineLen] = '\0';
+        }
+        if (lineLen == 0)
+        {
+            continue;
         }
-        // Add the null terminator.
-        dirEntry->name[dirEntry->nameLen] = '\0';
-
-        // Append the directory entry into the linked list.
-        // Cases for when inodeNum is 0 will be handled by the caller
-        // of this function.
-        append(&dirEntriesList, dirEntry);
 
-        // Update i for the next directory entry.
-        i += dirEntry->entrySize - 8;
-    }
+        // Resolve the path.
+        struct Ext2Stat fileStat;
 
-    return dirEntriesList;
-}
+        double phaseStart = startPhase();
+        int status = ext2Stat(ext2FS, line, &fileStat);
+        endPhase(PHASE_LOOKUP, phaseStart);
 
-// Circular doubly linked list.
-struct Node *createNode(void *data)
-{
-    struct Node *newNode = (struct Node *)do_malloc(sizeof(struct Node));
-    newNode->data = data;
-    newNode->next = NULL;
-    newNode->prev = NULL;
-
-    return newNode;
-}
+        if (status == EXT2_ERR_INVALID_PATH)
+        {
+            printf("INVALID PATH %s\n", line);
+            numFailed++;
+            continue;
+        }
 
-void append(struct Node **head, void *data)
-{
-    struct Node *newNode = createNode(data);
+        // Extract the file object. The errors of one
+        // path do not stop the others.
+        if (status == EXT2_OK && !opts.resolveOnly)
+        {
+            status = extractPath(ext2FS, &fileStat);
+        }
 
-    // If the list is empty, make the new node as head.
-    if (*head == NULL)
-    {
-        *head = newNode;
-        newNode->next = newNode;
-        newNode->prev = newNode;
-    }
-    else
-    {
-        // Insert the new node at the end.
-        struct Node *last = (*head)->prev;
-        last->next = newNode;
-        newNode->prev = last;
-        newNode->next = *head;
-        (*head)->prev = newNode;
-    }
-}
+        if (status != EXT2_OK)
+        {
+            fprintf(stderr, "%s: %s\n", line, ext2LastError());
+            printf("FAILED %s\n", line);
+            numFailed++;
+            continue;
+        }
 
-struct Node *pop(struct Node **head)
-{
-    if (*head == NULL)
-    {
-        printf("List is empty, cannot pop.\n");
-        return NULL;
+        printf("OK %u %s\n", fileStat.inodeNum, line);
     }
 
-    struct Node *lastNode = (*head)->prev;
-    if (*head == lastNode)
-    {
-        *head = NULL;
-    }
-    else
+    // Free the allocated memory.
+    free(line);
+    if (batchFile != stdin)
     {
-        lastNode->prev->next = *head;
-        (*head)->prev = lastNode->prev;
+        fclose(batchFile);
     }
 
-    return lastNode;
+    return numFailed;
 }
 
-void freeList(struct Node *head)
-{
-    if (head == NULL)
-    {
-        return;
+// Parse a size such as 4096, 512K, 16M or 1G (in bytes).
+size_t parseSize(char *str)
+{
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        size <<= 10;
+        // Fall through.
+    case 'M':
+    case 'm':
+        size <<= 10;
+        // Fall through.
+    case 'K':
+    case 'k':
+        size <<= 10;
+        end++;
+        break;
     }
 
-    struct Node *current = head;
-    struct Node *next;
-
-    do
+    if (end == str || *end != '\0' || size == 0)
     {
-        next = current->next;
-        free(current->data);
-        free(current);
-        current = next;
-    } while (current != head);
-}
-
-void *do_malloc(size_t size)
-{
-    void *ptr = malloc(size);
-    if (ptr == NULL)
-    {
-        perror("malloc failed");
+        fprintf(stderr, "Invalid size: %s\n", str);
         exit(1);
     }
 
-    return ptr;
+    return size;
 }
 
-void *do_calloc(size_t nmemb, size_t size)
+// Read the clock at the start of a phase (only with --stats).
+double startPhase(void)
 {
-    void *ptr = calloc(nmemb, size);
-    if (ptr == NULL)
+    if (opts.statsFormat == STATS_OFF)
     {
-        perror("calloc failed");
-        exit(1);
+        return 0;
     }
 
-    return ptr;
-}
-
-FILE *do_fopen(char *name, char *mode)
-{
-    FILE *fp = fopen(name, mode);
-    if (fp == NULL)
-    {
-        perror("fopen failed");
-        exit(1);
-    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    return fp;
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
 
-int do_fseek(FILE *fp, uint64_t offset, int whence)
+// Add the time since start to a phase.
+void endPhase(int phase, double start)
 {
-    if (fseek(fp, offset, whence) != 0)
+    if (opts.statsFormat != STATS_OFF)
     {
-        perror("fseek failed");
-        exit(1);
+        phaseTime[phase] += startPhase() - start;
     }
-
-    return 0;
 }
 
-int do_fread(void *buffer, size_t size, size_t count, FILE *file)
+// Print the statistics of the run, as a table or as JSON (see --stats).
+void printStats(struct Ext2FS *ext2FS, FILE *out)
 {
-    if (fread(buffer, size, count, file) != count)
-    {
-        fprintf(stderr, "fread failed\n");
-        exit(1);
-    }
+    static const char *phaseNames[PHASES] = {"setup", "lookup", "enumerate", "extract"};
+    static const char *kindNames[EXT2_READ_KINDS] = {"superblock", "bgdt", "inode", "indirect", "directory", "file_data"};
+    double totalTime = startPhase() - startTime;
 
-    return 0;
-}
+    struct Ext2Stats stats;
+    ext2GetStats(ext2FS, &stats);
 
-int do_fwrite(void *buffer, size_t size, size_t count, FILE *file)
-{
-    if (fwrite(buffer, size, count, file) != count)
+    if (opts.statsFormat == STATS_JSON)
     {
-        fprintf(stderr, "fwrite failed\n");
-        exit(1);
+        fprintf(out, "{\n  \"phases\": {");
+        for (int i = 0; i < PHASES; i++)
+        {
+            fprintf(out, "\"%s\": %.6f, ", phaseNames[i], phaseTime[i]);
+        }
+        fprintf(out, "\"total\": %.6f},\n  \"bytes_read\": {", totalTime);
+        for (int i = 0; i < EXT2_READ_KINDS; i++)
+        {
+            fprintf(out, "%s\"%s\": %llu", i == 0 ? "" : ", ", kindNames[i], (unsigned long long)stats.bytesRead[i]);
+        }
+        fprintf(out, "},\n  \"reads\": %llu,\n  \"seeks\": %llu,\n  \"copies\": %llu,\n",
+                (unsigned long long)stats.reads, (unsigned long long)stats.seeks, (unsigned long long)stats.copies);
+        fprintf(out, "  \"writes\": %llu,\n  \"bytes_written\": %llu,\n",
+                (unsigned long long)stats.writes, (unsigned long long)stats.bytesWritten);
+        fprintf(out, "  \"allocations\": %llu,\n  \"allocated_bytes\": %llu,\n  \"mkdirs\": %llu,\n",
+                (unsigned long long)stats.allocs, (unsigned long long)stats.allocBytes, (unsigned long long)stats.mkdirs);
+        fprintf(out, "  \"block_cache\": {");
+        for (int i = EXT2_READ_INODE; i <= EXT2_READ_DIRECTORY; i++)
+        {
+            fprintf(out, "%s\"%s\": {\"hits\": %llu, \"misses\": %llu, \"evictions\": %llu}",
+                    i == EXT2_READ_INODE ? "" : ", ", kindNames[i], (unsigned long long)stats.cacheHits[i],
+                    (unsigned long long)stats.cacheMisses[i], (unsigned long long)stats.cacheEvictions[i]);
+        }
+        fprintf(out, "},\n  \"dentry_cache\": {\"hits\": %llu, \"misses\": %llu}\n}\n",
+                (unsigned long long)stats.dentryHits, (unsigned long long)stats.dentryMisses);
+        return;
     }
 
-    return 0;
-}
-
-int do_fclose(FILE *fp)
-{
-    if (fclose(fp) != 0)
+    fprintf(out, "%-12s %14s\n", "phase", "seconds");
+    for (int i = 0; i < PHASES; i++)
     {
-        perror("fclose failed");
-        exit(1);
+        fprintf(out, "%-12s %14.6f\n", phaseNames[i], phaseTime[i]);
     }
+    fprintf(out, "%-12s %14.6f\n\n", "total", totalTime);
 
-    return 0;
-}
-
-int do_mkdir(char *name)
-{
-    // Create a new directory with read, write, and execute permissions
-    // for owner, group, and others.
-    if (mkdir(name, 0777) != 0)
+    // Only the inode, indirect and directory blocks go through the block cache.
+    fprintf(out, "%-12s %14s %12s %12s %9s\n", "read", "bytes", "cache hits", "cache misses", "hit rate");
+    for (int i = 0; i < EXT2_READ_KINDS; i++)
     {
-        if (errno != EEXIST)
+        uint64_t lookups = stats.cacheHits[i] + stats.cacheMisses[i];
+        fprintf(out, "%-12s %14llu", kindNames[i], (unsigned long long)stats.bytesRead[i]);
+        if (lookups > 0)
         {
-            perror("mkdir failed");
-            exit(1);
+            fprintf(out, " %12llu %12llu %8.1f%%\n", (unsigned long long)stats.cacheHits[i],
+                    (unsigned long long)stats.cacheMisses[i], 100.0 * stats.cacheHits[i] / lookups);
+        }
+        else
+        {
+            fprintf(out, " %12s %12s %9s\n", "-", "-", "-");
         }
     }
 
-    return 0;
+    uint64_t lookups = stats.dentryHits + stats.dentryMisses;
+    fprintf(out, "\n%-20s %14llu\n", "read calls", (unsigned long long)stats.reads);
+    fprintf(out, "%-20s %14llu\n", "seeks", (unsigned long long)stats.seeks);
+    fprintf(out, "%-20s %14llu\n", "copy calls", (unsigned long long)stats.copies);
+    fprintf(out, "%-20s %14llu\n", "write calls", (unsigned long long)stats.writes);
+    fprintf(out, "%-20s %14llu\n", "bytes written", (unsigned long long)stats.bytesWritten);
+    fprintf(out, "%-20s %14llu\n", "allocations", (unsigned long long)stats.allocs);
+    fprintf(out, "%-20s %14llu\n", "allocated bytes", (unsigned long long)stats.allocBytes);
+    fprintf(out, "%-20s %14llu\n", "mkdir calls", (unsigned long long)stats.mkdirs);
+    fprintf(out, "%-20s %14llu hits, %llu misses", "dentry cache", (unsigned long long)stats.dentryHits,
+            (unsigned long long)stats.dentryMisses);
+    if (lookups > 0)
+    {
+        fprintf(out, " (%.1f%%)", 100.0 * stats.dentryHits / lookups);
+    }
+    fprintf(out, "\n");
 }